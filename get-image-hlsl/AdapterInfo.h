@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+#include "FileUtil.h"
+#include "FileView.h"
+#include "ImageHash.h"
+
+// What --get-info reports about each adapter. Everything but the feature
+// levels comes straight from enumerating the adapters, which is cheap;
+// finding the feature levels means asking the driver, which isn't, so the
+// report is cached under a key covering everything else, driver versions
+// included. A driver update or a new GPU changes the key.
+struct AdapterInfo {
+	std::string description;  // UTF-8
+	uint32_t vendor_id = 0;
+	uint32_t device_id = 0;
+	uint32_t subsys_id = 0;
+	uint32_t revision = 0;
+	uint64_t dedicated_video_memory = 0;
+	uint64_t dedicated_system_memory = 0;
+	uint64_t shared_system_memory = 0;
+	bool software = false;
+	// The user mode driver's version as four 16 bit parts, most significant
+	// first, or 0 if the adapter wouldn't say.
+	uint64_t driver_version = 0;
+	// Names of the supported feature levels, such as "11_0", highest first.
+	std::vector<std::string> feature_levels;
+};
+
+namespace adapter_info_detail {
+
+// Bumped whenever the report's format changes, so old cache files miss.
+const uint32_t kVersion = 2;
+
+// The end of a report with the given key, newline and all, which is how a
+// cached one is recognised. Keys are written in sorted order, so "key" comes
+// last.
+inline std::string ReportSuffix(uint64_t key)
+{
+	return ",\"key\":\"" + HashToHex(key) + "\"}\n";
+}
+
+}
+
+// "a.b.c.d", as drivers are usually versioned.
+inline std::string DriverVersionString(uint64_t version)
+{
+	char str[32];
+	snprintf(str, sizeof(str), "%u.%u.%u.%u", static_cast<unsigned>(version >> 48),
+		static_cast<unsigned>((version >> 32) & 0xFFFF), static_cast<unsigned>((version >> 16) & 0xFFFF),
+		static_cast<unsigned>(version & 0xFFFF));
+	return str;
+}
+
+// A hash of everything about the adapters except their feature levels.
+inline uint64_t AdapterInfoKey(const std::vector<AdapterInfo> &adapters)
+{
+	Xxh64 hasher;
+	uint32_t version = adapter_info_detail::kVersion;
+	hasher.Update(&version, sizeof(version));
+	for (auto &adapter : adapters) {
+		uint64_t length = adapter.description.size();
+		hasher.Update(&length, sizeof(length));
+		hasher.Update(adapter.description.data(), adapter.description.size());
+		uint64_t fields[] = {
+			adapter.vendor_id, adapter.device_id, adapter.subsys_id, adapter.revision,
+			adapter.dedicated_video_memory, adapter.dedicated_system_memory, adapter.shared_system_memory,
+			adapter.software ? 1u : 0u, adapter.driver_version,
+		};
+		hasher.Update(fields, sizeof(fields));
+	}
+	return hasher.Digest();
+}
+
+// The report, for one line of JSON:
+//
+//   {"adapters": [{"DedicatedSystemMemory": ..., "DedicatedVideoMemory": ...,
+//    "Description": ..., "DeviceId": ..., "DriverVersion": "a.b.c.d",
+//    "FeatureLevels": [...], ..., "VendorId": ...}], "key": "<hex>"}
+inline nlohmann::json AdapterInfoJson(uint64_t key, const std::vector<AdapterInfo> &adapters)
+{
+	using nlohmann::json;
+	json list = json::array();
+	for (auto &adapter : adapters) {
+		list.push_back({
+			{ "Description", adapter.description },
+			{ "VendorId", adapter.vendor_id },
+			{ "DeviceId", adapter.device_id },
+			{ "SubSysId", adapter.subsys_id },
+			{ "Revision", adapter.revision },
+			{ "DedicatedVideoMemory", adapter.dedicated_video_memory },
+			{ "DedicatedSystemMemory", adapter.dedicated_system_memory },
+			{ "SharedSystemMemory", adapter.shared_system_memory },
+			{ "DriverVersion", adapter.driver_version ? json(DriverVersionString(adapter.driver_version)) : json() },
+			{ "Software", adapter.software },
+			{ "FeatureLevels", adapter.feature_levels },
+		});
+	}
+	return {
+		{ "key", HashToHex(key) },
+		{ "adapters", list },
+	};
+}
+
+// Produces the report, from cache_path if it holds one for the same adapters
+// and drivers, and otherwise by asking enumerator for the feature levels and
+// then writing the report to cache_path. An empty cache_path means no cache.
+// Enumerator needs:
+//
+//   bool Adapters(std::vector<AdapterInfo> *adapters);  // without feature levels
+//   std::vector<std::string> FeatureLevels(size_t index);
+//
+// Returns false if the adapters couldn't be enumerated. A cache that can't be
+// read or written is only a miss.
+template <typename Enumerator>
+bool AdapterReport(Enumerator &enumerator, const std::wstring &cache_path, std::string *report, bool *cached)
+{
+	std::vector<AdapterInfo> adapters;
+	if (!enumerator.Adapters(&adapters)) {
+		return false;
+	}
+	uint64_t key = AdapterInfoKey(adapters);
+	if (!cache_path.empty()) {
+		std::string suffix = adapter_info_detail::ReportSuffix(key);
+		FileView view;
+		// Anything else was cut short, or is for other adapters.
+		if (view.Open(cache_path) && view.Size() >= suffix.size() + 1 && view.Data()[0] == '{' &&
+			memcmp(view.Data() + view.Size() - suffix.size(), suffix.data(), suffix.size()) == 0) {
+			report->assign(view.Data(), view.Size() - 1);
+			*cached = true;
+			return true;
+		}
+	}
+
+	for (size_t i = 0; i < adapters.size(); i++) {
+		adapters[i].feature_levels = enumerator.FeatureLevels(i);
+	}
+	*report = AdapterInfoJson(key, adapters).dump();
+	*cached = false;
+	if (!cache_path.empty()) {
+		std::string line = *report + "\n";
+		WriteFileReplacing(cache_path, line.data(), line.size());
+	}
+	return true;
+}
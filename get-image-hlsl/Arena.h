@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+// A monotonic allocator for memory that only lives as long as loading one
+// job's uniforms: the paths built while looking for the file, and its
+// contents when it is read rather than mapped.
+// Allocating is a pointer bump, nothing is freed individually, and Reset
+// makes all of it available again at once.
+//
+// The chunks the memory comes from are kept across resets, so once the arena
+// has grown to fit a job it stops touching the heap altogether. HeapAllocations
+// counts the times it did, which is how to check that it has settled.
+class Arena {
+public:
+	static const size_t kDefaultChunkSize = 64 * 1024;
+
+	explicit Arena(size_t chunk_size = kDefaultChunkSize)
+		: chunk_size_(chunk_size), first_(nullptr), last_(nullptr), current_(nullptr), offset_(0),
+		allocations_(0), bytes_allocated_(0), heap_allocations_(0), capacity_(0) {
+	}
+
+	~Arena() {
+		Chunk *chunk = first_;
+		while (chunk) {
+			Chunk *next = chunk->next;
+			::operator delete(chunk);
+			chunk = next;
+		}
+	}
+
+	Arena(const Arena&) = delete;
+	Arena &operator=(const Arena&) = delete;
+
+	// alignment must be a power of two.
+	void *Allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+		allocations_++;
+		bytes_allocated_ += size;
+		for (;;) {
+			if (current_) {
+				uintptr_t base = reinterpret_cast<uintptr_t>(current_->Data());
+				size_t start = static_cast<size_t>(((base + offset_ + alignment - 1) & ~(alignment - 1)) - base);
+				if (start <= current_->size && size <= current_->size - start) {
+					offset_ = start + size;
+					return current_->Data() + start;
+				}
+				if (current_->next) {
+					// A chunk kept from before the last reset.
+					current_ = current_->next;
+					offset_ = 0;
+					continue;
+				}
+			}
+			AddChunk(std::max(chunk_size_, size + alignment));
+		}
+	}
+
+	// A null terminated copy of str.
+	template <typename Char> Char *Copy(const Char *str, size_t length) {
+		Char *copy = static_cast<Char*>(Allocate((length + 1) * sizeof(Char), alignof(Char)));
+		memcpy(copy, str, length * sizeof(Char));
+		copy[length] = Char();
+		return copy;
+	}
+
+	// Makes everything allocated so far available again, in constant time.
+	void Reset() {
+		current_ = first_;
+		offset_ = 0;
+	}
+
+	// Calls to Allocate and the bytes asked for, since the arena was created.
+	uint64_t Allocations() const {
+		return allocations_;
+	}
+
+	uint64_t BytesAllocated() const {
+		return bytes_allocated_;
+	}
+
+	// Chunks taken from the heap, and their total size.
+	uint64_t HeapAllocations() const {
+		return heap_allocations_;
+	}
+
+	size_t Capacity() const {
+		return capacity_;
+	}
+
+private:
+	struct Chunk {
+		Chunk *next;
+		size_t size;
+
+		char *Data() {
+			return reinterpret_cast<char*>(this) + kHeaderSize;
+		}
+	};
+
+	// Keeps the chunk's data as aligned as operator new's.
+	static const size_t kHeaderSize =
+		(sizeof(Chunk) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+	void AddChunk(size_t size) {
+		Chunk *chunk = static_cast<Chunk*>(::operator new(kHeaderSize + size));
+		chunk->next = nullptr;
+		chunk->size = size;
+		if (last_) {
+			last_->next = chunk;
+		}
+		else {
+			first_ = chunk;
+		}
+		last_ = chunk;
+		current_ = chunk;
+		offset_ = 0;
+		heap_allocations_++;
+		capacity_ += size;
+	}
+
+	size_t chunk_size_;
+	Chunk *first_;
+	Chunk *last_;
+	Chunk *current_;
+	size_t offset_;
+	uint64_t allocations_;
+	uint64_t bytes_allocated_;
+	uint64_t heap_allocations_;
+	size_t capacity_;
+};
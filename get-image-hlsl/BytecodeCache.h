@@ -0,0 +1,240 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "FileUtil.h"
+#include "FileView.h"
+#include "ImageHash.h"
+#include "IncludeCache.h"
+
+// Builds the key a compiled shader is cached under: a hash of everything that
+// can change the bytecode. Each piece is hashed along with its length, so
+// that moving bytes from one piece to the next changes the key.
+class CompileKey {
+public:
+	CompileKey &Add(const void *data, size_t size) {
+		uint64_t length = size;
+		hash_.Update(&length, sizeof(length));
+		hash_.Update(data, size);
+		return *this;
+	}
+
+	CompileKey &Add(const char *str) {
+		return Add(str, strlen(str));
+	}
+
+	CompileKey &Add(uint64_t value) {
+		return Add(&value, sizeof(value));
+	}
+
+	uint64_t Digest() const {
+		return hash_.Digest();
+	}
+
+private:
+	Xxh64 hash_;
+};
+
+// A persistent cache of compiled shader bytecode, so that a corpus that is
+// rendered again doesn't go through the HLSL compiler again. Each entry is a
+// file in the cache directory named after its key, holding a header:
+//
+//   "GFBC", uint32 version, uint64 key, uint64 XXH64 of everything after it
+//
+// then the files the shader included, as a uint32 count followed by, for each
+// one, the uint64 hash of its contents, the uint32 length of its path and
+// the path as uint32 characters; and then the bytecode itself.
+//
+// The key can't cover the included files, as we only find out what they are
+// by compiling, so an entry is only a hit if they all still hash the same.
+// Entries are written to a temporary file and renamed into place, so several
+// processes can share a directory. Anything missing, truncated or corrupted
+// is simply a miss.
+class BytecodeCache {
+public:
+	BytecodeCache() : hits_(0), misses_(0) {
+	}
+
+	// Creates the directory if it doesn't exist yet.
+	bool Open(const std::wstring &directory) {
+		directory_ = directory;
+#ifdef _WIN32
+		if (!CreateDirectoryW(directory.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+			return false;
+		}
+#else
+		if (mkdir(NativePath(directory).c_str(), 0777) != 0 && errno != EEXIST) {
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	bool Enabled() const {
+		return !directory_.empty();
+	}
+
+	const std::wstring &Directory() const {
+		return directory_;
+	}
+
+	// On a hit, points bytecode into entry, which must outlive its use. The
+	// included files are checked against include_cache, and if includes is
+	// given, that's where they go.
+	bool Load(uint64_t key, IncludeCache &include_cache, FileView &entry, const uint8_t **bytecode, size_t *size,
+		IncludeSet *includes = nullptr) {
+		if (Enabled() && entry.Open(EntryPath(key)) && Parse(key, entry, bytecode, size, include_cache, includes)) {
+			hits_++;
+			return true;
+		}
+		misses_++;
+		return false;
+	}
+
+	bool Store(uint64_t key, const IncludeSet &includes, const void *bytecode, size_t size) {
+		if (!Enabled()) {
+			return false;
+		}
+		std::vector<uint8_t> table;
+		Append<uint32_t>(table, static_cast<uint32_t>(includes.size()));
+		for (auto &dependency : includes) {
+			Append<uint64_t>(table, dependency.hash);
+			Append<uint32_t>(table, static_cast<uint32_t>(dependency.path.size()));
+			for (wchar_t c : dependency.path) {
+				Append<uint32_t>(table, static_cast<uint32_t>(c));
+			}
+		}
+		Xxh64 hasher;
+		hasher.Update(table.data(), table.size());
+		hasher.Update(bytecode, size);
+		uint64_t hash = hasher.Digest();
+		uint32_t version = kVersion;
+
+		std::wstring path = EntryPath(key);
+#ifdef _WIN32
+		std::wstring temp = path + L"." + std::to_wstring(GetCurrentProcessId()) + L".tmp";
+#else
+		std::wstring temp = path + L"." + std::to_wstring(getpid()) + L".tmp";
+#endif
+		FILE *f = OpenFile(temp, "wb");
+		if (!f) {
+			return false;
+		}
+		bool ok = fwrite("GFBC", 1, 4, f) == 4 &&
+			fwrite(&version, sizeof(version), 1, f) == 1 &&
+			fwrite(&key, sizeof(key), 1, f) == 1 &&
+			fwrite(&hash, sizeof(hash), 1, f) == 1 &&
+			fwrite(table.data(), 1, table.size(), f) == table.size() &&
+			fwrite(bytecode, 1, size, f) == size;
+		ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+		ok = ok && MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+		if (!ok) {
+			DeleteFileW(temp.c_str());
+		}
+#else
+		ok = ok && rename(NativePath(temp).c_str(), NativePath(path).c_str()) == 0;
+		if (!ok) {
+			unlink(NativePath(temp).c_str());
+		}
+#endif
+		return ok;
+	}
+
+	uint64_t Hits() const {
+		return hits_;
+	}
+
+	uint64_t Misses() const {
+		return misses_;
+	}
+
+private:
+	static const uint32_t kVersion = 2;
+	static const size_t kHeaderSize = 24;
+
+	template <typename T> static void Append(std::vector<uint8_t> &out, T value) {
+		const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&value);
+		out.insert(out.end(), bytes, bytes + sizeof(T));
+	}
+
+	template <typename T> static bool Read(const uint8_t *&p, const uint8_t *end, T *value) {
+		if (static_cast<size_t>(end - p) < sizeof(T)) {
+			return false;
+		}
+		memcpy(value, p, sizeof(T));
+		p += sizeof(T);
+		return true;
+	}
+
+	bool Parse(uint64_t key, const FileView &entry, const uint8_t **bytecode, size_t *size,
+		IncludeCache &include_cache, IncludeSet *included) const {
+		const uint8_t *p = reinterpret_cast<const uint8_t*>(entry.Data());
+		const uint8_t *end = p + entry.Size();
+		uint32_t version = 0;
+		uint64_t stored_key = 0, stored_hash = 0;
+		if (entry.Size() < kHeaderSize || memcmp(p, "GFBC", 4) != 0) {
+			return false;
+		}
+		p += 4;
+		Read(p, end, &version);
+		Read(p, end, &stored_key);
+		Read(p, end, &stored_hash);
+		if (version != kVersion || stored_key != key ||
+			Xxh64::Hash(p, static_cast<size_t>(end - p)) != stored_hash) {
+			return false;
+		}
+
+		IncludeSet includes;
+		uint32_t count = 0;
+		if (!Read(p, end, &count)) {
+			return false;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			IncludeDependency dependency;
+			uint32_t length = 0;
+			if (!Read(p, end, &dependency.hash) || !Read(p, end, &length) ||
+				static_cast<size_t>(end - p) / sizeof(uint32_t) < length) {
+				return false;
+			}
+			for (uint32_t c = 0; c < length; c++) {
+				uint32_t character = 0;
+				Read(p, end, &character);
+				dependency.path += static_cast<wchar_t>(character);
+			}
+			includes.push_back(dependency);
+		}
+		if (!include_cache.UpToDate(includes)) {
+			return false;
+		}
+		*bytecode = p;
+		*size = static_cast<size_t>(end - p);
+		if (included) {
+			*included = std::move(includes);
+		}
+		return true;
+	}
+
+	std::wstring EntryPath(uint64_t key) const {
+		std::string hex = HashToHex(key);
+		return directory_ + L"/" + std::wstring(hex.begin(), hex.end()) + L".dxbc";
+	}
+
+	std::wstring directory_;
+	std::atomic<uint64_t> hits_;
+	std::atomic<uint64_t> misses_;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+// Messages from the D3D debug layer, collected per job. The debug layer can
+// be very chatty about a broken shader, so only the most recent messages are
+// kept and the rest are counted as dropped.
+
+// Severity and category names, in the order of D3D11_MESSAGE_SEVERITY and
+// D3D11_MESSAGE_CATEGORY, so the raw values can be used to index them.
+const char *const DEBUG_MESSAGE_SEVERITIES[] = {
+	"corruption", "error", "warning", "info", "message",
+};
+const char *const DEBUG_MESSAGE_CATEGORIES[] = {
+	"application_defined", "miscellaneous", "initialization", "cleanup", "compilation", "state_creation",
+	"state_setting", "state_getting", "resource_manipulation", "execution", "shader",
+};
+
+struct DebugMessage {
+	int severity;
+	int category;
+	int id;
+	std::string text;
+};
+
+// A fixed size ring of messages. Once it is full each new message replaces
+// the oldest one. The entries are allocated up front and reused, so pushing
+// doesn't allocate unless a message is longer than any before it in its slot.
+class MessageRing {
+public:
+	explicit MessageRing(size_t capacity)
+		: entries_(capacity), first_(0), size_(0), dropped_(0) {
+	}
+
+	void Push(int severity, int category, int id, const char *text, size_t length) {
+		if (entries_.empty()) {
+			dropped_++;
+			return;
+		}
+		size_t slot = (first_ + size_) % entries_.size();
+		if (size_ == entries_.size()) {
+			first_ = (first_ + 1) % entries_.size();
+			dropped_++;
+		}
+		else {
+			size_++;
+		}
+		DebugMessage &message = entries_[slot];
+		message.severity = severity;
+		message.category = category;
+		message.id = id;
+		message.text.assign(text, length);
+	}
+
+	// Oldest first.
+	const DebugMessage &At(size_t i) const {
+		return entries_[(first_ + i) % entries_.size()];
+	}
+
+	size_t Size() const {
+		return size_;
+	}
+
+	size_t Capacity() const {
+		return entries_.size();
+	}
+
+	// How many messages were pushed out (or never fit) since the last Clear.
+	uint64_t Dropped() const {
+		return dropped_;
+	}
+
+	bool Empty() const {
+		return size_ == 0 && dropped_ == 0;
+	}
+
+	void Clear() {
+		first_ = 0;
+		size_ = 0;
+		dropped_ = 0;
+	}
+
+private:
+	std::vector<DebugMessage> entries_;
+	size_t first_;
+	size_t size_;
+	uint64_t dropped_;
+};
+
+namespace debug_messages_detail {
+
+inline const char *Name(const char *const *names, size_t count, int value)
+{
+	return value >= 0 && static_cast<size_t>(value) < count ? names[value] : "unknown";
+}
+
+}
+
+// One job's messages, for a line of JSON, shader and device being UTF-8.
+// device is left out when empty. The debug layer ends most messages with a
+// newline, which is trimmed off.
+inline nlohmann::json DebugMessagesJson(const std::string &shader, const std::string &device,
+	const MessageRing &ring)
+{
+	using namespace debug_messages_detail;
+	using nlohmann::json;
+	json messages = json::array();
+	for (size_t i = 0; i < ring.Size(); i++) {
+		const DebugMessage &message = ring.At(i);
+		std::string text = message.text;
+		while (!text.empty() && (text.back() == '\n' || text.back() == '\r' || text.back() == '\0')) {
+			text.pop_back();
+		}
+		messages.push_back({
+			{ "severity", Name(DEBUG_MESSAGE_SEVERITIES,
+				sizeof(DEBUG_MESSAGE_SEVERITIES) / sizeof(*DEBUG_MESSAGE_SEVERITIES), message.severity) },
+			{ "category", Name(DEBUG_MESSAGE_CATEGORIES,
+				sizeof(DEBUG_MESSAGE_CATEGORIES) / sizeof(*DEBUG_MESSAGE_CATEGORIES), message.category) },
+			{ "id", message.id },
+			{ "text", text },
+		});
+	}
+	json j = {
+		{ "shader", shader },
+		{ "debug_messages", messages },
+		{ "dropped", ring.Dropped() },
+	};
+	if (!device.empty()) {
+		j["device"] = device;
+	}
+	return j;
+}
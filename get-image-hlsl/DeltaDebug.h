@@ -0,0 +1,247 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ImageHash.h"
+
+// What the reducer deletes at a time.
+enum ReduceGranularity {
+	// Whole lines, with their line endings.
+	REDUCE_LINES,
+	// Identifiers, numbers, literals, comments and single punctuation
+	// characters, each with the whitespace after it.
+	REDUCE_TOKENS,
+};
+
+namespace delta_debug_detail {
+
+inline bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+inline bool IsWordChar(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.' ||
+		static_cast<unsigned char>(c) >= 0x80;
+}
+
+// The end of the token starting at p.
+inline const char *TokenEnd(const char *p, const char *end)
+{
+	if (IsWordChar(*p)) {
+		while (p < end && IsWordChar(*p)) {
+			p++;
+		}
+		return p;
+	}
+	if (*p == '"' || *p == '\'') {
+		char quote = *p++;
+		while (p < end && *p != quote && *p != '\n') {
+			p += *p == '\\' && p + 1 < end ? 2 : 1;
+		}
+		return p < end && *p == quote ? p + 1 : p;
+	}
+	if (*p == '/' && p + 1 < end && p[1] == '/') {
+		while (p < end && *p != '\n') {
+			p++;
+		}
+		return p;
+	}
+	if (*p == '/' && p + 1 < end && p[1] == '*') {
+		const char *close = std::search(p + 2, end, "*/", "*/" + 2);
+		return close == end ? end : close + 2;
+	}
+	return p + 1;
+}
+
+}
+
+// Splits source into pieces at the given granularity, which joined back
+// together are source again. With REDUCE_TOKENS any whitespace at the start
+// is a piece of its own.
+inline std::vector<std::string> SplitUnits(const std::string &source, ReduceGranularity granularity)
+{
+	using namespace delta_debug_detail;
+	std::vector<std::string> units;
+	const char *p = source.data();
+	const char *end = p + source.size();
+	while (p < end) {
+		const char *unit_end;
+		if (granularity == REDUCE_LINES) {
+			unit_end = std::find(p, end, '\n');
+			unit_end = unit_end == end ? end : unit_end + 1;
+		}
+		else {
+			unit_end = IsSpace(*p) ? p : TokenEnd(p, end);
+			while (unit_end < end && IsSpace(*unit_end)) {
+				unit_end++;
+			}
+		}
+		units.emplace_back(p, unit_end);
+		p = unit_end;
+	}
+	return units;
+}
+
+// Cuts a shader down to what still shows some problem, by delta debugging
+// (Zeller and Hildebrandt's ddmin): split the pieces into n chunks, try each
+// chunk alone and then everything but each chunk, keep the first candidate
+// that is still interesting, and split finer when none is. Lines go first,
+// then tokens, over and over until neither removes anything.
+//
+// The test is given candidates in the order ddmin would try them and
+// returns the index of the first interesting one, or the number of
+// candidates if none is. It gets up to width of them at a time, so that it
+// can try them in parallel; whatever it does, the result is the same as
+// trying them one by one. Every candidate's outcome is remembered by hash,
+// as ddmin comes back to the same text more often than might be expected.
+class DeltaDebugger {
+public:
+	typedef std::function<size_t(const std::vector<std::string>&)> Test;
+	// Called with the granularity and the source after each pass.
+	typedef std::function<void(ReduceGranularity, const std::string&)> Progress;
+
+	struct Stats {
+		// Candidates handed to the test, and ones answered from memory.
+		uint64_t tests = 0;
+		uint64_t remembered = 0;
+		uint64_t passes = 0;
+	};
+
+	DeltaDebugger(Test test, size_t width = 1, Progress progress = Progress())
+		: test_(test), width_(width ? width : 1), progress_(progress) {
+	}
+
+	// Reduces source, which the test has to find interesting.
+	std::string Reduce(const std::string &source) {
+		std::string current = source;
+		outcomes_[Xxh64::Hash(source.data(), source.size())] = true;
+		const ReduceGranularity granularities[] = { REDUCE_LINES, REDUCE_TOKENS };
+		while (true) {
+			std::string before = current;
+			for (ReduceGranularity granularity : granularities) {
+				current = Join(Ddmin(SplitUnits(current, granularity)));
+				stats_.passes++;
+				if (progress_) {
+					progress_(granularity, current);
+				}
+			}
+			if (current == before) {
+				return current;
+			}
+		}
+	}
+
+	const Stats &GetStats() const {
+		return stats_;
+	}
+
+private:
+	typedef std::vector<std::string> Units;
+
+	static std::string Join(const Units &units, size_t begin = 0, size_t end = SIZE_MAX) {
+		std::string joined;
+		for (size_t i = begin; i < std::min(end, units.size()); i++) {
+			joined += units[i];
+		}
+		return joined;
+	}
+
+	Units Ddmin(Units units) {
+		size_t n = 2;
+		while (units.size() >= 2) {
+			n = std::min(n, units.size());
+			auto chunk_begin = [&units, n](size_t k) {
+				return k * units.size() / n;
+			};
+			// With two chunks, each one alone is everything but the other.
+			bool subsets = n > 2;
+			std::vector<std::string> candidates;
+			if (subsets) {
+				for (size_t k = 0; k < n; k++) {
+					candidates.push_back(Join(units, chunk_begin(k), chunk_begin(k + 1)));
+				}
+			}
+			for (size_t k = 0; k < n; k++) {
+				candidates.push_back(Join(units, 0, chunk_begin(k)) + Join(units, chunk_begin(k + 1)));
+			}
+			size_t hit = FirstInteresting(candidates);
+			if (hit < candidates.size() && subsets && hit < n) {
+				units = Units(units.begin() + chunk_begin(hit), units.begin() + chunk_begin(hit + 1));
+				n = 2;
+			}
+			else if (hit < candidates.size()) {
+				size_t k = subsets ? hit - n : hit;
+				units.erase(units.begin() + chunk_begin(k), units.begin() + chunk_begin(k + 1));
+				n = std::max<size_t>(n - 1, 2);
+			}
+			else if (n >= units.size()) {
+				break;
+			}
+			else {
+				n = std::min(n * 2, units.size());
+			}
+		}
+		return units;
+	}
+
+	// The first interesting candidate, trying those not already known in
+	// batches of up to width.
+	size_t FirstInteresting(const std::vector<std::string> &candidates) {
+		std::vector<size_t> pending;
+		std::vector<std::string> batch;
+		for (size_t i = 0; i <= candidates.size(); i++) {
+			bool known = false;
+			bool interesting = false;
+			if (i < candidates.size()) {
+				auto it = outcomes_.find(Xxh64::Hash(candidates[i].data(), candidates[i].size()));
+				known = it != outcomes_.end();
+				interesting = known && it->second;
+				if (known) {
+					stats_.remembered++;
+				}
+				if (known && !interesting) {
+					continue;
+				}
+				if (!known) {
+					pending.push_back(i);
+					if (pending.size() < width_) {
+						continue;
+					}
+				}
+			}
+			if (!pending.empty()) {
+				batch.clear();
+				for (size_t index : pending) {
+					batch.push_back(candidates[index]);
+				}
+				size_t hit = test_(batch);
+				stats_.tests += batch.size();
+				for (size_t k = 0; k < std::min(hit + 1, batch.size()); k++) {
+					outcomes_[Xxh64::Hash(batch[k].data(), batch[k].size())] = k == hit;
+				}
+				if (hit < batch.size()) {
+					return pending[hit];
+				}
+				pending.clear();
+			}
+			if (interesting) {
+				return i;
+			}
+		}
+		return candidates.size();
+	}
+
+	Test test_;
+	size_t width_;
+	Progress progress_;
+	std::unordered_map<uint64_t, bool> outcomes_;
+	Stats stats_;
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "Image.h"
+#include "ImageCompare.h"
+
+// Support for rendering the same jobs on several devices and working out
+// which of them disagree.
+
+// Splits images into groups that match each other: each image joins the first
+// group whose first member it matches (within the per-channel tolerance and
+// percentage of differing pixels), or starts a new group. Returns the indices
+// of the images in each group, so a single group means everyone agreed.
+inline std::vector<std::vector<size_t>> GroupMatchingImages(const std::vector<ImageView> &images,
+	uint8_t tolerance, double max_percent)
+{
+	std::vector<std::vector<size_t>> groups;
+	for (size_t i = 0; i < images.size(); i++) {
+		bool placed = false;
+		for (auto &group : groups) {
+			const ImageView &representative = images[group.front()];
+			if (representative.width != images[i].width || representative.height != images[i].height) {
+				continue;
+			}
+			CompareResult result = CompareImages(representative, images[i], tolerance);
+			if (result.PercentDiffering() <= max_percent) {
+				group.push_back(i);
+				placed = true;
+				break;
+			}
+		}
+		if (!placed) {
+			groups.push_back(std::vector<size_t>(1, i));
+		}
+	}
+	return groups;
+}
+
+// Collects each device's image for a job until every device has produced one.
+// Devices read back on their own threads and at their own pace, so the images
+// are copied out of the mapped staging textures as they arrive.
+class DifferentialCollector {
+public:
+	DifferentialCollector(size_t jobs, size_t devices)
+		: images_(jobs, std::vector<Image>(devices)), arrived_(jobs, 0), devices_(devices) {
+	}
+
+	// Records device's image for job. Returns true for whichever device
+	// completes the set, which is then responsible for calling Compare and
+	// Release for that job.
+	bool Add(size_t job, size_t device, const ImageView &image) {
+		Image &copy = images_[job][device];
+		copy.width = image.width;
+		copy.height = image.height;
+		copy.pixels.resize(image.PackedSize());
+		for (uint32_t y = 0; y < image.height; y++) {
+			memcpy(copy.pixels.data() + y * image.PackedRowSize(), image.Row(y), image.PackedRowSize());
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		return ++arrived_[job] == devices_;
+	}
+
+	std::vector<std::vector<size_t>> Compare(size_t job, uint8_t tolerance, double max_percent) const {
+		std::vector<ImageView> views;
+		for (auto &image : images_[job]) {
+			views.push_back(image.View());
+		}
+		return GroupMatchingImages(views, tolerance, max_percent);
+	}
+
+	void Release(size_t job) {
+		for (auto &image : images_[job]) {
+			std::vector<uint8_t>().swap(image.pixels);
+		}
+	}
+
+private:
+	std::mutex mutex_;
+	std::vector<std::vector<Image>> images_;
+	std::vector<size_t> arrived_;
+	size_t devices_;
+};
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Small helpers for working with files by their wide-character path, so the
+// code that reads our inputs and writes our outputs doesn't need to care which
+// platform it is on.
+
+#ifndef _WIN32
+namespace file_util_detail {
+
+// wchar_t is UTF-32 everywhere except Windows, where we don't need these.
+
+// Writes wc as UTF-8 to out, which has room for 4 bytes, and returns how many
+// bytes it took.
+inline size_t EncodeUtf8(wchar_t wc, char *out)
+{
+	unsigned long c = static_cast<unsigned long>(wc);
+	if (c < 0x80) {
+		out[0] = static_cast<char>(c);
+		return 1;
+	}
+	if (c < 0x800) {
+		out[0] = static_cast<char>(0xC0 | (c >> 6));
+		out[1] = static_cast<char>(0x80 | (c & 0x3F));
+		return 2;
+	}
+	if (c < 0x10000) {
+		out[0] = static_cast<char>(0xE0 | (c >> 12));
+		out[1] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+		out[2] = static_cast<char>(0x80 | (c & 0x3F));
+		return 3;
+	}
+	out[0] = static_cast<char>(0xF0 | (c >> 18));
+	out[1] = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+	out[2] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+	out[3] = static_cast<char>(0x80 | (c & 0x3F));
+	return 4;
+}
+
+inline std::string WideToUtf8(const std::wstring &str)
+{
+	std::string out;
+	out.reserve(str.size());
+	for (wchar_t wc : str) {
+		char encoded[4];
+		out.append(encoded, EncodeUtf8(wc, encoded));
+	}
+	return out;
+}
+
+inline std::wstring Utf8ToWide(const std::string &str)
+{
+	std::wstring out;
+	out.reserve(str.size());
+	for (size_t i = 0; i < str.size();) {
+		unsigned char c = static_cast<unsigned char>(str[i]);
+		int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+		unsigned long code = extra == 0 ? c : c & (0x3F >> extra);
+		i++;
+		for (int k = 0; k < extra && i < str.size(); k++, i++) {
+			code = (code << 6) | (static_cast<unsigned char>(str[i]) & 0x3F);
+		}
+		out += static_cast<wchar_t>(code);
+	}
+	return out;
+}
+
+}
+#endif
+
+// The native form of a path, as expected by the platform's file APIs. Off
+// Windows it is converted to UTF-8 on the stack, so that opening a file
+// doesn't need the heap; a path too long for PATH_MAX comes out empty, which
+// fails to open like the real thing would.
+#ifdef _WIN32
+inline const wchar_t *NativePath(const wchar_t *path)
+{
+	return path;
+}
+
+inline const std::wstring &NativePath(const std::wstring &path)
+{
+	return path;
+}
+#else
+struct NativePathBuffer {
+	char path[PATH_MAX];
+
+	const char *c_str() const {
+		return path;
+	}
+};
+
+inline NativePathBuffer NativePath(const wchar_t *path)
+{
+	NativePathBuffer out;
+	size_t length = 0;
+	for (; *path; path++) {
+		char encoded[4];
+		size_t n = file_util_detail::EncodeUtf8(*path, encoded);
+		if (length + n >= sizeof(out.path)) {
+			length = 0;
+			break;
+		}
+		memcpy(out.path + length, encoded, n);
+		length += n;
+	}
+	out.path[length] = '\0';
+	return out;
+}
+
+inline NativePathBuffer NativePath(const std::wstring &path)
+{
+	return NativePath(path.c_str());
+}
+#endif
+
+// fopen, but taking a wide path. Returns nullptr on failure.
+inline FILE *OpenFile(const wchar_t *path, const char *mode)
+{
+#ifdef _WIN32
+	std::wstring wide_mode(mode, mode + strlen(mode));
+	return _wfopen(path, wide_mode.c_str());
+#else
+	return fopen(NativePath(path).c_str(), mode);
+#endif
+}
+
+inline FILE *OpenFile(const std::wstring &path, const char *mode)
+{
+	return OpenFile(path.c_str(), mode);
+}
+
+// Whether path names a regular file (rather than a directory, say).
+inline bool FileExists(const wchar_t *path)
+{
+#ifdef _WIN32
+	DWORD attributes = GetFileAttributesW(path);
+	return attributes != INVALID_FILE_ATTRIBUTES && !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat st;
+	return stat(NativePath(path).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+// Flushes f's buffer and asks the OS to put what has been written on disk.
+inline bool SyncFile(FILE *f)
+{
+	if (fflush(f) != 0) {
+		return false;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(f)) == 0;
+#else
+	return fsync(fileno(f)) == 0;
+#endif
+}
+
+// Cuts a file down to size bytes.
+inline bool TruncateFile(const std::wstring &path, uint64_t size)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER position;
+	position.QuadPart = static_cast<LONGLONG>(size);
+	bool ok = SetFilePointerEx(file, position, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+	CloseHandle(file);
+	return ok;
+#else
+	return truncate(NativePath(path).c_str(), static_cast<off_t>(size)) == 0;
+#endif
+}
+
+// Deletes the file at path.
+inline bool RemoveFile(const std::wstring &path)
+{
+#ifdef _WIN32
+	return DeleteFileW(path.c_str()) != 0;
+#else
+	return unlink(NativePath(path).c_str()) == 0;
+#endif
+}
+
+// Writes a whole file through a temporary file that is renamed over path, so
+// that readers see either the old contents or the new, never half of them.
+inline bool WriteFileReplacing(const std::wstring &path, const void *data, size_t size)
+{
+#ifdef _WIN32
+	std::wstring temp = path + L"." + std::to_wstring(GetCurrentProcessId()) + L".tmp";
+#else
+	std::wstring temp = path + L"." + std::to_wstring(getpid()) + L".tmp";
+#endif
+	FILE *f = OpenFile(temp, "wb");
+	if (!f) {
+		return false;
+	}
+	bool ok = fwrite(data, 1, size, f) == size;
+	ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+	ok = ok && MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+	if (!ok) {
+		DeleteFileW(temp.c_str());
+	}
+#else
+	ok = ok && rename(NativePath(temp).c_str(), NativePath(path).c_str()) == 0;
+	if (!ok) {
+		unlink(NativePath(temp).c_str());
+	}
+#endif
+	return ok;
+}
+
+// The extension of path in lower case without the dot, or an empty string.
+inline std::wstring FileExtension(const std::wstring &path)
+{
+	size_t dot = path.find_last_of(L'.');
+	size_t slash = path.find_last_of(L"/\\");
+	if (dot == std::wstring::npos || (slash != std::wstring::npos && slash > dot)) {
+		return std::wstring();
+	}
+	std::wstring extension = path.substr(dot + 1);
+	for (auto &c : extension) {
+		if (c >= L'A' && c <= L'Z') {
+			c = c - L'A' + L'a';
+		}
+	}
+	return extension;
+}
+
+// path with its extension (if any) replaced by the given one, which has no dot.
+inline std::wstring ReplaceExtension(const std::wstring &path, const std::wstring &extension)
+{
+	size_t dot = path.find_last_of(L'.');
+	size_t slash = path.find_last_of(L"/\\");
+	if (dot == std::wstring::npos || (slash != std::wstring::npos && slash > dot)) {
+		return path + L"." + extension;
+	}
+	return path.substr(0, dot + 1) + extension;
+}
+
+// The directory part of path, without a trailing separator, or an empty
+// string if it has none.
+inline std::wstring DirectoryOf(const std::wstring &path)
+{
+	size_t slash = path.find_last_of(L"/\\");
+	return slash == std::wstring::npos ? std::wstring() : path.substr(0, slash);
+}
+
+// name relative to directory, unless it is already absolute.
+inline std::wstring JoinPath(const std::wstring &directory, const std::wstring &name)
+{
+	bool absolute = !name.empty() && (name[0] == L'/' || name[0] == L'\\' || (name.size() > 1 && name[1] == L':'));
+	if (absolute || directory.empty()) {
+		return name;
+	}
+	return directory + L"/" + name;
+}
+
+// An absolute path with "." and ".." resolved (and, off Windows, symbolic
+// links too), so that one file always has the same name. Returns an empty
+// string if the file doesn't exist.
+inline std::wstring CanonicalPath(const std::wstring &path)
+{
+#ifdef _WIN32
+	DWORD length = GetFullPathNameW(path.c_str(), 0, nullptr, nullptr);
+	if (length == 0) {
+		return std::wstring();
+	}
+	std::wstring full(length, L'\0');
+	length = GetFullPathNameW(path.c_str(), length, &full[0], nullptr);
+	full.resize(length);
+	if (GetFileAttributesW(full.c_str()) == INVALID_FILE_ATTRIBUTES) {
+		return std::wstring();
+	}
+	return full;
+#else
+	char resolved[PATH_MAX];
+	if (!realpath(NativePath(path).c_str(), resolved)) {
+		return std::wstring();
+	}
+	return file_util_detail::Utf8ToWide(resolved);
+#endif
+}
+
+// The last modification time and size of a file, in whatever units the
+// platform uses: only good for telling whether the file has changed.
+inline bool FileStamp(const std::wstring &path, uint64_t *mtime, uint64_t *size)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data)) {
+		return false;
+	}
+	*mtime = (static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+	*size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+	return true;
+#else
+	struct stat st;
+	if (stat(NativePath(path).c_str(), &st) != 0) {
+		return false;
+	}
+	*mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000u + static_cast<uint64_t>(st.st_mtim.tv_nsec);
+	*size = static_cast<uint64_t>(st.st_size);
+	return true;
+#endif
+}
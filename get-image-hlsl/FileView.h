@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Arena.h"
+#include "FileUtil.h"
+
+// A read-only view of a whole file's contents, for handing the same bytes to
+// everything that needs them (the compiler, the hashes, the parsers) without
+// copying them around. Large files are memory mapped; small ones are read
+// into a buffer instead, as mapping them costs more than it saves. If mapping
+// fails for any reason the file is read instead.
+class FileView {
+public:
+	// Files smaller than this are read rather than mapped.
+	static const size_t kMapThreshold = 64 * 1024;
+
+	FileView() : data_(nullptr), size_(0), mapped_(false) {
+	}
+
+	~FileView() {
+		Close();
+	}
+
+	FileView(const FileView&) = delete;
+	FileView &operator=(const FileView&) = delete;
+
+	FileView(FileView &&other) : data_(nullptr), size_(0), mapped_(false) {
+		*this = std::move(other);
+	}
+
+	FileView &operator=(FileView &&other) {
+		if (this != &other) {
+			Close();
+			buffer_ = std::move(other.buffer_);
+			data_ = other.data_;
+			size_ = other.size_;
+			mapped_ = other.mapped_;
+			other.data_ = nullptr;
+			other.size_ = 0;
+			other.mapped_ = false;
+		}
+		return *this;
+	}
+
+	// Returns false if the file can't be opened or read. If arena is given,
+	// a file that is read rather than mapped is read into memory from it, in
+	// which case the view mustn't be used once the arena is reset.
+	bool Open(const wchar_t *path, size_t map_threshold = kMapThreshold, Arena *arena = nullptr) {
+		Close();
+#ifdef _WIN32
+		HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) ||
+			static_cast<uint64_t>(file_size.QuadPart) > static_cast<uint64_t>(SIZE_MAX)) {
+			CloseHandle(file);
+			return false;
+		}
+		size_t size = static_cast<size_t>(file_size.QuadPart);
+		if (size > 0 && size >= map_threshold) {
+			HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping) {
+				// The view keeps the mapping alive once it has been made.
+				void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				CloseHandle(mapping);
+				if (view) {
+					data_ = static_cast<const char*>(view);
+					size_ = size;
+					mapped_ = true;
+				}
+			}
+		}
+		bool ok = mapped_ || Read(file, size, arena);
+		CloseHandle(file);
+		return ok;
+#else
+		int fd = open(NativePath(path).c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			return false;
+		}
+		size_t size = static_cast<size_t>(st.st_size);
+		if (size > 0 && size >= map_threshold) {
+			void *view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (view != MAP_FAILED) {
+				data_ = static_cast<const char*>(view);
+				size_ = size;
+				mapped_ = true;
+			}
+		}
+		bool ok = mapped_ || Read(fd, size, arena);
+		close(fd);
+		return ok;
+#endif
+	}
+
+	bool Open(const std::wstring &path, size_t map_threshold = kMapThreshold, Arena *arena = nullptr) {
+		return Open(path.c_str(), map_threshold, arena);
+	}
+
+	void Close() {
+		if (mapped_) {
+#ifdef _WIN32
+			UnmapViewOfFile(data_);
+#else
+			munmap(const_cast<char*>(data_), size_);
+#endif
+		}
+		std::vector<char>().swap(buffer_);
+		data_ = nullptr;
+		size_ = 0;
+		mapped_ = false;
+	}
+
+	// Never null, even for an empty file, but not null terminated either.
+	const char *Data() const {
+		return data_ ? data_ : "";
+	}
+
+	size_t Size() const {
+		return size_;
+	}
+
+	bool StartsWith(const char *magic, size_t length) const {
+		return size_ >= length && memcmp(data_, magic, length) == 0;
+	}
+
+	bool Mapped() const {
+		return mapped_;
+	}
+
+private:
+#ifdef _WIN32
+	bool Read(HANDLE file, size_t size, Arena *arena) {
+		char *buffer = Buffer(size, arena);
+		size_t done = 0;
+		while (done < size) {
+			DWORD chunk = static_cast<DWORD>(std::min<size_t>(size - done, 1u << 30));
+			DWORD read = 0;
+			if (!ReadFile(file, buffer + done, chunk, &read, nullptr) || read == 0) {
+				buffer_.clear();
+				return false;
+			}
+			done += read;
+		}
+		data_ = buffer;
+		size_ = size;
+		return true;
+	}
+#else
+	bool Read(int fd, size_t size, Arena *arena) {
+		char *buffer = Buffer(size, arena);
+		size_t done = 0;
+		while (done < size) {
+			ssize_t n = read(fd, buffer + done, size - done);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				buffer_.clear();
+				return false;
+			}
+			done += static_cast<size_t>(n);
+		}
+		data_ = buffer;
+		size_ = size;
+		return true;
+	}
+#endif
+
+	char *Buffer(size_t size, Arena *arena) {
+		if (arena) {
+			return static_cast<char*>(arena->Allocate(size, 1));
+		}
+		buffer_.resize(size);
+		return buffer_.data();
+	}
+
+	const char *data_;
+	size_t size_;
+	bool mapped_;
+	std::vector<char> buffer_;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A read-only view of RGBA8 pixels. When it comes from a mapped staging
+// texture the rows are row_pitch bytes apart, which is usually more than
+// width * 4, so always step through rows with Row() rather than assuming the
+// pixels are tightly packed.
+struct ImageView {
+	const uint8_t *data;
+	uint32_t width;
+	uint32_t height;
+	uint32_t row_pitch;
+
+	const uint8_t *Row(uint32_t y) const {
+		return data + static_cast<size_t>(y) * row_pitch;
+	}
+
+	size_t PackedRowSize() const {
+		return static_cast<size_t>(width) * 4;
+	}
+
+	size_t PackedSize() const {
+		return PackedRowSize() * height;
+	}
+};
+
+// An RGBA8 image that owns its (tightly packed) pixels.
+struct Image {
+	std::vector<uint8_t> pixels;
+	uint32_t width;
+	uint32_t height;
+
+	ImageView View() const {
+		return { pixels.data(), width, height, width * 4 };
+	}
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define IMAGE_COMPARE_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(IMAGE_COMPARE_X86) && defined(__GNUC__)
+#define IMAGE_COMPARE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define IMAGE_COMPARE_TARGET_AVX2
+#endif
+
+#include "Image.h"
+
+// Pixel-by-pixel comparison of two RGBA8 images of the same size.
+//
+// A pixel "differs" when any of its channels differs by more than the
+// per-channel tolerance, so a tolerance of 0 is an exact comparison. The
+// fuzzy metrics (largest channel difference, fraction of differing pixels)
+// are what callers threshold on.
+struct CompareResult {
+	uint64_t total_pixels;
+	uint64_t differing_pixels;
+	uint8_t max_diff;
+
+	double PercentDiffering() const {
+		return total_pixels == 0 ? 0.0 : 100.0 * differing_pixels / total_pixels;
+	}
+};
+
+// The straightforward version. The SIMD kernels must agree with this exactly.
+inline void CompareRowScalar(const uint8_t *a, const uint8_t *b, uint32_t pixels, uint8_t tolerance,
+	uint64_t *differing, uint8_t *max_diff)
+{
+	for (uint32_t x = 0; x < pixels; x++) {
+		bool differs = false;
+		for (int c = 0; c < 4; c++) {
+			uint8_t lhs = a[x * 4 + c];
+			uint8_t rhs = b[x * 4 + c];
+			uint8_t diff = lhs > rhs ? lhs - rhs : rhs - lhs;
+			if (diff > *max_diff) {
+				*max_diff = diff;
+			}
+			if (diff > tolerance) {
+				differs = true;
+			}
+		}
+		if (differs) {
+			(*differing)++;
+		}
+	}
+}
+
+#ifdef IMAGE_COMPARE_X86
+// Eight pixels per iteration: the absolute difference of unsigned bytes is
+// the OR of the two saturating subtractions, and a pixel differs when any of
+// its bytes is still non-zero after subtracting the tolerance.
+IMAGE_COMPARE_TARGET_AVX2
+inline void CompareRowAvx2(const uint8_t *a, const uint8_t *b, uint32_t pixels, uint8_t tolerance,
+	uint64_t *differing, uint8_t *max_diff)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i tol = _mm256_set1_epi8(static_cast<char>(tolerance));
+	__m256i max = _mm256_setzero_si256();
+	uint64_t same_pixels = 0;
+	uint32_t x = 0;
+	for (; x + 8 <= pixels; x += 8) {
+		__m256i lhs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + x * 4));
+		__m256i rhs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + x * 4));
+		__m256i diff = _mm256_or_si256(_mm256_subs_epu8(lhs, rhs), _mm256_subs_epu8(rhs, lhs));
+		max = _mm256_max_epu8(max, diff);
+		__m256i over = _mm256_subs_epu8(diff, tol);
+		__m256i same = _mm256_cmpeq_epi32(over, zero);
+		unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(same)));
+		for (; mask != 0; mask &= mask - 1) {
+			same_pixels++;
+		}
+	}
+	// Fold the per-byte maxima down to a single byte.
+	__m128i m = _mm_max_epu8(_mm256_castsi256_si128(max), _mm256_extracti128_si256(max, 1));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 8));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 4));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 2));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 1));
+	uint8_t vector_max = static_cast<uint8_t>(_mm_cvtsi128_si32(m) & 0xFF);
+	if (vector_max > *max_diff) {
+		*max_diff = vector_max;
+	}
+	*differing += x - same_pixels;
+	CompareRowScalar(a + x * 4, b + x * 4, pixels - x, tolerance, differing, max_diff);
+}
+
+inline bool CpuHasAvx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuid(info, 1);
+	// The OS has to be saving the YMM registers too, not just the CPU having them.
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!osxsave || (_xgetbv(0) & 6) != 6) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+typedef void(*CompareRowFn)(const uint8_t*, const uint8_t*, uint32_t, uint8_t, uint64_t*, uint8_t*);
+
+inline CompareRowFn SelectCompareRow()
+{
+#ifdef IMAGE_COMPARE_X86
+	static const bool has_avx2 = CpuHasAvx2();
+	if (has_avx2) {
+		return CompareRowAvx2;
+	}
+#endif
+	return CompareRowScalar;
+}
+
+// Compares a and b, which must have the same dimensions. row_fn is only a
+// parameter so the kernels can be checked against each other.
+inline CompareResult CompareImages(const ImageView &a, const ImageView &b, uint8_t tolerance,
+	CompareRowFn row_fn = SelectCompareRow())
+{
+	CompareResult result = { static_cast<uint64_t>(a.width) * a.height, 0, 0 };
+	for (uint32_t y = 0; y < a.height; y++) {
+		row_fn(a.Row(y), b.Row(y), a.width, tolerance, &result.differing_pixels, &result.max_diff);
+	}
+	return result;
+}
+
+// A heatmap of where a and b differ: differing pixels are red, brighter the
+// bigger the difference, and everything else is a dimmed grey copy of b so
+// the differences can be placed in the image.
+inline void DiffHeatmap(const ImageView &a, const ImageView &b, uint8_t tolerance, std::vector<uint8_t> &out)
+{
+	out.resize(a.PackedSize());
+	for (uint32_t y = 0; y < a.height; y++) {
+		const uint8_t *lhs = a.Row(y);
+		const uint8_t *rhs = b.Row(y);
+		uint8_t *dst = out.data() + y * a.PackedRowSize();
+		for (uint32_t x = 0; x < a.width; x++) {
+			uint8_t diff = 0;
+			for (int c = 0; c < 4; c++) {
+				uint8_t d = lhs[x * 4 + c] > rhs[x * 4 + c] ?
+					lhs[x * 4 + c] - rhs[x * 4 + c] : rhs[x * 4 + c] - lhs[x * 4 + c];
+				if (d > diff) {
+					diff = d;
+				}
+			}
+			if (diff > tolerance) {
+				dst[x * 4 + 0] = static_cast<uint8_t>(128 + diff / 2);
+				dst[x * 4 + 1] = 0;
+				dst[x * 4 + 2] = 0;
+			}
+			else {
+				uint8_t grey = static_cast<uint8_t>((rhs[x * 4 + 0] + rhs[x * 4 + 1] + rhs[x * 4 + 2]) / 12);
+				dst[x * 4 + 0] = grey;
+				dst[x * 4 + 1] = grey;
+				dst[x * 4 + 2] = grey;
+			}
+			dst[x * 4 + 3] = 255;
+		}
+	}
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Image.h"
+
+// Streaming XXH64 (https://github.com/Cyan4973/xxHash), written out here
+// rather than vendored. Output matches the reference implementation, so
+// hashes can be checked with any other xxhash tool.
+class Xxh64 {
+public:
+	explicit Xxh64(uint64_t seed = 0) {
+		Reset(seed);
+	}
+
+	void Reset(uint64_t seed = 0) {
+		seed_ = seed;
+		lanes_[0] = seed + kPrime1 + kPrime2;
+		lanes_[1] = seed + kPrime2;
+		lanes_[2] = seed;
+		lanes_[3] = seed - kPrime1;
+		total_ = 0;
+		buffered_ = 0;
+	}
+
+	void Update(const void *data, size_t length) {
+		const uint8_t *p = static_cast<const uint8_t*>(data);
+		const uint8_t *end = p + length;
+		total_ += length;
+
+		if (buffered_ + length < 32) {
+			memcpy(buffer_ + buffered_, p, length);
+			buffered_ += length;
+			return;
+		}
+		if (buffered_ > 0) {
+			size_t fill = 32 - buffered_;
+			memcpy(buffer_ + buffered_, p, fill);
+			Stripe(buffer_);
+			p += fill;
+			buffered_ = 0;
+		}
+		// The bulk of an image goes through here, straight from the caller's
+		// memory. The four lanes are independent, which keeps the multipliers
+		// busy.
+		while (end - p >= 32) {
+			Stripe(p);
+			p += 32;
+		}
+		buffered_ = static_cast<size_t>(end - p);
+		memcpy(buffer_, p, buffered_);
+	}
+
+	uint64_t Digest() const {
+		uint64_t h;
+		if (total_ >= 32) {
+			h = Rotl(lanes_[0], 1) + Rotl(lanes_[1], 7) + Rotl(lanes_[2], 12) + Rotl(lanes_[3], 18);
+			for (int i = 0; i < 4; i++) {
+				h = (h ^ Round(0, lanes_[i])) * kPrime1 + kPrime4;
+			}
+		}
+		else {
+			h = seed_ + kPrime5;
+		}
+		h += total_;
+
+		const uint8_t *p = buffer_;
+		const uint8_t *end = buffer_ + buffered_;
+		while (end - p >= 8) {
+			h = Rotl(h ^ Round(0, Read64(p)), 27) * kPrime1 + kPrime4;
+			p += 8;
+		}
+		if (end - p >= 4) {
+			h = Rotl(h ^ (Read32(p) * kPrime1), 23) * kPrime2 + kPrime3;
+			p += 4;
+		}
+		while (p < end) {
+			h = Rotl(h ^ (*p * kPrime5), 11) * kPrime1;
+			p++;
+		}
+
+		h ^= h >> 33;
+		h *= kPrime2;
+		h ^= h >> 29;
+		h *= kPrime3;
+		h ^= h >> 32;
+		return h;
+	}
+
+	static uint64_t Hash(const void *data, size_t length, uint64_t seed = 0) {
+		Xxh64 hasher(seed);
+		hasher.Update(data, length);
+		return hasher.Digest();
+	}
+
+private:
+	static const uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+	static const uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+	static const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+	static const uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+	static uint64_t Rotl(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+
+	static uint64_t Read64(const uint8_t *p) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		return v;
+	}
+
+	static uint64_t Read32(const uint8_t *p) {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+
+	static uint64_t Round(uint64_t acc, uint64_t input) {
+		acc += input * kPrime2;
+		acc = Rotl(acc, 31);
+		return acc * kPrime1;
+	}
+
+	void Stripe(const uint8_t *p) {
+		lanes_[0] = Round(lanes_[0], Read64(p));
+		lanes_[1] = Round(lanes_[1], Read64(p + 8));
+		lanes_[2] = Round(lanes_[2], Read64(p + 16));
+		lanes_[3] = Round(lanes_[3], Read64(p + 24));
+	}
+
+	uint64_t seed_;
+	uint64_t lanes_[4];
+	uint64_t total_;
+	uint8_t buffer_[32];
+	size_t buffered_;
+};
+
+// Hash of an image's dimensions and pixels. Row padding is skipped, so this
+// works directly on a mapped staging texture and gives the same answer as for
+// a tightly packed copy of the same pixels.
+inline uint64_t HashImage(const ImageView &image)
+{
+	Xxh64 hasher;
+	hasher.Update(&image.width, sizeof(image.width));
+	hasher.Update(&image.height, sizeof(image.height));
+	for (uint32_t y = 0; y < image.height; y++) {
+		hasher.Update(image.Row(y), image.PackedRowSize());
+	}
+	return hasher.Digest();
+}
+
+inline std::string HashToHex(uint64_t hash)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex(16, '0');
+	for (int i = 15; i >= 0; i--) {
+		hex[i] = digits[hash & 0xF];
+		hash >>= 4;
+	}
+	return hex;
+}
+
+inline bool HexToHash(const std::string &hex, uint64_t *hash)
+{
+	if (hex.size() != 16) {
+		return false;
+	}
+	uint64_t value = 0;
+	for (char c : hex) {
+		value <<= 4;
+		if (c >= '0' && c <= '9') {
+			value |= c - '0';
+		}
+		else if (c >= 'a' && c <= 'f') {
+			value |= c - 'a' + 10;
+		}
+		else {
+			return false;
+		}
+	}
+	*hash = value;
+	return true;
+}
+
+// Maps image hashes to every output path that produced that image. The first
+// path recorded for a hash is the one that was actually written; the rest are
+// duplicates that were skipped.
+class DedupIndex {
+public:
+	// Records path under hash, unless it is already there, as it is when a
+	// batch is run again. Returns true if this is the first time the hash has
+	// been seen, i.e. the image should be written to path.
+	bool Add(uint64_t hash, const std::string &path) {
+		std::vector<std::string> &paths = entries_[hash];
+		if (std::find(paths.begin(), paths.end(), path) != paths.end()) {
+			return false;
+		}
+		paths.push_back(path);
+		return paths.size() == 1;
+	}
+
+	// The path the image with this hash was written to, or nullptr.
+	const std::string *Canonical(uint64_t hash) const {
+		auto it = entries_.find(hash);
+		return it == entries_.end() ? nullptr : &it->second.front();
+	}
+
+	const std::map<uint64_t, std::vector<std::string>> &Entries() const {
+		return entries_;
+	}
+
+	size_t Size() const {
+		return entries_.size();
+	}
+
+private:
+	std::map<uint64_t, std::vector<std::string>> entries_;
+};
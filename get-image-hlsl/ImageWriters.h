@@ -0,0 +1,289 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "FileUtil.h"
+#include "Image.h"
+
+// Writers for the uncompressed output formats. These exist for tooling that
+// only wants the pixels and would otherwise decode a PNG to get them back.
+//
+// All multi-byte header fields are written in host byte order, which is
+// little endian on everything we run on.
+
+// Binary PPM (P6). PPM has no alpha channel, so alpha is dropped.
+inline bool WritePpm(const ImageView &image, const std::wstring &path)
+{
+	FILE *f = OpenFile(path, "wb");
+	if (!f) {
+		return false;
+	}
+	fprintf(f, "P6\n%u %u\n255\n", image.width, image.height);
+	std::string row(static_cast<size_t>(image.width) * 3, '\0');
+	bool ok = true;
+	for (uint32_t y = 0; y < image.height && ok; y++) {
+		const uint8_t *src = image.Row(y);
+		for (uint32_t x = 0; x < image.width; x++) {
+			row[x * 3 + 0] = static_cast<char>(src[x * 4 + 0]);
+			row[x * 3 + 1] = static_cast<char>(src[x * 4 + 1]);
+			row[x * 3 + 2] = static_cast<char>(src[x * 4 + 2]);
+		}
+		ok = fwrite(row.data(), 1, row.size(), f) == row.size();
+	}
+	return (fclose(f) == 0) && ok;
+}
+
+// Raw RGBA8: the magic "RGBA", a uint32 width and a uint32 height, followed
+// by tightly packed rows, top to bottom.
+const char kRawRgbaMagic[4] = { 'R', 'G', 'B', 'A' };
+const size_t kRawRgbaHeaderSize = 12;
+
+inline bool WriteRawRgba(const ImageView &image, const std::wstring &path)
+{
+	FILE *f = OpenFile(path, "wb");
+	if (!f) {
+		return false;
+	}
+	bool ok = fwrite(kRawRgbaMagic, 1, 4, f) == 4 &&
+		fwrite(&image.width, 4, 1, f) == 1 &&
+		fwrite(&image.height, 4, 1, f) == 1;
+	for (uint32_t y = 0; y < image.height && ok; y++) {
+		ok = fwrite(image.Row(y), 1, image.PackedRowSize(), f) == image.PackedRowSize();
+	}
+	return (fclose(f) == 0) && ok;
+}
+
+// An append-only file of same-sized RGBA8 images that is written through a
+// memory mapping, so a batch can be read back by mapping the whole file.
+//
+// Layout:
+//   0   char     magic[4] = "GFIA"
+//   4   uint32   version (1)
+//   8   uint32   width
+//   12  uint32   height
+//   16  uint64   count of complete images
+//   24  uint64   reserved, 0
+//   32  image 0, image 1, ... each width * height * 4 bytes, tightly packed
+//
+// Image i therefore always starts at 32 + i * width * height * 4. The count
+// is written after each image's pixels, behind a release fence, so it never
+// covers a half-written image. Appending to an existing file carries on from
+// its count, as long as the dimensions match.
+class ImageArrayWriter {
+public:
+	static const size_t kHeaderSize = 32;
+	static const uint32_t kVersion = 1;
+
+	ImageArrayWriter()
+		: view_(nullptr), mapped_size_(0), width_(0), height_(0), count_(0), opened_(false) {
+#ifdef _WIN32
+		file_ = INVALID_HANDLE_VALUE;
+		mapping_ = nullptr;
+#else
+		fd_ = -1;
+#endif
+	}
+
+	~ImageArrayWriter() {
+		Close();
+	}
+
+	// Opens or creates the array. Fails if the file exists but isn't an image
+	// array of the given dimensions, in which case it is left as it was.
+	bool Open(const std::wstring &path, uint32_t width, uint32_t height) {
+		Close();
+		width_ = width;
+		height_ = height;
+		count_ = 0;
+		uint64_t existing = 0;
+#ifdef _WIN32
+		file_ = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+			OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file_ == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file_, &size)) {
+			return false;
+		}
+		existing = static_cast<uint64_t>(size.QuadPart);
+#else
+		fd_ = open(NativePath(path).c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd_ < 0) {
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd_, &st) != 0) {
+			return false;
+		}
+		existing = static_cast<uint64_t>(st.st_size);
+#endif
+		if (existing == 0) {
+			if (!Map(kHeaderSize + ImageSize() * 16)) {
+				return false;
+			}
+			memcpy(view_, "GFIA", 4);
+			WriteField<uint32_t>(4, kVersion);
+			WriteField<uint32_t>(8, width_);
+			WriteField<uint32_t>(12, height_);
+			WriteField<uint64_t>(16, 0);
+			WriteField<uint64_t>(24, 0);
+			opened_ = true;
+			return true;
+		}
+		if (existing < kHeaderSize || !Map(existing)) {
+			return false;
+		}
+		if (memcmp(view_, "GFIA", 4) != 0 ||
+			ReadField<uint32_t>(4) != kVersion ||
+			ReadField<uint32_t>(8) != width_ ||
+			ReadField<uint32_t>(12) != height_) {
+			return false;
+		}
+		count_ = ReadField<uint64_t>(16);
+		opened_ = kHeaderSize + count_ * ImageSize() <= existing;
+		return opened_;
+	}
+
+	// Appends an image and returns its index in the array through index.
+	bool Append(const ImageView &image, uint64_t *index) {
+		if (!opened_ || !view_ || image.width != width_ || image.height != height_) {
+			return false;
+		}
+		uint64_t needed = kHeaderSize + (count_ + 1) * ImageSize();
+		if (needed > mapped_size_) {
+			// Grow geometrically so a long batch only remaps a handful of times.
+			uint64_t grown = kHeaderSize + (count_ + 1) * 2 * ImageSize();
+			if (!Map(grown)) {
+				return false;
+			}
+		}
+		uint8_t *dst = view_ + kHeaderSize + count_ * ImageSize();
+		for (uint32_t y = 0; y < height_; y++) {
+			memcpy(dst + y * image.PackedRowSize(), image.Row(y), image.PackedRowSize());
+		}
+		*index = count_;
+		count_++;
+		std::atomic_thread_fence(std::memory_order_release);
+		WriteField<uint64_t>(16, count_);
+		return true;
+	}
+
+	uint64_t Count() const {
+		return count_;
+	}
+
+	// Unmaps the file and trims the unused tail left over from growing it.
+	// A file that Open refused is only closed.
+	bool Close() {
+		bool ok = true;
+		Unmap();
+		uint64_t size = kHeaderSize + count_ * ImageSize();
+#ifdef _WIN32
+		if (file_ != INVALID_HANDLE_VALUE) {
+			if (opened_) {
+				LARGE_INTEGER end;
+				end.QuadPart = static_cast<LONGLONG>(size);
+				ok = SetFilePointerEx(file_, end, nullptr, FILE_BEGIN) && SetEndOfFile(file_);
+			}
+			CloseHandle(file_);
+			file_ = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (fd_ >= 0) {
+			if (opened_) {
+				ok = ftruncate(fd_, static_cast<off_t>(size)) == 0;
+			}
+			close(fd_);
+			fd_ = -1;
+		}
+#endif
+		opened_ = false;
+		return ok;
+	}
+
+private:
+	uint64_t ImageSize() const {
+		return static_cast<uint64_t>(width_) * height_ * 4;
+	}
+
+	template <typename T> T ReadField(size_t offset) const {
+		T value;
+		memcpy(&value, view_ + offset, sizeof(T));
+		return value;
+	}
+
+	template <typename T> void WriteField(size_t offset, T value) {
+		memcpy(view_ + offset, &value, sizeof(T));
+	}
+
+	// (Re)maps the file at the given size, growing the file to match.
+	bool Map(uint64_t size) {
+		Unmap();
+#ifdef _WIN32
+		mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READWRITE,
+			static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xFFFFFFFF), nullptr);
+		if (!mapping_) {
+			return false;
+		}
+		view_ = static_cast<uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T>(size)));
+#else
+		struct stat st;
+		if (fstat(fd_, &st) != 0) {
+			return false;
+		}
+		if (static_cast<uint64_t>(st.st_size) < size && ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+			return false;
+		}
+		void *view = mmap(nullptr, static_cast<size_t>(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+		view_ = view == MAP_FAILED ? nullptr : static_cast<uint8_t*>(view);
+#endif
+		mapped_size_ = view_ ? size : 0;
+		return view_ != nullptr;
+	}
+
+	void Unmap() {
+#ifdef _WIN32
+		if (view_) {
+			UnmapViewOfFile(view_);
+		}
+		if (mapping_) {
+			CloseHandle(mapping_);
+			mapping_ = nullptr;
+		}
+#else
+		if (view_) {
+			munmap(view_, static_cast<size_t>(mapped_size_));
+		}
+#endif
+		view_ = nullptr;
+		mapped_size_ = 0;
+	}
+
+#ifdef _WIN32
+	HANDLE file_;
+	HANDLE mapping_;
+#else
+	int fd_;
+#endif
+	uint8_t *view_;
+	uint64_t mapped_size_;
+	uint32_t width_;
+	uint32_t height_;
+	uint64_t count_;
+	// Whether Open succeeded, and so the file is ours to resize.
+	bool opened_;
+};
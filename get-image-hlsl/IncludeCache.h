@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FileUtil.h"
+#include "FileView.h"
+#include "ImageHash.h"
+
+// A process-wide cache of the files shaders #include. Generated shaders tend
+// to share one big prelude, and without this every shader would read it from
+// disk again.
+
+struct IncludeFile {
+	std::wstring path;  // canonical
+	uint64_t mtime;
+	uint64_t size;
+	uint64_t hash;  // XXH64 of the contents
+	FileView contents;
+};
+
+// One file a shader included, and the hash of what it contained at the time.
+struct IncludeDependency {
+	std::wstring path;
+	uint64_t hash;
+};
+
+typedef std::vector<IncludeDependency> IncludeSet;
+
+class IncludeCache {
+public:
+	IncludeCache() : hits_(0), misses_(0) {
+	}
+
+	// Returns the file's contents, reading it only if it isn't cached yet or
+	// its modification time or size has changed since. Returns null if the
+	// file can't be read. The contents stay valid for as long as the caller
+	// holds on to the pointer, even if the file is reread meanwhile.
+	std::shared_ptr<const IncludeFile> Get(const std::wstring &path) {
+		std::wstring canonical = CanonicalPath(path);
+		uint64_t mtime, size;
+		if (canonical.empty() || !FileStamp(canonical, &mtime, &size)) {
+			return nullptr;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto it = files_.find(canonical);
+			if (it != files_.end() && it->second->mtime == mtime && it->second->size == size) {
+				hits_++;
+				return it->second;
+			}
+		}
+
+		std::shared_ptr<IncludeFile> file = std::make_shared<IncludeFile>();
+		file->path = canonical;
+		file->mtime = mtime;
+		file->size = size;
+		if (!file->contents.Open(canonical)) {
+			return nullptr;
+		}
+		file->hash = Xxh64::Hash(file->contents.Data(), file->contents.Size());
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		misses_++;
+		files_[canonical] = file;
+		return file;
+	}
+
+	// Whether every file in includes still has the contents it was recorded
+	// with.
+	bool UpToDate(const IncludeSet &includes) {
+		for (auto &dependency : includes) {
+			std::shared_ptr<const IncludeFile> file = Get(dependency.path);
+			if (!file || file->hash != dependency.hash) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	uint64_t Hits() const {
+		return hits_;
+	}
+
+	uint64_t Misses() const {
+		return misses_;
+	}
+
+private:
+	std::mutex mutex_;
+	std::map<std::wstring, std::shared_ptr<const IncludeFile>> files_;
+	std::atomic<uint64_t> hits_;
+	std::atomic<uint64_t> misses_;
+};
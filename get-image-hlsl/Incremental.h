@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FileUtil.h"
+#include "FileView.h"
+#include "ImageHash.h"
+#include "IncludeCache.h"
+
+// The up to date check behind --incremental, in the manner of a build system:
+// each output is recorded with a key over everything that went into it (the
+// shader, its uniforms, the compile settings, the devices...) and the files
+// its shader included. A job whose output still exists, whose key is the
+// same and whose includes haven't changed needn't be rendered again.
+//
+// The manifest file is a header:
+//
+//   "GFIM", uint32 version, uint64 XXH64 of everything after it
+//
+// then a uint64 count of outputs and, for each, its path, uint64 key, and
+// includes as a uint32 count followed by, for each, the uint64 hash of its
+// contents and its path. Paths are a uint32 length and that many uint32
+// characters. A manifest that is missing or damaged counts as empty, which
+// costs a full render but never skips a job that shouldn't be.
+class OutputManifest {
+public:
+	// Reads the manifest at path, if there is one, and remembers path for
+	// Save. Returns false if the file is something other than a manifest, so
+	// that Save doesn't overwrite it.
+	bool Load(const std::wstring &path) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		path_ = path;
+		entries_.clear();
+		FileView view;
+		if (!view.Open(path)) {
+			return true;
+		}
+		if (view.Size() >= 4 && !view.StartsWith("GFIM", 4)) {
+			return false;
+		}
+		if (!Parse(reinterpret_cast<const uint8_t*>(view.Data()), view.Size())) {
+			entries_.clear();
+		}
+		return true;
+	}
+
+	// Whether output exists and was last written from inputs with this key,
+	// including files that are still what they were.
+	bool UpToDate(const std::wstring &output, uint64_t key, IncludeCache &include_cache) {
+		IncludeSet includes;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto it = entries_.find(output);
+			if (it == entries_.end() || it->second.key != key) {
+				return false;
+			}
+			includes = it->second.includes;
+		}
+		return FileExists(output.c_str()) && include_cache.UpToDate(includes);
+	}
+
+	// Notes that output has just been written. Safe to call from several
+	// threads at once.
+	void Record(const std::wstring &output, uint64_t key, const IncludeSet &includes) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		Entry &entry = entries_[output];
+		entry.key = key;
+		entry.includes = includes;
+	}
+
+	// Writes the manifest back where it was loaded from, replacing it
+	// atomically. Outputs not touched by this run keep their entries.
+	bool Save() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::vector<uint8_t> body;
+		Append<uint64_t>(body, entries_.size());
+		for (auto &entry : entries_) {
+			AppendPath(body, entry.first);
+			Append<uint64_t>(body, entry.second.key);
+			Append<uint32_t>(body, static_cast<uint32_t>(entry.second.includes.size()));
+			for (auto &dependency : entry.second.includes) {
+				Append<uint64_t>(body, dependency.hash);
+				AppendPath(body, dependency.path);
+			}
+		}
+		std::vector<uint8_t> file;
+		const char *magic = "GFIM";
+		file.insert(file.end(), magic, magic + 4);
+		Append<uint32_t>(file, kVersion);
+		Append<uint64_t>(file, Xxh64::Hash(body.data(), body.size()));
+		file.insert(file.end(), body.begin(), body.end());
+		return WriteFileReplacing(path_, file.data(), file.size());
+	}
+
+	size_t Size() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return entries_.size();
+	}
+
+private:
+	struct Entry {
+		uint64_t key = 0;
+		IncludeSet includes;
+	};
+
+	static const uint32_t kVersion = 1;
+
+	template <typename T> static void Append(std::vector<uint8_t> &out, T value) {
+		const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&value);
+		out.insert(out.end(), bytes, bytes + sizeof(T));
+	}
+
+	static void AppendPath(std::vector<uint8_t> &out, const std::wstring &path) {
+		Append<uint32_t>(out, static_cast<uint32_t>(path.size()));
+		for (wchar_t c : path) {
+			Append<uint32_t>(out, static_cast<uint32_t>(c));
+		}
+	}
+
+	template <typename T> static bool Read(const uint8_t *&p, const uint8_t *end, T *value) {
+		if (static_cast<size_t>(end - p) < sizeof(T)) {
+			return false;
+		}
+		memcpy(value, p, sizeof(T));
+		p += sizeof(T);
+		return true;
+	}
+
+	static bool ReadPath(const uint8_t *&p, const uint8_t *end, std::wstring *path) {
+		uint32_t length = 0;
+		if (!Read(p, end, &length) || static_cast<size_t>(end - p) / sizeof(uint32_t) < length) {
+			return false;
+		}
+		path->clear();
+		path->reserve(length);
+		for (uint32_t c = 0; c < length; c++) {
+			uint32_t character = 0;
+			Read(p, end, &character);
+			*path += static_cast<wchar_t>(character);
+		}
+		return true;
+	}
+
+	bool Parse(const uint8_t *p, size_t size) {
+		const uint8_t *end = p + size;
+		uint32_t version = 0;
+		uint64_t hash = 0, count = 0;
+		if (size < 16 || memcmp(p, "GFIM", 4) != 0) {
+			return false;
+		}
+		p += 4;
+		Read(p, end, &version);
+		Read(p, end, &hash);
+		if (version != kVersion || Xxh64::Hash(p, static_cast<size_t>(end - p)) != hash ||
+			!Read(p, end, &count)) {
+			return false;
+		}
+		for (uint64_t i = 0; i < count; i++) {
+			std::wstring output;
+			Entry entry;
+			uint32_t include_count = 0;
+			if (!ReadPath(p, end, &output) || !Read(p, end, &entry.key) || !Read(p, end, &include_count)) {
+				return false;
+			}
+			for (uint32_t k = 0; k < include_count; k++) {
+				IncludeDependency dependency;
+				if (!Read(p, end, &dependency.hash) || !ReadPath(p, end, &dependency.path)) {
+					return false;
+				}
+				entry.includes.push_back(dependency);
+			}
+			entries_[output] = entry;
+		}
+		return p == end;
+	}
+
+	std::wstring path_;
+	std::mutex mutex_;
+	std::map<std::wstring, Entry> entries_;
+};
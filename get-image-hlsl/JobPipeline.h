@@ -0,0 +1,60 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Hands prepared jobs (e.g. compiled shader bytecode) from one producer to
+// several consumers, each of which works through every job in order. This is
+// how a shader gets compiled once and then rendered on every device.
+//
+// An item is freed once every consumer has said it is done with it, and the
+// producer is held back once `capacity` items are alive, so a fast producer
+// can't run arbitrarily far ahead of the slowest consumer.
+template <typename T>
+class PreparedJobs {
+public:
+	PreparedJobs(size_t count, size_t consumers, size_t capacity)
+		: items_(count), ready_(count, false), remaining_(count, consumers),
+		capacity_(capacity), live_(0) {
+	}
+
+	// Makes job i available to the consumers, blocking while too many earlier
+	// jobs are still alive.
+	void Publish(size_t i, T item) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		freed_.wait(lock, [this] { return live_ < capacity_; });
+		items_[i] = std::move(item);
+		ready_[i] = true;
+		live_++;
+		published_.notify_all();
+	}
+
+	// Blocks until job i has been published. The reference stays valid until
+	// this consumer calls Done(i).
+	const T &Wait(size_t i) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		published_.wait(lock, [this, i] { return ready_[i]; });
+		return items_[i];
+	}
+
+	void Done(size_t i) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (--remaining_[i] == 0) {
+			items_[i] = T();
+			live_--;
+			freed_.notify_one();
+		}
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable published_;
+	std::condition_variable freed_;
+	std::vector<T> items_;
+	std::vector<bool> ready_;
+	std::vector<size_t> remaining_;
+	size_t capacity_;
+	size_t live_;
+};
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FileUtil.h"
+#include "FileView.h"
+
+// CRC-32 as used by zip and PNG (reflected, polynomial 0xEDB88320). Pass the
+// previous result as crc to continue over more data.
+inline uint32_t Crc32(const void *data, size_t size, uint32_t crc = 0)
+{
+	struct Table {
+		uint32_t entries[256];
+
+		Table() {
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++) {
+					c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				}
+				entries[i] = c;
+			}
+		}
+	};
+	static const Table table;
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) {
+		crc = table.entries[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+// An append-only file of records, for remembering which jobs are done across
+// crashes. The file starts with "GFJL" and a uint32 version, then each record
+// is a uint32 payload length, the CRC-32 of that length and the payload, and
+// the payload itself. Integers are little endian whatever the machine, so a
+// journal can be moved between machines.
+//
+// Records are written as they are appended but only synced to disk once per
+// group, so a crash can lose the last group, and can leave a record half
+// written. Opening the journal again keeps every record up to the first one
+// that is cut short or fails its checksum, and truncates the rest so that
+// new records follow on from the good ones.
+class Journal {
+public:
+	static const size_t kDefaultGroupSize = 64;
+	// Longer records are taken to be garbage.
+	static const uint32_t kMaxRecordSize = 1 << 20;
+
+	explicit Journal(size_t group_size = kDefaultGroupSize)
+		: group_size_(group_size ? group_size : 1), file_(nullptr), pending_(0), records_(0), syncs_(0),
+		truncated_bytes_(0) {
+	}
+
+	~Journal() {
+		Close();
+	}
+
+	Journal(const Journal&) = delete;
+	Journal &operator=(const Journal&) = delete;
+
+	// Opens path, creating it if it doesn't exist, and calls
+	// on_record(const char *payload, size_t size) for each record already in
+	// it, oldest first. Returns false if the file can't be opened or isn't a
+	// journal.
+	template <typename OnRecord> bool Open(const std::wstring &path, OnRecord on_record) {
+		Close();
+		uint64_t good_size;
+		uint64_t file_size;
+		if (!Read(path, on_record, &good_size, &file_size)) {
+			return false;
+		}
+		if (good_size < file_size) {
+			if (!TruncateFile(path, good_size)) {
+				return false;
+			}
+			truncated_bytes_ = file_size - good_size;
+		}
+		file_ = OpenFile(path, "ab");
+		if (!file_) {
+			return false;
+		}
+		if (good_size == 0) {
+			uint8_t header[8];
+			PutHeader(header);
+			if (fwrite(header, 1, sizeof(header), file_) != sizeof(header) || !SyncFile(file_)) {
+				Close();
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Calls on_record for each intact record in the journal at path without
+	// changing it, and sets good_size to where they end and file_size to the
+	// size of the whole file. A journal that doesn't exist yet is empty.
+	template <typename OnRecord> static bool Read(const std::wstring &path, OnRecord on_record,
+		uint64_t *good_size = nullptr, uint64_t *file_size = nullptr) {
+		uint64_t good = 0;
+		uint64_t size = 0;
+		uint64_t mtime;
+		if (FileStamp(path, &mtime, &size) && size > 0) {
+			FileView view;
+			if (!view.Open(path) || !Recover(view, on_record, &good)) {
+				return false;
+			}
+		}
+		if (good_size) {
+			*good_size = good;
+		}
+		if (file_size) {
+			*file_size = size;
+		}
+		return true;
+	}
+
+	bool IsOpen() const {
+		return file_ != nullptr;
+	}
+
+	// Adds a record, syncing the group if this fills it. Safe to call from
+	// several threads at once.
+	bool Append(const void *payload, size_t size) {
+		if (size > kMaxRecordSize) {
+			return false;
+		}
+		uint8_t header[8];
+		PutUint32(header, static_cast<uint32_t>(size));
+		PutUint32(header + 4, Crc32(payload, size, Crc32(header, 4)));
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!file_ || fwrite(header, 1, sizeof(header), file_) != sizeof(header) ||
+			fwrite(payload, 1, size, file_) != size) {
+			return false;
+		}
+		records_++;
+		if (++pending_ >= group_size_) {
+			return SyncLocked();
+		}
+		return true;
+	}
+
+	bool Append(const std::string &payload) {
+		return Append(payload.data(), payload.size());
+	}
+
+	// Syncs whatever has been appended since the last sync.
+	bool Sync() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return SyncLocked();
+	}
+
+	// Syncs and closes the file. Returns false if the sync failed.
+	bool Close() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!file_) {
+			return true;
+		}
+		bool ok = SyncLocked();
+		ok = fclose(file_) == 0 && ok;
+		file_ = nullptr;
+		return ok;
+	}
+
+	// Records appended since opening, and syncs done.
+	uint64_t Records() const {
+		return records_;
+	}
+
+	uint64_t Syncs() const {
+		return syncs_;
+	}
+
+	// How much of a torn or corrupted tail Open cut off.
+	uint64_t TruncatedBytes() const {
+		return truncated_bytes_;
+	}
+
+private:
+	static const uint32_t kVersion = 1;
+
+	static void PutHeader(uint8_t *out) {
+		memcpy(out, "GFJL", 4);
+		PutUint32(out + 4, kVersion);
+	}
+
+	static void PutUint32(uint8_t *out, uint32_t value) {
+		for (int i = 0; i < 4; i++) {
+			out[i] = static_cast<uint8_t>(value >> (8 * i));
+		}
+	}
+
+	static uint32_t GetUint32(const uint8_t *in) {
+		return static_cast<uint32_t>(in[0]) | (static_cast<uint32_t>(in[1]) << 8) |
+			(static_cast<uint32_t>(in[2]) << 16) | (static_cast<uint32_t>(in[3]) << 24);
+	}
+
+	// Walks the records in view, setting good_size to the end of the last
+	// intact one. A header cut short counts as an empty journal; any other
+	// header means this isn't one of ours.
+	template <typename OnRecord> static bool Recover(const FileView &view, OnRecord &on_record, uint64_t *good_size) {
+		const uint8_t *data = reinterpret_cast<const uint8_t*>(view.Data());
+		size_t size = view.Size();
+		*good_size = 0;
+		uint8_t header[8];
+		PutHeader(header);
+		if (size < 8) {
+			return memcmp(data, header, size) == 0;
+		}
+		if (memcmp(data, header, 8) != 0) {
+			return false;
+		}
+		size_t offset = 8;
+		while (size - offset >= 8) {
+			uint32_t length = GetUint32(data + offset);
+			if (length > kMaxRecordSize || length > size - offset - 8 ||
+				Crc32(data + offset + 8, length, Crc32(data + offset, 4)) != GetUint32(data + offset + 4)) {
+				break;
+			}
+			on_record(reinterpret_cast<const char*>(data + offset + 8), static_cast<size_t>(length));
+			offset += 8 + length;
+		}
+		*good_size = offset;
+		return true;
+	}
+
+	bool SyncLocked() {
+		if (!file_) {
+			return false;
+		}
+		if (pending_ == 0) {
+			return true;
+		}
+		pending_ = 0;
+		syncs_++;
+		return SyncFile(file_);
+	}
+
+	size_t group_size_;
+	std::mutex mutex_;
+	FILE *file_;
+	size_t pending_;
+	uint64_t records_;
+	uint64_t syncs_;
+	uint64_t truncated_bytes_;
+};
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Checking that text is a single JSON value (RFC 8259) before handing it to
+// json.hpp. We build json.hpp without exceptions, so when it meets anything
+// else it prints an error and exits the process: text that may not be JSON
+// at all, such as the records in a journal someone points us at, has to be
+// checked first.
+//
+// The check is stricter than json.hpp on purpose, so that whatever passes it
+// also parses. Strings must be valid UTF-8 with no raw control characters and
+// no lone surrogates in their escapes, and arrays and objects can't nest more
+// than kMaxJsonDepth deep, which also keeps json.hpp's recursive parser well
+// within the stack.
+
+namespace json_check_detail {
+
+const int kMaxJsonDepth = 256;
+
+class Checker {
+public:
+	Checker(const char *begin, const char *end)
+		: p_(reinterpret_cast<const uint8_t*>(begin)), end_(reinterpret_cast<const uint8_t*>(end)) {
+	}
+
+	bool Document() {
+		SkipWhitespace();
+		if (!Value(0)) {
+			return false;
+		}
+		SkipWhitespace();
+		return p_ == end_;
+	}
+
+private:
+	bool Value(int depth) {
+		if (p_ == end_) {
+			return false;
+		}
+		switch (*p_) {
+		case '{':
+			return Object(depth + 1);
+		case '[':
+			return Array(depth + 1);
+		case '"':
+			return String();
+		case 't':
+			return Literal("true");
+		case 'f':
+			return Literal("false");
+		case 'n':
+			return Literal("null");
+		default:
+			return Number();
+		}
+	}
+
+	bool Object(int depth) {
+		p_++;
+		SkipWhitespace();
+		if (depth > kMaxJsonDepth) {
+			return false;
+		}
+		if (Consume('}')) {
+			return true;
+		}
+		for (;;) {
+			SkipWhitespace();
+			if (p_ == end_ || *p_ != '"' || !String()) {
+				return false;
+			}
+			SkipWhitespace();
+			if (!Consume(':')) {
+				return false;
+			}
+			SkipWhitespace();
+			if (!Value(depth)) {
+				return false;
+			}
+			SkipWhitespace();
+			if (Consume('}')) {
+				return true;
+			}
+			if (!Consume(',')) {
+				return false;
+			}
+		}
+	}
+
+	bool Array(int depth) {
+		p_++;
+		SkipWhitespace();
+		if (depth > kMaxJsonDepth) {
+			return false;
+		}
+		if (Consume(']')) {
+			return true;
+		}
+		for (;;) {
+			SkipWhitespace();
+			if (!Value(depth)) {
+				return false;
+			}
+			SkipWhitespace();
+			if (Consume(']')) {
+				return true;
+			}
+			if (!Consume(',')) {
+				return false;
+			}
+		}
+	}
+
+	bool String() {
+		p_++;
+		while (p_ != end_) {
+			uint8_t c = *p_++;
+			if (c == '"') {
+				return true;
+			}
+			if (c < 0x20 || (c == '\\' && !Escape()) || (c >= 0x80 && !Utf8(c))) {
+				return false;
+			}
+		}
+		return false;
+	}
+
+	bool Escape() {
+		if (p_ == end_) {
+			return false;
+		}
+		switch (*p_++) {
+		case '"':
+		case '\\':
+		case '/':
+		case 'b':
+		case 'f':
+		case 'n':
+		case 'r':
+		case 't':
+			return true;
+		case 'u': {
+			uint32_t unit;
+			if (!Hex4(&unit) || (unit >= 0xDC00 && unit <= 0xDFFF)) {
+				return false;
+			}
+			if (unit < 0xD800 || unit > 0xDBFF) {
+				return true;
+			}
+			// A high surrogate, which has to be followed by a low one.
+			if (end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u') {
+				return false;
+			}
+			p_ += 2;
+			return Hex4(&unit) && unit >= 0xDC00 && unit <= 0xDFFF;
+		}
+		default:
+			return false;
+		}
+	}
+
+	bool Hex4(uint32_t *unit) {
+		if (end_ - p_ < 4) {
+			return false;
+		}
+		*unit = 0;
+		for (int i = 0; i < 4; i++) {
+			uint8_t c = *p_++;
+			uint32_t digit;
+			if (c >= '0' && c <= '9') {
+				digit = c - '0';
+			}
+			else if (c >= 'a' && c <= 'f') {
+				digit = c - 'a' + 10;
+			}
+			else if (c >= 'A' && c <= 'F') {
+				digit = c - 'A' + 10;
+			}
+			else {
+				return false;
+			}
+			*unit = *unit << 4 | digit;
+		}
+		return true;
+	}
+
+	// The rest of a UTF-8 sequence that started with lead. Overlong forms,
+	// surrogates and anything past U+10FFFF are rejected.
+	bool Utf8(uint8_t lead) {
+		int continuations;
+		uint32_t code_point;
+		uint32_t smallest;
+		if (lead >= 0xC2 && lead <= 0xDF) {
+			continuations = 1;
+			code_point = lead & 0x1F;
+			smallest = 0x80;
+		}
+		else if (lead >= 0xE0 && lead <= 0xEF) {
+			continuations = 2;
+			code_point = lead & 0x0F;
+			smallest = 0x800;
+		}
+		else if (lead >= 0xF0 && lead <= 0xF4) {
+			continuations = 3;
+			code_point = lead & 0x07;
+			smallest = 0x10000;
+		}
+		else {
+			return false;
+		}
+		if (end_ - p_ < continuations) {
+			return false;
+		}
+		for (int i = 0; i < continuations; i++) {
+			uint8_t c = *p_++;
+			if ((c & 0xC0) != 0x80) {
+				return false;
+			}
+			code_point = code_point << 6 | (c & 0x3F);
+		}
+		return code_point >= smallest && code_point <= 0x10FFFF && (code_point < 0xD800 || code_point > 0xDFFF);
+	}
+
+	bool Number() {
+		Consume('-');
+		if (!Consume('0') && !Digits()) {
+			return false;
+		}
+		if (Consume('.') && !Digits()) {
+			return false;
+		}
+		if (Consume('e') || Consume('E')) {
+			if (!Consume('+')) {
+				Consume('-');
+			}
+			return Digits();
+		}
+		return true;
+	}
+
+	bool Digits() {
+		const uint8_t *start = p_;
+		while (p_ != end_ && *p_ >= '0' && *p_ <= '9') {
+			p_++;
+		}
+		return p_ != start;
+	}
+
+	bool Literal(const char *literal) {
+		for (; *literal; literal++) {
+			if (!Consume(*literal)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool Consume(char c) {
+		if (p_ == end_ || *p_ != static_cast<uint8_t>(c)) {
+			return false;
+		}
+		p_++;
+		return true;
+	}
+
+	void SkipWhitespace() {
+		while (p_ != end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+			p_++;
+		}
+	}
+
+	const uint8_t *p_;
+	const uint8_t *end_;
+};
+
+}
+
+// Whether [begin, end) is exactly one JSON value, optionally surrounded by
+// whitespace, that json::parse will accept.
+inline bool IsWellFormedJson(const char *begin, const char *end)
+{
+	return json_check_detail::Checker(begin, end).Document();
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+// A least-recently-used cache with a cap on the total cost of what it holds,
+// where each entry's cost is whatever the caller says it is (e.g. its size in
+// bytes). It isn't thread safe: each device keeps its own.
+template <typename Key, typename Value>
+class LruCache {
+public:
+	explicit LruCache(size_t capacity = 0)
+		: capacity_(capacity), cost_(0), hits_(0), misses_(0), evictions_(0) {
+	}
+
+	// Returns null if key isn't cached. Otherwise it becomes the most
+	// recently used entry.
+	Value *Find(const Key &key) {
+		auto it = index_.find(key);
+		if (it == index_.end()) {
+			misses_++;
+			return nullptr;
+		}
+		hits_++;
+		entries_.splice(entries_.begin(), entries_, it->second);
+		return &it->second->value;
+	}
+
+	// Adds (or replaces) an entry, then evicts the least recently used ones
+	// until everything fits again. Something that costs more than the whole
+	// capacity isn't kept at all.
+	void Insert(const Key &key, Value value, size_t cost) {
+		Erase(key);
+		if (cost > capacity_) {
+			return;
+		}
+		entries_.push_front(Entry{ key, std::move(value), cost });
+		index_[key] = entries_.begin();
+		cost_ += cost;
+		EvictToFit();
+	}
+
+	void Erase(const Key &key) {
+		auto it = index_.find(key);
+		if (it != index_.end()) {
+			cost_ -= it->second->cost;
+			entries_.erase(it->second);
+			index_.erase(it);
+		}
+	}
+
+	void SetCapacity(size_t capacity) {
+		capacity_ = capacity;
+		EvictToFit();
+	}
+
+	size_t Capacity() const {
+		return capacity_;
+	}
+
+	size_t Cost() const {
+		return cost_;
+	}
+
+	size_t Size() const {
+		return entries_.size();
+	}
+
+	uint64_t Hits() const {
+		return hits_;
+	}
+
+	uint64_t Misses() const {
+		return misses_;
+	}
+
+	uint64_t Evictions() const {
+		return evictions_;
+	}
+
+private:
+	struct Entry {
+		Key key;
+		Value value;
+		size_t cost;
+	};
+
+	void EvictToFit() {
+		while (cost_ > capacity_) {
+			Entry &oldest = entries_.back();
+			cost_ -= oldest.cost;
+			index_.erase(oldest.key);
+			entries_.pop_back();
+			evictions_++;
+		}
+	}
+
+	// Most recently used first.
+	std::list<Entry> entries_;
+	std::unordered_map<Key, typename std::list<Entry>::iterator> index_;
+	size_t capacity_;
+	size_t cost_;
+	uint64_t hits_;
+	uint64_t misses_;
+	uint64_t evictions_;
+};
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "FileUtil.h"
+#include "FileView.h"
+#include "IncludeCache.h"
+#include "Journal.h"
+
+// A Bloom filter over 64 bit keys, which are hashes already, so the probes
+// are made from the key by double hashing rather than by hashing it again.
+// Never says no to a key that was added; says yes to about 1% of others
+// while it holds no more than a tenth as many keys as it has bits.
+class BloomFilter {
+public:
+	static const int kProbes = 7;
+
+	explicit BloomFilter(size_t bits = 0) {
+		Reset(bits);
+	}
+
+	// Empties the filter and sizes it to at least bits, a power of two.
+	void Reset(size_t bits) {
+		size_t size = 1024;
+		while (size < bits) {
+			size *= 2;
+		}
+		words_.assign(size / 64, 0);
+		mask_ = size - 1;
+		count_ = 0;
+	}
+
+	void Add(uint64_t key) {
+		uint64_t h1 = key;
+		uint64_t h2 = Mix(key) | 1;
+		for (int i = 0; i < kProbes; i++) {
+			uint64_t bit = (h1 + i * h2) & mask_;
+			words_[bit / 64] |= uint64_t(1) << (bit % 64);
+		}
+		count_++;
+	}
+
+	bool MayContain(uint64_t key) const {
+		uint64_t h1 = key;
+		uint64_t h2 = Mix(key) | 1;
+		for (int i = 0; i < kProbes; i++) {
+			uint64_t bit = (h1 + i * h2) & mask_;
+			if (!(words_[bit / 64] & (uint64_t(1) << (bit % 64)))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	size_t Bits() const {
+		return mask_ + 1;
+	}
+
+	size_t Count() const {
+		return count_;
+	}
+
+private:
+	static uint64_t Mix(uint64_t x) {
+		x ^= x >> 33;
+		x *= 0xFF51AFD7ED558CCDull;
+		x ^= x >> 33;
+		return x;
+	}
+
+	std::vector<uint64_t> words_;
+	uint64_t mask_;
+	size_t count_;
+};
+
+// Why a shader is known to be bad.
+enum ShaderFailureKind {
+	// The HLSL compiler rejected it.
+	SHADER_FAILURE_COMPILE = 1,
+	// The process died, or the device was lost, while it was being rendered.
+	SHADER_FAILURE_CRASH = 2,
+};
+
+struct ShaderFailure {
+	ShaderFailureKind kind;
+	// The compiler's errors, or a description of the crash.
+	std::string message;
+	// Whether it came out of the cache rather than just happening. Not
+	// stored.
+	bool cached;
+};
+
+inline const char *ShaderFailureName(ShaderFailureKind kind)
+{
+	return kind == SHADER_FAILURE_COMPILE ? "compile" : "crash";
+}
+
+// Shaders known to fail, kept between runs so that a corpus rendered again
+// doesn't pay for its bad shaders again. Keys are up to the caller: a hash
+// of the source and compile settings for compile failures, and of the
+// bytecode for crashes.
+//
+// Entries are records in a journal (see Journal.h), each holding:
+//
+//   uint8 kind, uint8 version, 6 reserved bytes, uint64 key,
+//   uint64 environment, uint32 include count, then for each include its
+//   uint64 XXH64, uint32 path length and path (one uint32 per character),
+//   then the message
+//
+// where environment is what the failure depends on besides the key: the
+// compiler's version for compile failures, the adapters and drivers for
+// crashes. Open is given the current ones, and entries made under others
+// are dropped, and the journal rewritten without them. The includes are the
+// files a compile failure #included, as for BytecodeCache: once any of them
+// has changed, Find no longer returns the entry. Records from before they
+// were kept (version 0) are dropped too if they are compile failures. A
+// Bloom filter in front of the entries answers for the shaders that are
+// fine, which are most of them, without touching the table.
+//
+// Not safe to use from several threads at once.
+class NegativeCache {
+public:
+	NegativeCache() : invalidated_(0), hits_(0) {
+	}
+
+	bool Enabled() const {
+		return journal_.IsOpen();
+	}
+
+	// Opens, or creates, the cache at path.
+	bool Open(const std::wstring &path, uint64_t compiler_environment, uint64_t driver_environment) {
+		environments_[SHADER_FAILURE_COMPILE] = compiler_environment;
+		environments_[SHADER_FAILURE_CRASH] = driver_environment;
+		entries_.clear();
+		invalidated_ = 0;
+		bool read = Journal::Read(path, [this](const char *payload, size_t size) {
+			Entry entry;
+			uint64_t key;
+			if (!Parse(payload, size, &key, &entry)) {
+				invalidated_++;
+			}
+			else if (entry.environment != environments_[entry.failure.kind]) {
+				invalidated_++;
+			}
+			else {
+				entries_[key] = std::move(entry);
+			}
+		});
+		if (!read) {
+			return false;
+		}
+		if (invalidated_ > 0) {
+			// Start again with only the entries that still hold.
+			if (!TruncateFile(path, 0) || !journal_.Open(path, [](const char*, size_t) {})) {
+				return false;
+			}
+			for (auto &entry : entries_) {
+				Append(entry.first, entry.second);
+			}
+			if (!journal_.Sync()) {
+				return false;
+			}
+		}
+		else if (!journal_.Open(path, [](const char*, size_t) {})) {
+			return false;
+		}
+		RebuildFilter();
+		return true;
+	}
+
+	// The failure recorded for key, or nullptr. An entry whose includes have
+	// changed since, according to include_cache, doesn't count.
+	const ShaderFailure *Find(uint64_t key, IncludeCache &include_cache) {
+		if (!filter_.MayContain(key)) {
+			return nullptr;
+		}
+		auto it = entries_.find(key);
+		if (it == entries_.end() || !include_cache.UpToDate(it->second.includes)) {
+			return nullptr;
+		}
+		hits_++;
+		return &it->second.failure;
+	}
+
+	// Records a failure, and the files it included if it didn't compile.
+	// Returns false if it couldn't be written.
+	bool Add(uint64_t key, const ShaderFailure &failure, const IncludeSet &includes = IncludeSet()) {
+		Entry &entry = entries_[key];
+		entry.failure = failure;
+		entry.environment = environments_[failure.kind];
+		entry.includes = includes;
+		if (entries_.size() * 10 > filter_.Bits()) {
+			RebuildFilter();
+		}
+		else {
+			filter_.Add(key);
+		}
+		return Append(key, entry) && journal_.Sync();
+	}
+
+	bool Close() {
+		return journal_.Close();
+	}
+
+	size_t Size() const {
+		return entries_.size();
+	}
+
+	// Entries dropped by Open because the compiler or drivers had changed.
+	uint64_t Invalidated() const {
+		return invalidated_;
+	}
+
+	uint64_t Hits() const {
+		return hits_;
+	}
+
+	const BloomFilter &Filter() const {
+		return filter_;
+	}
+
+private:
+	struct Entry {
+		ShaderFailure failure;
+		uint64_t environment;
+		IncludeSet includes;
+	};
+
+	static const uint8_t kRecordVersion = 1;
+	static const size_t kRecordHeaderSize = 24;
+
+	template <typename T> static void Put(std::string &out, T value) {
+		out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	template <typename T> static bool Take(const char *&p, const char *end, T *value) {
+		if (static_cast<size_t>(end - p) < sizeof(T)) {
+			return false;
+		}
+		memcpy(value, p, sizeof(T));
+		p += sizeof(T);
+		return true;
+	}
+
+	static bool Parse(const char *payload, size_t size, uint64_t *key, Entry *entry) {
+		if (size < kRecordHeaderSize) {
+			return false;
+		}
+		uint8_t kind = static_cast<uint8_t>(payload[0]);
+		uint8_t version = static_cast<uint8_t>(payload[1]);
+		if ((kind != SHADER_FAILURE_COMPILE && kind != SHADER_FAILURE_CRASH) || version > kRecordVersion ||
+			(version == 0 && kind == SHADER_FAILURE_COMPILE)) {
+			return false;
+		}
+		entry->failure.kind = static_cast<ShaderFailureKind>(kind);
+		memcpy(key, payload + 8, 8);
+		memcpy(&entry->environment, payload + 16, 8);
+		const char *p = payload + kRecordHeaderSize;
+		const char *end = payload + size;
+		entry->includes.clear();
+		uint32_t count = 0;
+		if (version > 0 && !Take(p, end, &count)) {
+			return false;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			IncludeDependency dependency;
+			uint32_t length = 0;
+			if (!Take(p, end, &dependency.hash) || !Take(p, end, &length) ||
+				static_cast<size_t>(end - p) / sizeof(uint32_t) < length) {
+				return false;
+			}
+			for (uint32_t c = 0; c < length; c++) {
+				uint32_t character = 0;
+				Take(p, end, &character);
+				dependency.path += static_cast<wchar_t>(character);
+			}
+			entry->includes.push_back(dependency);
+		}
+		entry->failure.message.assign(p, end);
+		entry->failure.cached = false;
+		return true;
+	}
+
+	bool Append(uint64_t key, const Entry &entry) {
+		std::string record(kRecordHeaderSize, '\0');
+		record[0] = static_cast<char>(entry.failure.kind);
+		record[1] = static_cast<char>(kRecordVersion);
+		memcpy(&record[8], &key, 8);
+		memcpy(&record[16], &entry.environment, 8);
+		Put<uint32_t>(record, static_cast<uint32_t>(entry.includes.size()));
+		for (auto &dependency : entry.includes) {
+			Put<uint64_t>(record, dependency.hash);
+			Put<uint32_t>(record, static_cast<uint32_t>(dependency.path.size()));
+			for (wchar_t c : dependency.path) {
+				Put<uint32_t>(record, static_cast<uint32_t>(c));
+			}
+		}
+		// Journal records are capped, and a message that long isn't worth
+		// keeping whole.
+		record.append(entry.failure.message, 0, Journal::kMaxRecordSize / 2);
+		return journal_.Append(record);
+	}
+
+	void RebuildFilter() {
+		filter_.Reset(entries_.size() * 20);
+		for (auto &entry : entries_) {
+			filter_.Add(entry.first);
+		}
+	}
+
+	Journal journal_;
+	uint64_t environments_[3];
+	std::unordered_map<uint64_t, Entry> entries_;
+	BloomFilter filter_;
+	uint64_t invalidated_;
+	uint64_t hits_;
+};
+
+// Remembers which shader a device is drawing, in a small file rewritten for
+// each job, so that if the driver takes the process down with it, or the
+// device is lost and we give up, the next run can tell which shader did it.
+// The file holds:
+//
+//   "GFCM", uint32 length of the name, uint64 key, the shader's name
+//
+// and is only removed once rendering has finished. Writes are flushed to
+// the operating system but not synced, as outliving the process is all
+// that is needed.
+class CrashMarker {
+public:
+	CrashMarker() : file_(nullptr) {
+	}
+
+	// Leaves the file alone: a marker that wasn't removed is a crash.
+	~CrashMarker() {
+		if (file_) {
+			fclose(file_);
+		}
+	}
+
+	CrashMarker(const CrashMarker&) = delete;
+	CrashMarker &operator=(const CrashMarker&) = delete;
+
+	// What a run that didn't finish was drawing, if it left a marker at path.
+	static bool Leftover(const std::wstring &path, uint64_t *key, std::string *name) {
+		FileView view;
+		uint32_t length;
+		if (!view.Open(path) || view.Size() < kHeaderSize || !view.StartsWith("GFCM", 4)) {
+			return false;
+		}
+		memcpy(&length, view.Data() + 4, 4);
+		memcpy(key, view.Data() + 8, 8);
+		if (*key == 0 || length > view.Size() - kHeaderSize) {
+			return false;
+		}
+		name->assign(view.Data() + kHeaderSize, length);
+		return true;
+	}
+
+	bool Open(const std::wstring &path) {
+		path_ = path;
+		file_ = OpenFile(path, "wb");
+		return file_ && Set(0, std::string());
+	}
+
+	// Marks the shader called name, with key, as being drawn. A key of 0
+	// marks nothing.
+	bool Set(uint64_t key, const std::string &name) {
+		char header[kHeaderSize];
+		uint32_t length = static_cast<uint32_t>(name.size());
+		memcpy(header, "GFCM", 4);
+		memcpy(header + 4, &length, 4);
+		memcpy(header + 8, &key, 8);
+		return file_ && fseek(file_, 0, SEEK_SET) == 0 && fwrite(header, 1, kHeaderSize, file_) == kHeaderSize &&
+			fwrite(name.data(), 1, name.size(), file_) == name.size() && fflush(file_) == 0;
+	}
+
+	// Everything drawn without crashing, so the marker can go.
+	void Remove() {
+		if (file_) {
+			fclose(file_);
+			file_ = nullptr;
+			RemoveFile(path_);
+		}
+	}
+
+private:
+	static const size_t kHeaderSize = 16;
+
+	std::wstring path_;
+	FILE *file_;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "Image.h"
+
+// A ring of readback slots that lets the GPU copy frame k while the CPU is
+// still mapping and encoding frame k-1.
+//
+// This knows nothing about D3D. The Backend provides the actual slots and must
+// have the following members:
+//
+//   size_t Depth() const;              // number of slots in the ring
+//   void IssueCopy(size_t slot);       // queue a copy of the current frame
+//   bool IsReady(size_t slot);         // non-blocking: has that copy landed?
+//   ImageView Map(size_t slot);        // only called once IsReady is true
+//   void Unmap(size_t slot);
+//
+// Each pushed frame carries a Tag (e.g. a job index) that is handed back to the
+// consumer along with the pixels, in the same order the frames were pushed.
+template <typename Backend, typename Tag>
+class ReadbackRing {
+public:
+	typedef std::function<void(const Tag&, const ImageView&)> Consumer;
+
+	ReadbackRing(Backend &backend, Consumer consumer)
+		: backend_(backend), consumer_(consumer), tags_(backend.Depth()),
+		head_(0), in_flight_(0) {
+		assert(backend_.Depth() > 0);
+	}
+
+	~ReadbackRing() {
+		Flush();
+	}
+
+	// Copy the current frame into the next free slot. If every slot is still
+	// busy the oldest frame is drained first, which is the only place this
+	// blocks. Anything older than the new frame that the GPU has already
+	// finished is drained straight away so its encode overlaps with the copy
+	// we just queued.
+	void Push(const Tag &tag) {
+		if (in_flight_ == backend_.Depth()) {
+			DrainOldest();
+		}
+		size_t slot = (head_ + in_flight_) % backend_.Depth();
+		tags_[slot] = tag;
+		backend_.IssueCopy(slot);
+		in_flight_++;
+
+		while (in_flight_ > 1 && backend_.IsReady(head_)) {
+			DrainOldest();
+		}
+	}
+
+	// Wait for and consume every frame still in flight.
+	void Flush() {
+		while (in_flight_ > 0) {
+			DrainOldest();
+		}
+	}
+
+	size_t InFlight() const {
+		return in_flight_;
+	}
+
+private:
+	void DrainOldest() {
+		assert(in_flight_ > 0);
+		while (!backend_.IsReady(head_)) {
+			std::this_thread::yield();
+		}
+		ImageView image = backend_.Map(head_);
+		consumer_(tags_[head_], image);
+		backend_.Unmap(head_);
+		head_ = (head_ + 1) % backend_.Depth();
+		in_flight_--;
+	}
+
+	Backend &backend_;
+	Consumer consumer_;
+	std::vector<Tag> tags_;
+	size_t head_;
+	size_t in_flight_;
+};
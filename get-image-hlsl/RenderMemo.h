@@ -0,0 +1,178 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "FileUtil.h"
+#include "FileView.h"
+#include "Image.h"
+#include "ImageHash.h"
+
+// DXBC chunks that can't change what a shader draws: resource definitions
+// (variable and buffer names, and the compiler's name), statistics, debug
+// info, and DXIL's debug names. Shaders that only differ in these, such as
+// variants that rename identifiers, render the same.
+const char *const DXBC_IGNORED_CHUNKS[] = {
+	"RDEF", "STAT", "SDBG", "SPDB", "ILDB", "ILDN", "PRIV",
+};
+
+// A hash of the parts of a DXBC container that affect rendering. A container
+// is "DXBC", a 16 byte checksum over the rest, a uint32 version, a uint32
+// total size and a uint32 chunk count, then the offset of each chunk; a
+// chunk is a fourcc, a uint32 size and its data. Every chunk not in
+// DXBC_IGNORED_CHUNKS is hashed in order, fourcc and all, and the checksum
+// is left out, as it covers the ignored chunks too. Bytecode that isn't a
+// well formed container is hashed whole.
+inline uint64_t CanonicalBytecodeHash(const void *bytecode, size_t size)
+{
+	const uint8_t *data = static_cast<const uint8_t*>(bytecode);
+	auto get_uint32 = [data](size_t offset) {
+		uint32_t value;
+		memcpy(&value, data + offset, sizeof(value));
+		return value;
+	};
+	const size_t kHeaderSize = 32;
+	if (size < kHeaderSize || memcmp(data, "DXBC", 4) != 0 || get_uint32(24) != size) {
+		return Xxh64::Hash(data, size);
+	}
+	uint32_t chunks = get_uint32(28);
+	if (chunks > (size - kHeaderSize) / 4) {
+		return Xxh64::Hash(data, size);
+	}
+	Xxh64 hasher;
+	for (uint32_t c = 0; c < chunks; c++) {
+		uint32_t offset = get_uint32(kHeaderSize + 4 * c);
+		if (offset < kHeaderSize || offset > size - 8 || get_uint32(offset + 4) > size - offset - 8) {
+			return Xxh64::Hash(data, size);
+		}
+		size_t chunk_size = 8 + get_uint32(offset + 4);
+		bool ignored = false;
+		for (const char *fourcc : DXBC_IGNORED_CHUNKS) {
+			ignored = ignored || memcmp(data + offset, fourcc, 4) == 0;
+		}
+		if (!ignored) {
+			hasher.Update(data + offset, chunk_size);
+		}
+	}
+	return hasher.Digest();
+}
+
+// Images already rendered, so that a job whose shader, uniforms, device and
+// resolution match an earlier one's gets its image without drawing. The key
+// is up to the caller; the memo only stores images under it. Each entry is a
+// file in the memo directory named after its key, holding a header:
+//
+//   "GFRM", uint32 version, uint64 key, uint64 XXH64 of everything after it,
+//   uint32 width, uint32 height
+//
+// then the pixels, tightly packed RGBA8. As with the bytecode cache, entries
+// are renamed into place and anything damaged is simply a miss.
+class RenderMemo {
+public:
+	RenderMemo() : hits_(0), misses_(0) {
+	}
+
+	// Creates the directory if it doesn't exist yet.
+	bool Open(const std::wstring &directory) {
+		directory_ = directory;
+#ifdef _WIN32
+		if (!CreateDirectoryW(directory.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+			return false;
+		}
+#else
+		if (mkdir(NativePath(directory).c_str(), 0777) != 0 && errno != EEXIST) {
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	bool Enabled() const {
+		return !directory_.empty();
+	}
+
+	// The image stored under key, if there is an intact one.
+	bool Load(uint64_t key, Image *image) {
+		FileView entry;
+		if (Enabled() && entry.Open(EntryPath(key)) && Parse(key, entry, image)) {
+			hits_++;
+			return true;
+		}
+		misses_++;
+		return false;
+	}
+
+	bool Store(uint64_t key, const ImageView &image) {
+		if (!Enabled()) {
+			return false;
+		}
+		std::vector<uint8_t> file(kHeaderSize + image.PackedSize());
+		uint8_t *pixels = file.data() + kHeaderSize;
+		for (uint32_t y = 0; y < image.height; y++) {
+			memcpy(pixels + y * image.PackedRowSize(), image.Row(y), image.PackedRowSize());
+		}
+		memcpy(&file[24], &image.width, 4);
+		memcpy(&file[28], &image.height, 4);
+		uint64_t hash = Xxh64::Hash(&file[24], file.size() - 24);
+		uint32_t version = kVersion;
+		memcpy(&file[0], "GFRM", 4);
+		memcpy(&file[4], &version, 4);
+		memcpy(&file[8], &key, 8);
+		memcpy(&file[16], &hash, 8);
+		return WriteFileReplacing(EntryPath(key), file.data(), file.size());
+	}
+
+	uint64_t Hits() const {
+		return hits_;
+	}
+
+	uint64_t Misses() const {
+		return misses_;
+	}
+
+private:
+	static const uint32_t kVersion = 1;
+	static const size_t kHeaderSize = 32;
+
+	static bool Parse(uint64_t key, const FileView &entry, Image *image) {
+		const uint8_t *data = reinterpret_cast<const uint8_t*>(entry.Data());
+		if (entry.Size() < kHeaderSize || memcmp(data, "GFRM", 4) != 0) {
+			return false;
+		}
+		uint32_t version, width, height;
+		uint64_t stored_key, hash;
+		memcpy(&version, data + 4, 4);
+		memcpy(&stored_key, data + 8, 8);
+		memcpy(&hash, data + 16, 8);
+		memcpy(&width, data + 24, 4);
+		memcpy(&height, data + 28, 4);
+		if (version != kVersion || stored_key != key ||
+			(entry.Size() - kHeaderSize) / 4 != static_cast<uint64_t>(width) * height ||
+			(entry.Size() - kHeaderSize) % 4 != 0 ||
+			Xxh64::Hash(data + 24, entry.Size() - 24) != hash) {
+			return false;
+		}
+		image->width = width;
+		image->height = height;
+		image->pixels.assign(data + kHeaderSize, data + entry.Size());
+		return true;
+	}
+
+	std::wstring EntryPath(uint64_t key) const {
+		std::string hex = HashToHex(key);
+		return directory_ + L"/" + std::wstring(hex.begin(), hex.end()) + L".gfrm";
+	}
+
+	std::wstring directory_;
+	std::atomic<uint64_t> hits_;
+	std::atomic<uint64_t> misses_;
+};
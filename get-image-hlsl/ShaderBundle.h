@@ -0,0 +1,239 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "FileUtil.h"
+#include "FileView.h"
+#include "ImageHash.h"
+
+// Bundles of compiled shaders, so that shaders compiled once on one machine
+// can be rendered on many without the HLSL compiler. A bundle is a single
+// file that gets memory mapped, and the bytecode is handed to the driver
+// straight out of the mapping.
+//
+// Layout (host byte order, which is little endian everywhere we run):
+//
+//   header:   "GFSB", uint32 version, uint64 shader count, uint64 offset of
+//             the index
+//   bytecode: each shader's bytecode, starting on a 16 byte boundary
+//   names:    the shader names, UTF-8, one after the other
+//   index:    on a 16 byte boundary, one entry per shader, sorted by name:
+//             uint64 offset and size of its bytecode, uint64 XXH64 of the
+//             bytecode, uint64 offset and uint32 length of its name, and 4
+//             reserved bytes
+
+struct ShaderBundleEntry {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t hash;
+	uint64_t name_offset;
+	uint32_t name_length;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(ShaderBundleEntry) == 40, "bundle index entries are 40 bytes");
+
+class ShaderBundleWriter {
+public:
+	ShaderBundleWriter() : file_(nullptr), offset_(0) {
+	}
+
+	~ShaderBundleWriter() {
+		if (file_) {
+			fclose(file_);
+		}
+	}
+
+	bool Open(const std::wstring &path) {
+		file_ = OpenFile(path, "wb");
+		if (!file_) {
+			return false;
+		}
+		// The header is written again with the real values by Close.
+		uint8_t header[kHeaderSize] = {};
+		offset_ = 0;
+		return Write(header, sizeof(header));
+	}
+
+	// Returns false if the name is already taken or the write fails.
+	bool Add(const std::string &name, const void *bytecode, size_t size) {
+		if (!taken_.insert(name).second) {
+			return false;
+		}
+		uint8_t padding[kAlignment] = {};
+		if (!Write(padding, static_cast<size_t>((kAlignment - offset_ % kAlignment) % kAlignment))) {
+			return false;
+		}
+		ShaderBundleEntry entry = {};
+		entry.offset = offset_;
+		entry.size = size;
+		entry.hash = Xxh64::Hash(bytecode, size);
+		entry.name_length = static_cast<uint32_t>(name.size());
+		entries_.push_back(entry);
+		names_.push_back(name);
+		return Write(bytecode, size);
+	}
+
+	bool Close() {
+		if (!file_) {
+			return false;
+		}
+		bool ok = true;
+		for (size_t i = 0; i < entries_.size(); i++) {
+			entries_[i].name_offset = offset_;
+			ok = ok && Write(names_[i].data(), names_[i].size());
+		}
+
+		std::vector<size_t> order(entries_.size());
+		for (size_t i = 0; i < order.size(); i++) {
+			order[i] = i;
+		}
+		std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return names_[a] < names_[b]; });
+		uint8_t padding[kAlignment] = {};
+		ok = ok && Write(padding, static_cast<size_t>((kAlignment - offset_ % kAlignment) % kAlignment));
+		uint64_t index_offset = offset_;
+		for (size_t i : order) {
+			ok = ok && Write(&entries_[i], sizeof(ShaderBundleEntry));
+		}
+
+		uint32_t version = kVersion;
+		uint64_t count = entries_.size();
+		ok = ok && fseek(file_, 0, SEEK_SET) == 0 &&
+			fwrite("GFSB", 1, 4, file_) == 4 &&
+			fwrite(&version, sizeof(version), 1, file_) == 1 &&
+			fwrite(&count, sizeof(count), 1, file_) == 1 &&
+			fwrite(&index_offset, sizeof(index_offset), 1, file_) == 1;
+		ok = fclose(file_) == 0 && ok;
+		file_ = nullptr;
+		return ok;
+	}
+
+	static const uint32_t kVersion = 1;
+	static const size_t kHeaderSize = 24;
+	static const size_t kAlignment = 16;
+
+private:
+	bool Write(const void *data, size_t size) {
+		offset_ += size;
+		return fwrite(data, 1, size, file_) == size;
+	}
+
+	FILE *file_;
+	uint64_t offset_;
+	std::vector<ShaderBundleEntry> entries_;
+	std::vector<std::string> names_;
+	std::set<std::string> taken_;
+};
+
+class ShaderBundle {
+public:
+	ShaderBundle() : count_(0), index_(nullptr) {
+	}
+
+	// Maps the bundle and checks that its index is sound, so that Find can
+	// trust it.
+	bool Open(const std::wstring &path) {
+		if (!view_.Open(path, 0) || view_.Size() < ShaderBundleWriter::kHeaderSize || !view_.StartsWith("GFSB", 4)) {
+			return false;
+		}
+		uint32_t version;
+		uint64_t index_offset;
+		memcpy(&version, view_.Data() + 4, sizeof(version));
+		memcpy(&count_, view_.Data() + 8, sizeof(count_));
+		memcpy(&index_offset, view_.Data() + 16, sizeof(index_offset));
+		uint64_t size = view_.Size();
+		if (version != ShaderBundleWriter::kVersion || index_offset > size ||
+			count_ > (size - index_offset) / sizeof(ShaderBundleEntry) ||
+			index_offset % alignof(ShaderBundleEntry) != 0) {
+			return false;
+		}
+		index_ = reinterpret_cast<const ShaderBundleEntry*>(view_.Data() + index_offset);
+		for (uint64_t i = 0; i < count_; i++) {
+			const ShaderBundleEntry &entry = index_[i];
+			if (entry.offset > size || entry.size > size - entry.offset ||
+				entry.name_offset > size || entry.name_length > size - entry.name_offset ||
+				(i > 0 && !(Name(index_[i - 1]) < Name(entry)))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	uint64_t Count() const {
+		return count_;
+	}
+
+	const ShaderBundleEntry &Entry(uint64_t i) const {
+		return index_[i];
+	}
+
+	std::string Name(const ShaderBundleEntry &entry) const {
+		return std::string(view_.Data() + entry.name_offset, entry.name_length);
+	}
+
+	const uint8_t *Bytecode(const ShaderBundleEntry &entry) const {
+		return reinterpret_cast<const uint8_t*>(view_.Data()) + entry.offset;
+	}
+
+	// Whether entry's bytecode still hashes to what the writer recorded. Open
+	// only checks the index, so this is what catches damaged bytecode before
+	// it reaches the driver.
+	bool Verify(const ShaderBundleEntry &entry) const {
+		return Xxh64::Hash(Bytecode(entry), static_cast<size_t>(entry.size)) == entry.hash;
+	}
+
+	// Binary search of the index. Returns null if there is no such shader.
+	const ShaderBundleEntry *Find(const std::string &name) const {
+		uint64_t low = 0;
+		uint64_t high = count_;
+		while (low < high) {
+			uint64_t middle = low + (high - low) / 2;
+			const ShaderBundleEntry &entry = index_[middle];
+			int order = Compare(entry, name);
+			if (order == 0) {
+				return &entry;
+			}
+			if (order < 0) {
+				low = middle + 1;
+			}
+			else {
+				high = middle;
+			}
+		}
+		return nullptr;
+	}
+
+private:
+	// Compares entry's name with name, the way std::string would.
+	int Compare(const ShaderBundleEntry &entry, const std::string &name) const {
+		size_t common = std::min<size_t>(entry.name_length, name.size());
+		int order = memcmp(view_.Data() + entry.name_offset, name.data(), common);
+		if (order != 0) {
+			return order;
+		}
+		return entry.name_length < name.size() ? -1 : entry.name_length > name.size() ? 1 : 0;
+	}
+
+	FileView view_;
+	uint64_t count_;
+	const ShaderBundleEntry *index_;
+};
+
+// Splits a "bundle.gfsb#name" reference to a shader in a bundle. Returns
+// false if path isn't one.
+inline bool SplitBundleReference(const std::wstring &path, std::wstring *bundle, std::wstring *name)
+{
+	size_t hash = path.find_last_of(L'#');
+	if (hash == std::wstring::npos || FileExtension(path.substr(0, hash)) != L"gfsb") {
+		return false;
+	}
+	*bundle = path.substr(0, hash);
+	*name = path.substr(hash + 1);
+	return true;
+}
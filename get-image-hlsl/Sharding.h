@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cwchar>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+#include "FileUtil.h"
+#include "Journal.h"
+#include "JsonCheck.h"
+
+// Splitting a batch over several machines (--shard i/N) and putting their
+// journals back together (--merge-journals).
+
+namespace sharding_detail {
+
+// The splitmix64 finalizer: every bit of x affects every bit of the result.
+inline uint64_t Mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ull;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBull;
+	x ^= x >> 31;
+	return x;
+}
+
+}
+
+// Which of shards a job whose shader hashes to key belongs to, by rendezvous
+// hashing: each shard scores the key and the highest score wins. Only the
+// key matters, so identical shaders always land on the same shard, wherever
+// they are in the batch. Going from N shards to N + 1 only moves the jobs
+// that the new shard now wins, about 1 in N + 1 of them, and moves them all
+// to the new shard.
+inline uint32_t ShardOf(uint64_t key, uint32_t shards)
+{
+	using sharding_detail::Mix64;
+	uint32_t best = 0;
+	uint64_t best_score = 0;
+	for (uint32_t shard = 0; shard < shards; shard++) {
+		uint64_t score = Mix64(key ^ Mix64(shard + 1));
+		if (shard == 0 || score > best_score) {
+			best = shard;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+// Parses "i/N", with i < N.
+inline bool ParseShard(const std::wstring &str, uint32_t *index, uint32_t *count)
+{
+	size_t slash = str.find(L'/');
+	if (slash == std::wstring::npos || slash == 0 || slash + 1 == str.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < str.size(); i++) {
+		if (i != slash && (str[i] < L'0' || str[i] > L'9')) {
+			return false;
+		}
+	}
+	unsigned long long i = wcstoull(str.c_str(), nullptr, 10);
+	unsigned long long n = wcstoull(str.c_str() + slash + 1, nullptr, 10);
+	if (n == 0 || n > UINT32_MAX || i >= n) {
+		return false;
+	}
+	*index = static_cast<uint32_t>(i);
+	*count = static_cast<uint32_t>(n);
+	return true;
+}
+
+// Reads the records of several journals, which should each be a JSON object
+// with an "id", and makes one report of them:
+//
+//   {"journals": <count>, "jobs": <distinct ids>, "duplicates": <count>,
+//    "results": [<records, ordered by id>]}
+//
+// An id in more than one record (say a job run again after re-sharding) is
+// reported once, from the first journal it is in. Returns false, with the
+// index of the culprit in bad_journal, if a journal can't be read or holds
+// anything else, including records that aren't JSON at all.
+inline bool MergeJournals(const std::vector<std::wstring> &journals, nlohmann::json *report, size_t *bad_journal)
+{
+	using nlohmann::json;
+	std::map<std::string, json> results;
+	uint64_t duplicates = 0;
+	for (size_t j = 0; j < journals.size(); j++) {
+		const std::wstring &path = journals[j];
+		bool well_formed = true;
+		bool read = FileExists(path.c_str()) && Journal::Read(path, [&](const char *payload, size_t size) {
+			if (!well_formed || !IsWellFormedJson(payload, payload + size)) {
+				well_formed = false;
+				return;
+			}
+			json record = json::parse(payload, payload + size);
+			if (!record.is_object() || record.count("id") == 0 || !record.at("id").is_string()) {
+				well_formed = false;
+				return;
+			}
+			std::string id = record.at("id").get<std::string>();
+			if (results.count(id) > 0) {
+				duplicates++;
+				return;
+			}
+			results.insert(std::make_pair(id, std::move(record)));
+		});
+		if (!read || !well_formed) {
+			*bad_journal = j;
+			return false;
+		}
+	}
+	json merged = json::array();
+	for (auto &result : results) {
+		merged.push_back(std::move(result.second));
+	}
+	*report = {
+		{ "journals", journals.size() },
+		{ "jobs", results.size() },
+		{ "duplicates", duplicates },
+		{ "results", std::move(merged) },
+	};
+	return true;
+}
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "ImageHash.h"
+
+// Shaders from the generator and the reducer often differ only in comments,
+// whitespace and line endings, which can't change the bytecode. Keying the
+// bytecode cache on a canonical form of the source, rather than its bytes,
+// lets those share an entry.
+//
+// The canonical form is the source's tokens, with:
+// - comments and line continuations removed, and line endings made "\n",
+// - whitespace only kept where dropping it could join two tokens into one,
+//   and as a single space in preprocessor directives, where it can matter
+//   (#define F(x) isn't #define F (x)),
+// - line breaks only kept where they end a directive.
+// String and character literals, and <...> in #include, are kept as they
+// are. The tokenizing is only as fine as it needs to be to never give two
+// sources that could compile differently the same form; sources that could
+// have had the same one sometimes don't, which only costs a cache miss.
+//
+// With SOURCE_KEY_LINES every token also stays on the line it was on, so
+// bytecode with debug info from one source has the right line numbers for
+// any other with the same key. Comments spanning lines and continued
+// directives are made up for with line breaks after them.
+//
+// __LINE__ compiles to the line it is on, so SOURCE_KEY_TOKENS gives way to
+// SOURCE_KEY_LINES for a source whose canonical form mentions it, or has a
+// ## that could paste it together.
+enum SourceKeyMode {
+	SOURCE_KEY_BYTES,
+	SOURCE_KEY_TOKENS,
+	SOURCE_KEY_LINES,
+};
+
+namespace source_key_detail {
+
+enum CharClass {
+	CLASS_NONE,
+	// Identifiers, numbers and literals, which run into each other.
+	CLASS_WORD,
+	// Operators, which can combine into longer ones (+ +, / *).
+	CLASS_OPERATOR,
+	// Tokens that never combine with anything.
+	CLASS_SEPARATOR,
+};
+
+inline bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+// Indexed by unsigned char. Anything unusual is a word character too, which
+// keeps the space next to it.
+inline const bool *WordChars()
+{
+	struct Table {
+		bool entries[256];
+
+		Table() {
+			for (int i = 0; i < 256; i++) {
+				char c = static_cast<char>(i);
+				entries[i] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+					c == '_' || c == '.' || c == '$' || c == '@' || c == '`' || c == '\\' || i >= 0x80 || i == 0;
+			}
+		}
+	};
+	static const Table table;
+	return table.entries;
+}
+
+inline bool IsWordChar(char c)
+{
+	return WordChars()[static_cast<unsigned char>(c)];
+}
+
+inline CharClass ClassOf(char c)
+{
+	switch (c) {
+	case '(': case ')': case '[': case ']': case '{': case '}': case ';': case ',': case '~':
+		return CLASS_SEPARATOR;
+	case '+': case '-': case '*': case '/': case '%': case '<': case '>': case '=': case '!': case '&':
+	case '|': case '^': case ':': case '?': case '#':
+		return CLASS_OPERATOR;
+	default:
+		return CLASS_WORD;
+	}
+}
+
+class Canonicalizer {
+public:
+	Canonicalizer(const char *src, size_t size, bool keep_lines, std::string *out)
+		: end_(src + size), p_(src), keep_lines_(keep_lines), out_(out), line_(1), out_line_(1),
+		last_(CLASS_NONE), last_number_(false), last_exponent_(false), space_(false), newline_(false), line_start_(true),
+		directive_(false), directive_name_(false), include_(false) {
+	}
+
+	void Run() {
+		while (true) {
+			SkipSplices();
+			if (p_ == end_) {
+				break;
+			}
+			char c = *p_;
+			if (IsSpace(c)) {
+				while (p_ < end_ && IsSpace(*p_)) {
+					p_++;
+				}
+				space_ = true;
+			}
+			else if (c == '\n' || c == '\r') {
+				p_ += c == '\r' && p_ + 1 < end_ && p_[1] == '\n' ? 2 : 1;
+				line_++;
+				newline_ = newline_ || directive_;
+				space_ = true;
+				line_start_ = true;
+				directive_ = false;
+				include_ = false;
+			}
+			else if (c == '/' && Peek(1) == '/') {
+				SkipLineComment();
+			}
+			else if (c == '/' && Peek(1) == '*') {
+				SkipBlockComment();
+			}
+			else if (c == '"' || c == '\'') {
+				Literal(c, c);
+			}
+			else if (c == '<' && include_) {
+				Literal('<', '>');
+			}
+			else if (IsWordChar(c)) {
+				Word();
+			}
+			else {
+				// %: is another way of writing #.
+				bool hash = c == '#' || (c == '%' && Peek(1) == ':');
+				bool starts_directive = hash && line_start_;
+				// The sign of an exponent is part of the number.
+				bool sign = (c == '+' || c == '-') && last_exponent_ && !space_;
+				Token(ClassOf(c), hash ? '#' : c);
+				out_->push_back(c);
+				if (c == '%' && hash) {
+					Advance();
+					out_->push_back(':');
+				}
+				p_++;
+				directive_ = directive_ || starts_directive;
+				directive_name_ = starts_directive;
+				last_ = ClassOf(c);
+				last_number_ = sign;
+				last_exponent_ = false;
+			}
+		}
+		if (keep_lines_ && line_ > out_line_) {
+			out_->append(line_ - out_line_, '\n');
+		}
+	}
+
+private:
+	// Line continuations go before anything else, even inside tokens.
+	void SkipSplices() {
+		while (p_ < end_ && *p_ == '\\') {
+			const char *q = p_ + 1;
+			if (q < end_ && *q == '\r') {
+				q++;
+			}
+			if (q < end_ && *q == '\n') {
+				q++;
+			}
+			if (q == p_ + 1) {
+				return;
+			}
+			p_ = q;
+			line_++;
+		}
+	}
+
+	// The character offset characters on, looking through continuations.
+	char Peek(size_t offset) {
+		const char *q = p_;
+		for (size_t i = 0; i < offset && q < end_; i++) {
+			q++;
+			while (q < end_ && *q == '\\' && q + 1 < end_ && (q[1] == '\n' || q[1] == '\r')) {
+				q += q[1] == '\r' && q + 2 < end_ && q[2] == '\n' ? 3 : 2;
+			}
+		}
+		return q < end_ ? *q : '\n';
+	}
+
+	// Moves past one character, and any continuations after it.
+	void Advance() {
+		p_++;
+		SkipSplices();
+	}
+
+	void SkipLineComment() {
+		while (p_ < end_ && *p_ != '\n' && *p_ != '\r') {
+			Advance();
+		}
+	}
+
+	// A comment is a space, even one spanning lines: it doesn't end a
+	// directive. One that is never closed stays, so that the source still
+	// doesn't compile.
+	void SkipBlockComment() {
+		Advance();
+		Advance();
+		while (p_ < end_) {
+			if (*p_ == '*' && Peek(1) == '/') {
+				Advance();
+				Advance();
+				space_ = true;
+				return;
+			}
+			if (*p_ == '\n' || (*p_ == '\r' && Peek(1) != '\n')) {
+				line_++;
+			}
+			Advance();
+		}
+		Token(CLASS_OPERATOR, '/');
+		out_->append("/*");
+		last_ = CLASS_OPERATOR;
+		last_number_ = false;
+		last_exponent_ = false;
+	}
+
+	// Starts a token of the given class, after whatever has to separate it
+	// from the last one.
+	void Token(CharClass cls, char first) {
+		// Line breaks only go where there was space, as one inside a token
+		// continued onto the next line would split it. And a # after a line
+		// break would start a directive, which it doesn't if a comment was
+		// all that took it onto another line.
+		if (keep_lines_ && !directive_ && space_ && line_ > out_line_ && (first != '#' || line_start_)) {
+			out_->append(line_ - out_line_, '\n');
+			out_line_ = line_;
+		}
+		else if (newline_ || (line_start_ && first == '#' && last_ != CLASS_NONE)) {
+			out_->push_back('\n');
+		}
+		else if (space_ && (directive_ || (cls == last_ && cls != CLASS_SEPARATOR) ||
+			(last_exponent_ && (first == '+' || first == '-')) || (last_number_ && cls == CLASS_WORD))) {
+			out_->push_back(' ');
+		}
+		space_ = false;
+		newline_ = false;
+		line_start_ = false;
+		directive_name_ = false;
+	}
+
+	void Word() {
+		bool directive_name = directive_name_;
+		bool continues_number = last_number_ && !space_;
+		Token(CLASS_WORD, *p_);
+		size_t begin = out_->size();
+		const bool *word_chars = WordChars();
+		while (true) {
+			const char *start = p_;
+			while (p_ < end_ && *p_ != '\\' && word_chars[static_cast<unsigned char>(*p_)]) {
+				p_++;
+			}
+			out_->append(start, p_ - start);
+			if (p_ == end_ || *p_ != '\\') {
+				break;
+			}
+			// A continuation, which the word carries on after, or a stray
+			// backslash, which is part of it.
+			const char *backslash = p_;
+			SkipSplices();
+			if (p_ == backslash) {
+				out_->push_back('\\');
+				p_++;
+			}
+		}
+		// Numbers are preprocessor numbers, which take in letters and the
+		// sign after an exponent: 1e+5 and 1e-a are one token each, but
+		// 1e +5 is two, so a space after a number's exponent or sign has to
+		// stay.
+		char first = (*out_)[begin];
+		char second = out_->size() > begin + 1 ? (*out_)[begin + 1] : '\0';
+		char final = out_->back();
+		last_number_ = continues_number || (first >= '0' && first <= '9') ||
+			(first == '.' && second >= '0' && second <= '9');
+		last_exponent_ = last_number_ && (final == 'e' || final == 'E' || final == 'p' || final == 'P');
+		include_ = directive_name && out_->compare(begin, std::string::npos, "include") == 0;
+		last_ = CLASS_WORD;
+	}
+
+	// Copies a literal as it is, up to its closing quote or the end of the
+	// line.
+	void Literal(char open, char close) {
+		Token(CLASS_WORD, open);
+		out_->push_back(open);
+		Advance();
+		while (p_ < end_ && *p_ != '\n' && *p_ != '\r') {
+			char c = *p_;
+			out_->push_back(c);
+			Advance();
+			if (c == close) {
+				break;
+			}
+			if (c == '\\' && open != '<' && p_ < end_ && *p_ != '\n' && *p_ != '\r') {
+				out_->push_back(*p_);
+				Advance();
+			}
+		}
+		last_ = CLASS_WORD;
+		last_number_ = false;
+		last_exponent_ = false;
+	}
+
+	const char *end_;
+	const char *p_;
+	bool keep_lines_;
+	std::string *out_;
+	// The line we are on in the source, and in the output.
+	uint64_t line_;
+	uint64_t out_line_;
+	CharClass last_;
+	// Whether the last token was a number, and ended in an exponent.
+	bool last_number_;
+	bool last_exponent_;
+	// Whether a space or a directive's line break is due before the next
+	// token.
+	bool space_;
+	bool newline_;
+	bool line_start_;
+	bool directive_;
+	// Whether the next word names the directive, and whether it is #include.
+	bool directive_name_;
+	bool include_;
+};
+
+}
+
+// The canonical form of src, appended to out.
+inline void CanonicalSource(const char *src, size_t size, SourceKeyMode mode, std::string *out)
+{
+	if (mode == SOURCE_KEY_BYTES) {
+		out->append(src, size);
+		return;
+	}
+	size_t start = out->size();
+	source_key_detail::Canonicalizer(src, size, mode == SOURCE_KEY_LINES, out).Run();
+	if (mode == SOURCE_KEY_TOKENS &&
+		(out->find("__LINE__", start) != std::string::npos || out->find("##", start) != std::string::npos)) {
+		out->resize(start);
+		source_key_detail::Canonicalizer(src, size, true, out).Run();
+	}
+}
+
+// A hash of the canonical form of src. buffer is only scratch space, passed
+// in so that it can be reused.
+inline uint64_t SourceKey(const char *src, size_t size, SourceKeyMode mode, std::string &buffer)
+{
+	if (mode == SOURCE_KEY_BYTES) {
+		return Xxh64::Hash(src, size);
+	}
+	buffer.clear();
+	CanonicalSource(src, size, mode, &buffer);
+	return Xxh64::Hash(buffer.data(), buffer.size());
+}
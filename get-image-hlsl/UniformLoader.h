@@ -0,0 +1,912 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <cwchar>
+#include <string>
+
+#include "Arena.h"
+#include "FileUtil.h"
+
+// A streaming loader for uniform files.
+//
+// Rather than parsing the whole file into a JSON tree and then picking the
+// uniforms out of it, this walks the text once and writes the values of the
+// uniforms we know about straight into the bytes of the constant buffer.
+// Everything else in the file is skipped over without being stored, so it
+// makes no allocations however big the file is.
+//
+// Besides JSON, the same uniforms can be given as CBOR or MessagePack (as
+// written by json::to_cbor and json::to_msgpack), which store the floats as
+// floats and so skip text-to-float parsing altogether.
+
+enum UniformFormat {
+	UNIFORM_FORMAT_JSON,
+	UNIFORM_FORMAT_CBOR,
+	UNIFORM_FORMAT_MSGPACK,
+};
+
+struct UniformFileType {
+	const wchar_t *extension;
+	UniformFormat format;
+};
+
+// Uniforms live next to the shader, with its extension swapped for one of
+// these. When there is more than one the binary encodings win, as they are
+// the quicker to load.
+const UniformFileType UNIFORM_FILE_TYPES[] = {
+	{ L"cbor", UNIFORM_FORMAT_CBOR },
+	{ L"msgpack", UNIFORM_FORMAT_MSGPACK },
+	{ L"json", UNIFORM_FORMAT_JSON },
+};
+
+// Finds the uniforms for shader, returning false if it doesn't have any. This
+// happens for every job, so the candidate paths are built in arena rather
+// than on the heap, and *path stays valid until the arena is reset.
+inline bool FindUniformFile(const wchar_t *shader, Arena &arena, const wchar_t **path, UniformFormat *format)
+{
+	// The extension is replaced the way ReplaceExtension does it.
+	size_t length = wcslen(shader);
+	size_t stem = length;
+	for (size_t i = length; i > 0; i--) {
+		if (shader[i - 1] == L'/' || shader[i - 1] == L'\\') {
+			break;
+		}
+		if (shader[i - 1] == L'.') {
+			stem = i - 1;
+			break;
+		}
+	}
+	for (auto &type : UNIFORM_FILE_TYPES) {
+		size_t extension_length = wcslen(type.extension);
+		wchar_t *candidate = static_cast<wchar_t*>(
+			arena.Allocate((stem + extension_length + 2) * sizeof(wchar_t), alignof(wchar_t)));
+		memcpy(candidate, shader, stem * sizeof(wchar_t));
+		candidate[stem] = L'.';
+		memcpy(candidate + stem + 1, type.extension, (extension_length + 1) * sizeof(wchar_t));
+		if (FileExists(candidate)) {
+			*path = candidate;
+			*format = type.format;
+			return true;
+		}
+	}
+	return false;
+}
+
+// The format of a uniform file, going by its extension.
+inline bool UniformFormatFromExtension(const std::wstring &path, UniformFormat *format)
+{
+	std::wstring extension = FileExtension(path);
+	for (auto &type : UNIFORM_FILE_TYPES) {
+		if (extension == type.extension) {
+			*format = type.format;
+			return true;
+		}
+	}
+	return false;
+}
+
+// A uniform we know how to pass: a top level key whose value must be an array
+// of exactly `count` numbers, stored as floats starting at `offset` in the
+// constant buffer.
+struct UniformBinding {
+	const char *name;
+	size_t offset;
+	size_t count;
+};
+
+class UniformParser {
+public:
+	// Parses [begin, end), which needn't be null terminated. Returns false
+	// with a message in error if it isn't valid JSON, or if a known uniform
+	// doesn't have the right shape. Bit i of *found is set if bindings[i] was
+	// present. A top level value that isn't an object is allowed and simply
+	// contains no uniforms.
+	static bool Parse(const char *begin, const char *end, const UniformBinding *bindings, size_t num_bindings,
+		uint8_t *constants, uint32_t *found, std::string *error) {
+		UniformParser parser(begin, end, error);
+		*found = 0;
+		parser.SkipWhitespace();
+		if (parser.p_ < parser.end_ && *parser.p_ == '{') {
+			if (!parser.ParseTopLevel(bindings, num_bindings, constants, found)) {
+				return false;
+			}
+		}
+		else if (!parser.SkipValue(0)) {
+			return false;
+		}
+		parser.SkipWhitespace();
+		if (parser.p_ != parser.end_) {
+			return parser.Fail("unexpected trailing characters");
+		}
+		return true;
+	}
+
+private:
+	// Deeper than this and the file is either broken or malicious.
+	static const int kMaxDepth = 256;
+
+	UniformParser(const char *begin, const char *end, std::string *error)
+		: begin_(begin), p_(begin), end_(end), error_(error) {
+	}
+
+	bool ParseTopLevel(const UniformBinding *bindings, size_t num_bindings, uint8_t *constants, uint32_t *found) {
+		p_++;
+		SkipWhitespace();
+		if (Consume('}')) {
+			return true;
+		}
+		while (true) {
+			const char *key = nullptr;
+			size_t key_length = 0;
+			SkipWhitespace();
+			if (!ParseString(&key, &key_length)) {
+				return false;
+			}
+			SkipWhitespace();
+			if (!Consume(':')) {
+				return Fail("expected ':'");
+			}
+			SkipWhitespace();
+
+			size_t i = 0;
+			while (i < num_bindings &&
+				!(strlen(bindings[i].name) == key_length && memcmp(bindings[i].name, key, key_length) == 0)) {
+				i++;
+			}
+			if (i < num_bindings) {
+				if (!ParseFloatArray(bindings[i], constants + bindings[i].offset)) {
+					return false;
+				}
+				*found |= 1u << i;
+			}
+			else if (!SkipValue(1)) {
+				return false;
+			}
+
+			SkipWhitespace();
+			if (Consume('}')) {
+				return true;
+			}
+			if (!Consume(',')) {
+				return Fail("expected ',' or '}'");
+			}
+		}
+	}
+
+	bool ParseFloatArray(const UniformBinding &binding, uint8_t *out) {
+		const char *start = p_;
+		bool ok = Consume('[');
+		for (size_t i = 0; ok && i < binding.count; i++) {
+			SkipWhitespace();
+			if (i > 0) {
+				ok = Consume(',');
+				SkipWhitespace();
+			}
+			float value = 0.0f;
+			ok = ok && ParseNumber(&value);
+			if (ok) {
+				memcpy(out + i * sizeof(float), &value, sizeof(float));
+			}
+			SkipWhitespace();
+		}
+		if (ok && Consume(']')) {
+			return true;
+		}
+		// Find the end of whatever it actually was, for the error message.
+		p_ = start;
+		if (SkipValue(1)) {
+			*error_ = std::string(binding.name) + " should be an array of " + std::to_string(binding.count) +
+				" floats but got " + std::string(start, p_) + " instead.";
+		}
+		return false;
+	}
+
+	bool ParseNumber(float *value) {
+		const char *start = p_;
+		if (p_ < end_ && *p_ == '-') {
+			p_++;
+		}
+		while (p_ < end_ && ((*p_ >= '0' && *p_ <= '9') || *p_ == '.' || *p_ == 'e' || *p_ == 'E' ||
+			*p_ == '+' || *p_ == '-')) {
+			p_++;
+		}
+		// strtod needs a terminated string and the input may not be one.
+		char buffer[64];
+		size_t length = static_cast<size_t>(p_ - start);
+		if (length == 0 || length >= sizeof(buffer)) {
+			p_ = start;
+			return false;
+		}
+		memcpy(buffer, start, length);
+		buffer[length] = '\0';
+		char *parsed_end;
+		double parsed = strtod(buffer, &parsed_end);
+		if (parsed_end != buffer + length) {
+			p_ = start;
+			return false;
+		}
+		*value = static_cast<float>(parsed);
+		return true;
+	}
+
+	// Leaves key pointing at the raw (still escaped) characters of the string.
+	bool ParseString(const char **key, size_t *length) {
+		if (!Consume('"')) {
+			return Fail("expected a string");
+		}
+		const char *start = p_;
+		while (p_ < end_ && *p_ != '"') {
+			if (*p_ == '\\') {
+				p_++;
+			}
+			p_++;
+		}
+		if (p_ >= end_) {
+			return Fail("unterminated string");
+		}
+		*key = start;
+		*length = static_cast<size_t>(p_ - start);
+		p_++;
+		return true;
+	}
+
+	bool SkipValue(int depth) {
+		if (depth > kMaxDepth) {
+			return Fail("nested too deeply");
+		}
+		SkipWhitespace();
+		if (p_ >= end_) {
+			return Fail("unexpected end of input");
+		}
+		const char *key = nullptr;
+		size_t key_length = 0;
+		switch (*p_) {
+		case '{':
+		case '[': {
+			char close = *p_ == '{' ? '}' : ']';
+			bool object = *p_ == '{';
+			p_++;
+			SkipWhitespace();
+			if (Consume(close)) {
+				return true;
+			}
+			while (true) {
+				SkipWhitespace();
+				if (object) {
+					if (!ParseString(&key, &key_length)) {
+						return false;
+					}
+					SkipWhitespace();
+					if (!Consume(':')) {
+						return Fail("expected ':'");
+					}
+				}
+				if (!SkipValue(depth + 1)) {
+					return false;
+				}
+				SkipWhitespace();
+				if (Consume(close)) {
+					return true;
+				}
+				if (!Consume(',')) {
+					return Fail("expected ',' or a closing bracket");
+				}
+			}
+		}
+		case '"':
+			return ParseString(&key, &key_length);
+		case 't':
+			return Literal("true");
+		case 'f':
+			return Literal("false");
+		case 'n':
+			return Literal("null");
+		default: {
+			float ignored = 0.0f;
+			return ParseNumber(&ignored) || Fail("unexpected character");
+		}
+		}
+	}
+
+	bool Literal(const char *literal) {
+		size_t length = strlen(literal);
+		if (static_cast<size_t>(end_ - p_) < length || memcmp(p_, literal, length) != 0) {
+			return Fail("invalid literal");
+		}
+		p_ += length;
+		return true;
+	}
+
+	void SkipWhitespace() {
+		while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+			p_++;
+		}
+	}
+
+	bool Consume(char c) {
+		if (p_ < end_ && *p_ == c) {
+			p_++;
+			return true;
+		}
+		return false;
+	}
+
+	bool Fail(const char *message) {
+		*error_ = std::string(message) + " at offset " + std::to_string(p_ - begin_);
+		return false;
+	}
+
+	const char *begin_;
+	const char *p_;
+	const char *end_;
+	std::string *error_;
+};
+
+// What the CBOR and MessagePack parsers have in common: bounds checked big
+// endian reads and the error messages.
+class BinaryUniformParser {
+protected:
+	// Deeper than this and the file is either broken or malicious.
+	static const int kMaxDepth = 256;
+
+	BinaryUniformParser(const char *begin, const char *end, std::string *error)
+		: begin_(reinterpret_cast<const uint8_t*>(begin)), p_(begin_),
+		end_(reinterpret_cast<const uint8_t*>(end)), error_(error) {
+	}
+
+	bool ReadUint(size_t bytes, uint64_t *value) {
+		if (static_cast<size_t>(end_ - p_) < bytes) {
+			return Fail("unexpected end of input");
+		}
+		*value = 0;
+		for (size_t i = 0; i < bytes; i++) {
+			*value = (*value << 8) | *p_++;
+		}
+		return true;
+	}
+
+	bool Skip(uint64_t bytes) {
+		if (static_cast<uint64_t>(end_ - p_) < bytes) {
+			return Fail("unexpected end of input");
+		}
+		p_ += bytes;
+		return true;
+	}
+
+	bool Peek(uint8_t *byte) {
+		if (p_ >= end_) {
+			return Fail("unexpected end of input");
+		}
+		*byte = *p_;
+		return true;
+	}
+
+	// Returns num_bindings if key isn't one of the bindings.
+	static size_t FindBinding(const UniformBinding *bindings, size_t num_bindings, const uint8_t *key,
+		uint64_t key_length) {
+		size_t i = 0;
+		while (i < num_bindings &&
+			!(strlen(bindings[i].name) == key_length && memcmp(bindings[i].name, key, key_length) == 0)) {
+			i++;
+		}
+		return i;
+	}
+
+	static float FloatFromBits(uint32_t bits) {
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	static float DoubleFromBits(uint64_t bits) {
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		return static_cast<float>(value);
+	}
+
+	static float HalfFromBits(uint16_t bits) {
+		int exponent = (bits >> 10) & 0x1f;
+		int mantissa = bits & 0x3ff;
+		float value;
+		if (exponent == 0) {
+			value = std::ldexp(static_cast<float>(mantissa), -24);
+		}
+		else if (exponent != 31) {
+			value = std::ldexp(static_cast<float>(mantissa + 1024), exponent - 25);
+		}
+		else {
+			value = mantissa == 0 ? std::numeric_limits<float>::infinity() : std::numeric_limits<float>::quiet_NaN();
+		}
+		return (bits & 0x8000) ? -value : value;
+	}
+
+	bool ShapeError(const UniformBinding &binding, const uint8_t *start) {
+		*error_ = std::string(binding.name) + " should be an array of " + std::to_string(binding.count) +
+			" floats at offset " + std::to_string(start - begin_);
+		return false;
+	}
+
+	bool Fail(const char *message) {
+		*error_ = std::string(message) + " at offset " + std::to_string(p_ - begin_);
+		return false;
+	}
+
+	const uint8_t *begin_;
+	const uint8_t *p_;
+	const uint8_t *end_;
+	std::string *error_;
+};
+
+class CborUniformParser : BinaryUniformParser {
+public:
+	// As UniformParser::Parse, for CBOR.
+	static bool Parse(const char *begin, const char *end, const UniformBinding *bindings, size_t num_bindings,
+		uint8_t *constants, uint32_t *found, std::string *error) {
+		CborUniformParser parser(begin, end, error);
+		*found = 0;
+		if (parser.p_ < parser.end_ && (*parser.p_ >> 5) == kMap) {
+			if (!parser.ParseTopLevel(bindings, num_bindings, constants, found)) {
+				return false;
+			}
+		}
+		else if (!parser.SkipValue(0)) {
+			return false;
+		}
+		if (parser.p_ != parser.end_) {
+			return parser.Fail("unexpected trailing bytes");
+		}
+		return true;
+	}
+
+private:
+	enum MajorType {
+		kUnsigned = 0,
+		kNegative = 1,
+		kBytes = 2,
+		kText = 3,
+		kArray = 4,
+		kMap = 5,
+		kTag = 6,
+		kSimple = 7,
+	};
+	static const uint8_t kIndefinite = 31;
+	static const uint8_t kBreak = 0xff;
+
+	CborUniformParser(const char *begin, const char *end, std::string *error)
+		: BinaryUniformParser(begin, end, error) {
+	}
+
+	// Reads the first byte of an item and the argument that follows it: a
+	// value, a length, or for simple values the bits of a float.
+	bool ReadHead(uint8_t *major, uint8_t *info, uint64_t *argument) {
+		uint8_t initial = 0;
+		if (!Peek(&initial)) {
+			return false;
+		}
+		p_++;
+		*major = initial >> 5;
+		*info = initial & 0x1f;
+		if (*info < 24) {
+			*argument = *info;
+			return true;
+		}
+		if (*info <= 27) {
+			return ReadUint(size_t(1) << (*info - 24), argument);
+		}
+		if (*info == kIndefinite && *major != kUnsigned && *major != kNegative && *major != kTag) {
+			*argument = 0;
+			return true;
+		}
+		p_--;
+		return Fail("invalid CBOR item");
+	}
+
+	bool AtBreak() {
+		if (p_ < end_ && *p_ == kBreak) {
+			p_++;
+			return true;
+		}
+		return false;
+	}
+
+	bool ParseTopLevel(const UniformBinding *bindings, size_t num_bindings, uint8_t *constants, uint32_t *found) {
+		uint8_t major = 0, info = 0;
+		uint64_t count = 0;
+		if (!ReadHead(&major, &info, &count)) {
+			return false;
+		}
+		for (uint64_t entry = 0; info == kIndefinite || entry < count; entry++) {
+			if (info == kIndefinite && AtBreak()) {
+				return true;
+			}
+			// Only definite length text keys can name a uniform.
+			size_t i = num_bindings;
+			uint8_t initial = 0;
+			if (!Peek(&initial)) {
+				return false;
+			}
+			if ((initial >> 5) == kText && (initial & 0x1f) != kIndefinite) {
+				uint8_t key_major = 0, key_info = 0;
+				uint64_t key_length = 0;
+				if (!ReadHead(&key_major, &key_info, &key_length)) {
+					return false;
+				}
+				const uint8_t *key = p_;
+				if (!Skip(key_length)) {
+					return false;
+				}
+				i = FindBinding(bindings, num_bindings, key, key_length);
+			}
+			else if (!SkipValue(1)) {
+				return false;
+			}
+
+			if (i < num_bindings) {
+				if (!ParseFloatArray(bindings[i], constants + bindings[i].offset)) {
+					return false;
+				}
+				*found |= 1u << i;
+			}
+			else if (!SkipValue(1)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool ParseFloatArray(const UniformBinding &binding, uint8_t *out) {
+		const uint8_t *start = p_;
+		uint8_t major = 0, info = 0;
+		uint64_t count = 0;
+		if (!ReadHead(&major, &info, &count)) {
+			return false;
+		}
+		if (major != kArray || info == kIndefinite || count != binding.count) {
+			return ShapeError(binding, start);
+		}
+		for (size_t i = 0; i < binding.count; i++) {
+			uint64_t argument = 0;
+			if (!ReadHead(&major, &info, &argument)) {
+				return false;
+			}
+			float value = 0.0f;
+			if (major == kUnsigned) {
+				value = static_cast<float>(argument);
+			}
+			else if (major == kNegative) {
+				value = static_cast<float>(-1.0 - static_cast<double>(argument));
+			}
+			else if (major == kSimple && info == 25) {
+				value = HalfFromBits(static_cast<uint16_t>(argument));
+			}
+			else if (major == kSimple && info == 26) {
+				value = FloatFromBits(static_cast<uint32_t>(argument));
+			}
+			else if (major == kSimple && info == 27) {
+				value = DoubleFromBits(argument);
+			}
+			else {
+				return ShapeError(binding, start);
+			}
+			memcpy(out + i * sizeof(float), &value, sizeof(float));
+		}
+		return true;
+	}
+
+	bool SkipValue(int depth) {
+		if (depth > kMaxDepth) {
+			return Fail("nested too deeply");
+		}
+		uint8_t major = 0, info = 0;
+		uint64_t argument = 0;
+		if (!ReadHead(&major, &info, &argument)) {
+			return false;
+		}
+		switch (major) {
+		case kBytes:
+		case kText:
+			if (info != kIndefinite) {
+				return Skip(argument);
+			}
+			// An indefinite length string is a series of definite length
+			// chunks of the same type.
+			while (!AtBreak()) {
+				uint8_t chunk_major = 0, chunk_info = 0;
+				if (!ReadHead(&chunk_major, &chunk_info, &argument)) {
+					return false;
+				}
+				if (chunk_major != major || chunk_info == kIndefinite) {
+					return Fail("invalid string chunk");
+				}
+				if (!Skip(argument)) {
+					return false;
+				}
+			}
+			return true;
+		case kArray:
+		case kMap: {
+			int items = major == kMap ? 2 : 1;
+			for (uint64_t entry = 0; info == kIndefinite || entry < argument; entry++) {
+				if (info == kIndefinite && AtBreak()) {
+					return true;
+				}
+				for (int item = 0; item < items; item++) {
+					if (!SkipValue(depth + 1)) {
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+		case kTag:
+			return SkipValue(depth + 1);
+		case kSimple:
+			if (info == kIndefinite) {
+				p_--;
+				return Fail("unexpected break");
+			}
+			return true;
+		default:
+			return true;
+		}
+	}
+};
+
+class MsgpackUniformParser : BinaryUniformParser {
+public:
+	// As UniformParser::Parse, for MessagePack.
+	static bool Parse(const char *begin, const char *end, const UniformBinding *bindings, size_t num_bindings,
+		uint8_t *constants, uint32_t *found, std::string *error) {
+		MsgpackUniformParser parser(begin, end, error);
+		*found = 0;
+		if (parser.p_ < parser.end_ && IsMap(*parser.p_)) {
+			if (!parser.ParseTopLevel(bindings, num_bindings, constants, found)) {
+				return false;
+			}
+		}
+		else if (!parser.SkipValue(0)) {
+			return false;
+		}
+		if (parser.p_ != parser.end_) {
+			return parser.Fail("unexpected trailing bytes");
+		}
+		return true;
+	}
+
+private:
+	MsgpackUniformParser(const char *begin, const char *end, std::string *error)
+		: BinaryUniformParser(begin, end, error) {
+	}
+
+	static bool IsMap(uint8_t type) {
+		return (type >= 0x80 && type <= 0x8f) || type == 0xde || type == 0xdf;
+	}
+
+	static bool IsArray(uint8_t type) {
+		return (type >= 0x90 && type <= 0x9f) || type == 0xdc || type == 0xdd;
+	}
+
+	static bool IsString(uint8_t type) {
+		return (type >= 0xa0 && type <= 0xbf) || (type >= 0xd9 && type <= 0xdb);
+	}
+
+	// Reads the type byte and element count of a map, array or string.
+	bool ReadLength(uint8_t *type, uint64_t *length) {
+		if (!Peek(type)) {
+			return false;
+		}
+		p_++;
+		if (*type >= 0x80 && *type <= 0x9f) {
+			*length = *type & 0x0f;
+			return true;
+		}
+		if (*type >= 0xa0 && *type <= 0xbf) {
+			*length = *type & 0x1f;
+			return true;
+		}
+		switch (*type) {
+		case 0xd9:
+			return ReadUint(1, length);
+		case 0xda:
+		case 0xdc:
+		case 0xde:
+			return ReadUint(2, length);
+		case 0xdb:
+		case 0xdd:
+		case 0xdf:
+			return ReadUint(4, length);
+		default:
+			p_--;
+			return Fail("expected a map, array or string");
+		}
+	}
+
+	bool ParseTopLevel(const UniformBinding *bindings, size_t num_bindings, uint8_t *constants, uint32_t *found) {
+		uint8_t type = 0;
+		uint64_t count = 0;
+		if (!ReadLength(&type, &count)) {
+			return false;
+		}
+		for (uint64_t entry = 0; entry < count; entry++) {
+			size_t i = num_bindings;
+			if (!Peek(&type)) {
+				return false;
+			}
+			if (IsString(type)) {
+				uint64_t key_length = 0;
+				if (!ReadLength(&type, &key_length)) {
+					return false;
+				}
+				const uint8_t *key = p_;
+				if (!Skip(key_length)) {
+					return false;
+				}
+				i = FindBinding(bindings, num_bindings, key, key_length);
+			}
+			else if (!SkipValue(1)) {
+				return false;
+			}
+
+			if (i < num_bindings) {
+				if (!ParseFloatArray(bindings[i], constants + bindings[i].offset)) {
+					return false;
+				}
+				*found |= 1u << i;
+			}
+			else if (!SkipValue(1)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool ParseFloatArray(const UniformBinding &binding, uint8_t *out) {
+		const uint8_t *start = p_;
+		uint8_t type = 0;
+		uint64_t count = 0;
+		if (!Peek(&type)) {
+			return false;
+		}
+		if (!IsArray(type)) {
+			return ShapeError(binding, start);
+		}
+		if (!ReadLength(&type, &count)) {
+			return false;
+		}
+		if (count != binding.count) {
+			return ShapeError(binding, start);
+		}
+		for (size_t i = 0; i < binding.count; i++) {
+			if (!Peek(&type)) {
+				return false;
+			}
+			p_++;
+			uint64_t bits = 0;
+			float value = 0.0f;
+			if (type <= 0x7f) {
+				value = type;
+			}
+			else if (type >= 0xe0) {
+				value = static_cast<int8_t>(type);
+			}
+			else if (type == 0xca) {
+				if (!ReadUint(4, &bits)) {
+					return false;
+				}
+				value = FloatFromBits(static_cast<uint32_t>(bits));
+			}
+			else if (type == 0xcb) {
+				if (!ReadUint(8, &bits)) {
+					return false;
+				}
+				value = DoubleFromBits(bits);
+			}
+			else if (type >= 0xcc && type <= 0xcf) {
+				if (!ReadUint(size_t(1) << (type - 0xcc), &bits)) {
+					return false;
+				}
+				value = static_cast<float>(bits);
+			}
+			else if (type >= 0xd0 && type <= 0xd3) {
+				size_t bytes = size_t(1) << (type - 0xd0);
+				if (!ReadUint(bytes, &bits)) {
+					return false;
+				}
+				// Sign extend.
+				int shift = static_cast<int>(64 - bytes * 8);
+				value = static_cast<float>(static_cast<int64_t>(bits << shift) >> shift);
+			}
+			else {
+				return ShapeError(binding, start);
+			}
+			memcpy(out + i * sizeof(float), &value, sizeof(float));
+		}
+		return true;
+	}
+
+	bool SkipValue(int depth) {
+		if (depth > kMaxDepth) {
+			return Fail("nested too deeply");
+		}
+		uint8_t type = 0;
+		if (!Peek(&type)) {
+			return false;
+		}
+		uint64_t length = 0;
+		if (IsMap(type) || IsArray(type)) {
+			if (!ReadLength(&type, &length)) {
+				return false;
+			}
+			int items = IsMap(type) ? 2 : 1;
+			for (uint64_t entry = 0; entry < length; entry++) {
+				for (int item = 0; item < items; item++) {
+					if (!SkipValue(depth + 1)) {
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+		if (IsString(type)) {
+			return ReadLength(&type, &length) && Skip(length);
+		}
+		p_++;
+		if (type <= 0x7f || type >= 0xe0 || type == 0xc0 || type == 0xc2 || type == 0xc3) {
+			return true;
+		}
+		switch (type) {
+		case 0xc4:
+		case 0xc5:
+		case 0xc6:
+			// bin 8/16/32
+			return ReadUint(size_t(1) << (type - 0xc4), &length) && Skip(length);
+		case 0xc7:
+		case 0xc8:
+		case 0xc9:
+			// ext 8/16/32: a length, then a type byte and the data
+			return ReadUint(size_t(1) << (type - 0xc7), &length) && Skip(length + 1);
+		case 0xca:
+			return Skip(4);
+		case 0xcb:
+			return Skip(8);
+		case 0xcc:
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+			return Skip(uint64_t(1) << (type - 0xcc));
+		case 0xd0:
+		case 0xd1:
+		case 0xd2:
+		case 0xd3:
+			return Skip(uint64_t(1) << (type - 0xd0));
+		case 0xd4:
+		case 0xd5:
+		case 0xd6:
+		case 0xd7:
+		case 0xd8:
+			// fixext 1/2/4/8/16: a type byte and the data
+			return Skip(1 + (uint64_t(1) << (type - 0xd4)));
+		default:
+			p_--;
+			return Fail("invalid MessagePack type");
+		}
+	}
+};
+
+// Parses uniforms in any of the supported formats.
+inline bool ParseUniforms(UniformFormat format, const char *begin, const char *end, const UniformBinding *bindings,
+	size_t num_bindings, uint8_t *constants, uint32_t *found, std::string *error) {
+	switch (format) {
+	case UNIFORM_FORMAT_CBOR:
+		return CborUniformParser::Parse(begin, end, bindings, num_bindings, constants, found, error);
+	case UNIFORM_FORMAT_MSGPACK:
+		return MsgpackUniformParser::Parse(begin, end, bindings, num_bindings, constants, found, error);
+	default:
+		return UniformParser::Parse(begin, end, bindings, num_bindings, constants, found, error);
+	}
+}
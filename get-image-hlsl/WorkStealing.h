@@ -0,0 +1,102 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Spreads jobs over workers that may run at very different speeds, such as
+// several GPUs and a software rasterizer in one machine. Each worker has its
+// own queue, and each job goes on the shortest queue when it becomes ready.
+// A worker takes the oldest job from its own queue, and once that is empty it
+// steals the newest job from the longest queue of another worker, so a fast
+// worker is never left idle while a slow one has a backlog.
+//
+// Jobs take milliseconds, so a single lock over all the queues is plenty.
+class WorkStealingQueues {
+public:
+	explicit WorkStealingQueues(size_t workers)
+		: queues_(workers), taken_(workers, 0), stolen_(workers, 0), closed_(false) {
+	}
+
+	// Queues job for the worker with the least queued, and returns which
+	// worker that was.
+	size_t Push(size_t job) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		size_t shortest = 0;
+		for (size_t w = 1; w < queues_.size(); w++) {
+			if (queues_[w].size() < queues_[shortest].size()) {
+				shortest = w;
+			}
+		}
+		queues_[shortest].push_back(job);
+		// Any worker might be the one waiting to steal it.
+		ready_.notify_all();
+		return shortest;
+	}
+
+	// Says that no more jobs are coming, so workers can stop once the queues
+	// are empty.
+	void Close() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		ready_.notify_all();
+	}
+
+	// Blocks until there is a job for worker. Returns false once the queues
+	// are closed and empty.
+	bool Pop(size_t worker, size_t *job) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (;;) {
+			std::deque<size_t> &own = queues_[worker];
+			if (!own.empty()) {
+				*job = own.front();
+				own.pop_front();
+				taken_[worker]++;
+				return true;
+			}
+			size_t victim = worker;
+			for (size_t w = 0; w < queues_.size(); w++) {
+				if (queues_[w].size() > (victim == worker ? 0 : queues_[victim].size())) {
+					victim = w;
+				}
+			}
+			if (victim != worker) {
+				*job = queues_[victim].back();
+				queues_[victim].pop_back();
+				taken_[worker]++;
+				stolen_[worker]++;
+				return true;
+			}
+			if (closed_) {
+				return false;
+			}
+			ready_.wait(lock);
+		}
+	}
+
+	size_t Workers() const {
+		return queues_.size();
+	}
+
+	// How many jobs worker has run, and how many of those it stole.
+	uint64_t Taken(size_t worker) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return taken_[worker];
+	}
+
+	uint64_t Stolen(size_t worker) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return stolen_[worker];
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable ready_;
+	std::vector<std::deque<size_t>> queues_;
+	std::vector<uint64_t> taken_;
+	std::vector<uint64_t> stolen_;
+	bool closed_;
+};
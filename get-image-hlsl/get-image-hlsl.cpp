@@ -3,6 +3,31 @@
 #define JSON_NOEXCEPTION
 #include "json.hpp"
 
+#include "AdapterInfo.h"
+#include "Arena.h"
+#include "BytecodeCache.h"
+#include "DebugMessages.h"
+#include "DeltaDebug.h"
+#include "FileView.h"
+#include "ImageCompare.h"
+#include "ImageHash.h"
+#include "Differential.h"
+#include "ImageWriters.h"
+#include "Incremental.h"
+#include "IncludeCache.h"
+#include "JobPipeline.h"
+#include "Journal.h"
+#include "JsonCheck.h"
+#include "LruCache.h"
+#include "NegativeCache.h"
+#include "ReadbackRing.h"
+#include "RenderMemo.h"
+#include "ShaderBundle.h"
+#include "Sharding.h"
+#include "SourceKey.h"
+#include "UniformLoader.h"
+#include "WorkStealing.h"
+
 using json = nlohmann::json;
 using namespace Microsoft::WRL;
 using namespace DirectX;
@@ -10,159 +35,2528 @@ using namespace DirectX;
 const UINT WIDTH = 256;
 const UINT HEIGHT = 256;
 
-ID3D11RenderTargetView* g_pRenderTargetView = nullptr;
-ID3D11VertexShader*     g_pVertexShader = nullptr;
-ID3D11PixelShader*      g_pPixelShader = nullptr;
-IDXGISwapChain*         g_pSwapChain = nullptr;
-ID3D11DeviceContext*    g_pImmediateContext = nullptr;
-ID3D11DeviceContext1*   g_pImmediateContext1 = nullptr;
-ID3D11Device*           g_pd3dDevice = nullptr;
-HWND                    g_hWnd = nullptr;
-D3D_DRIVER_TYPE         g_driverType = D3D_DRIVER_TYPE_NULL;
-D3D_FEATURE_LEVEL       g_featureLevel = D3D_FEATURE_LEVEL_11_0;
-ID3D11Device1*			g_pd3dDevice1 = nullptr;
-IDXGISwapChain1*        g_pSwapChain1 = nullptr;
+// The phases --timings breaks a run down into.
+enum Phase {
+	PHASE_STARTUP,  // from the process being created to wmain
+	PHASE_CO_INITIALIZE,
+	PHASE_INIT_DEVICE,  // including the vertex shader and other fixed state
+	PHASE_PREPARE_SHADERS,  // compiling or loading bytecode, and uniforms
+	PHASE_LOAD_SHADERS,  // creating pixel shaders and constant buffers
+	PHASE_RENDER,  // drawing and copying images off the GPU
+	PHASE_WRITE_IMAGES,  // encoding, hashing, comparing and writing them
+	PHASE_TEARDOWN,
+	PHASE_COUNT,
+};
+const char *PHASE_NAMES[PHASE_COUNT] = {
+	"startup", "co_initialize", "init_device", "prepare_shaders", "load_shaders", "render", "write_images",
+	"teardown",
+};
+
+typedef std::chrono::steady_clock Clock;
+
+// Everything needed to render with one D3D device. Usually there is just the
+// one, but --driver can ask for several so that the same shaders get
+// rendered on each of them, and --all-adapters for one per GPU so that jobs
+// can be spread over them. Each device is only ever used by one thread.
+struct RenderDevice {
+	std::wstring name;
+	D3D_DRIVER_TYPE driver_type = D3D_DRIVER_TYPE_NULL;
+	D3D_FEATURE_LEVEL feature_level = D3D_FEATURE_LEVEL_11_0;
+	HWND hwnd = nullptr;
+	ComPtr<ID3D11Device> device;
+	ComPtr<ID3D11Device1> device1;
+	ComPtr<ID3D11DeviceContext> context;
+	ComPtr<ID3D11DeviceContext1> context1;
+	ComPtr<IDXGISwapChain> swap_chain;
+	ComPtr<IDXGISwapChain1> swap_chain1;
+	ComPtr<ID3D11RenderTargetView> render_target_view;
+
+	ComPtr<ID3D11VertexShader> vertex_shader;
+	ComPtr<ID3D11InputLayout> vertex_layout;
+	ComPtr<ID3D11Buffer> vertex_buffer;
+	ComPtr<ID3D11PixelShader> pixel_shader;
+	ComPtr<ID3D11Buffer> constant_buffer;
+
+	// Pixel shaders already created on this device, by bytecode hash, so
+	// that a shader rendered again doesn't go through CreatePixelShader.
+	LruCache<uint64_t, ComPtr<ID3D11PixelShader>> pixel_shaders;
+
+	// Only set with --debug-layer. The debug layer's messages are drained
+	// from info_queue after each job and kept in debug_messages until they
+	// are reported.
+	ComPtr<ID3D11InfoQueue> info_queue;
+	MessageRing debug_messages{ 0 };
+	std::vector<uint8_t> message_buffer;
+
+	// Time spent loading, rendering and reading back jobs on this device,
+	// and how much of it went on loading shaders and writing images.
+	double seconds = 0.0;
+	double load_seconds = 0.0;
+	double write_seconds = 0.0;
+	// Jobs rendered on this device, and how many of those it took from
+	// another device's queue.
+	uint64_t jobs = 0;
+	uint64_t stolen_jobs = 0;
+};
+
+// Serialises the JSON lines we print, which can come from several devices'
+// threads at once.
+std::mutex              g_stdoutMutex;
+
+// How many frames may be waiting on their GPU-to-CPU copy at once.
+UINT                    g_readbackDepth = 3;
+
+// What a shader cut down by --reduce has to go on doing to be kept.
+enum ReduceTarget {
+	REDUCE_TARGET_NONE,
+	REDUCE_TARGET_COMPILE,
+	REDUCE_TARGET_CRASH,
+	REDUCE_TARGET_MISMATCH,
+};
+
+enum OutputFormat {
+	OUTPUT_FORMAT_AUTO,  // pick from the output file's extension
+	OUTPUT_FORMAT_PNG,
+	OUTPUT_FORMAT_PPM,
+	OUTPUT_FORMAT_RGBA,
+};
+OutputFormat            g_outputFormat = OUTPUT_FORMAT_AUTO;
+
+// If set, every image is appended to this image array instead of being
+// written to its own file.
+std::wstring            g_imageArray;
+
+// --hash-only prints a hash of each image instead of writing it.
+bool                    g_hashOnly = false;
+
+// If set, only the first of each set of identical images is written and this
+// file records the hash -> output paths mapping for all of them.
+std::wstring            g_dedupIndex;
+
+// Thresholds for comparing against reference images: a pixel differs when
+// a channel is off by more than the tolerance, and the images match when no
+// more than the given percentage of pixels differ. The same thresholds decide
+// whether devices agree when rendering on several of them.
+UINT                    g_compareTolerance = 0;
+double                  g_compareMaxPercent = 0.0;
+
+// --debug-layer creates devices with the D3D debug layer and reports what it
+// says about each job. Without it there is no debug layer to slow us down.
+bool                    g_debugLayer = false;
+
+// The most debug layer messages reported for one job on one device.
+const size_t            DEBUG_MESSAGE_CAPACITY = 64;
+
+// --all-adapters creates a device on every GPU and renders each job on just
+// one of them, rather than every job on every device as --driver does.
+bool                    g_spreadJobs = false;
+
+// --timings prints how long each phase of the run took. The phases are timed
+// regardless, as that costs next to nothing. Phases that happen on every
+// device's thread are summed over the devices.
+bool                    g_timings = false;
+double                  g_phaseSeconds[PHASE_COUNT] = {};
+
+// Memory for whatever preparing a job needs only until the job is handed to
+// the devices. It is reset after every job, so after the first few it stops
+// needing the heap; --timings reports how often it did.
+Arena                   g_jobArena;
+
+// How much bytecode each device may keep pixel shaders around for.
+size_t                  g_shaderCacheBytes = 64 << 20;
+
+// Compiled shaders are kept here between runs when --cache-dir is given.
+BytecodeCache           g_bytecodeCache;
+
+// What of a shader's source the bytecode cache key covers (--cache-key).
+SourceKeyMode           g_sourceKey = SOURCE_KEY_TOKENS;
+
+// Rendered images are kept here between runs when --memo is given.
+RenderMemo              g_renderMemo;
+
+// With --negative-cache, shaders that failed to compile or crashed are
+// recorded here, and jobs with those shaders fail straight away.
+std::wstring            g_negativeCachePath;
+NegativeCache           g_negativeCache;
+
+// While rendering with --negative-cache, which shader each device is drawing,
+// for the next run to find if this one dies. A run that gives up for reasons
+// of its own clears them on the way out, so only the marker of a device whose
+// D3D call failed, or every device's if the process is killed, is left behind.
+std::vector<std::unique_ptr<CrashMarker>> g_crashMarkers;
+const size_t            NO_DEVICE = static_cast<size_t>(-1);
+thread_local size_t     g_threadDevice = NO_DEVICE;
+std::atomic<size_t>     g_failedDevice(NO_DEVICE);
+
+// With --journal, finished batch jobs are recorded here, and jobs already in
+// it are skipped, so a batch that was cut short can be run again to finish it.
+std::wstring            g_journalPath;
+Journal                 g_journal;
+
+// With --incremental, outputs are recorded here with what they were made from,
+// and jobs whose output is up to date are skipped.
+std::wstring            g_manifestPath;
+OutputManifest          g_manifest;
+
+// Files that shaders #include, shared by every compile in the process.
+IncludeCache            g_includeCache;
+
+// Named sets of compile flags for --compile-profile. debug is what we have
+// always compiled with, so it stays the default.
+struct CompileProfile {
+	const wchar_t *name;
+	UINT flags;
+};
+const CompileProfile COMPILE_PROFILES[] = {
+	{ L"debug", D3DCOMPILE_ENABLE_STRICTNESS | D3DCOMPILE_DEBUG },
+	{ L"O0", D3DCOMPILE_ENABLE_STRICTNESS | D3DCOMPILE_OPTIMIZATION_LEVEL0 },
+	{ L"O1", D3DCOMPILE_ENABLE_STRICTNESS | D3DCOMPILE_OPTIMIZATION_LEVEL1 },
+	{ L"O2", D3DCOMPILE_ENABLE_STRICTNESS | D3DCOMPILE_OPTIMIZATION_LEVEL2 },
+	{ L"O3", D3DCOMPILE_ENABLE_STRICTNESS | D3DCOMPILE_OPTIMIZATION_LEVEL3 },
+	{ L"skip-optimization", D3DCOMPILE_ENABLE_STRICTNESS | D3DCOMPILE_SKIP_OPTIMIZATION },
+	{ L"skip-validation", D3DCOMPILE_ENABLE_STRICTNESS | D3DCOMPILE_SKIP_VALIDATION },
+};
+UINT                    g_compileFlags = COMPILE_PROFILES[0].flags;
+
+// The shader model to compile for, as in the "4_0" of ps_4_0.
+std::string             g_shaderModel = "4_0";
+const char *SHADER_MODELS[] = { "4_0", "4_1", "5_0" };
+
+// One shader to render and where to put the result.
+struct Job {
+	std::wstring pixel_shader;
+	std::wstring output;
+	// Optional image to compare the result against, and where to write a
+	// heatmap of the differences.
+	std::wstring reference;
+	std::wstring heatmap;
+	// What the journal knows the job by (UTF-8): the batch entry's "id", or
+	// failing that its output, or failing that its shader.
+	std::string id;
+	// For --incremental: a hash of the job's inputs, and the files its shader
+	// included, filled in when it is prepared.
+	uint64_t input_key = 0;
+	IncludeSet includes;
+	// For --memo: what the image is stored under, and whether it was found
+	// there rather than drawn.
+	uint64_t memo_key = 0;
+	bool memo_hit = false;
+	// For --negative-cache: what a crash drawing the job is recorded under,
+	// and whether it failed instead of being drawn.
+	uint64_t crash_key = 0;
+	bool failed = false;
+};
+
+__declspec(align(16))
+struct InjectionSwitch {
+	DirectX::XMFLOAT2 injectionSwitch;
+};
+
+// The uniforms we know how to pass, and where they go in the constant buffer.
+const UniformBinding UNIFORM_BINDINGS[] = {
+	{ "injectionSwitch", offsetof(InjectionSwitch, injectionSwitch), 2 },
+};
+const uint32_t INJECTION_SWITCH_FOUND = 1u << 0;
+
+// A job's uniforms, already packed the way the constant buffer wants them.
+// found has bit i set if UNIFORM_BINDINGS[i] was given.
+struct Uniforms {
+	InjectionSwitch constants = {};
+	uint32_t found = 0;
+};
+
+// A job's shader, compiled once and shared between all the devices. The
+// bytecode points into whatever storage holds it: the compiled blob, a .cso
+// file or a bundle, which is kept alive until every device is done with it.
+struct PreparedShader {
+	std::shared_ptr<void> storage;
+	const void *bytecode = nullptr;
+	size_t bytecode_size = 0;
+	uint64_t bytecode_hash = 0;
+	Uniforms uniforms;
+	// The image from --memo, if this job has been rendered before.
+	std::shared_ptr<Image> memoized;
+	// Why the job can't be drawn, if --negative-cache knows or found out.
+	std::shared_ptr<ShaderFailure> failure;
+};
 
-ID3D11InputLayout*      g_pVertexLayout = nullptr;
-ID3D11Buffer*           g_pVertexBuffer = nullptr;
+// Bundles that jobs refer to, each mapped once however many jobs use it.
+typedef std::map<std::wstring, std::shared_ptr<ShaderBundle>> OpenBundles;
 
 
 //--------------------------------------------------------------------------------------
 // Forward declarations
 //--------------------------------------------------------------------------------------
-HRESULT InitDevice(UINT, D3D_DRIVER_TYPE*);
-void LoadShaders(std::wstring &pixel_shader, json&);
-void OutputPixelShader(std::wstring&, json&, std::wstring&);
+HRESULT InitDevice(RenderDevice&, UINT, D3D_DRIVER_TYPE*, IDXGIAdapter* = nullptr);
+std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters(bool);
+void InitPipeline(RenderDevice&, ID3DBlob*);
+void LoadShaders(RenderDevice&, const PreparedShader&);
+void RenderJobs(std::vector<RenderDevice>&, std::vector<Job>&);
+void RenderFrame(RenderDevice&);
+void ReportDebugMessages(RenderDevice&, const Job&, bool);
+bool ParseDrivers(const std::wstring&, std::vector<D3D_DRIVER_TYPE>&);
+const wchar_t *DriverName(D3D_DRIVER_TYPE);
+std::wstring DeviceOutputPath(const std::wstring&, const std::wstring&);
+void PrintJsonLine(const json&);
+double SecondsSince(Clock::time_point);
+double SecondsSinceProcessStart();
+void PrintTimings(size_t, size_t, double);
+bool LoadBatch(const std::wstring&, std::vector<Job>&, bool);
+void PrepareShader(const std::wstring&, OpenBundles&, PreparedShader&, IncludeSet* = nullptr, ShaderFailure* = nullptr);
+std::wstring ShaderName(const std::wstring&);
+const wchar_t *UniformSourcePath(const std::wstring&, Arena&);
+int WriteBundle(const std::wstring&, const std::vector<Job>&);
+void LoadUniforms(const wchar_t*, Uniforms&, Arena&);
+int ConvertUniforms(const std::wstring&, const std::vector<std::wstring>&);
+bool ConvertUniformFile(const std::wstring&, UniformFormat);
+void SavePng(const ImageView&, const std::wstring&);
+void WriteImage(const ImageView&, const std::wstring&);
+bool LoadDedupIndex(const std::wstring&, DedupIndex&);
+void DecodeImage(const std::wstring&, Image&);
+void CompareToReference(const Job&, const std::wstring&, const ImageView&, std::map<std::wstring, Image>&);
+size_t SkipJournaledJobs(std::vector<Job>&);
+void ShardJobs(std::vector<Job>&, uint32_t, uint32_t);
+void SkipUpToDateJobs(std::vector<Job>&, const std::vector<RenderDevice>&);
+int MergeJournalsCommand(const std::wstring&, const std::vector<std::wstring>&);
+void RecordDone(const Job&, json&);
+uint64_t CompilerFingerprint();
+void OpenNegativeCache(const std::vector<RenderDevice>&);
+std::wstring CrashMarkerPath(size_t);
+void ClearCrashMarkers();
+uint64_t CrashKey(const PreparedShader&);
+void ReportFailure(const Job&, const ShaderFailure&);
+int ReduceShader(std::vector<RenderDevice>&, const std::wstring&, const std::wstring&, ReduceTarget);
+bool SaveDedupIndex(const std::wstring&, const DedupIndex&);
 LRESULT CALLBACK    WndProc(HWND, UINT, WPARAM, LPARAM);
 void checkFailImpl(HRESULT, int);
 void CompileShaderStr(const char *srcCode, _In_ LPCSTR entryPoint,
 	_In_ LPCSTR profile, _Outptr_ ID3DBlob **blob);
 void CompileShaderFromFile(_In_ LPCWSTR srcFile, _In_ LPCSTR entryPoint,
-	_In_ LPCSTR profile, _Outptr_ ID3DBlob **blob);
-void PrintDeviceInfo();
-bool readFile(const std::wstring& fileName, std::string& contentsOut);
+	_In_ LPCSTR profile, _Outptr_ ID3DBlob **blob, IncludeSet *includes = nullptr, ShaderFailure *failure = nullptr);
+void CompileShaderBytes(const char *srcCode, size_t srcSize, _In_ LPCSTR sourceName, _In_ LPCSTR entryPoint,
+	_In_ LPCSTR profile, _Outptr_ ID3DBlob **blob, IncludeSet *includes = nullptr, ShaderFailure *failure = nullptr);
+HRESULT CompileUncached(const char *srcCode, size_t srcSize, _In_ LPCSTR sourceName, _In_ LPCSTR entryPoint,
+	_In_ LPCSTR profile, UINT flags, _Outptr_ ID3DBlob **blob, ID3DBlob **errorBlob, IncludeSet *includes);
+int CompileReport(const std::vector<Job>&);
+int PrintAdapterInfo();
+bool DescribeAdapter(IDXGIAdapter1*, AdapterInfo*);
+std::string wstring_to_utf8(const std::wstring& str);
+std::wstring utf8_to_wstring(const std::string& str);
 #define checkFail(hr) checkFailImpl(hr, __LINE__)
+extern const char* vertex_shader_source;
 
 int wmain(int argc, wchar_t* argv[], wchar_t *envp[]) {
+	Clock::time_point main_start = Clock::now();
+	g_phaseSeconds[PHASE_STARTUP] = SecondsSinceProcessStart();
+
 	std::wstring pixel_shader;
 	std::wstring output(L"output.png");
-	D3D_DRIVER_TYPE force_driver_type = D3D_DRIVER_TYPE_UNKNOWN;
+	std::wstring batch;
+	std::wstring compare_to;
+	std::wstring diff_heatmap;
+	std::vector<D3D_DRIVER_TYPE> drivers;
 	bool print_adapter_info = false;
+	bool add_warp = false;
+	bool compile_report = false;
+	std::wstring write_bundle;
+	uint32_t shard_index = 0;
+	uint32_t shard_count = 0;
+	std::wstring reduce_output;
+	ReduceTarget reduce_target = REDUCE_TARGET_NONE;
 
 	for (int i = 1; i < argc; i++) {
 		std::wstring curr_arg = std::wstring(argv[i]);
 		if (!curr_arg.compare(0, 2, L"--")) {
+			if (curr_arg == L"--convert-uniforms") {
+				// A separate mode: everything after it is for the conversion.
+				if (i + 1 >= argc) {
+					std::wcerr << "--convert-uniforms requires a format" << std::endl;
+					return EXIT_FAILURE;
+				}
+				return ConvertUniforms(argv[i + 1], std::vector<std::wstring>(argv + i + 2, argv + argc));
+			}
+			if (curr_arg == L"--merge-journals") {
+				// Also a separate mode: the report to write, then the journals.
+				if (i + 2 >= argc) {
+					std::wcerr << "--merge-journals requires a report path and at least one journal" << std::endl;
+					return EXIT_FAILURE;
+				}
+				return MergeJournalsCommand(argv[i + 1], std::vector<std::wstring>(argv + i + 2, argv + argc));
+			}
 			if (curr_arg == L"--output") {
 				output = argv[++i];
 				continue;
 			}
-			if (curr_arg == L"--get-info") {
-				print_adapter_info = true;
+			if (curr_arg == L"--format") {
+				std::wstring format_string = argv[++i];
+				if (format_string == L"png") {
+					g_outputFormat = OUTPUT_FORMAT_PNG;
+				}
+				else if (format_string == L"ppm") {
+					g_outputFormat = OUTPUT_FORMAT_PPM;
+				}
+				else if (format_string == L"rgba") {
+					g_outputFormat = OUTPUT_FORMAT_RGBA;
+				}
+				else {
+					std::wcerr << "Unknown output format " << format_string <<
+						" expected one of png, ppm, rgba" << std::endl;
+					return EXIT_FAILURE;
+				}
 				continue;
 			}
-			if (curr_arg == L"--driver") {
-				std::wstring driver_string = argv[++i];
-				if (driver_string == L"auto") {
-					continue;
+			if (curr_arg == L"--image-array") {
+				g_imageArray = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--hash-only") {
+				g_hashOnly = true;
+				continue;
+			}
+			if (curr_arg == L"--dedup") {
+				g_dedupIndex = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--compare-to") {
+				compare_to = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--diff-heatmap") {
+				diff_heatmap = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--compare-tolerance") {
+				int tolerance = _wtoi(argv[++i]);
+				if (tolerance < 0 || tolerance > 255) {
+					std::wcerr << "--compare-tolerance must be between 0 and 255" << std::endl;
+					return EXIT_FAILURE;
+				}
+				g_compareTolerance = tolerance;
+				continue;
+			}
+			if (curr_arg == L"--compare-max-percent") {
+				g_compareMaxPercent = _wtof(argv[++i]);
+				if (g_compareMaxPercent < 0.0 || g_compareMaxPercent > 100.0) {
+					std::wcerr << "--compare-max-percent must be between 0 and 100" << std::endl;
+					return EXIT_FAILURE;
+				}
+				continue;
+			}
+			if (curr_arg == L"--batch") {
+				batch = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--shard") {
+				std::wstring shard_string = argv[++i];
+				if (!ParseShard(shard_string, &shard_index, &shard_count)) {
+					std::wcerr << "Bad shard " << shard_string << " expected i/N with i < N, such as 0/4" << std::endl;
+					return EXIT_FAILURE;
+				}
+				continue;
+			}
+			if (curr_arg == L"--incremental") {
+				g_manifestPath = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--journal") {
+				g_journalPath = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--negative-cache") {
+				g_negativeCachePath = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--cache-dir") {
+				std::wstring cache_dir = argv[++i];
+				if (!g_bytecodeCache.Open(cache_dir)) {
+					std::wcerr << "Could not create cache directory " << cache_dir << std::endl;
+					return EXIT_FAILURE;
+				}
+				continue;
+			}
+			if (curr_arg == L"--memo") {
+				std::wstring memo_dir = argv[++i];
+				if (!g_renderMemo.Open(memo_dir)) {
+					std::wcerr << "Could not create memo directory " << memo_dir << std::endl;
+					return EXIT_FAILURE;
+				}
+				continue;
+			}
+			if (curr_arg == L"--cache-key") {
+				std::wstring mode = argv[++i];
+				if (mode == L"bytes") {
+					g_sourceKey = SOURCE_KEY_BYTES;
+				}
+				else if (mode == L"tokens") {
+					g_sourceKey = SOURCE_KEY_TOKENS;
+				}
+				else if (mode == L"lines") {
+					g_sourceKey = SOURCE_KEY_LINES;
+				}
+				else {
+					std::wcerr << "Unknown cache key " << mode << " (expected bytes, tokens or lines)" << std::endl;
+					return EXIT_FAILURE;
+				}
+				continue;
+			}
+			if (curr_arg == L"--compile-profile") {
+				std::wstring profile_name = argv[++i];
+				const CompileProfile *profile = nullptr;
+				for (auto &candidate : COMPILE_PROFILES) {
+					if (profile_name == candidate.name) {
+						profile = &candidate;
+					}
+				}
+				if (!profile) {
+					std::wcerr << "Unknown compile profile " << profile_name <<
+						" expected one of debug, O0, O1, O2, O3, skip-optimization, skip-validation" << std::endl;
+					return EXIT_FAILURE;
+				}
+				g_compileFlags = profile->flags;
+				continue;
+			}
+			if (curr_arg == L"--shader-model") {
+				std::string model = wstring_to_utf8(argv[++i]);
+				if (std::find(std::begin(SHADER_MODELS), std::end(SHADER_MODELS), model) == std::end(SHADER_MODELS)) {
+					std::wcerr << "Unknown shader model " << argv[i] << " expected one of 4_0, 4_1, 5_0" << std::endl;
+					return EXIT_FAILURE;
 				}
-				else if (driver_string == L"hardware") {
-					force_driver_type = D3D_DRIVER_TYPE_HARDWARE;
+				g_shaderModel = model;
+				continue;
+			}
+			if (curr_arg == L"--reduce") {
+				reduce_output = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--interesting") {
+				std::wstring target = argv[++i];
+				if (target == L"compile") {
+					reduce_target = REDUCE_TARGET_COMPILE;
 				}
-				else if (driver_string == L"warp") {
-					force_driver_type = D3D_DRIVER_TYPE_WARP;
+				else if (target == L"crash") {
+					reduce_target = REDUCE_TARGET_CRASH;
 				}
-				else if (driver_string == L"reference") {
-					force_driver_type = D3D_DRIVER_TYPE_REFERENCE;
+				else if (target == L"mismatch") {
+					reduce_target = REDUCE_TARGET_MISMATCH;
 				}
 				else {
-					std::wcerr << "Unknown driver specification  " << driver_string <<
-						" expected one of auto, hardware, warp, reference" << std::endl;
+					std::wcerr << "Unknown --interesting " << target << " expected one of compile, crash, mismatch" <<
+						std::endl;
+					return EXIT_FAILURE;
+				}
+				continue;
+			}
+			if (curr_arg == L"--write-bundle") {
+				write_bundle = argv[++i];
+				continue;
+			}
+			if (curr_arg == L"--compile-report") {
+				compile_report = true;
+				continue;
+			}
+			if (curr_arg == L"--shader-cache-mb") {
+				int megabytes = _wtoi(argv[++i]);
+				if (megabytes < 0) {
+					std::wcerr << "--shader-cache-mb must not be negative" << std::endl;
+					return EXIT_FAILURE;
+				}
+				g_shaderCacheBytes = static_cast<size_t>(megabytes) << 20;
+				continue;
+			}
+			if (curr_arg == L"--readback-depth") {
+				int depth = _wtoi(argv[++i]);
+				if (depth <= 0) {
+					std::wcerr << "--readback-depth must be a positive integer" << std::endl;
+					return EXIT_FAILURE;
+				}
+				g_readbackDepth = depth;
+				continue;
+			}
+			if (curr_arg == L"--timings") {
+				g_timings = true;
+				continue;
+			}
+			if (curr_arg == L"--debug-layer") {
+				g_debugLayer = true;
+				continue;
+			}
+			if (curr_arg == L"--get-info") {
+				print_adapter_info = true;
+				continue;
+			}
+			if (curr_arg == L"--driver") {
+				if (!ParseDrivers(argv[++i], drivers)) {
 					return EXIT_FAILURE;
 				}
 				continue;
 			}
+			if (curr_arg == L"--all-adapters") {
+				g_spreadJobs = true;
+				continue;
+			}
+			if (curr_arg == L"--add-warp") {
+				add_warp = true;
+				continue;
+			}
+
+			std::wcerr << "Unknown argument " << curr_arg << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (pixel_shader.length() == 0) {
+			pixel_shader = curr_arg;
+		}
+		else {
+			std::wcerr << "Ignoring extra argument " << curr_arg << std::endl;
+		}
+	}
+
+	if (!print_adapter_info && (pixel_shader.length() == 0) && (batch.length() == 0)) {
+		std::wcerr << "Requires pixel shader argument, --batch or --get-info" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if ((compile_report || write_bundle.length() > 0) && (pixel_shader.length() == 0) && (batch.length() == 0)) {
+		std::wcerr << "--compile-report and --write-bundle require a pixel shader argument or --batch" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (compile_report && write_bundle.length() > 0) {
+		std::wcerr << "Cannot specify both --compile-report and --write-bundle" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (print_adapter_info && (pixel_shader.length() > 0 || batch.length() > 0)) {
+		std::wcerr << "Cannot specify both --get-info and pixel shader argument or --batch" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if ((pixel_shader.length() > 0) && (batch.length() > 0)) {
+		std::wcerr << "Cannot specify both --batch and pixel shader argument" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if ((g_hashOnly || g_dedupIndex.length() > 0) && g_imageArray.length() > 0) {
+		std::wcerr << "Cannot combine --hash-only or --dedup with --image-array" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if ((compare_to.length() > 0 || diff_heatmap.length() > 0) && batch.length() > 0) {
+		std::wcerr << "Use the \"reference\" and \"heatmap\" fields of the batch file instead of --compare-to and --diff-heatmap" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (diff_heatmap.length() > 0 && compare_to.length() == 0) {
+		std::wcerr << "--diff-heatmap requires --compare-to" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (g_hashOnly && g_dedupIndex.length() > 0) {
+		std::wcerr << "Cannot specify both --hash-only and --dedup" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if ((drivers.size() > 1 || g_spreadJobs) && (g_dedupIndex.length() > 0 || g_imageArray.length() > 0)) {
+		std::wcerr << "Cannot combine several drivers or --all-adapters with --dedup or --image-array" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (g_spreadJobs && (drivers.size() > 0 || print_adapter_info)) {
+		std::wcerr << "Cannot combine --all-adapters with --driver or --get-info" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (add_warp && !g_spreadJobs) {
+		std::wcerr << "--add-warp requires --all-adapters" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (g_journalPath.length() > 0 && (batch.length() == 0 || compile_report || write_bundle.length() > 0)) {
+		std::wcerr << "--journal requires --batch, and doesn't apply to --compile-report or --write-bundle" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (g_manifestPath.length() > 0 && (g_hashOnly || g_dedupIndex.length() > 0 || g_imageArray.length() > 0 ||
+		drivers.size() > 1 || compile_report || write_bundle.length() > 0)) {
+		std::wcerr << "--incremental needs one output file per job, so can't be combined with --hash-only, "
+			"--dedup, --image-array, several drivers, --compile-report or --write-bundle" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (g_renderMemo.Enabled() && (drivers.size() > 1 || g_spreadJobs)) {
+		std::wcerr << "--memo needs a single device, so can't be combined with several drivers or --all-adapters" <<
+			std::endl;
+		return EXIT_FAILURE;
+	}
+	if (g_negativeCachePath.length() > 0 && (compile_report || write_bundle.length() > 0 || print_adapter_info)) {
+		std::wcerr << "--negative-cache only applies to rendering, not --compile-report, --write-bundle or --get-info" <<
+			std::endl;
+		return EXIT_FAILURE;
+	}
+	if ((reduce_output.length() > 0) != (reduce_target != REDUCE_TARGET_NONE)) {
+		std::wcerr << "--reduce and --interesting go together" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (reduce_output.length() > 0 && (pixel_shader.length() == 0 || compile_report || write_bundle.length() > 0 ||
+		g_journalPath.length() > 0 || g_manifestPath.length() > 0 || g_renderMemo.Enabled() ||
+		g_negativeCachePath.length() > 0)) {
+		std::wcerr << "--reduce requires a pixel shader argument, and can't be combined with --batch, "
+			"--compile-report, --write-bundle, --journal, --incremental, --memo or --negative-cache" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (reduce_target == REDUCE_TARGET_MISMATCH && drivers.size() < 2 && !g_spreadJobs) {
+		std::wcerr << "--interesting mismatch needs several devices, from --driver or --all-adapters" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (shard_count > 0 && batch.length() == 0) {
+		std::wcerr << "--shard requires --batch" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (drivers.size() > 0 && print_adapter_info) {
+		std::wcerr << "--get-info reports every adapter, so takes no --driver" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<Job> jobs;
+	if (batch.length() > 0) {
+		// Outputs don't matter when nothing gets rendered.
+		bool output_required = g_imageArray.length() == 0 && !compile_report && write_bundle.length() == 0;
+		if (!LoadBatch(batch, jobs, output_required)) {
+			return EXIT_FAILURE;
+		}
+		if (shard_count > 0) {
+			ShardJobs(jobs, shard_index, shard_count);
+		}
+	}
+	else if (pixel_shader.length() > 0) {
+		jobs.push_back({ pixel_shader, output, compare_to, diff_heatmap });
+	}
+	if (compile_report) {
+		return CompileReport(jobs);
+	}
+	if (write_bundle.length() > 0) {
+		return WriteBundle(write_bundle, jobs);
+	}
+	if (print_adapter_info) {
+		return PrintAdapterInfo();
+	}
+	if (g_journalPath.length() > 0) {
+		size_t skipped = SkipJournaledJobs(jobs);
+		json j = {
+			{ "journal", {
+				{ "skipped", skipped },
+				{ "remaining", jobs.size() },
+				{ "truncated_bytes", g_journal.TruncatedBytes() },
+			} },
+		};
+		PrintJsonLine(j);
+	}
+
+	Clock::time_point start = Clock::now();
+	checkFail(CoInitializeEx(nullptr, COINITBASE_MULTITHREADED));
+	g_phaseSeconds[PHASE_CO_INITIALIZE] += SecondsSince(start);
+
+	start = Clock::now();
+	std::vector<RenderDevice> devices;
+	if (g_spreadJobs) {
+		std::vector<ComPtr<IDXGIAdapter1>> adapters = EnumerateAdapters(false);
+		if (adapters.empty() && !add_warp) {
+			std::wcerr << "No hardware adapters found (--add-warp renders on WARP as well)" << std::endl;
+			return EXIT_FAILURE;
+		}
+		devices.resize(adapters.size() + (add_warp ? 1 : 0));
+		D3D_DRIVER_TYPE hardware = D3D_DRIVER_TYPE_HARDWARE;
+		for (size_t i = 0; i < adapters.size(); i++) {
+			checkFail(InitDevice(devices[i], 1, &hardware, adapters[i].Get()));
+			devices[i].name = L"adapter" + std::to_wstring(i);
+		}
+		if (add_warp) {
+			D3D_DRIVER_TYPE warp = D3D_DRIVER_TYPE_WARP;
+			checkFail(InitDevice(devices.back(), 1, &warp));
+		}
+	}
+	else if (drivers.empty()) {
+		D3D_DRIVER_TYPE driverTypes[] =
+		{
+			D3D_DRIVER_TYPE_HARDWARE,
+			D3D_DRIVER_TYPE_WARP,
+			D3D_DRIVER_TYPE_REFERENCE,
+		};
+		UINT numDriverTypes = ARRAYSIZE(driverTypes);
+
+		devices.resize(1);
+		checkFail(InitDevice(devices[0], numDriverTypes, driverTypes));
+	}
+	else {
+		devices.resize(drivers.size());
+		for (size_t i = 0; i < drivers.size(); i++) {
+			checkFail(InitDevice(devices[i], 1, &drivers[i]));
+		}
+	}
+	g_phaseSeconds[PHASE_INIT_DEVICE] += SecondsSince(start);
+
+	if (reduce_output.length() > 0) {
+		int result = ReduceShader(devices, pixel_shader, reduce_output, reduce_target);
+		devices.clear();
+		CoUninitialize();
+		return result;
+	}
+	if (g_negativeCachePath.length() > 0) {
+		OpenNegativeCache(devices);
+	}
+	if (g_manifestPath.length() > 0) {
+		SkipUpToDateJobs(jobs, devices);
+	}
+
+	RenderJobs(devices, jobs);
+
+	if (g_manifestPath.length() > 0 && !g_manifest.Save()) {
+		std::wcerr << "Could not write manifest " << g_manifestPath << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	start = Clock::now();
+	size_t device_count = devices.size();
+	devices.clear();
+	CoUninitialize();
+	g_phaseSeconds[PHASE_TEARDOWN] += SecondsSince(start);
+
+	if (g_journal.IsOpen() && !g_journal.Close()) {
+		std::wcerr << "Could not sync journal " << g_journalPath << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (g_negativeCache.Enabled() && !g_negativeCache.Close()) {
+		std::wcerr << "Could not sync negative cache " << g_negativeCachePath << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (g_timings) {
+		PrintTimings(jobs.size(), device_count, g_phaseSeconds[PHASE_STARTUP] + SecondsSince(main_start));
+	}
+
+	// Without --negative-cache a failure would have ended the run already.
+	bool any_failed = std::any_of(jobs.begin(), jobs.end(), [](const Job &job) { return job.failed; });
+	return any_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+bool ParseDrivers(const std::wstring &driver_string, std::vector<D3D_DRIVER_TYPE> &drivers)
+{
+	/*
+	--driver takes one driver type, or a comma separated list of them to
+	render every shader on each one. "auto" means try each in turn and use
+	the first that works, and can't be part of a list.
+	*/
+	drivers.clear();
+	if (driver_string == L"auto") {
+		return true;
+	}
+	std::wstringstream ss(driver_string);
+	std::wstring name;
+	while (std::getline(ss, name, L',')) {
+		D3D_DRIVER_TYPE driver_type;
+		if (name == L"hardware") {
+			driver_type = D3D_DRIVER_TYPE_HARDWARE;
+		}
+		else if (name == L"warp") {
+			driver_type = D3D_DRIVER_TYPE_WARP;
+		}
+		else if (name == L"reference") {
+			driver_type = D3D_DRIVER_TYPE_REFERENCE;
+		}
+		else {
+			std::wcerr << "Unknown driver specification  " << name <<
+				" expected auto or a comma separated list of hardware, warp, reference" << std::endl;
+			return false;
+		}
+		if (std::find(drivers.begin(), drivers.end(), driver_type) != drivers.end()) {
+			std::wcerr << "Driver " << name << " given more than once" << std::endl;
+			return false;
+		}
+		drivers.push_back(driver_type);
+	}
+	return true;
+}
+
+std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters(bool include_software)
+{
+	/*
+	Every GPU in the machine, in DXGI's order (the default one first). The
+	Microsoft Basic Render Driver is only included if include_software is
+	set; it is WARP by another name, which --add-warp asks for explicitly.
+	*/
+	ComPtr<IDXGIFactory1> factory;
+	checkFail(CreateDXGIFactory1(__uuidof(IDXGIFactory1), reinterpret_cast<void**>(factory.GetAddressOf())));
+	std::vector<ComPtr<IDXGIAdapter1>> adapters;
+	ComPtr<IDXGIAdapter1> adapter;
+	for (UINT i = 0; factory->EnumAdapters1(i, adapter.ReleaseAndGetAddressOf()) != DXGI_ERROR_NOT_FOUND; i++) {
+		DXGI_ADAPTER_DESC1 desc;
+		checkFail(adapter->GetDesc1(&desc));
+		if ((desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE) && !include_software) {
+			continue;
+		}
+		adapters.push_back(adapter);
+	}
+	return adapters;
+}
+
+const wchar_t *DriverName(D3D_DRIVER_TYPE driver_type)
+{
+	switch (driver_type) {
+	case D3D_DRIVER_TYPE_HARDWARE:
+		return L"hardware";
+	case D3D_DRIVER_TYPE_WARP:
+		return L"warp";
+	case D3D_DRIVER_TYPE_REFERENCE:
+		return L"reference";
+	default:
+		return L"unknown";
+	}
+}
+
+bool LoadBatch(const std::wstring &batch, std::vector<Job> &jobs, bool output_required)
+{
+	/*
+	A batch is a JSON array of {"shader": ..., "output": ...} objects, all of
+	which get rendered by this one process. Entries may also name a
+	"reference" image to compare against and a "heatmap" of the differences,
+	and an "id" for --journal to know them by.
+	*/
+	FileView batchContent;
+	if (!batchContent.Open(batch)) {
+		std::wcerr << "Could not read batch file " << batch << std::endl;
+		return false;
+	}
+	json batch_json = json::parse(batchContent.Data(), batchContent.Data() + batchContent.Size());
+	if (!batch_json.is_array()) {
+		std::wcerr << "Batch file " << batch << " should contain a JSON array" << std::endl;
+		return false;
+	}
+	// Outputs are only optional when everything goes into an image array.
+	for (auto &entry : batch_json) {
+		if (!entry.is_object() ||
+			entry.count("shader") == 0 || !entry.at("shader").is_string() ||
+			(entry.count("output") == 0 && output_required) ||
+			(entry.count("output") > 0 && !entry.at("output").is_string())) {
+			std::cerr << "Batch entries should be objects with string \"shader\" and \"output\" fields but got "
+				<< entry << " instead." << std::endl;
+			return false;
+		}
+		Job job;
+		job.pixel_shader = utf8_to_wstring(entry.at("shader").get<std::string>());
+		if (entry.count("output") > 0) {
+			job.output = utf8_to_wstring(entry.at("output").get<std::string>());
+		}
+		if (entry.count("reference") > 0 && entry.at("reference").is_string()) {
+			job.reference = utf8_to_wstring(entry.at("reference").get<std::string>());
+		}
+		if (entry.count("heatmap") > 0 && entry.at("heatmap").is_string()) {
+			job.heatmap = utf8_to_wstring(entry.at("heatmap").get<std::string>());
+		}
+		if (entry.count("id") > 0 && entry.at("id").is_string()) {
+			job.id = entry.at("id").get<std::string>();
+		}
+		else if (entry.count("output") > 0) {
+			job.id = entry.at("output").get<std::string>();
+		}
+		else {
+			job.id = entry.at("shader").get<std::string>();
+		}
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+size_t SkipJournaledJobs(std::vector<Job> &jobs)
+{
+	/*
+	Open the journal and drop the jobs it says are done, returning how many
+	that was. A record that was only half written when the last run died is
+	cut off here, so the job it was for simply runs again. A record that is
+	whole but isn't JSON means this isn't our journal, so rather than add to
+	it we stop.
+	*/
+	std::unordered_set<std::string> done;
+	bool well_formed = true;
+	bool opened = g_journal.Open(g_journalPath, [&done, &well_formed](const char *payload, size_t size) {
+		if (!well_formed || !IsWellFormedJson(payload, payload + size)) {
+			well_formed = false;
+			return;
+		}
+		json record = json::parse(payload, payload + size);
+		if (record.is_object() && record.count("id") > 0 && record.at("id").is_string()) {
+			done.insert(record.at("id").get<std::string>());
+		}
+	});
+	if (!opened) {
+		std::wcerr << "Could not open journal " << g_journalPath << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (!well_formed) {
+		std::wcerr << "Journal " << g_journalPath << " holds records that aren't JSON" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	size_t count = jobs.size();
+	jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&done](const Job &job) {
+		return done.count(job.id) > 0;
+	}), jobs.end());
+	return count - jobs.size();
+}
+
+uint64_t ShaderContentHash(const std::wstring &pixel_shader, OpenBundles &bundles)
+{
+	/*
+	A hash of the shader itself, not of its path: the file's contents, or
+	for a shader in a bundle, the hash the bundle stores for it.
+	*/
+	std::wstring bundle_path, name;
+	if (SplitBundleReference(pixel_shader, &bundle_path, &name)) {
+		std::shared_ptr<ShaderBundle> &bundle = bundles[bundle_path];
+		if (!bundle) {
+			bundle = std::make_shared<ShaderBundle>();
+			if (!bundle->Open(bundle_path)) {
+				std::wcerr << "Could not read shader bundle " << bundle_path << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		const ShaderBundleEntry *entry = bundle->Find(wstring_to_utf8(name));
+		if (!entry) {
+			std::wcerr << "No shader called " << name << " in bundle " << bundle_path << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		return entry->hash;
+	}
+	FileView view;
+	if (!view.Open(pixel_shader)) {
+		std::wcerr << "Could not read shader " << pixel_shader << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	return Xxh64::Hash(view.Data(), view.Size());
+}
+
+void ShardJobs(std::vector<Job> &jobs, uint32_t index, uint32_t count)
+{
+	/*
+	Keep just the jobs that belong to shard index of count, and say how many
+	that was. Every machine running a shard of the same batch reads every
+	shader to hash it, but that is far cheaper than compiling them.
+	*/
+	OpenBundles bundles;
+	size_t total = jobs.size();
+	jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&bundles, index, count](const Job &job) {
+		return ShardOf(ShaderContentHash(job.pixel_shader, bundles), count) != index;
+	}), jobs.end());
+	json j = {
+		{ "shard", {
+			{ "index", index },
+			{ "count", count },
+			{ "jobs", jobs.size() },
+			{ "batch_jobs", total },
+		} },
+	};
+	PrintJsonLine(j);
+}
+
+uint64_t DeviceFingerprint(const std::vector<RenderDevice> &devices)
+{
+	/*
+	What about the devices can change the images: the adapters and their
+	drivers (keyed the same way as --get-info's report), the kind of driver
+	and the feature level.
+	*/
+	CompileKey key;
+	std::vector<AdapterInfo> adapters;
+	for (auto &dev : devices) {
+		ComPtr<IDXGIDevice> dxgi_device;
+		ComPtr<IDXGIAdapter> adapter;
+		ComPtr<IDXGIAdapter1> adapter1;
+		AdapterInfo info;
+		if (SUCCEEDED(dev.device.As(&dxgi_device)) && SUCCEEDED(dxgi_device->GetAdapter(&adapter)) &&
+			SUCCEEDED(adapter.As(&adapter1))) {
+			DescribeAdapter(adapter1.Get(), &info);
+		}
+		adapters.push_back(info);
+		key.Add(uint64_t(dev.driver_type)).Add(uint64_t(dev.feature_level));
+	}
+	return key.Add(AdapterInfoKey(adapters)).Digest();
+}
+
+uint64_t JobInputKey(const Job &job, uint64_t device_fingerprint, OpenBundles &bundles)
+{
+	/*
+	A hash of everything that goes into a job's image except the files its
+	shader includes, which the manifest checks one by one. The shader's path
+	counts too, as relative #includes resolve against it.
+	*/
+	CompileKey key;
+	key.Add(ShaderContentHash(job.pixel_shader, bundles))
+		.Add(job.pixel_shader.data(), job.pixel_shader.size() * sizeof(wchar_t))
+		.Add(g_shaderModel.c_str())
+		.Add(uint64_t(g_compileFlags))
+		.Add(CompilerFingerprint())
+		.Add(uint64_t(WIDTH))
+		.Add(uint64_t(HEIGHT))
+		.Add(uint64_t(g_outputFormat))
+		.Add(device_fingerprint);
+	{
+		const wchar_t *uniform_path;
+		UniformFormat format;
+		FileView uniforms;
+		if (FindUniformFile(UniformSourcePath(job.pixel_shader, g_jobArena), g_jobArena, &uniform_path, &format) &&
+			uniforms.Open(uniform_path, FileView::kMapThreshold, &g_jobArena)) {
+			key.Add(uint64_t(format)).Add(uniforms.Data(), uniforms.Size());
+		}
+		else {
+			key.Add(nullptr, 0);
+		}
+	}
+	g_jobArena.Reset();
+	return key.Digest();
+}
+
+void SkipUpToDateJobs(std::vector<Job> &jobs, const std::vector<RenderDevice> &devices)
+{
+	/*
+	--incremental: work out each job's input key and drop the jobs whose
+	output the manifest says is up to date. Jobs with a reference image
+	always run, as the comparison is what they are for.
+	*/
+	if (!g_manifest.Load(g_manifestPath)) {
+		std::wcerr << g_manifestPath << " is not a manifest" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	uint64_t fingerprint = DeviceFingerprint(devices);
+	OpenBundles bundles;
+	size_t total = jobs.size();
+	for (auto &job : jobs) {
+		job.input_key = JobInputKey(job, fingerprint, bundles);
+	}
+	jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const Job &job) {
+		return job.reference.empty() && g_manifest.UpToDate(job.output, job.input_key, g_includeCache);
+	}), jobs.end());
+	json j = {
+		{ "incremental", {
+			{ "skipped", total - jobs.size() },
+			{ "remaining", jobs.size() },
+		} },
+	};
+	PrintJsonLine(j);
+}
+
+int MergeJournalsCommand(const std::wstring &report_path, const std::vector<std::wstring> &journals)
+{
+	/*
+	--merge-journals: combine the journals of a batch's shards into one JSON
+	report of every job's result.
+	*/
+	json report;
+	size_t bad_journal;
+	if (!MergeJournals(journals, &report, &bad_journal)) {
+		std::wcerr << "Could not read journal " << journals[bad_journal] << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::string text = report.dump(1) + "\n";
+	if (!WriteFileReplacing(report_path, text.data(), text.size())) {
+		std::wcerr << "Could not write report " << report_path << std::endl;
+		return EXIT_FAILURE;
+	}
+	json j = {
+		{ "journals", report["journals"] },
+		{ "jobs", report["jobs"] },
+		{ "duplicates", report["duplicates"] },
+	};
+	PrintJsonLine(j);
+	return EXIT_SUCCESS;
+}
+
+void RecordDone(const Job &job, json &result)
+{
+	/*
+	Note in the journal that job is finished, along with result. Only the id
+	matters for skipping it next time; the rest is for whoever reads the
+	journal. Once a record can't be written, later runs can't trust the
+	journal to be complete, so give up.
+	*/
+	result["id"] = job.id;
+	if (!g_journal.Append(result.dump())) {
+		std::wcerr << "Could not write to journal " << g_journalPath << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+uint64_t CompilerFingerprint()
+{
+	/*
+	Which compiler compiles our shaders: the version we were built against,
+	and the size and time of the DLL actually loaded, which Windows updates
+	replace without that version changing. It goes into every key over
+	compiled output, so is only worked out once.
+	*/
+	static const uint64_t fingerprint = [] {
+		uint64_t mtime = 0;
+		uint64_t size = 0;
+		HMODULE module = GetModuleHandleW(D3DCOMPILER_DLL_W);
+		wchar_t path[MAX_PATH];
+		if (module && GetModuleFileNameW(module, path, MAX_PATH) > 0) {
+			FileStamp(path, &mtime, &size);
+		}
+		CompileKey key;
+		return key.Add(uint64_t(D3D_COMPILER_VERSION)).Add(mtime).Add(size).Digest();
+	}();
+	return fingerprint;
+}
+
+std::wstring CrashMarkerPath(size_t device)
+{
+	return g_negativeCachePath + L"." + std::to_wstring(device) + L".running";
+}
+
+void ClearCrashMarkers()
+{
+	// Registered with atexit.
+	for (size_t d = 0; d < g_crashMarkers.size(); d++) {
+		if (d != g_failedDevice) {
+			g_crashMarkers[d]->Set(0, std::string());
+		}
+	}
+}
+
+void OpenNegativeCache(const std::vector<RenderDevice> &devices)
+{
+	/*
+	--negative-cache: load the failures recorded by earlier runs, dropping
+	those made with another compiler or other drivers, then look for crash
+	markers that a run which died left behind. Each one names the shader
+	that device was drawing, which goes down as a crash.
+	*/
+	if (!g_negativeCache.Open(g_negativeCachePath, CompilerFingerprint(), DeviceFingerprint(devices))) {
+		std::wcerr << "Could not open negative cache " << g_negativeCachePath << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	uint64_t crashes = 0;
+	for (size_t d = 0; FileExists(CrashMarkerPath(d).c_str()); d++) {
+		uint64_t key;
+		ShaderFailure crash;
+		std::string name;
+		if (CrashMarker::Leftover(CrashMarkerPath(d), &key, &name)) {
+			crash.kind = SHADER_FAILURE_CRASH;
+			crash.message = "The last run ended without finishing while drawing " + name;
+			crash.cached = false;
+			if (!g_negativeCache.Add(key, crash)) {
+				std::wcerr << "Could not write to negative cache " << g_negativeCachePath << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			crashes++;
+		}
+		RemoveFile(CrashMarkerPath(d));
+	}
+	json j = {
+		{ "negative_cache", {
+			{ "entries", g_negativeCache.Size() },
+			{ "invalidated", g_negativeCache.Invalidated() },
+			{ "crashes", crashes },
+		} },
+	};
+	PrintJsonLine(j);
+}
+
+uint64_t CrashKey(const PreparedShader &shader)
+{
+	// Drivers crash on the code they are given, and sometimes only with
+	// particular uniforms.
+	CompileKey key;
+	return key.Add(shader.bytecode_hash)
+		.Add(uint64_t(shader.uniforms.found))
+		.Add(&shader.uniforms.constants, sizeof(shader.uniforms.constants))
+		.Digest();
+}
+
+void ReportFailure(const Job &job, const ShaderFailure &failure)
+{
+	/*
+	Say why a job won't be drawn. As far as the journal goes it is finished:
+	running it again would fail the same way.
+	*/
+	json j = {
+		{ "shader", wstring_to_utf8(job.pixel_shader) },
+		{ "failure", ShaderFailureName(failure.kind) },
+		{ "message", failure.message },
+		{ "cached", failure.cached },
+	};
+	PrintJsonLine(j);
+	if (g_journal.IsOpen()) {
+		RecordDone(job, j);
+	}
+}
+
+void LoadUniforms(const wchar_t *pixel_shader, Uniforms &uniforms, Arena &arena)
+{
+	// The uniforms are picked straight out of the file rather than going
+	// through a json DOM, as the files can be much bigger than the few floats
+	// we want. The file name and a file small enough to be read rather than
+	// mapped live in arena.
+	const wchar_t *filename;
+	UniformFormat format;
+	FileView content;
+	if (!FindUniformFile(pixel_shader, arena, &filename, &format) ||
+		!content.Open(filename, FileView::kMapThreshold, &arena)) {
+		return;
+	}
+	std::string error;
+	if (!ParseUniforms(format, content.Data(), content.Data() + content.Size(),
+		UNIFORM_BINDINGS, ARRAYSIZE(UNIFORM_BINDINGS),
+		reinterpret_cast<uint8_t*>(&uniforms.constants), &uniforms.found, &error)) {
+		std::wcerr << filename << L": " << utf8_to_wstring(error) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+void PrepareShader(const std::wstring &pixel_shader, OpenBundles &bundles, PreparedShader &shader,
+	IncludeSet *includes, ShaderFailure *failure)
+{
+	/*
+	A pixel shader is one of:
+	- bundle.gfsb#name: the shader called name in a bundle of bytecode,
+	- a .cso file holding compiled bytecode,
+	- HLSL source, which gets compiled (or fetched from the cache).
+	Bytecode from bundles and .cso files goes to the driver as it is, without
+	being copied. If includes is given, it gets the files HLSL source
+	included. If failure is given, source that doesn't compile leaves the
+	shader without bytecode and failure saying why, rather than ending the
+	process.
+	*/
+	std::wstring bundle_path, name;
+	if (SplitBundleReference(pixel_shader, &bundle_path, &name)) {
+		std::shared_ptr<ShaderBundle> &bundle = bundles[bundle_path];
+		if (!bundle) {
+			bundle = std::make_shared<ShaderBundle>();
+			if (!bundle->Open(bundle_path)) {
+				std::wcerr << "Could not read shader bundle " << bundle_path << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		const ShaderBundleEntry *entry = bundle->Find(wstring_to_utf8(name));
+		if (!entry) {
+			std::wcerr << "No shader called " << name << " in bundle " << bundle_path << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (!bundle->Verify(*entry)) {
+			std::wcerr << "Shader " << name << " in bundle " << bundle_path << " is corrupt" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		shader.storage = bundle;
+		shader.bytecode = bundle->Bytecode(*entry);
+		shader.bytecode_size = static_cast<size_t>(entry->size);
+		shader.bytecode_hash = entry->hash;
+		return;
+	}
+
+	if (FileExtension(pixel_shader) == L"cso") {
+		std::shared_ptr<FileView> view = std::make_shared<FileView>();
+		if (!view->Open(pixel_shader)) {
+			std::wcerr << "Could not read shader " << pixel_shader << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		shader.storage = view;
+		shader.bytecode = view->Data();
+		shader.bytecode_size = view->Size();
+		shader.bytecode_hash = Xxh64::Hash(shader.bytecode, shader.bytecode_size);
+		return;
+	}
+
+	ID3DBlob *blob = nullptr;
+	CompileShaderFromFile(pixel_shader.c_str(), "main", ("ps_" + g_shaderModel).c_str(), &blob, includes, failure);
+	if (!blob) {
+		return;
+	}
+	shader.storage = std::shared_ptr<void>(blob, [](void *p) { static_cast<ID3DBlob*>(p)->Release(); });
+	shader.bytecode = blob->GetBufferPointer();
+	shader.bytecode_size = blob->GetBufferSize();
+	shader.bytecode_hash = Xxh64::Hash(shader.bytecode, shader.bytecode_size);
+}
+
+std::wstring ShaderName(const std::wstring &pixel_shader)
+{
+	// The name within its bundle, or else the file name without extension.
+	std::wstring bundle_path, name;
+	if (SplitBundleReference(pixel_shader, &bundle_path, &name)) {
+		return name;
+	}
+	size_t slash = pixel_shader.find_last_of(L"/\\");
+	name = slash == std::wstring::npos ? pixel_shader : pixel_shader.substr(slash + 1);
+	size_t dot = name.find_last_of(L'.');
+	return dot == std::wstring::npos ? name : name.substr(0, dot);
+}
+
+const wchar_t *UniformSourcePath(const std::wstring &pixel_shader, Arena &arena)
+{
+	// The path whose uniforms a shader takes. For a shader in a bundle
+	// that's as if it were a file called name next to the bundle.
+	std::wstring bundle_path, name;
+	if (SplitBundleReference(pixel_shader, &bundle_path, &name)) {
+		std::wstring path = JoinPath(DirectoryOf(bundle_path), name + L".cso");
+		return arena.Copy(path.c_str(), path.size());
+	}
+	return pixel_shader.c_str();
+}
+
+int WriteBundle(const std::wstring &path, const std::vector<Job> &jobs)
+{
+	/*
+	Compiles every job's shader and packs the bytecode into a bundle, named
+	after the shaders' file names, for rendering elsewhere with
+	bundle.gfsb#name.
+	*/
+	ShaderBundleWriter writer;
+	if (!writer.Open(path)) {
+		std::wcerr << "Could not open " << path << " for writing" << std::endl;
+		return EXIT_FAILURE;
+	}
+	OpenBundles bundles;
+	for (auto &job : jobs) {
+		PreparedShader shader;
+		PrepareShader(job.pixel_shader, bundles, shader);
+		std::wstring name = ShaderName(job.pixel_shader);
+		if (!writer.Add(wstring_to_utf8(name), shader.bytecode, shader.bytecode_size)) {
+			std::wcerr << "Could not add " << name << " to " << path << " (is the name used twice?)" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	if (!writer.Close()) {
+		std::wcerr << "Could not write " << path << std::endl;
+		return EXIT_FAILURE;
+	}
+	json j = { { "bundle", wstring_to_utf8(path) }, { "shaders", jobs.size() } };
+	PrintJsonLine(j);
+	return EXIT_SUCCESS;
+}
+
+int ConvertUniforms(const std::wstring &format_string, const std::vector<std::wstring> &paths)
+{
+	/*
+	Rewrites existing uniform files in another format, next to the originals.
+	Each path is either a uniform file or a directory, in which case every
+	json file in it is converted.
+	*/
+	UniformFormat format;
+	if (!UniformFormatFromExtension(L"." + format_string, &format)) {
+		std::wcerr << "Unknown uniform format " << format_string <<
+			" expected one of cbor, msgpack, json" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (paths.empty()) {
+		std::wcerr << "--convert-uniforms requires files or directories to convert" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	size_t converted = 0;
+	for (auto &path : paths) {
+		DWORD attributes = GetFileAttributesW(path.c_str());
+		if (attributes == INVALID_FILE_ATTRIBUTES) {
+			std::wcerr << "Could not find " << path << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			if (!ConvertUniformFile(path, format)) {
+				return EXIT_FAILURE;
+			}
+			converted++;
+			continue;
+		}
+
+		WIN32_FIND_DATAW find_data;
+		HANDLE find = FindFirstFileW((path + L"\\*.json").c_str(), &find_data);
+		if (find == INVALID_HANDLE_VALUE) {
+			continue;
+		}
+		do {
+			if (!ConvertUniformFile(path + L"\\" + find_data.cFileName, format)) {
+				FindClose(find);
+				return EXIT_FAILURE;
+			}
+			converted++;
+		} while (FindNextFileW(find, &find_data));
+		FindClose(find);
+	}
+
+	json j = { { "converted", converted } };
+	PrintJsonLine(j);
+	return EXIT_SUCCESS;
+}
+
+bool ConvertUniformFile(const std::wstring &path, UniformFormat to)
+{
+	UniformFormat from;
+	if (!UniformFormatFromExtension(path, &from)) {
+		std::wcerr << "Don't know the uniform format of " << path << std::endl;
+		return false;
+	}
+	if (from == to) {
+		return true;
+	}
+
+	FileView content;
+	if (!content.Open(path)) {
+		std::wcerr << "Could not read " << path << std::endl;
+		return false;
+	}
+	json uniforms;
+	std::vector<uint8_t> bytes(content.Data(), content.Data() + content.Size());
+	switch (from) {
+	case UNIFORM_FORMAT_CBOR:
+		uniforms = json::from_cbor(bytes);
+		break;
+	case UNIFORM_FORMAT_MSGPACK:
+		uniforms = json::from_msgpack(bytes);
+		break;
+	default:
+		uniforms = json::parse(content.Data(), content.Data() + content.Size());
+		break;
+	}
+	switch (to) {
+	case UNIFORM_FORMAT_CBOR:
+		bytes = json::to_cbor(uniforms);
+		break;
+	case UNIFORM_FORMAT_MSGPACK:
+		bytes = json::to_msgpack(uniforms);
+		break;
+	default: {
+		std::string text = uniforms.dump();
+		bytes.assign(text.begin(), text.end());
+		break;
+	}
+	}
+
+	std::wstring output;
+	for (auto &type : UNIFORM_FILE_TYPES) {
+		if (type.format == to) {
+			output = ReplaceExtension(path, type.extension);
+		}
+	}
+	FILE *file = OpenFile(output, "wb");
+	if (!file) {
+		std::wcerr << "Could not open " << output << " for writing" << std::endl;
+		return false;
+	}
+	bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		std::wcerr << "Could not write " << output << std::endl;
+	}
+	return ok;
+}
+
+// Readback backend for ReadbackRing: copies the back buffer into one of a ring
+// of staging textures and uses an event query per slot to find out when the
+// copy has landed, so mapping it never stalls.
+class D3D11ReadbackBackend {
+public:
+	D3D11ReadbackBackend(RenderDevice &dev, ID3D11Texture2D *source, size_t depth)
+		: context_(dev.context.Get()), source_(source), staging_(depth), queries_(depth) {
+		D3D11_TEXTURE2D_DESC desc;
+		source->GetDesc(&desc);
+		desc.BindFlags = 0;
+		desc.MiscFlags = 0;
+		desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+		desc.Usage = D3D11_USAGE_STAGING;
+		width_ = desc.Width;
+		height_ = desc.Height;
+
+		D3D11_QUERY_DESC query_desc;
+		query_desc.Query = D3D11_QUERY_EVENT;
+		query_desc.MiscFlags = 0;
+
+		for (size_t i = 0; i < depth; i++) {
+			checkFail(dev.device->CreateTexture2D(&desc, nullptr, &staging_[i]));
+			checkFail(dev.device->CreateQuery(&query_desc, &queries_[i]));
+		}
+	}
+
+	size_t Depth() const {
+		return staging_.size();
+	}
+
+	void IssueCopy(size_t slot) {
+		context_->CopyResource(staging_[slot].Get(), source_);
+		context_->End(queries_[slot].Get());
+		// Kick the copy off now rather than whenever the driver gets round to it.
+		context_->Flush();
+	}
+
+	bool IsReady(size_t slot) {
+		return context_->GetData(queries_[slot].Get(), nullptr, 0,
+			D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK;
+	}
+
+	ImageView Map(size_t slot) {
+		D3D11_MAPPED_SUBRESOURCE mapped;
+		checkFail(context_->Map(staging_[slot].Get(), 0, D3D11_MAP_READ, 0, &mapped));
+		return { static_cast<const uint8_t*>(mapped.pData), width_, height_, mapped.RowPitch };
+	}
+
+	void Unmap(size_t slot) {
+		context_->Unmap(staging_[slot].Get(), 0);
+	}
+
+private:
+	ID3D11DeviceContext *context_;
+	ID3D11Texture2D *source_;
+	std::vector<ComPtr<ID3D11Texture2D>> staging_;
+	std::vector<ComPtr<ID3D11Query>> queries_;
+	uint32_t width_;
+	uint32_t height_;
+};
+
+// How many compiled shaders may be waiting for the slowest device to get to
+// them.
+const size_t MAX_PREPARED_AHEAD = 64;
+
+// State shared by everything that consumes read back images.
+struct OutputState {
+	ImageArrayWriter image_array;
+	DedupIndex dedup_index;
+	// Only used when rendering on more than one device.
+	std::unique_ptr<DifferentialCollector> differential;
+};
+
+void ProcessImage(std::vector<RenderDevice>&, size_t, const Job&, size_t, const ImageView&, OutputState&,
+	std::map<std::wstring, Image>&);
+void RenderOnDevice(std::vector<RenderDevice>&, size_t, std::vector<Job>&, PreparedJobs<PreparedShader>&,
+	WorkStealingQueues*, OutputState&);
+
+uint64_t RenderMemoKey(const PreparedShader &shader, uint64_t device_fingerprint)
+{
+	/*
+	What the image of a prepared job depends on: the bytecode, less anything
+	that can't change what it draws, the constant buffer, the device and the
+	resolution. Variants whose source differs but compiles to the same code
+	share a key.
+	*/
+	CompileKey key;
+	return key.Add(CanonicalBytecodeHash(shader.bytecode, shader.bytecode_size))
+		.Add(uint64_t(shader.uniforms.found))
+		.Add(&shader.uniforms.constants, sizeof(shader.uniforms.constants))
+		.Add(g_shaderModel.c_str())
+		.Add(device_fingerprint)
+		.Add(uint64_t(WIDTH))
+		.Add(uint64_t(HEIGHT))
+		.Digest();
+}
+
+void RenderJobs(std::vector<RenderDevice> &devices, std::vector<Job> &jobs)
+{
+	/*
+	Render every job on every device and write out the results.
+
+	The main thread compiles each shader once and hands the bytecode to one
+	thread per device, so devices render concurrently with each other and
+	with the compilation of later shaders. Nothing about a device is touched
+	by more than its own thread.
+
+	With --all-adapters each job is rendered once, on whichever device gets
+	to it: prepared jobs go on per-device queues that idle devices steal
+	from, so a fast GPU isn't held up by a slow one.
+
+	With --memo, jobs whose image is already in the memo aren't drawn; the
+	image from the memo goes out in their place.
+
+	With --negative-cache, jobs whose shader doesn't compile, or is known to
+	crash, are reported and passed over. Each device keeps a crash marker
+	naming the last shader it drew, which only goes once every job is done.
+	*/
+	if (jobs.empty()) {
+		return;
+	}
+
+	// The vertex shader never changes, so set it up once per device.
+	Clock::time_point start = Clock::now();
+	ID3DBlob* pVSBlob = nullptr;
+	CompileShaderStr(vertex_shader_source, "main", ("vs_" + g_shaderModel).c_str(), &pVSBlob);
+	for (auto &dev : devices) {
+		InitPipeline(dev, pVSBlob);
+		dev.pixel_shaders.SetCapacity(g_shaderCacheBytes);
+	}
+	pVSBlob->Release();
+	g_phaseSeconds[PHASE_INIT_DEVICE] += SecondsSince(start);
+
+	OutputState state;
+	if (g_imageArray.length() > 0 && !state.image_array.Open(g_imageArray, WIDTH, HEIGHT)) {
+		std::wcerr << "Could not open image array " << g_imageArray <<
+			" (it must be a " << WIDTH << "x" << HEIGHT << " image array if it already exists)" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (g_dedupIndex.length() > 0 && !LoadDedupIndex(g_dedupIndex, state.dedup_index)) {
+		exit(EXIT_FAILURE);
+	}
+	if (devices.size() > 1 && !g_spreadJobs) {
+		state.differential.reset(new DifferentialCollector(jobs.size(), devices.size()));
+	}
+
+	std::unique_ptr<WorkStealingQueues> queues;
+	if (g_spreadJobs) {
+		queues.reset(new WorkStealingQueues(devices.size()));
+	}
+	PreparedJobs<PreparedShader> prepared(jobs.size(), queues ? 1 : devices.size(), MAX_PREPARED_AHEAD);
+	if (g_negativeCache.Enabled()) {
+		for (size_t d = 0; d < devices.size(); d++) {
+			g_crashMarkers.emplace_back(new CrashMarker);
+			if (!g_crashMarkers[d]->Open(CrashMarkerPath(d))) {
+				std::wcerr << "Could not write crash marker " << CrashMarkerPath(d) << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		atexit(ClearCrashMarkers);
+	}
+	std::vector<std::thread> threads;
+	for (size_t d = 0; d < devices.size(); d++) {
+		threads.emplace_back([&devices, d, &jobs, &prepared, &queues, &state] {
+			RenderOnDevice(devices, d, jobs, prepared, queues.get(), state);
+		});
+	}
+
+	uint64_t device_fingerprint = g_renderMemo.Enabled() ? DeviceFingerprint(devices) : 0;
+	OpenBundles bundles;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		PreparedShader shader;
+		ShaderFailure failure;
+		start = Clock::now();
+		PrepareShader(jobs[i].pixel_shader, bundles, shader, g_manifestPath.length() > 0 ? &jobs[i].includes : nullptr,
+			g_negativeCache.Enabled() ? &failure : nullptr);
+		LoadUniforms(UniformSourcePath(jobs[i].pixel_shader, g_jobArena), shader.uniforms, g_jobArena);
+		g_jobArena.Reset();
+		if (g_negativeCache.Enabled()) {
+			const ShaderFailure *crash = nullptr;
+			if (shader.bytecode) {
+				jobs[i].crash_key = CrashKey(shader);
+				crash = g_negativeCache.Find(jobs[i].crash_key, g_includeCache);
+				if (crash) {
+					failure = *crash;
+					failure.cached = true;
+				}
+			}
+			if (!shader.bytecode || crash) {
+				shader.failure = std::make_shared<ShaderFailure>(failure);
+				jobs[i].failed = true;
+				ReportFailure(jobs[i], failure);
+			}
+		}
+		if (g_renderMemo.Enabled() && !shader.failure) {
+			jobs[i].memo_key = RenderMemoKey(shader, device_fingerprint);
+			std::shared_ptr<Image> image = std::make_shared<Image>();
+			if (g_renderMemo.Load(jobs[i].memo_key, image.get())) {
+				shader.memoized = image;
+				jobs[i].memo_hit = true;
+			}
+		}
+		g_phaseSeconds[PHASE_PREPARE_SHADERS] += SecondsSince(start);
+		prepared.Publish(i, std::move(shader));
+		if (queues) {
+			queues->Push(i);
+		}
+	}
+	if (queues) {
+		queues->Close();
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	for (auto &marker : g_crashMarkers) {
+		marker->Remove();
+	}
+	g_crashMarkers.clear();
+	for (auto &dev : devices) {
+		g_phaseSeconds[PHASE_LOAD_SHADERS] += dev.load_seconds;
+		g_phaseSeconds[PHASE_WRITE_IMAGES] += dev.write_seconds;
+		g_phaseSeconds[PHASE_RENDER] += dev.seconds - dev.load_seconds - dev.write_seconds;
+	}
+
+	if (g_imageArray.length() > 0 && !state.image_array.Close()) {
+		std::wcerr << "Could not finish writing image array " << g_imageArray << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (g_dedupIndex.length() > 0 && !SaveDedupIndex(g_dedupIndex, state.dedup_index)) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (devices.size() > 1) {
+		json timings = json::array();
+		for (auto &dev : devices) {
+			json timing = {
+				{ "device", wstring_to_utf8(dev.name) },
+				{ "jobs", dev.jobs },
+				{ "seconds", dev.seconds },
+				{ "shader_cache_hits", dev.pixel_shaders.Hits() },
+				{ "shader_cache_misses", dev.pixel_shaders.Misses() },
+			};
+			if (g_spreadJobs) {
+				timing["stolen_jobs"] = dev.stolen_jobs;
+			}
+			timings.push_back(timing);
+		}
+		json j = { { "timings", timings } };
+		PrintJsonLine(j);
+	}
+}
+
+void RenderOnDevice(std::vector<RenderDevice> &devices, size_t device, std::vector<Job> &jobs,
+	PreparedJobs<PreparedShader> &prepared, WorkStealingQueues *queues, OutputState &state)
+{
+	/*
+	Render every job on one device, or when queues is set, whichever jobs
+	this device gets from them. Readback goes through a ring of staging
+	textures, so while the GPU is copying out one frame we are already
+	encoding the previous one.
+
+	With --negative-cache each frame is read back before the next is drawn
+	instead, so that the crash marker names the shader whose frame is on the
+	device until the device is done with it, and is cleared in between.
+	*/
+	RenderDevice &dev = devices[device];
+	g_threadDevice = device;
+	checkFail(CoInitializeEx(nullptr, COINITBASE_MULTITHREADED));
+
+	// Many jobs tend to share a reference, so only decode each one once.
+	std::map<std::wstring, Image> references;
+
+	ComPtr<ID3D11Texture2D> backBuffer;
+	checkFail(dev.swap_chain->GetBuffer(0, __uuidof(ID3D11Texture2D),
+		reinterpret_cast<LPVOID*>(backBuffer.GetAddressOf())));
+
+	bool marking = !g_crashMarkers.empty();
+	D3D11ReadbackBackend backend(dev, backBuffer.Get(), marking ? 1 : std::min<size_t>(g_readbackDepth, jobs.size()));
+	ReadbackRing<D3D11ReadbackBackend, size_t> ring(backend,
+		[&devices, device, &jobs, &state, &references](const size_t &index, const ImageView &image) {
+		Clock::time_point start = Clock::now();
+		ProcessImage(devices, device, jobs[index], index, image, state, references);
+		devices[device].write_seconds += SecondsSince(start);
+	});
+
+	// Time spent waiting for the compiler isn't this device's fault, so it
+	// is left out.
+	Clock::duration busy = Clock::duration::zero();
+	if (dev.info_queue) {
+		// Whatever setting up the device had to say isn't about any job.
+		dev.info_queue->ClearStoredMessages();
+	}
+	size_t next = 0;
+	auto next_job = [&](size_t *i) {
+		if (queues) {
+			return queues->Pop(device, i);
+		}
+		*i = next++;
+		return *i < jobs.size();
+	};
+	size_t i;
+	while (next_job(&i)) {
+		const PreparedShader &shader = prepared.Wait(i);
+		Clock::time_point start = Clock::now();
+		if (shader.failure) {
+			// Already reported.
+			prepared.Done(i);
+			continue;
+		}
+		if (shader.memoized) {
+			// Nothing to draw. Whatever is in flight goes first, so images
+			// still come out in job order.
+			std::shared_ptr<Image> image = shader.memoized;
+			prepared.Done(i);
+			ring.Flush();
+			Clock::time_point write_start = Clock::now();
+			ProcessImage(devices, device, jobs[i], i, image->View(), state, references);
+			dev.write_seconds += SecondsSince(write_start);
+			busy += Clock::now() - start;
+			dev.jobs++;
+			continue;
+		}
+		if (marking && !g_crashMarkers[device]->Set(jobs[i].crash_key, wstring_to_utf8(jobs[i].pixel_shader))) {
+			std::wcerr << "Could not write crash marker for " << dev.name << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		LoadShaders(dev, shader);
+		dev.load_seconds += SecondsSince(start);
+		prepared.Done(i);
+		RenderFrame(dev);
+		ring.Push(i);
+		if (marking) {
+			ring.Flush();
+			if (!g_crashMarkers[device]->Set(0, std::string())) {
+				std::wcerr << "Could not write crash marker for " << dev.name << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		busy += Clock::now() - start;
+		dev.jobs++;
+		if (dev.info_queue) {
+			ReportDebugMessages(dev, jobs[i], devices.size() > 1);
+		}
+	}
+	Clock::time_point start = Clock::now();
+	ring.Flush();
+	busy += Clock::now() - start;
+	dev.seconds = std::chrono::duration<double>(busy).count();
+	if (queues) {
+		dev.stolen_jobs = queues->Stolen(device);
+	}
+
+	CoUninitialize();
+}
+
+void RecreateDevice(RenderDevice &dev, ID3DBlob *vs_blob)
+{
+	/*
+	Nothing made on a device that has been removed works again, so replace it
+	with a new one of the same kind, on the same adapter.
+	*/
+	std::wstring name = dev.name;
+	D3D_DRIVER_TYPE driver_type = dev.driver_type;
+	ComPtr<IDXGIDevice> dxgi_device;
+	ComPtr<IDXGIAdapter> adapter;
+	if (driver_type == D3D_DRIVER_TYPE_HARDWARE && SUCCEEDED(dev.device.As(&dxgi_device))) {
+		dxgi_device->GetAdapter(&adapter);
+	}
+	DestroyWindow(dev.hwnd);
+	dev = RenderDevice();
+	checkFail(InitDevice(dev, 1, &driver_type, adapter.Get()));
+	dev.name = name;
+	InitPipeline(dev, vs_blob);
+	dev.pixel_shaders.SetCapacity(g_shaderCacheBytes);
+}
+
+HRESULT DrawOnce(RenderDevice &dev, D3D11ReadbackBackend &readback, const PreparedShader &shader, Image *image)
+{
+	/*
+	Draw one shader and wait for its image, for --reduce. Unlike the batch
+	path this hands D3D's failures back rather than giving up, as a shader
+	the driver rejects, or that loses the device, may be just what is being
+	looked for.
+	*/
+	if (!dev.pixel_shaders.Find(shader.bytecode_hash)) {
+		ComPtr<ID3D11PixelShader> pixel_shader;
+		HRESULT hr = dev.device->CreatePixelShader(shader.bytecode, shader.bytecode_size, nullptr, &pixel_shader);
+		if (FAILED(hr)) {
+			return hr;
+		}
+		dev.pixel_shaders.Insert(shader.bytecode_hash, pixel_shader, shader.bytecode_size);
+	}
+	LoadShaders(dev, shader);
+	RenderFrame(dev);
+	readback.IssueCopy(0);
+	while (!readback.IsReady(0)) {
+		HRESULT hr = dev.device->GetDeviceRemovedReason();
+		if (FAILED(hr)) {
+			return hr;
+		}
+		std::this_thread::yield();
+	}
+	HRESULT hr = dev.device->GetDeviceRemovedReason();
+	if (FAILED(hr)) {
+		return hr;
+	}
+	ImageView view = readback.Map(0);
+	image->width = view.width;
+	image->height = view.height;
+	image->pixels.resize(view.PackedSize());
+	for (uint32_t y = 0; y < view.height; y++) {
+		memcpy(&image->pixels[y * view.PackedRowSize()], view.Row(y), view.PackedRowSize());
+	}
+	readback.Unmap(0);
+	return S_OK;
+}
+
+std::string FirstErrorCode(const std::string &errors)
+{
+	// The X3004 of "error X3004: undeclared identifier", or nothing.
+	size_t error = errors.find("error X");
+	if (error == std::string::npos) {
+		return std::string();
+	}
+	size_t begin = error + 6;
+	size_t end = begin + 1;
+	while (end < errors.size() && isdigit(static_cast<unsigned char>(errors[end]))) {
+		end++;
+	}
+	return errors.substr(begin, end - begin);
+}
+
+int ReduceShader(std::vector<RenderDevice> &devices, const std::wstring &pixel_shader, const std::wstring &output,
+	ReduceTarget target)
+{
+	/*
+	--reduce: cut pixel_shader down to as little as still shows the problem,
+	by delta debugging (see DeltaDebug.h), and write that to output. It all
+	happens in this process, so each of the thousands of candidates costs a
+	compile and a draw on devices that are already set up, rather than a
+	process, a window and a device. The problem is one of:
+	- compile: failing to compile with the same first error code (X3004 and
+	  so on) as the original,
+	- crash: the driver rejecting the bytecode, or the device being removed
+	  while drawing it, after which the device is made again,
+	- mismatch: the devices not all drawing the same image, within
+	  --compare-tolerance and --compare-max-percent.
+	Candidates are compiled on this thread, through the bytecode cache if
+	there is one. With several devices, crash candidates are drawn on them
+	in parallel, one each; a mismatch candidate goes to all of them at once.
+	*/
+	Clock::time_point start = Clock::now();
+	FileView source;
+	std::wstring bundle, name;
+	if (FileExtension(pixel_shader) == L"cso" || SplitBundleReference(pixel_shader, &bundle, &name) ||
+		!source.Open(pixel_shader)) {
+		std::wcerr << "--reduce needs HLSL source, and could not read " << pixel_shader << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::string original(source.Data(), source.Size());
+	std::string source_name = wstring_to_utf8(pixel_shader);
+	std::string profile = "ps_" + g_shaderModel;
+	Uniforms uniforms;
+	LoadUniforms(UniformSourcePath(pixel_shader, g_jobArena), uniforms, g_jobArena);
+	g_jobArena.Reset();
+
+	ComPtr<ID3DBlob> vs_blob;
+	CompileShaderStr(vertex_shader_source, "main", ("vs_" + g_shaderModel).c_str(), vs_blob.GetAddressOf());
+	std::vector<ComPtr<ID3D11Texture2D>> back_buffers(devices.size());
+	std::vector<std::unique_ptr<D3D11ReadbackBackend>> readbacks(devices.size());
+	auto set_up = [&](size_t d) {
+		checkFail(devices[d].swap_chain->GetBuffer(0, __uuidof(ID3D11Texture2D),
+			reinterpret_cast<LPVOID*>(back_buffers[d].ReleaseAndGetAddressOf())));
+		readbacks[d].reset(new D3D11ReadbackBackend(devices[d], back_buffers[d].Get(), 1));
+	};
+	for (size_t d = 0; d < devices.size(); d++) {
+		InitPipeline(devices[d], vs_blob.Get());
+		devices[d].pixel_shaders.SetCapacity(g_shaderCacheBytes);
+		set_up(d);
+	}
+	auto recreate = [&](size_t d) {
+		readbacks[d].reset();
+		back_buffers[d].Reset();
+		RecreateDevice(devices[d], vs_blob.Get());
+		set_up(d);
+	};
+
+	std::string error_code;
+	auto compile = [&](const std::string &candidate, PreparedShader *shader, ShaderFailure *failure) {
+		ID3DBlob *blob = nullptr;
+		CompileShaderBytes(candidate.data(), candidate.size(), source_name.c_str(), "main", profile.c_str(), &blob,
+			nullptr, failure);
+		if (!blob) {
+			return false;
+		}
+		shader->storage = std::shared_ptr<void>(blob, [](void *p) { static_cast<ID3DBlob*>(p)->Release(); });
+		shader->bytecode = blob->GetBufferPointer();
+		shader->bytecode_size = blob->GetBufferSize();
+		shader->bytecode_hash = Xxh64::Hash(shader->bytecode, shader->bytecode_size);
+		shader->uniforms = uniforms;
+		return true;
+	};
+
+	auto test = [&](const std::vector<std::string> &candidates) {
+		std::vector<PreparedShader> shaders(candidates.size());
+		std::vector<bool> compiled(candidates.size());
+		for (size_t i = 0; i < candidates.size(); i++) {
+			ShaderFailure failure;
+			compiled[i] = compile(candidates[i], &shaders[i], &failure);
+			if (target == REDUCE_TARGET_COMPILE && !compiled[i] && FirstErrorCode(failure.message) == error_code) {
+				return i;
+			}
+		}
+		if (target == REDUCE_TARGET_CRASH) {
+			// One candidate per device.
+			std::vector<HRESULT> results(candidates.size(), S_OK);
+			std::vector<std::thread> threads;
+			for (size_t i = 0; i < candidates.size(); i++) {
+				if (compiled[i]) {
+					threads.emplace_back([&devices, &readbacks, &shaders, &results, i] {
+						Image image;
+						results[i] = DrawOnce(devices[i], *readbacks[i], shaders[i], &image);
+					});
+				}
+			}
+			for (auto &thread : threads) {
+				thread.join();
+			}
+			size_t hit = candidates.size();
+			for (size_t i = 0; i < candidates.size(); i++) {
+				if (FAILED(results[i])) {
+					recreate(i);
+					hit = std::min(hit, i);
+				}
+			}
+			return hit;
+		}
+		if (target == REDUCE_TARGET_MISMATCH) {
+			for (size_t i = 0; i < candidates.size(); i++) {
+				if (!compiled[i]) {
+					continue;
+				}
+				std::vector<Image> images(devices.size());
+				std::vector<HRESULT> results(devices.size(), S_OK);
+				std::vector<std::thread> threads;
+				for (size_t d = 0; d < devices.size(); d++) {
+					threads.emplace_back([&devices, &readbacks, &shaders, &images, &results, i, d] {
+						results[d] = DrawOnce(devices[d], *readbacks[d], shaders[i], &images[d]);
+					});
+				}
+				for (auto &thread : threads) {
+					thread.join();
+				}
+				// A device that fell over says nothing about the images.
+				bool drawn = true;
+				for (size_t d = 0; d < devices.size(); d++) {
+					if (FAILED(results[d])) {
+						recreate(d);
+						drawn = false;
+					}
+				}
+				std::vector<ImageView> views;
+				for (auto &image : images) {
+					views.push_back(image.View());
+				}
+				if (drawn && GroupMatchingImages(views, static_cast<uint8_t>(g_compareTolerance),
+					g_compareMaxPercent).size() > 1) {
+					return i;
+				}
+			}
+		}
+		return candidates.size();
+	};
+
+	if (target == REDUCE_TARGET_COMPILE) {
+		PreparedShader shader;
+		ShaderFailure failure;
+		if (compile(original, &shader, &failure)) {
+			std::wcerr << pixel_shader << " compiles, so there is no error to keep" << std::endl;
+			return EXIT_FAILURE;
+		}
+		error_code = FirstErrorCode(failure.message);
+	}
+	if (test(std::vector<std::string>(1, original)) != 0) {
+		std::wcerr << pixel_shader << " doesn't show the problem to begin with" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	size_t width = target == REDUCE_TARGET_CRASH ? devices.size() : 1;
+	DeltaDebugger reducer(test, width, [](ReduceGranularity granularity, const std::string &current) {
+		json j = {
+			{ "reduce_pass", granularity == REDUCE_LINES ? "lines" : "tokens" },
+			{ "bytes", current.size() },
+		};
+		PrintJsonLine(j);
+	});
+	std::string reduced = reducer.Reduce(original);
+
+	if (!WriteFileReplacing(output, reduced.data(), reduced.size())) {
+		std::wcerr << "Could not write " << output << std::endl;
+		return EXIT_FAILURE;
+	}
+	json j = {
+		{ "reduced", {
+			{ "output", wstring_to_utf8(output) },
+			{ "original_bytes", original.size() },
+			{ "bytes", reduced.size() },
+			{ "tests", reducer.GetStats().tests },
+			{ "remembered", reducer.GetStats().remembered },
+			{ "passes", reducer.GetStats().passes },
+			{ "seconds", SecondsSince(start) },
+		} },
+	};
+	PrintJsonLine(j);
+	return EXIT_SUCCESS;
+}
 
-			std::wcerr << "Unknown argument " << curr_arg << std::endl;
-			return EXIT_FAILURE;
+void ReportDebugMessages(RenderDevice &dev, const Job &job, bool several_devices)
+{
+	/*
+	Move whatever the debug layer has said since the last job into the
+	device's ring and print it as a line of JSON, if there was anything.
+	Messages about reading back earlier jobs' images can end up here too,
+	as those happen while this job is in flight.
+	*/
+	UINT64 count = dev.info_queue->GetNumStoredMessages();
+	for (UINT64 m = 0; m < count; m++) {
+		SIZE_T length = 0;
+		if (FAILED(dev.info_queue->GetMessage(m, nullptr, &length))) {
+			continue;
 		}
-		if (pixel_shader.length() == 0) {
-			pixel_shader = curr_arg;
+		if (dev.message_buffer.size() < length) {
+			dev.message_buffer.resize(length);
 		}
-		else {
-			std::wcerr << "Ignoring extra argument " << curr_arg << std::endl;
+		D3D11_MESSAGE *message = reinterpret_cast<D3D11_MESSAGE*>(dev.message_buffer.data());
+		if (SUCCEEDED(dev.info_queue->GetMessage(m, message, &length))) {
+			dev.debug_messages.Push(message->Severity, message->Category, message->ID, message->pDescription,
+				message->DescriptionByteLength);
 		}
 	}
+	dev.info_queue->ClearStoredMessages();
 
-	if (!print_adapter_info && (pixel_shader.length() == 0)) {
-		std::wcerr << "Requires pixel shader argument or --get-info" << std::endl;
-		return EXIT_FAILURE;
-	}
-	if (print_adapter_info && (pixel_shader.length() > 0)) {
-		std::wcerr << "Cannot specify both --get-info and pixel shader argument" << std::endl;
-		return EXIT_FAILURE;
+	if (!dev.debug_messages.Empty()) {
+		PrintJsonLine(DebugMessagesJson(wstring_to_utf8(job.pixel_shader),
+			several_devices ? wstring_to_utf8(dev.name) : std::string(), dev.debug_messages));
 	}
+	dev.debug_messages.Clear();
+}
 
-	checkFail(CoInitializeEx(nullptr, COINITBASE_MULTITHREADED));
+void ProcessImage(std::vector<RenderDevice> &devices, size_t device, const Job &job, size_t index,
+	const ImageView &image, OutputState &state, std::map<std::wstring, Image> &references)
+{
+	/*
+	Do whatever was asked for with one read back image. This runs on the
+	device's own thread, so anything shared between devices has to be safe
+	for that (which is why --dedup and --image-array need a single device).
+	*/
+	const RenderDevice &dev = devices[device];
+	bool several_devices = devices.size() > 1;
+	// Whether this job is being rendered on the other devices too.
+	bool every_device = several_devices && !g_spreadJobs;
+
+	if (job.memo_key != 0 && !job.memo_hit) {
+		// Only a miss if it fails.
+		g_renderMemo.Store(job.memo_key, image);
+	}
 
-	if (force_driver_type == D3D_DRIVER_TYPE_UNKNOWN) {
-		D3D_DRIVER_TYPE driverTypes[] =
-		{
-			D3D_DRIVER_TYPE_HARDWARE,
-			D3D_DRIVER_TYPE_WARP,
-			D3D_DRIVER_TYPE_REFERENCE,
+	if (job.reference.length() > 0) {
+		CompareToReference(job, several_devices ? dev.name : std::wstring(), image, references);
+	}
+	if (g_hashOnly) {
+		json j = {
+			{ "shader", wstring_to_utf8(job.pixel_shader) },
+			{ "hash", HashToHex(HashImage(image)) },
 		};
-		UINT numDriverTypes = ARRAYSIZE(driverTypes);
-
-		checkFail(InitDevice(numDriverTypes, driverTypes));
+		if (several_devices) {
+			j["device"] = wstring_to_utf8(dev.name);
+		}
+		PrintJsonLine(j);
+	}
+	else if (g_dedupIndex.length() > 0) {
+		if (state.dedup_index.Add(HashImage(image), wstring_to_utf8(job.output))) {
+			WriteImage(image, job.output);
+		}
+	}
+	else if (g_imageArray.length() > 0) {
+		uint64_t array_index;
+		if (!state.image_array.Append(image, &array_index)) {
+			std::wcerr << "Could not append to image array " << g_imageArray << std::endl;
+			exit(EXIT_FAILURE);
+		}
 	}
 	else {
-		checkFail(InitDevice(1, &force_driver_type));
+		WriteImage(image, every_device ? DeviceOutputPath(job.output, dev.name) : job.output);
+		if (g_manifestPath.length() > 0) {
+			g_manifest.Record(job.output, job.input_key, job.includes);
+		}
 	}
 
-	json uniform_data;
+	if (every_device && state.differential->Add(index, device, image)) {
+		// This was the last device to finish the job, so report who disagrees.
+		auto groups = state.differential->Compare(index, static_cast<uint8_t>(g_compareTolerance),
+			g_compareMaxPercent);
+		json groups_json = json::array();
+		for (auto &group : groups) {
+			json names = json::array();
+			for (size_t d : group) {
+				names.push_back(wstring_to_utf8(devices[d].name));
+			}
+			groups_json.push_back(names);
+		}
+		json j = {
+			{ "shader", wstring_to_utf8(job.pixel_shader) },
+			{ "agree", groups.size() == 1 },
+			{ "groups", groups_json },
+		};
+		PrintJsonLine(j);
+		state.differential->Release(index);
+		if (g_journal.IsOpen()) {
+			RecordDone(job, j);
+		}
+	}
+	else if (!every_device && g_journal.IsOpen()) {
+		json j = {
+			{ "shader", wstring_to_utf8(job.pixel_shader) },
+			{ "hash", HashToHex(HashImage(image)) },
+		};
+		RecordDone(job, j);
+	}
+}
 
-	if (print_adapter_info) {
-		PrintDeviceInfo();
-		return EXIT_SUCCESS;
+std::wstring DeviceOutputPath(const std::wstring &output, const std::wstring &device_name)
+{
+	// out.png becomes out.warp.png, so each device gets its own file.
+	size_t dot = output.find_last_of(L'.');
+	size_t slash = output.find_last_of(L"/\\");
+	if (dot == std::wstring::npos || (slash != std::wstring::npos && slash > dot)) {
+		return output + L"." + device_name;
 	}
+	return output.substr(0, dot) + L"." + device_name + output.substr(dot);
+}
+
+void PrintJsonLine(const json &j)
+{
+	std::lock_guard<std::mutex> lock(g_stdoutMutex);
+	std::cout << j.dump() << std::endl;
+}
 
+double SecondsSince(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
 
-	assert(pixel_shader.size() > 0);
-	std::wstring jsonFilename(pixel_shader);
-	jsonFilename.replace(jsonFilename.end() - 4, jsonFilename.end(), L"json");
-	std::string jsonContent;
-	if (readFile(jsonFilename, jsonContent)) {
-		uniform_data = json::parse(jsonContent);
+double SecondsSinceProcessStart()
+{
+	/*
+	How long the process took to get as far as wmain: loading the executable
+	and its DLLs and running static initializers. The system clock only
+	ticks every few milliseconds, so this is rough.
+	*/
+	FILETIME creation, exit_time, kernel_time, user_time, now;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit_time, &kernel_time, &user_time)) {
+		return 0.0;
+	}
+	GetSystemTimeAsFileTime(&now);
+	ULARGE_INTEGER created, current;
+	created.LowPart = creation.dwLowDateTime;
+	created.HighPart = creation.dwHighDateTime;
+	current.LowPart = now.dwLowDateTime;
+	current.HighPart = now.dwHighDateTime;
+	if (current.QuadPart < created.QuadPart) {
+		return 0.0;
 	}
+	// FILETIMEs count 100ns intervals.
+	return static_cast<double>(current.QuadPart - created.QuadPart) / 1e7;
+}
 
-	OutputPixelShader(pixel_shader, uniform_data, output);
+void PrintTimings(size_t job_count, size_t device_count, double total_seconds)
+{
+	json phases = json::object();
+	for (int phase = 0; phase < PHASE_COUNT; phase++) {
+		phases[PHASE_NAMES[phase]] = g_phaseSeconds[phase];
+	}
+	json j = {
+		{ "jobs", job_count },
+		{ "devices", device_count },
+		{ "total_seconds", total_seconds },
+		{ "phase_seconds", phases },
+		{ "job_arena", {
+			{ "allocations", g_jobArena.Allocations() },
+			{ "bytes", g_jobArena.BytesAllocated() },
+			{ "heap_allocations", g_jobArena.HeapAllocations() },
+			{ "capacity", g_jobArena.Capacity() },
+		} },
+	};
+	if (g_renderMemo.Enabled()) {
+		j["render_memo"] = {
+			{ "hits", g_renderMemo.Hits() },
+			{ "misses", g_renderMemo.Misses() },
+		};
+	}
+	if (g_negativeCache.Enabled()) {
+		j["negative_cache"] = {
+			{ "hits", g_negativeCache.Hits() },
+			{ "entries", g_negativeCache.Size() },
+		};
+	}
+	PrintJsonLine(j);
+}
 
-	return EXIT_SUCCESS;
+void CompareToReference(const Job &job, const std::wstring &device_name, const ImageView &image,
+	std::map<std::wstring, Image> &references)
+{
+	/*
+	Compare a freshly read back image with the job's reference and print the
+	result as a line of JSON. device_name is only set when rendering on more
+	than one device.
+	*/
+	auto it = references.find(job.reference);
+	if (it == references.end()) {
+		it = references.insert(std::make_pair(job.reference, Image())).first;
+		DecodeImage(job.reference, it->second);
+	}
+	const Image &reference = it->second;
+	if (reference.width != image.width || reference.height != image.height) {
+		std::wcerr << "Reference image " << job.reference << " is " << reference.width << "x" << reference.height
+			<< " but the rendered image is " << image.width << "x" << image.height << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	CompareResult result = CompareImages(image, reference.View(), static_cast<uint8_t>(g_compareTolerance));
+	json j = {
+		{ "shader", wstring_to_utf8(job.pixel_shader) },
+		{ "reference", wstring_to_utf8(job.reference) },
+		{ "match", result.PercentDiffering() <= g_compareMaxPercent },
+		{ "differing_pixels", result.differing_pixels },
+		{ "percent_differing", result.PercentDiffering() },
+		{ "max_diff", result.max_diff },
+	};
+	if (device_name.length() > 0) {
+		j["device"] = wstring_to_utf8(device_name);
+	}
+	PrintJsonLine(j);
+
+	if (job.heatmap.length() > 0) {
+		Image heatmap;
+		heatmap.width = image.width;
+		heatmap.height = image.height;
+		DiffHeatmap(image, reference.View(), static_cast<uint8_t>(g_compareTolerance), heatmap.pixels);
+		WriteImage(heatmap.View(),
+			device_name.length() > 0 ? DeviceOutputPath(job.heatmap, device_name) : job.heatmap);
+	}
+}
+
+void DecodeImage(const std::wstring &path, Image &image)
+{
+	// Decode anything WIC understands into tightly packed RGBA8.
+	ComPtr<IWICImagingFactory> factory;
+	checkFail(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory)));
+
+	ComPtr<IWICBitmapDecoder> decoder;
+	HRESULT hr = factory->CreateDecoderFromFilename(path.c_str(), nullptr, GENERIC_READ,
+		WICDecodeMetadataCacheOnDemand, &decoder);
+	if (FAILED(hr)) {
+		std::wcerr << "Could not read image " << path << std::endl;
+		checkFail(hr);
+	}
+	ComPtr<IWICBitmapFrameDecode> frame;
+	checkFail(decoder->GetFrame(0, &frame));
+	checkFail(frame->GetSize(&image.width, &image.height));
+
+	ComPtr<IWICFormatConverter> converter;
+	checkFail(factory->CreateFormatConverter(&converter));
+	checkFail(converter->Initialize(frame.Get(), GUID_WICPixelFormat32bppRGBA, WICBitmapDitherTypeNone,
+		nullptr, 0, WICBitmapPaletteTypeCustom));
+
+	image.pixels.resize(static_cast<size_t>(image.width) * image.height * 4);
+	checkFail(converter->CopyPixels(nullptr, image.width * 4, static_cast<UINT>(image.pixels.size()),
+		image.pixels.data()));
 }
 
-void OutputPixelShader(std::wstring &pixel_shader, json& uniform_data, std::wstring &output)
+bool LoadDedupIndex(const std::wstring &path, DedupIndex &index)
 {
 	/*
-	Take our pixel shader and write it to an output image as a PNG.
+	The index is a JSON object mapping each image hash (16 hex digits) to the
+	outputs that produced it, the first of which is the one on disk. A missing
+	file is just an empty index.
 	*/
+	FileView content;
+	if (!content.Open(path)) {
+		return true;
+	}
+	json index_json = json::parse(content.Data(), content.Data() + content.Size());
+	if (!index_json.is_object()) {
+		std::wcerr << "Dedup index " << path << " should contain a JSON object" << std::endl;
+		return false;
+	}
+	for (auto it = index_json.begin(); it != index_json.end(); ++it) {
+		uint64_t hash;
+		if (!HexToHash(it.key(), &hash) || !it.value().is_array()) {
+			std::wcerr << "Malformed entry in dedup index " << path << std::endl;
+			return false;
+		}
+		for (auto &output : it.value()) {
+			if (!output.is_string()) {
+				std::wcerr << "Malformed entry in dedup index " << path << std::endl;
+				return false;
+			}
+			index.Add(hash, output.get<std::string>());
+		}
+	}
+	return true;
+}
+
+bool SaveDedupIndex(const std::wstring &path, const DedupIndex &index)
+{
+	json index_json = json::object();
+	for (auto &entry : index.Entries()) {
+		index_json[HashToHex(entry.first)] = entry.second;
+	}
+	std::string text = index_json.dump(4) + "\n";
+	if (!WriteFileReplacing(path, text.data(), text.size())) {
+		std::wcerr << "Could not write dedup index " << path << std::endl;
+		return false;
+	}
+	return true;
+}
 
-	LoadShaders(pixel_shader, uniform_data);
+void WriteImage(const ImageView &image, const std::wstring &output)
+{
+	OutputFormat format = g_outputFormat;
+	if (format == OUTPUT_FORMAT_AUTO) {
+		std::wstring extension = FileExtension(output);
+		if (extension == L"ppm") {
+			format = OUTPUT_FORMAT_PPM;
+		}
+		else if (extension == L"rgba" || extension == L"raw") {
+			format = OUTPUT_FORMAT_RGBA;
+		}
+		else {
+			format = OUTPUT_FORMAT_PNG;
+		}
+	}
+
+	bool ok = true;
+	switch (format) {
+	case OUTPUT_FORMAT_PPM:
+		ok = WritePpm(image, output);
+		break;
+	case OUTPUT_FORMAT_RGBA:
+		ok = WriteRawRgba(image, output);
+		break;
+	default:
+		SavePng(image, output);
+		break;
+	}
+	if (!ok) {
+		std::wcerr << "Could not write output " << output << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
 
-	g_pImmediateContext->ClearRenderTargetView(g_pRenderTargetView, Colors::MidnightBlue);
+void RenderFrame(RenderDevice &dev)
+{
+	dev.context->ClearRenderTargetView(dev.render_target_view.Get(), Colors::MidnightBlue);
 
-	g_pImmediateContext->VSSetShader(g_pVertexShader, nullptr, 0);
-	g_pImmediateContext->PSSetShader(g_pPixelShader, nullptr, 0);
-	g_pImmediateContext->Draw(3, 0);
-	g_pImmediateContext->Draw(3, 3);
+	dev.context->VSSetShader(dev.vertex_shader.Get(), nullptr, 0);
+	dev.context->PSSetShader(dev.pixel_shader.Get(), nullptr, 0);
+	dev.context->Draw(3, 0);
+	dev.context->Draw(3, 3);
 
 	// Present the information rendered to the back buffer to the front buffer (the screen)
-	g_pSwapChain->Present(0, 0);
+	dev.swap_chain->Present(0, 0);
+}
 
-	ComPtr<ID3D11Texture2D> backBuffer;
-	checkFail(g_pSwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D),
-		reinterpret_cast<LPVOID*>(backBuffer.GetAddressOf())));
-	checkFail(SaveWICTextureToFile(g_pImmediateContext, backBuffer.Get(),
-		GUID_ContainerFormatPng, output.c_str()));
+void SavePng(const ImageView &image, const std::wstring &output)
+{
+	/*
+	Encode RGBA8 pixels straight out of a mapped staging texture as a PNG.
+
+	This does the same job as DirectXTK's SaveWICTextureToFile, except that
+	function insists on making (and synchronously mapping) its own staging
+	copy of a texture, which is exactly what the readback ring is avoiding.
+	*/
+	// The factory is free threaded, so every device's thread can share it.
+	static ComPtr<IWICImagingFactory> factory = [] {
+		ComPtr<IWICImagingFactory> f;
+		checkFail(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&f)));
+		return f;
+	}();
+
+	ComPtr<IWICStream> stream;
+	checkFail(factory->CreateStream(&stream));
+	checkFail(stream->InitializeFromFilename(output.c_str(), GENERIC_WRITE));
+
+	ComPtr<IWICBitmapEncoder> encoder;
+	checkFail(factory->CreateEncoder(GUID_ContainerFormatPng, nullptr, &encoder));
+	checkFail(encoder->Initialize(stream.Get(), WICBitmapEncoderNoCache));
+
+	ComPtr<IWICBitmapFrameEncode> frame;
+	ComPtr<IPropertyBag2> properties;
+	checkFail(encoder->CreateNewFrame(&frame, &properties));
+	checkFail(frame->Initialize(properties.Get()));
+	checkFail(frame->SetSize(image.width, image.height));
+
+	WICPixelFormatGUID format = GUID_WICPixelFormat32bppRGBA;
+	checkFail(frame->SetPixelFormat(&format));
+	UINT size = image.row_pitch * image.height;
+	if (IsEqualGUID(format, GUID_WICPixelFormat32bppRGBA)) {
+		checkFail(frame->WritePixels(image.height, image.row_pitch, size, const_cast<BYTE*>(image.data)));
+	}
+	else {
+		// Older versions of the PNG encoder can't take RGBA directly, so let
+		// WIC convert to whatever it asked for instead.
+		ComPtr<IWICBitmap> source;
+		checkFail(factory->CreateBitmapFromMemory(image.width, image.height, GUID_WICPixelFormat32bppRGBA,
+			image.row_pitch, size, const_cast<BYTE*>(image.data), &source));
+		ComPtr<IWICFormatConverter> converter;
+		checkFail(factory->CreateFormatConverter(&converter));
+		checkFail(converter->Initialize(source.Get(), format, WICBitmapDitherTypeNone, nullptr, 0,
+			WICBitmapPaletteTypeCustom));
+		checkFail(frame->WriteSource(converter.Get(), nullptr));
+	}
+
+	checkFail(frame->Commit());
+	checkFail(encoder->Commit());
 }
 
 struct SimpleVertex
@@ -184,7 +2578,7 @@ const char* vertex_shader_source =
 
 
 
-HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
+HRESULT InitDevice(RenderDevice &dev, UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes, IDXGIAdapter *adapter)
 {
 	/*
 	This function does all the set up we need to actually produce our image.
@@ -192,9 +2586,12 @@ HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
 	It's very much cobbled together from tutorials and I'd be lying if I said I fully
 	understood it.
 
+	When adapter is set the device is created on it, and driverTypes only
+	decides what the device is called.
 	*/
 	HINSTANCE hInstance = GetModuleHandle(NULL);
-	// Register class
+	// Register class (just the once, however many devices we create)
+	static bool registered = false;
 	WNDCLASSEX wcex;
 	wcex.cbSize = sizeof(WNDCLASSEX);
 	wcex.style = CS_HREDRAW | CS_VREDRAW;
@@ -208,8 +2605,9 @@ HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
 	wcex.lpszMenuName = nullptr;
 	wcex.lpszClassName = L"GetImageHLSL";
 	wcex.hIconSm = NULL;
-	if (!RegisterClassEx(&wcex))
+	if (!registered && !RegisterClassEx(&wcex))
 		return E_FAIL;
+	registered = true;
 
 	RECT rc = { 0, 0, WIDTH, HEIGHT };
 	AdjustWindowRect(&rc, WS_OVERLAPPEDWINDOW, FALSE);
@@ -218,16 +2616,16 @@ HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
 	// should - it does if we try to compile this as a windows app rather than a 
 	// command line one - but it doesn't. Fortunately that's exactly what we want!
 	// But this is still surprising.
-	g_hWnd = CreateWindow(L"GetImageHLSL", L"You probably should never see this",
+	dev.hwnd = CreateWindow(L"GetImageHLSL", L"You probably should never see this",
 		WS_OVERLAPPEDWINDOW,
 		CW_USEDEFAULT, CW_USEDEFAULT, rc.right - rc.left, rc.bottom - rc.top, nullptr, nullptr, hInstance,
 		nullptr);
-	if (!g_hWnd)
+	if (!dev.hwnd)
 		return E_FAIL;
 
 	HRESULT hr = S_OK;
 
-	UINT createDeviceFlags = D3D11_CREATE_DEVICE_DEBUG;
+	UINT createDeviceFlags = g_debugLayer ? D3D11_CREATE_DEVICE_DEBUG : 0;
 
 
 	D3D_FEATURE_LEVEL featureLevels[] =
@@ -241,15 +2639,17 @@ HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
 
 	for (UINT driverTypeIndex = 0; driverTypeIndex < numDriverTypes; driverTypeIndex++)
 	{
-		g_driverType = driverTypes[driverTypeIndex];
-		hr = D3D11CreateDevice(nullptr, g_driverType, nullptr, createDeviceFlags, featureLevels, numFeatureLevels,
-			D3D11_SDK_VERSION, &g_pd3dDevice, &g_featureLevel, &g_pImmediateContext);
+		dev.driver_type = driverTypes[driverTypeIndex];
+		// D3D11CreateDevice insists on an unknown driver type given an adapter.
+		D3D_DRIVER_TYPE createType = adapter ? D3D_DRIVER_TYPE_UNKNOWN : dev.driver_type;
+		hr = D3D11CreateDevice(adapter, createType, nullptr, createDeviceFlags, featureLevels, numFeatureLevels,
+			D3D11_SDK_VERSION, &dev.device, &dev.feature_level, &dev.context);
 
 		if (hr == E_INVALIDARG)
 		{
 			// DirectX 11.0 platforms will not recognize D3D_FEATURE_LEVEL_11_1 so we need to retry without it
-			hr = D3D11CreateDevice(nullptr, g_driverType, nullptr, createDeviceFlags, &featureLevels[1], numFeatureLevels - 1,
-				D3D11_SDK_VERSION, &g_pd3dDevice, &g_featureLevel, &g_pImmediateContext);
+			hr = D3D11CreateDevice(adapter, createType, nullptr, createDeviceFlags, &featureLevels[1], numFeatureLevels - 1,
+				D3D11_SDK_VERSION, &dev.device, &dev.feature_level, &dev.context);
 		}
 
 		if (SUCCEEDED(hr)) {
@@ -257,12 +2657,18 @@ HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
 		}
 	}
 	checkFail(hr);
+	dev.name = DriverName(dev.driver_type);
+
+	if (g_debugLayer) {
+		checkFail(dev.device.As(&dev.info_queue));
+		dev.debug_messages = MessageRing(DEBUG_MESSAGE_CAPACITY);
+	}
 
-	// Obtain DXGI factory from device (since we used nullptr for pAdapter above)
+	// Obtain DXGI factory from device (whichever adapter it ended up on)
 	IDXGIFactory1* dxgiFactory = nullptr;
 	{
 		IDXGIDevice* dxgiDevice = nullptr;
-		hr = g_pd3dDevice->QueryInterface(__uuidof(IDXGIDevice), reinterpret_cast<void**>(&dxgiDevice));
+		hr = dev.device->QueryInterface(__uuidof(IDXGIDevice), reinterpret_cast<void**>(&dxgiDevice));
 		if (SUCCEEDED(hr))
 		{
 			IDXGIAdapter* adapter = nullptr;
@@ -280,10 +2686,10 @@ HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
 	if (dxgiFactory2)
 	{
 		// DirectX 11.1 or later
-		hr = g_pd3dDevice->QueryInterface(__uuidof(ID3D11Device1), reinterpret_cast<void**>(g_pd3dDevice1));
+		hr = dev.device.As(&dev.device1);
 		if (SUCCEEDED(hr))
 		{
-			(void)g_pImmediateContext->QueryInterface(__uuidof(ID3D11DeviceContext1), reinterpret_cast<void**>(&g_pImmediateContext1));
+			(void)dev.context.As(&dev.context1);
 		}
 
 		DXGI_SWAP_CHAIN_DESC1 sd;
@@ -296,8 +2702,8 @@ HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
 		sd.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
 		sd.BufferCount = 1;
 
-		checkFail(dxgiFactory2->CreateSwapChainForHwnd(g_pd3dDevice, g_hWnd, &sd, nullptr, nullptr, &g_pSwapChain1));
-		checkFail(g_pSwapChain1->QueryInterface(__uuidof(IDXGISwapChain), reinterpret_cast<void**>(&g_pSwapChain)));
+		checkFail(dxgiFactory2->CreateSwapChainForHwnd(dev.device.Get(), dev.hwnd, &sd, nullptr, nullptr, &dev.swap_chain1));
+		checkFail(dev.swap_chain1.As(&dev.swap_chain));
 
 		dxgiFactory2->Release();
 	}
@@ -313,24 +2719,24 @@ HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
 		sd.BufferDesc.RefreshRate.Numerator = 60;
 		sd.BufferDesc.RefreshRate.Denominator = 1;
 		sd.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-		sd.OutputWindow = g_hWnd;
+		sd.OutputWindow = dev.hwnd;
 		sd.SampleDesc.Count = 1;
 		sd.SampleDesc.Quality = 0;
 		sd.Windowed = TRUE;
 
-		checkFail(dxgiFactory->CreateSwapChain(g_pd3dDevice, &sd, &g_pSwapChain));
+		checkFail(dxgiFactory->CreateSwapChain(dev.device.Get(), &sd, &dev.swap_chain));
 	}
 
 	dxgiFactory->Release();
 
 	// Create a render target view
 	ID3D11Texture2D* pBackBuffer = nullptr;
-	checkFail(g_pSwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), reinterpret_cast<void**>(&pBackBuffer)));
+	checkFail(dev.swap_chain->GetBuffer(0, __uuidof(ID3D11Texture2D), reinterpret_cast<void**>(&pBackBuffer)));
 
-	checkFail(g_pd3dDevice->CreateRenderTargetView(pBackBuffer, nullptr, &g_pRenderTargetView));
+	checkFail(dev.device->CreateRenderTargetView(pBackBuffer, nullptr, &dev.render_target_view));
 	pBackBuffer->Release();
 
-	g_pImmediateContext->OMSetRenderTargets(1, &g_pRenderTargetView, nullptr);
+	dev.context->OMSetRenderTargets(1, dev.render_target_view.GetAddressOf(), nullptr);
 
 	// Setup the viewport
 	D3D11_VIEWPORT vp;
@@ -340,27 +2746,21 @@ HRESULT InitDevice(UINT numDriverTypes, D3D_DRIVER_TYPE *driverTypes)
 	vp.MaxDepth = 1.0f;
 	vp.TopLeftX = 0;
 	vp.TopLeftY = 0;
-	g_pImmediateContext->RSSetViewports(1, &vp);
+	dev.context->RSSetViewports(1, &vp);
 
 	return S_OK;
 }
 
-
-__declspec(align(16))
-struct InjectionSwitch {
-	DirectX::XMFLOAT2 injectionSwitch;
-};
-
-void LoadShaders(std::wstring &pixel_shader, json& uniform_data)
+void InitPipeline(RenderDevice &dev, ID3DBlob *pVSBlob)
 {
-
-	// Compile the vertex shader
-	ID3DBlob* pVSBlob = nullptr;
-	CompileShaderStr(vertex_shader_source, "main", "vs_4_0", &pVSBlob);
+	/*
+	Set up everything that is the same for every job: the vertex shader,
+	its input layout and the two triangles covering the screen.
+	*/
 
 	// Create the vertex shader
 	checkFail(
-		g_pd3dDevice->CreateVertexShader(pVSBlob->GetBufferPointer(), pVSBlob->GetBufferSize(), nullptr, &g_pVertexShader));
+		dev.device->CreateVertexShader(pVSBlob->GetBufferPointer(), pVSBlob->GetBufferSize(), nullptr, &dev.vertex_shader));
 
 	// Define the input layout
 	D3D11_INPUT_ELEMENT_DESC layout[] =
@@ -370,22 +2770,11 @@ void LoadShaders(std::wstring &pixel_shader, json& uniform_data)
 	UINT numElements = ARRAYSIZE(layout);
 
 	// Create the input layout
-	checkFail(g_pd3dDevice->CreateInputLayout(layout, numElements, pVSBlob->GetBufferPointer(),
-		pVSBlob->GetBufferSize(), &g_pVertexLayout));
-	pVSBlob->Release();
+	checkFail(dev.device->CreateInputLayout(layout, numElements, pVSBlob->GetBufferPointer(),
+		pVSBlob->GetBufferSize(), &dev.vertex_layout));
 
 	// Set the input layout
-	g_pImmediateContext->IASetInputLayout(g_pVertexLayout);
-
-	// Compile the pixel shader
-	if (pixel_shader.size() > 0) {
-		ID3DBlob* pPSBlob = nullptr;
-		CompileShaderFromFile(pixel_shader.c_str(), "main", "ps_4_0", &pPSBlob);
-
-		// Create the pixel shader
-		checkFail(
-			g_pd3dDevice->CreatePixelShader(pPSBlob->GetBufferPointer(), pPSBlob->GetBufferSize(), nullptr, &g_pPixelShader));
-	}
+	dev.context->IASetInputLayout(dev.vertex_layout.Get());
 
 	// Create vertex buffer with two separate triangles, each covering half
 	// of the screen. We use this to just cover all of the screen so that the pixel shader
@@ -410,54 +2799,58 @@ void LoadShaders(std::wstring &pixel_shader, json& uniform_data)
 	D3D11_SUBRESOURCE_DATA InitData;
 	ZeroMemory(&InitData, sizeof(InitData));
 	InitData.pSysMem = vertices;
-	checkFail(g_pd3dDevice->CreateBuffer(&bd, &InitData, &g_pVertexBuffer));
+	checkFail(dev.device->CreateBuffer(&bd, &InitData, &dev.vertex_buffer));
 
 	// Set vertex buffer
 	UINT stride = sizeof(SimpleVertex);
 	UINT offset = 0;
-	g_pImmediateContext->IASetVertexBuffers(0, 1, &g_pVertexBuffer, &stride, &offset);
+	dev.context->IASetVertexBuffers(0, 1, dev.vertex_buffer.GetAddressOf(), &stride, &offset);
 
 	// Set primitive topology
-	g_pImmediateContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-
-	if (uniform_data.is_object()) {
-		if (uniform_data.count("injectionSwitch") > 0) {
-			json injection_switch_json = uniform_data.at("injectionSwitch");
-			if (
-				!injection_switch_json.is_array() ||
-				injection_switch_json.size() != 2 ||
-				!injection_switch_json.at(0).is_number() ||
-				!injection_switch_json.at(1).is_number()
-				) {
-				std::cerr << "injectionSwitch should be an array of two floats but got " << injection_switch_json << " instead." << std::endl;
-				exit(EXIT_FAILURE);
-			}
-
-			InjectionSwitch injection_switch = {
-				DirectX::XMFLOAT2(injection_switch_json.at(0), injection_switch_json.at(1))
-			};
-
-			ID3D11Buffer *buffer = nullptr;
-
-			D3D11_BUFFER_DESC cbDesc;
-			cbDesc.ByteWidth = sizeof(InjectionSwitch);
-			cbDesc.Usage = D3D11_USAGE_DYNAMIC;
-			cbDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-			cbDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-			cbDesc.MiscFlags = 0;
-			cbDesc.StructureByteStride = 0;
-
-			D3D11_SUBRESOURCE_DATA init_data;
-			init_data.pSysMem = &injection_switch;
-			init_data.SysMemPitch = 0;
-			init_data.SysMemSlicePitch = 0;
-			assert(g_pd3dDevice != nullptr);
+	dev.context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+}
 
-			checkFail(g_pd3dDevice->CreateBuffer(&cbDesc, &init_data, &buffer));
+void LoadShaders(RenderDevice &dev, const PreparedShader &shader)
+{
+	// Create the pixel shader from bytecode that has already been compiled,
+	// once, for all the devices, unless this device has already made one
+	// from the same bytecode. Assigning over the ComPtrs lets go of the
+	// previous job's objects.
+	const Uniforms &uniforms = shader.uniforms;
+	ComPtr<ID3D11PixelShader> *cached = dev.pixel_shaders.Find(shader.bytecode_hash);
+	if (cached) {
+		dev.pixel_shader = *cached;
+	}
+	else {
+		checkFail(
+			dev.device->CreatePixelShader(shader.bytecode, shader.bytecode_size, nullptr,
+				dev.pixel_shader.ReleaseAndGetAddressOf()));
+		// The bytecode size stands in for the driver's memory, which we
+		// can't see.
+		dev.pixel_shaders.Insert(shader.bytecode_hash, dev.pixel_shader, shader.bytecode_size);
+	}
 
-			g_pImmediateContext->PSSetConstantBuffers(0, 1, &buffer);
-		}
+	dev.constant_buffer.Reset();
+	if (uniforms.found & INJECTION_SWITCH_FOUND) {
+		D3D11_BUFFER_DESC cbDesc;
+		cbDesc.ByteWidth = sizeof(InjectionSwitch);
+		cbDesc.Usage = D3D11_USAGE_DYNAMIC;
+		cbDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+		cbDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+		cbDesc.MiscFlags = 0;
+		cbDesc.StructureByteStride = 0;
+
+		D3D11_SUBRESOURCE_DATA init_data;
+		init_data.pSysMem = &uniforms.constants;
+		init_data.SysMemPitch = 0;
+		init_data.SysMemSlicePitch = 0;
+
+		checkFail(dev.device->CreateBuffer(&cbDesc, &init_data, &dev.constant_buffer));
 	}
+	// Always set this, so that a job without uniforms doesn't inherit the
+	// previous job's buffer.
+	ID3D11Buffer *constant_buffer = dev.constant_buffer.Get();
+	dev.context->PSSetConstantBuffers(0, 1, &constant_buffer);
 }
 
 
@@ -468,33 +2861,127 @@ std::string wstring_to_utf8(const std::wstring& str)
 	return myconv.to_bytes(str);
 }
 
-void PrintDeviceInfo() {
+// convert UTF-8 string to wstring
+std::wstring utf8_to_wstring(const std::string& str)
+{
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> myconv;
+	return myconv.from_bytes(str);
+}
 
-	IDXGIDevice *dxgiDevice;
-	assert(g_pd3dDevice != nullptr);
-	g_pd3dDevice->QueryInterface(__uuidof(IDXGIDevice), (void **)&dxgiDevice);
-	{
-		ComPtr<IDXGIAdapter> adapter;
-		if (SUCCEEDED(dxgiDevice->GetAdapter(&adapter)))
-		{
-			DXGI_ADAPTER_DESC desc;
-			if (SUCCEEDED(adapter->GetDesc(&desc)))
-			{
-				json j = {
-					{ "Description", wstring_to_utf8(std::wstring(desc.Description)) },
-					{ "VendorId", desc.VendorId},
-					{ "VendorId", desc.VendorId },
-					{ "DeviceId", desc.DeviceId },
-					{ "SubSysId", desc.SubSysId },
-					{ "Revision", desc.Revision },
-					{ "DedicatedVideoMemory", desc.DedicatedVideoMemory },
-					{ "DedicatedSystemMemory", desc.DedicatedSystemMemory },
-					{ "SharedSystemMemory", desc.SharedSystemMemory },
-				};
-				std::cout << j.dump(4) << std::endl;
+// Feature levels --get-info asks about, highest first.
+const D3D_FEATURE_LEVEL INFO_FEATURE_LEVELS[] = {
+	D3D_FEATURE_LEVEL_12_1,
+	D3D_FEATURE_LEVEL_12_0,
+	D3D_FEATURE_LEVEL_11_1,
+	D3D_FEATURE_LEVEL_11_0,
+	D3D_FEATURE_LEVEL_10_1,
+	D3D_FEATURE_LEVEL_10_0,
+	D3D_FEATURE_LEVEL_9_3,
+	D3D_FEATURE_LEVEL_9_2,
+	D3D_FEATURE_LEVEL_9_1,
+};
+const char *INFO_FEATURE_LEVEL_NAMES[] = {
+	"12_1", "12_0", "11_1", "11_0", "10_1", "10_0", "9_3", "9_2", "9_1",
+};
+
+// Everything about adapter but its feature levels.
+bool DescribeAdapter(IDXGIAdapter1 *adapter, AdapterInfo *info)
+{
+	DXGI_ADAPTER_DESC1 desc;
+	if (FAILED(adapter->GetDesc1(&desc))) {
+		return false;
+	}
+	info->description = wstring_to_utf8(desc.Description);
+	info->vendor_id = desc.VendorId;
+	info->device_id = desc.DeviceId;
+	info->subsys_id = desc.SubSysId;
+	info->revision = desc.Revision;
+	info->dedicated_video_memory = desc.DedicatedVideoMemory;
+	info->dedicated_system_memory = desc.DedicatedSystemMemory;
+	info->shared_system_memory = desc.SharedSystemMemory;
+	info->software = (desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE) != 0;
+	LARGE_INTEGER umd_version;
+	if (SUCCEEDED(adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &umd_version))) {
+		info->driver_version = static_cast<uint64_t>(umd_version.QuadPart);
+	}
+	return true;
+}
+
+// The adapters as DXGI sees them, for AdapterReport.
+class DxgiAdapterEnumerator {
+public:
+	bool Adapters(std::vector<AdapterInfo> *adapters) {
+		adapters_ = EnumerateAdapters(true);
+		for (auto &adapter : adapters_) {
+			AdapterInfo info;
+			if (!DescribeAdapter(adapter.Get(), &info)) {
+				return false;
+			}
+			adapters->push_back(info);
+		}
+		return true;
+	}
+
+	std::vector<std::string> FeatureLevels(size_t index) {
+		/*
+		Without anywhere to put a device, D3D11CreateDevice only reports the
+		highest feature level the adapter supports, and every level below
+		that is supported too.
+		*/
+		UINT count = ARRAYSIZE(INFO_FEATURE_LEVELS);
+		UINT first = 0;
+		D3D_FEATURE_LEVEL highest;
+		HRESULT hr = D3D11CreateDevice(adapters_[index].Get(), D3D_DRIVER_TYPE_UNKNOWN, nullptr, 0,
+			INFO_FEATURE_LEVELS, count, D3D11_SDK_VERSION, nullptr, &highest, nullptr);
+		// A runtime rejects the whole list if it doesn't know one of the
+		// levels. The 11.1 runtime doesn't know 12_0 and 12_1, so try again
+		// from 11_1, and then from 11_0, the highest level the 11.0 runtime
+		// knows.
+		const D3D_FEATURE_LEVEL retries[] = { D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0 };
+		for (D3D_FEATURE_LEVEL retry : retries) {
+			if (hr != E_INVALIDARG) {
+				break;
+			}
+			first = static_cast<UINT>(std::find(std::begin(INFO_FEATURE_LEVELS), std::end(INFO_FEATURE_LEVELS), retry) -
+				std::begin(INFO_FEATURE_LEVELS));
+			hr = D3D11CreateDevice(adapters_[index].Get(), D3D_DRIVER_TYPE_UNKNOWN, nullptr, 0,
+				&INFO_FEATURE_LEVELS[first], count - first, D3D11_SDK_VERSION, nullptr, &highest, nullptr);
+		}
+		std::vector<std::string> names;
+		if (FAILED(hr)) {
+			return names;
+		}
+		for (UINT i = first; i < count; i++) {
+			if (INFO_FEATURE_LEVELS[i] <= highest) {
+				names.push_back(INFO_FEATURE_LEVEL_NAMES[i]);
 			}
 		}
+		return names;
+	}
+
+private:
+	std::vector<ComPtr<IDXGIAdapter1>> adapters_;
+};
+
+int PrintAdapterInfo() {
+	/*
+	--get-info: describe every adapter through the DXGI factory alone, with
+	no window, swap chain or device to set up. The report is cached in the
+	--cache-dir, if there is one, until the adapters or drivers change.
+	*/
+	std::wstring cache_path;
+	if (g_bytecodeCache.Enabled()) {
+		cache_path = JoinPath(g_bytecodeCache.Directory(), L"adapter-info.json");
+	}
+	DxgiAdapterEnumerator enumerator;
+	std::string report;
+	bool cached;
+	if (!AdapterReport(enumerator, cache_path, &report, &cached)) {
+		std::wcerr << "Could not enumerate adapters" << std::endl;
+		return EXIT_FAILURE;
 	}
+	std::cout << report << std::endl;
+	return EXIT_SUCCESS;
 }
 
 LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
@@ -522,6 +3009,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
 void checkFailImpl(HRESULT hr, int lineno) {
 	if (FAILED(hr)) {
+		g_failedDevice = g_threadDevice;
 		std::cerr << "Failed at line " << lineno << std::endl;
 		LPWSTR output;
 		FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS |
@@ -538,45 +3026,40 @@ struct VertexShaderInput {
 };
 
 
+std::string ErrorBlobText(ID3DBlob *errorBlob)
+{
+	// The compiler's messages, which stop at the first NUL if there is one
+	// before the end of the blob.
+	if (!errorBlob) {
+		return std::string();
+	}
+	auto n = errorBlob->GetBufferSize();
+	auto err = (const char *)errorBlob->GetBufferPointer();
+	return std::string(err, std::find(err, err + n, '\0'));
+}
+
 void PrintErrorBlob(ID3DBlob * errorBlob)
 {
 	if (errorBlob) {
-		// FIXME: This is incredibly stupid code and I can imagine no earthly
-		// reason for it to be necessary. All of the obvious things to do here
-		// seemed to produce no output when run, but that must be the result of
-		// me doing something wrong. However, this works for now.
-		auto n = errorBlob->GetBufferSize();
-		auto err = (char *)errorBlob->GetBufferPointer();
-		for (auto i = 0UL; i < n; i++) {
-			if (!err[i])
-				break;
-			std::cerr << err[i];
-		}
-		std::cerr << std::endl;
+		std::cerr << ErrorBlobText(errorBlob) << std::endl;
 		errorBlob->Release();
 	}
 }
 
 void CompileShaderFromFile(_In_ LPCWSTR srcFile, _In_ LPCSTR entryPoint,
-	_In_ LPCSTR profile, _Outptr_ ID3DBlob **blob) {
+	_In_ LPCSTR profile, _Outptr_ ID3DBlob **blob, IncludeSet *includes, ShaderFailure *failure) {
 	if (!srcFile || !entryPoint || !profile || !blob)
 		exit(1);
 
-	*blob = nullptr;
-
-	UINT flags = D3DCOMPILE_ENABLE_STRICTNESS | D3DCOMPILE_DEBUG;
-
-	const D3D_SHADER_MACRO defines[] = { NULL, NULL };
-
-	ID3DBlob *errorBlob = nullptr;
-	HRESULT hr =
-		D3DCompileFromFile(srcFile, defines, D3D_COMPILE_STANDARD_FILE_INCLUDE,
-			entryPoint, profile, flags, 0, blob, &errorBlob);
-	if (FAILED(hr)) {
-		PrintErrorBlob(errorBlob);
-
-		checkFail(hr);
+	// Read the source once and compile it from memory, so the same bytes
+	// serve for the cache key and for the compiler.
+	FileView source;
+	if (!source.Open(srcFile)) {
+		std::wcerr << "Could not read shader " << srcFile << std::endl;
+		exit(EXIT_FAILURE);
 	}
+	CompileShaderBytes(source.Data(), source.Size(), wstring_to_utf8(srcFile).c_str(), entryPoint, profile, blob,
+		includes, failure);
 }
 
 void CompileShaderStr(const char *srcCode, _In_ LPCSTR entryPoint,
@@ -584,32 +3067,206 @@ void CompileShaderStr(const char *srcCode, _In_ LPCSTR entryPoint,
 	if (!srcCode || !entryPoint || !profile || !blob)
 		exit(1);
 
-	*blob = nullptr;
+	CompileShaderBytes(srcCode, strlen(srcCode), "<string>", entryPoint, profile, blob);
+}
 
-	UINT flags = D3DCOMPILE_ENABLE_STRICTNESS | D3DCOMPILE_DEBUG;
+// Serves #includes out of g_includeCache rather than from disk, and keeps
+// track of which files a shader included so that the bytecode cache can tell
+// when they change.
+class CachedIncludeHandler : public ID3DInclude {
+public:
+	explicit CachedIncludeHandler(const std::wstring &source_directory)
+		: source_directory_(source_directory) {
+	}
 
-	const D3D_SHADER_MACRO defines[] = { NULL, NULL };
+	HRESULT __stdcall Open(D3D_INCLUDE_TYPE, LPCSTR pFileName, LPCVOID pParentData,
+		LPCVOID *ppData, UINT *pBytes) override {
+		// Look next to the file doing the including first, then next to the
+		// shader itself, as the standard handler does.
+		std::wstring name = utf8_to_wstring(pFileName);
+		std::vector<std::wstring> candidates;
+		auto parent = directories_.find(pParentData);
+		if (parent != directories_.end()) {
+			candidates.push_back(JoinPath(parent->second, name));
+		}
+		candidates.push_back(JoinPath(source_directory_, name));
+
+		for (auto &candidate : candidates) {
+			std::shared_ptr<const IncludeFile> file = g_includeCache.Get(candidate);
+			if (!file) {
+				continue;
+			}
+			// Holding on to the file keeps its contents alive until the
+			// compile has finished with them.
+			open_files_.push_back(file);
+			directories_[file->contents.Data()] = DirectoryOf(file->path);
+			bool recorded = false;
+			for (auto &dependency : includes_) {
+				recorded = recorded || dependency.path == file->path;
+			}
+			if (!recorded) {
+				includes_.push_back({ file->path, file->hash });
+			}
+			*ppData = file->contents.Data();
+			*pBytes = static_cast<UINT>(file->contents.Size());
+			return S_OK;
+		}
+		return E_FAIL;
+	}
+
+	HRESULT __stdcall Close(LPCVOID) override {
+		return S_OK;
+	}
+
+	const IncludeSet &Includes() const {
+		return includes_;
+	}
+
+private:
+	std::wstring source_directory_;
+	std::map<LPCVOID, std::wstring> directories_;
+	std::vector<std::shared_ptr<const IncludeFile>> open_files_;
+	IncludeSet includes_;
+};
+
+void CompileShaderBytes(const char *srcCode, size_t srcSize, _In_ LPCSTR sourceName, _In_ LPCSTR entryPoint,
+	_In_ LPCSTR profile, _Outptr_ ID3DBlob **blob, IncludeSet *includes, ShaderFailure *failure) {
+	*blob = nullptr;
+
+	// Relative #includes resolve against the shader's directory, so the same
+	// source in another directory may well compile differently. The source
+	// itself is keyed on its tokens, so that shaders differing only in
+	// comments and whitespace share an entry.
+	std::wstring source_directory = DirectoryOf(utf8_to_wstring(sourceName));
+	uint64_t key = 0;
+	if (g_bytecodeCache.Enabled() || failure) {
+		std::string canonical;
+		key = CompileKey()
+			.Add(uint64_t(g_sourceKey))
+			.Add(SourceKey(srcCode, srcSize, g_sourceKey, canonical))
+			.Add(source_directory.data(), source_directory.size() * sizeof(wchar_t))
+			.Add(entryPoint)
+			.Add(profile)
+			.Add(uint64_t(g_compileFlags))
+			.Add(CompilerFingerprint())
+			.Digest();
+	}
+	// Given failure, source that doesn't compile comes back without bytecode
+	// rather than ending the process. With --negative-cache, source known not
+	// to compile isn't compiled again, unless a file it includes has changed,
+	// and source that doesn't compile now goes in the cache with its
+	// includes.
+	const ShaderFailure *known = failure ? g_negativeCache.Find(key, g_includeCache) : nullptr;
+	if (known && known->kind == SHADER_FAILURE_COMPILE) {
+		*failure = *known;
+		failure->cached = true;
+		return;
+	}
+	FileView entry;
+	const uint8_t *bytecode;
+	size_t bytecode_size;
+	if (g_bytecodeCache.Enabled() &&
+		g_bytecodeCache.Load(key, g_includeCache, entry, &bytecode, &bytecode_size, includes)) {
+		checkFail(D3DCreateBlob(bytecode_size, blob));
+		memcpy((*blob)->GetBufferPointer(), bytecode, bytecode_size);
+		return;
+	}
 
 	ID3DBlob *errorBlob = nullptr;
-	HRESULT hr =
-		D3DCompile(srcCode, strlen(srcCode), "<string>", defines, D3D_COMPILE_STANDARD_FILE_INCLUDE,
-			entryPoint, profile, flags, 0, blob, &errorBlob);
+	IncludeSet included;
+	HRESULT hr = CompileUncached(srcCode, srcSize, sourceName, entryPoint, profile, g_compileFlags,
+		blob, &errorBlob, &included);
+	if (hr == E_FAIL && errorBlob && failure) {
+		// Errors in the source, rather than the compiler failing to run.
+		failure->kind = SHADER_FAILURE_COMPILE;
+		failure->message = ErrorBlobText(errorBlob);
+		failure->cached = false;
+		errorBlob->Release();
+		if (g_negativeCache.Enabled() && !g_negativeCache.Add(key, *failure, included)) {
+			std::wcerr << "Could not write to negative cache " << g_negativeCachePath << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
 	if (FAILED(hr)) {
 		PrintErrorBlob(errorBlob);
 
 		checkFail(hr);
 	}
+	if (errorBlob) {
+		// Warnings only.
+		errorBlob->Release();
+	}
+	g_bytecodeCache.Store(key, included, (*blob)->GetBufferPointer(), (*blob)->GetBufferSize());
+	if (includes) {
+		*includes = std::move(included);
+	}
 }
 
+HRESULT CompileUncached(const char *srcCode, size_t srcSize, _In_ LPCSTR sourceName, _In_ LPCSTR entryPoint,
+	_In_ LPCSTR profile, UINT flags, _Outptr_ ID3DBlob **blob, ID3DBlob **errorBlob, IncludeSet *includes) {
+	const D3D_SHADER_MACRO defines[] = { NULL, NULL };
 
-bool readFile(const std::wstring& fileName, std::string& contentsOut) {
-	std::ifstream ifs(fileName.c_str());
-	if (!ifs) {
-		return false;
+	CachedIncludeHandler include_handler(DirectoryOf(utf8_to_wstring(sourceName)));
+	HRESULT hr =
+		D3DCompile(srcCode, srcSize, sourceName, defines, &include_handler,
+			entryPoint, profile, flags, 0, blob, errorBlob);
+	*includes = include_handler.Includes();
+	return hr;
+}
+
+int CompileReport(const std::vector<Job> &jobs)
+{
+	/*
+	Compiles every job's shader with each compile profile in turn, bypassing
+	the bytecode cache, and prints a line of JSON per profile with how long
+	that took and how big the bytecode came out. Nothing is rendered.
+	*/
+	std::vector<FileView> sources(jobs.size());
+	for (size_t i = 0; i < jobs.size(); i++) {
+		std::wstring bundle_path, name;
+		if (SplitBundleReference(jobs[i].pixel_shader, &bundle_path, &name) ||
+			FileExtension(jobs[i].pixel_shader) == L"cso") {
+			std::wcerr << "--compile-report needs HLSL source but " << jobs[i].pixel_shader <<
+				" is already compiled" << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (!sources[i].Open(jobs[i].pixel_shader)) {
+			std::wcerr << "Could not read shader " << jobs[i].pixel_shader << std::endl;
+			return EXIT_FAILURE;
+		}
 	}
-	std::stringstream ss;
-	ss << ifs.rdbuf();
-	contentsOut = ss.str();
-	return true;
+	std::string profile = "ps_" + g_shaderModel;
+
+	for (auto &compile_profile : COMPILE_PROFILES) {
+		size_t failed = 0;
+		uint64_t bytecode_bytes = 0;
+		double seconds = 0.0;
+		for (size_t i = 0; i < jobs.size(); i++) {
+			ComPtr<ID3DBlob> blob;
+			ComPtr<ID3DBlob> errors;
+			IncludeSet includes;
+			auto start = std::chrono::steady_clock::now();
+			HRESULT hr = CompileUncached(sources[i].Data(), sources[i].Size(),
+				wstring_to_utf8(jobs[i].pixel_shader).c_str(), "main", profile.c_str(), compile_profile.flags,
+				&blob, &errors, &includes);
+			seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (FAILED(hr)) {
+				failed++;
+				continue;
+			}
+			bytecode_bytes += blob->GetBufferSize();
+		}
+		json j = {
+			{ "profile", wstring_to_utf8(compile_profile.name) },
+			{ "shader_model", g_shaderModel },
+			{ "shaders", jobs.size() },
+			{ "failed", failed },
+			{ "seconds", seconds },
+			{ "bytecode_bytes", bytecode_bytes },
+		};
+		PrintJsonLine(j);
+	}
+	return EXIT_SUCCESS;
 }
 
@@ -38,6 +38,13 @@
 
 #include <codecvt>
 #include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 
 // " to simplify the tutorial we will go ahead and add them all to your new
 // project's pch.h header" lol
@@ -64,3 +71,4 @@
 
 #pragma comment(lib, "d3dcompiler.lib")
 #pragma comment(lib, "d3d11.lib")
+#pragma comment(lib, "dxgi.lib")
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+"""Measures how long single-shot get-image-hlsl runs take.
+
+Runs the executable once per shader per round over a fixed corpus, with
+--timings, and reports percentiles of the wall clock time and of each phase
+the executable reports. Cold runs start from an empty --cache-dir and warm
+runs reuse the one the cold run filled. The results are written as JSON with
+sorted keys, so that results from two commits can be diffed, or compared
+directly with --baseline.
+
+There is no GPU-free build of get-image-hlsl, so the stand-in for a GPU is the
+WARP software rasterizer (--driver warp, the default here). Anything that can
+run the executable can run this; --launcher puts a command in front of it,
+e.g. --launcher wine on Linux.
+"""
+
+import argparse
+import json
+import math
+import os
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+DEFAULT_CORPUS = [
+    os.path.join(REPO, 'SamplePixelShader.hlsl'),
+    os.path.join(REPO, 'PixelShaderWithInjectionSwitch.hlsl'),
+]
+PERCENTILES = [50, 90, 99]
+
+
+def percentile(values, p):
+    """Nearest-rank percentile of a non-empty list."""
+    ordered = sorted(values)
+    rank = max(0, min(len(ordered) - 1, int(math.ceil(p / 100.0 * len(ordered))) - 1))
+    return ordered[rank]
+
+
+def summarize(values):
+    summary = {'p%d' % p: percentile(values, p) for p in PERCENTILES}
+    summary['min'] = min(values)
+    summary['max'] = max(values)
+    return summary
+
+
+def run_once(args, shader, cache_dir, output):
+    command = shlex.split(args.launcher) + [
+        args.exe, shader, '--output', output, '--driver', args.driver, '--cache-dir', cache_dir, '--timings']
+    start = time.perf_counter()
+    result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+    wall = time.perf_counter() - start
+    if result.returncode != 0:
+        sys.exit('%s failed with exit code %d:\n%s' % (' '.join(command), result.returncode, result.stderr))
+    for line in reversed(result.stdout.splitlines()):
+        try:
+            report = json.loads(line)
+        except ValueError:
+            continue
+        if 'phase_seconds' in report:
+            return wall, report['phase_seconds']
+    sys.exit('%s printed no timings' % ' '.join(command))
+
+
+def benchmark(args):
+    samples = {mode: {'wall_seconds': [], 'phases': {}} for mode in ('cold', 'warm')}
+    scratch = tempfile.mkdtemp(prefix='bench_startup')
+    try:
+        output = os.path.join(scratch, 'out.png')
+        for round_index in range(args.runs):
+            for shader_index, shader in enumerate(args.corpus):
+                cache_dir = os.path.join(scratch, 'cache%d_%d' % (round_index, shader_index))
+                for mode in ['cold'] + ['warm'] * args.warm_runs:
+                    wall, phases = run_once(args, shader, cache_dir, output)
+                    samples[mode]['wall_seconds'].append(wall)
+                    for name, seconds in phases.items():
+                        samples[mode]['phases'].setdefault(name, []).append(seconds)
+    finally:
+        shutil.rmtree(scratch, ignore_errors=True)
+
+    results = {
+        'exe': os.path.basename(args.exe),
+        'driver': args.driver,
+        'corpus': [os.path.relpath(shader, REPO) for shader in args.corpus],
+        'runs': args.runs,
+    }
+    for mode, mode_samples in samples.items():
+        if not mode_samples['wall_seconds']:
+            continue
+        results[mode] = {
+            'samples': len(mode_samples['wall_seconds']),
+            'wall_seconds': summarize(mode_samples['wall_seconds']),
+            'phase_seconds': {name: summarize(values) for name, values in mode_samples['phases'].items()},
+        }
+    return results
+
+
+def compare(results, baseline):
+    """Prints how each median moved relative to the baseline."""
+    for mode in ('cold', 'warm'):
+        if mode not in results or mode not in baseline:
+            continue
+        rows = [('wall', results[mode]['wall_seconds'], baseline[mode]['wall_seconds'])]
+        for name, summary in sorted(results[mode]['phase_seconds'].items()):
+            if name in baseline[mode]['phase_seconds']:
+                rows.append((name, summary, baseline[mode]['phase_seconds'][name]))
+        for name, now, before in rows:
+            change = (now['p50'] - before['p50']) / before['p50'] * 100.0 if before['p50'] > 0 else 0.0
+            print('%s %-16s p50 %9.3f ms -> %9.3f ms (%+.1f%%)' % (
+                mode, name, before['p50'] * 1e3, now['p50'] * 1e3, change))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--exe', required=True, help='path to get-image-hlsl.exe')
+    parser.add_argument('--corpus', nargs='+', default=DEFAULT_CORPUS, help='shaders to run (default: the samples)')
+    parser.add_argument('--runs', type=int, default=20, help='rounds over the corpus (default: 20)')
+    parser.add_argument('--warm-runs', type=int, default=1, help='warm runs after each cold one (default: 1)')
+    parser.add_argument('--driver', default='warp', help='--driver to pass (default: warp)')
+    parser.add_argument('--launcher', default='', help='command to run the executable with, e.g. wine')
+    parser.add_argument('--output', default='bench_startup.json', help='where to write the results')
+    parser.add_argument('--baseline', help='earlier results to compare against')
+    args = parser.parse_args()
+    if args.runs < 1 or args.warm_runs < 0:
+        parser.error('--runs must be positive and --warm-runs not negative')
+    args.corpus = [os.path.abspath(shader) for shader in args.corpus]
+
+    results = benchmark(args)
+    with open(args.output, 'w') as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+        f.write('\n')
+    if args.baseline:
+        with open(args.baseline) as f:
+            compare(results, json.load(f))
+
+
+if __name__ == '__main__':
+    main()
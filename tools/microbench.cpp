@@ -0,0 +1,788 @@
+// Microbenchmarks for the parts of get-image-hlsl that don't need D3D: loading
+// uniforms, reading files, writing, hashing and comparing images, keying and
+// looking up cached shaders. Each benchmark reports the time per operation,
+// the throughput, and how many heap allocations each operation makes.
+//
+// It only uses the portable headers, so it builds anywhere. On Linux, from
+// the root of the repository:
+//
+//   g++ -O2 -std=c++14 -Iget-image-hlsl tools/microbench.cpp -o microbench
+//   ./microbench [--filter SUBSTRING] [--min-seconds S] [--json FILE]
+//
+// Inputs are the sample shaders and uniforms in the repository (so run it
+// from the root) plus synthetic ones of random sizes, generated from a fixed
+// seed so that every run measures the same thing.
+
+#define JSON_NOEXCEPTION
+#include "json.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Arena.h"
+#include "BytecodeCache.h"
+#include "FileUtil.h"
+#include "FileView.h"
+#include "Image.h"
+#include "ImageCompare.h"
+#include "ImageHash.h"
+#include "ImageWriters.h"
+#include "IncludeCache.h"
+#include "LruCache.h"
+#include "NegativeCache.h"
+#include "SourceKey.h"
+#include "UniformLoader.h"
+
+using json = nlohmann::json;
+
+// Every allocation in the process goes through the replacement operators
+// below, so benchmarks can count how many they make. All of the forms are
+// replaced, so that none of them slips past the count, and they all go
+// through the two functions here, which are kept out of line: otherwise
+// GCC sees free() called on what operator new returned, inlined, and warns.
+static std::atomic<uint64_t> g_allocations(0);
+
+#if defined(_MSC_VER)
+#define MICROBENCH_NOINLINE __declspec(noinline)
+#else
+#define MICROBENCH_NOINLINE __attribute__((noinline))
+#endif
+
+MICROBENCH_NOINLINE static void *CountedAllocate(size_t size, size_t alignment) noexcept
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	size = size == 0 ? 1 : size;
+	if (alignment <= alignof(std::max_align_t)) {
+		return malloc(size);
+	}
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void *p = nullptr;
+	return posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+#endif
+}
+
+MICROBENCH_NOINLINE static void CountedFree(void *p, size_t alignment) noexcept
+{
+#ifdef _WIN32
+	if (alignment > alignof(std::max_align_t)) {
+		_aligned_free(p);
+		return;
+	}
+#else
+	(void)alignment;
+#endif
+	free(p);
+}
+
+static void *CountedNew(size_t size, size_t alignment)
+{
+	void *p = CountedAllocate(size, alignment);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void *operator new(size_t size)
+{
+	return CountedNew(size, 0);
+}
+
+void *operator new[](size_t size)
+{
+	return CountedNew(size, 0);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, 0);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, 0);
+}
+
+void operator delete(void *p) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete[](void *p) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete(void *p, const std::nothrow_t&) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) noexcept
+{
+	CountedFree(p, 0);
+}
+
+#ifdef __cpp_aligned_new
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	return CountedNew(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+	return CountedNew(size, static_cast<size_t>(alignment));
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p, std::align_val_t alignment) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *p, std::align_val_t alignment) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p, size_t, std::align_val_t alignment) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *p, size_t, std::align_val_t alignment) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchResult {
+	std::string name;
+	uint64_t iterations;
+	double seconds;
+	uint64_t bytes_per_op;
+	uint64_t allocations;
+};
+
+double g_minSeconds = 0.2;
+std::string g_filter;
+std::vector<BenchResult> g_results;
+
+// Keeps the compiler from optimizing away work whose result isn't used.
+volatile uint64_t g_sink;
+
+// Runs op (which returns something to sink) in doubling batches until it has
+// run for long enough, after one untimed run to warm up caches.
+template <typename Op>
+void Bench(const std::string &name, uint64_t bytes_per_op, Op op)
+{
+	if (name.find(g_filter) == std::string::npos) {
+		return;
+	}
+	g_sink += op();
+	uint64_t iterations = 0;
+	uint64_t batch = 1;
+	uint64_t allocations_before = g_allocations.load();
+	Clock::time_point start = Clock::now();
+	double seconds = 0.0;
+	while (seconds < g_minSeconds) {
+		for (uint64_t i = 0; i < batch; i++) {
+			g_sink += op();
+		}
+		iterations += batch;
+		batch *= 2;
+		seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	}
+	BenchResult result = { name, iterations, seconds, bytes_per_op, g_allocations.load() - allocations_before };
+	printf("%-48s %12.1f ns/op %10.1f MB/s %8.2f allocs/op\n", name.c_str(),
+		seconds / iterations * 1e9, bytes_per_op * iterations / seconds / 1e6,
+		static_cast<double>(result.allocations) / iterations);
+	fflush(stdout);
+	g_results.push_back(result);
+}
+
+std::wstring Widen(const std::string &str)
+{
+	return std::wstring(str.begin(), str.end());
+}
+
+bool ReadWholeFile(const std::string &path, std::string *contents)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		return false;
+	}
+	char buffer[65536];
+	size_t n;
+	contents->clear();
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		contents->append(buffer, n);
+	}
+	fclose(f);
+	return true;
+}
+
+// A scratch directory for the files the benchmarks read and write, removed
+// again at the end.
+class ScratchDirectory {
+public:
+	ScratchDirectory() {
+#ifdef _WIN32
+		char temp[MAX_PATH];
+		GetTempPathA(MAX_PATH, temp);
+		path_ = std::string(temp) + "microbench" + std::to_string(GetCurrentProcessId());
+		CreateDirectoryA(path_.c_str(), nullptr);
+#else
+		char temp[] = "/tmp/microbenchXXXXXX";
+		if (mkdtemp(temp)) {
+			path_ = temp;
+		}
+#endif
+		if (path_.empty()) {
+			fprintf(stderr, "Could not create a scratch directory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	~ScratchDirectory() {
+		// Newest first, so directories are empty by the time they go.
+		for (auto it = files_.rbegin(); it != files_.rend(); ++it) {
+			remove(it->c_str());
+		}
+#ifdef _WIN32
+		RemoveDirectoryA(path_.c_str());
+#else
+		rmdir(path_.c_str());
+#endif
+	}
+
+	// A path in the directory, which is deleted with it. It can also be a
+	// directory, as long as everything in it is deleted first.
+	std::string File(const std::string &name) {
+		files_.push_back(path_ + "/" + name);
+		return files_.back();
+	}
+
+	std::string Write(const std::string &name, const std::string &contents) {
+		std::string path = File(name);
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f || fwrite(contents.data(), 1, contents.size(), f) != contents.size() || fclose(f) != 0) {
+			fprintf(stderr, "Could not write %s\n", path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		return path;
+	}
+
+	const std::string &Path() const {
+		return path_;
+	}
+
+private:
+	std::string path_;
+	std::vector<std::string> files_;
+};
+
+// A size between size / 2 and size * 2, so that the synthetic inputs don't
+// all land on convenient powers of two.
+size_t FuzzSize(std::mt19937_64 &rng, size_t size)
+{
+	return size / 2 + static_cast<size_t>(rng() % (size + size / 2));
+}
+
+// json.hpp default-constructs a null value, whose payload is left unset,
+// and moves it into place when it is given a non-finite number. GCC can't
+// see that the payload of a null is never read, and warns wherever a float
+// is stored, so the two functions that store them are fenced off.
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// A uniforms file of roughly the given size, in the shape graphicsfuzz
+// produces: injectionSwitch plus many other uniforms with their values and
+// types, which we have to skip over.
+std::string SyntheticUniforms(std::mt19937_64 &rng, size_t size)
+{
+	std::uniform_real_distribution<float> value(-1000.0f, 1000.0f);
+	json j = json::object();
+	j["injectionSwitch"] = { 0.0, 1.0 };
+	for (int i = 0; j.dump().size() < size; i++) {
+		json args = json::array();
+		for (int k = 0, n = 1 + static_cast<int>(rng() % 4); k < n; k++) {
+			args.push_back(value(rng));
+		}
+		j["uniform" + std::to_string(i)] = { { "func", "glUniform" + std::to_string(args.size()) + "f" },
+			{ "args", args } };
+	}
+	return j.dump(2);
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+struct Constants {
+	float injection_switch[2];
+};
+
+const UniformBinding BINDINGS[] = {
+	{ "injectionSwitch", offsetof(Constants, injection_switch), 2 },
+};
+
+void UniformBenchmarks(const std::vector<std::pair<std::string, std::string>> &inputs)
+{
+	for (auto &input : inputs) {
+		const std::string &text = input.second;
+		uint64_t size = text.size();
+		Constants constants;
+
+		// What loading uniforms used to be: a JSON tree, then picking the
+		// values out of it.
+		Bench("uniform_pack/json_dom/" + input.first, size, [&] {
+			json j = json::parse(text.begin(), text.end());
+			auto it = j.find("injectionSwitch");
+			if (it != j.end()) {
+				constants.injection_switch[0] = (*it)[0].get<float>();
+				constants.injection_switch[1] = (*it)[1].get<float>();
+			}
+			return static_cast<uint64_t>(constants.injection_switch[1]);
+		});
+
+		json j = json::parse(text.begin(), text.end());
+		std::vector<uint8_t> cbor = json::to_cbor(j);
+		std::vector<uint8_t> msgpack = json::to_msgpack(j);
+		struct Encoding {
+			const char *name;
+			UniformFormat format;
+			const char *begin;
+			size_t size;
+		} encodings[] = {
+			{ "json_stream", UNIFORM_FORMAT_JSON, text.data(), text.size() },
+			{ "cbor_stream", UNIFORM_FORMAT_CBOR, reinterpret_cast<const char*>(cbor.data()), cbor.size() },
+			{ "msgpack_stream", UNIFORM_FORMAT_MSGPACK, reinterpret_cast<const char*>(msgpack.data()), msgpack.size() },
+		};
+		for (auto &encoding : encodings) {
+			std::string error;
+			Bench(std::string("uniform_pack/") + encoding.name + "/" + input.first, encoding.size, [&] {
+				uint32_t found;
+				if (!ParseUniforms(encoding.format, encoding.begin, encoding.begin + encoding.size, BINDINGS, 1,
+					reinterpret_cast<uint8_t*>(&constants), &found, &error)) {
+					fprintf(stderr, "%s\n", error.c_str());
+					exit(EXIT_FAILURE);
+				}
+				return static_cast<uint64_t>(found);
+			});
+		}
+	}
+}
+
+// Everything loading one job's uniforms does, from finding the file to
+// packing the values, the way get-image-hlsl does it with its job arena. Once
+// the arena has grown this shouldn't allocate at all.
+void UniformLoadBenchmarks(ScratchDirectory &scratch, const std::vector<std::pair<std::string, std::string>> &inputs)
+{
+	Arena arena;
+	for (auto &input : inputs) {
+		scratch.Write(input.first + ".json", input.second);
+		std::wstring shader = Widen(scratch.File(input.first + ".hlsl"));
+		Constants constants;
+		std::string error;
+		Bench("uniform_load/job_arena/" + input.first, input.second.size(), [&] {
+			const wchar_t *path;
+			UniformFormat format;
+			uint32_t found = 0;
+			{
+				FileView content;
+				if (!FindUniformFile(shader.c_str(), arena, &path, &format) ||
+					!content.Open(path, FileView::kMapThreshold, &arena) ||
+					!ParseUniforms(format, content.Data(), content.Data() + content.Size(), BINDINGS, 1,
+						reinterpret_cast<uint8_t*>(&constants), &found, &error)) {
+					fprintf(stderr, "Could not load uniforms for %s\n", input.first.c_str());
+					exit(EXIT_FAILURE);
+				}
+			}
+			arena.Reset();
+			return static_cast<uint64_t>(found);
+		});
+	}
+}
+
+// Every way of reading a file also hashes it, as otherwise a mapped file
+// would never actually be read.
+void FileReadBenchmarks(const std::vector<std::pair<std::string, std::string>> &files)
+{
+	for (auto &file : files) {
+		std::wstring path = Widen(file.second);
+		uint64_t size = 0, mtime = 0;
+		FileStamp(path, &mtime, &size);
+
+		Bench("file_read/fread/" + file.first, size, [&] {
+			std::string contents;
+			ReadWholeFile(file.second, &contents);
+			return Xxh64::Hash(contents.data(), contents.size());
+		});
+		Bench("file_read/file_view_read/" + file.first, size, [&] {
+			FileView view;
+			view.Open(path, static_cast<size_t>(-1));
+			return Xxh64::Hash(view.Data(), view.Size());
+		});
+		Bench("file_read/file_view_mapped/" + file.first, size, [&] {
+			FileView view;
+			view.Open(path, 0);
+			return Xxh64::Hash(view.Data(), view.Size());
+		});
+	}
+}
+
+Image NoisyImage(std::mt19937_64 &rng, uint32_t width, uint32_t height)
+{
+	Image image;
+	image.width = width;
+	image.height = height;
+	image.pixels.resize(static_cast<size_t>(width) * height * 4);
+	for (auto &byte : image.pixels) {
+		byte = static_cast<uint8_t>(rng());
+	}
+	return image;
+}
+
+// PNG encoding goes through WIC, which only exists on Windows; its cost shows
+// up in the write_images phase of get-image-hlsl --timings instead.
+void ImageBenchmarks(std::mt19937_64 &rng, ScratchDirectory &scratch)
+{
+	const uint32_t sizes[] = { 256, 1024 };
+	for (uint32_t size : sizes) {
+		Image a = NoisyImage(rng, size, size);
+		Image b = a;
+		// A sprinkling of differences, as between two drivers that mostly agree.
+		for (size_t i = 0; i < b.pixels.size(); i += 997) {
+			b.pixels[i] ^= 0x10;
+		}
+		std::string dims = std::to_string(size) + "x" + std::to_string(size);
+		uint64_t bytes = a.View().PackedSize();
+
+		Bench("image_hash/xxh64/" + dims, bytes, [&] {
+			return HashImage(a.View());
+		});
+		Bench("image_compare/scalar/" + dims, bytes * 2, [&] {
+			return CompareImages(a.View(), b.View(), 0, CompareRowScalar).differing_pixels;
+		});
+		if (SelectCompareRow() != CompareRowScalar) {
+			Bench("image_compare/simd/" + dims, bytes * 2, [&] {
+				return CompareImages(a.View(), b.View(), 0).differing_pixels;
+			});
+		}
+
+		std::wstring ppm = Widen(scratch.File("image" + dims + ".ppm"));
+		std::wstring rgba = Widen(scratch.File("image" + dims + ".rgba"));
+		Bench("image_write/ppm/" + dims, bytes, [&] {
+			return static_cast<uint64_t>(WritePpm(a.View(), ppm));
+		});
+		Bench("image_write/rgba/" + dims, bytes, [&] {
+			return static_cast<uint64_t>(WriteRawRgba(a.View(), rgba));
+		});
+		std::wstring array_path = Widen(scratch.File("array" + dims + ".gfia"));
+		ImageArrayWriter array;
+		if (!array.Open(array_path, size, size)) {
+			fprintf(stderr, "Could not open an image array in %s\n", scratch.Path().c_str());
+			exit(EXIT_FAILURE);
+		}
+		Bench("image_write/array_append/" + dims, bytes, [&] {
+			uint64_t index = 0;
+			array.Append(a.View(), &index);
+			return index;
+		});
+		array.Close();
+	}
+}
+
+// Lookups that hit, which is the case worth making fast.
+void CacheBenchmarks(std::mt19937_64 &rng, ScratchDirectory &scratch,
+	const std::vector<std::pair<std::string, std::string>> &shaders)
+{
+	IncludeCache include_cache;
+	for (auto &shader : shaders) {
+		std::wstring path = Widen(shader.second);
+		Bench("include_cache/get/" + shader.first, 0, [&] {
+			return include_cache.Get(path)->hash;
+		});
+	}
+
+	std::string directory = scratch.File("cache");
+	BytecodeCache cache;
+	if (!cache.Open(Widen(directory))) {
+		fprintf(stderr, "Could not create %s\n", directory.c_str());
+		exit(EXIT_FAILURE);
+	}
+	const size_t bytecode_sizes[] = { 1024, 16 * 1024, 256 * 1024 };
+	for (size_t base : bytecode_sizes) {
+		std::string bytecode(FuzzSize(rng, base), '\0');
+		for (auto &c : bytecode) {
+			c = static_cast<char>(rng());
+		}
+		IncludeSet includes;
+		for (auto &shader : shaders) {
+			includes.push_back({ Widen(shader.second), include_cache.Get(Widen(shader.second))->hash });
+		}
+		uint64_t key = CompileKey().Add(bytecode.data(), bytecode.size()).Digest();
+		cache.Store(key, includes, bytecode.data(), bytecode.size());
+		scratch.File("cache/" + HashToHex(key) + ".dxbc");
+		Bench("bytecode_cache/load/" + std::to_string(bytecode.size()) + "B", bytecode.size(), [&] {
+			FileView entry;
+			const uint8_t *data = nullptr;
+			size_t size = 0;
+			if (!cache.Load(key, include_cache, entry, &data, &size)) {
+				fprintf(stderr, "Bytecode cache lookup missed\n");
+				exit(EXIT_FAILURE);
+			}
+			return static_cast<uint64_t>(size);
+		});
+	}
+
+	const size_t entry_counts[] = { 64, 4096 };
+	for (size_t count : entry_counts) {
+		LruCache<uint64_t, uint64_t> lru(count);
+		std::vector<uint64_t> keys(count);
+		for (auto &key : keys) {
+			key = rng();
+			lru.Insert(key, key, 1);
+		}
+		size_t next = 0;
+		Bench("lru_cache/find/" + std::to_string(count), 0, [&] {
+			uint64_t key = keys[next];
+			next = (next + 7) % keys.size();
+			return *lru.Find(key);
+		});
+	}
+
+	// The negative cache is asked about every shader, and nearly all of them
+	// are fine, so it is misses that matter there.
+	std::string negative_path = scratch.File("negative-cache.gfjl");
+	NegativeCache negative;
+	if (!negative.Open(Widen(negative_path), 1, 2)) {
+		fprintf(stderr, "Could not create %s\n", negative_path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	ShaderFailure failure = { SHADER_FAILURE_COMPILE, "error X3004: undeclared identifier 'x'", false };
+	for (int i = 0; i < 1024; i++) {
+		negative.Add(rng(), failure);
+	}
+	std::vector<uint64_t> misses(4096);
+	for (auto &key : misses) {
+		key = rng();
+	}
+	size_t next_miss = 0;
+	IncludeCache include_cache;
+	Bench("negative_cache/miss/1024", 0, [&] {
+		uint64_t key = misses[next_miss];
+		next_miss = (next_miss + 1) % misses.size();
+		return static_cast<uint64_t>(negative.Find(key, include_cache) != nullptr);
+	});
+	negative.Close();
+}
+
+// HLSL of roughly the given size, in the shape the generator and reducer
+// produce: lots of small statements, with comments, blank lines, the odd
+// directive and a mix of line endings for the tokenizer to get through.
+std::string SyntheticShader(std::mt19937_64 &rng, size_t size)
+{
+	const char *statements[] = {
+		"  float4 v%d = float4(injectionSwitch.x, 0.5f, 1.0e-3, 1.0);",
+		"  if (injectionSwitch.x > injectionSwitch.y) { v%d = -v%d * 2.0f; }",
+		"  // dead code injected by the generator, %d",
+		"  /* a block comment\n     over two lines, %d */",
+		"",
+		"#define SWIZZLE%d(a) ((a).yxwz)",
+		"  for (int i%d = 0; i%d < 4; i%d++) { color += float4(i%d, 0, 0, 1) / 4.0; }",
+	};
+	std::string source = "cbuffer InjectionSwitch : register(b0) {\n  float2 injectionSwitch;\n};\n\n"
+		"float4 main(float4 pos : SV_POSITION) : SV_TARGET\n{\n  float4 color = 0;\n";
+	for (int n = 0; source.size() < size; n++) {
+		char line[256];
+		const char *statement = statements[rng() % (sizeof(statements) / sizeof(statements[0]))];
+		snprintf(line, sizeof(line), statement, n, n, n, n);
+		source += line;
+		source += rng() % 4 == 0 ? "\r\n" : "\n";
+	}
+	return source + "  return color;\n}\n";
+}
+
+void SourceKeyBenchmarks(std::mt19937_64 &rng, const std::vector<std::pair<std::string, std::string>> &shaders)
+{
+	std::vector<std::pair<std::string, std::string>> sources;
+	for (auto &shader : shaders) {
+		std::string source;
+		if (ReadWholeFile(shader.second, &source)) {
+			sources.push_back({ shader.first, source });
+		}
+	}
+	const size_t sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+	for (size_t size : sizes) {
+		std::string source = SyntheticShader(rng, FuzzSize(rng, size));
+		sources.push_back({ std::to_string(source.size()) + "B", source });
+	}
+
+	const std::pair<const char*, SourceKeyMode> modes[] = {
+		{ "bytes", SOURCE_KEY_BYTES }, { "tokens", SOURCE_KEY_TOKENS }, { "lines", SOURCE_KEY_LINES },
+	};
+	std::string buffer;
+	for (auto &source : sources) {
+		for (auto &mode : modes) {
+			Bench(std::string("source_key/") + mode.first + "/" + source.first, source.second.size(), [&] {
+				return SourceKey(source.second.data(), source.second.size(), mode.second, buffer);
+			});
+		}
+	}
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+void WriteJson(const std::string &path)
+{
+	json results = json::array();
+	for (auto &result : g_results) {
+		results.push_back({
+			{ "name", result.name },
+			{ "iterations", result.iterations },
+			{ "ns_per_op", result.seconds / result.iterations * 1e9 },
+			{ "mb_per_s", result.bytes_per_op * result.iterations / result.seconds / 1e6 },
+			{ "allocations_per_op", static_cast<double>(result.allocations) / result.iterations },
+		});
+	}
+	FILE *f = fopen(path.c_str(), "wb");
+	std::string text = results.dump(2) + "\n";
+	if (!f || fwrite(text.data(), 1, text.size(), f) != text.size() || fclose(f) != 0) {
+		fprintf(stderr, "Could not write %s\n", path.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+}
+
+int main(int argc, char *argv[])
+{
+	std::string json_path;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc) {
+			g_filter = argv[++i];
+		}
+		else if (arg == "--min-seconds" && i + 1 < argc) {
+			g_minSeconds = atof(argv[++i]);
+		}
+		else if (arg == "--json" && i + 1 < argc) {
+			json_path = argv[++i];
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--filter SUBSTRING] [--min-seconds S] [--json FILE]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::mt19937_64 rng(20171020);
+	ScratchDirectory scratch;
+
+	// The samples in the repository, and synthetic files of random sizes.
+	std::vector<std::pair<std::string, std::string>> shaders;
+	const char *sample_shaders[] = { "SamplePixelShader.hlsl", "PixelShaderWithInjectionSwitch.hlsl" };
+	for (const char *name : sample_shaders) {
+		if (FILE *f = fopen(name, "rb")) {
+			fclose(f);
+			shaders.push_back({ name, name });
+		}
+	}
+	if (shaders.empty()) {
+		fprintf(stderr, "Sample shaders not found; run from the root of the repository to include them\n");
+	}
+
+	std::vector<std::pair<std::string, std::string>> uniforms;
+	std::string sample_uniforms;
+	if (ReadWholeFile("PixelShaderWithInjectionSwitch.json", &sample_uniforms)) {
+		uniforms.push_back({ "sample", sample_uniforms });
+	}
+	const size_t uniform_sizes[] = { 1024, 64 * 1024 };
+	for (size_t size : uniform_sizes) {
+		std::string text = SyntheticUniforms(rng, FuzzSize(rng, size));
+		uniforms.push_back({ std::to_string(text.size()) + "B", text });
+	}
+
+	std::vector<std::pair<std::string, std::string>> files = shaders;
+	const size_t file_sizes[] = { 4 * 1024, 256 * 1024, 8 * 1024 * 1024 };
+	for (size_t size : file_sizes) {
+		std::string contents(FuzzSize(rng, size), '\0');
+		for (auto &c : contents) {
+			c = static_cast<char>(rng());
+		}
+		std::string name = std::to_string(contents.size()) + "B";
+		files.push_back({ name, scratch.Write(name + ".bin", contents) });
+	}
+
+	UniformBenchmarks(uniforms);
+	UniformLoadBenchmarks(scratch, uniforms);
+	FileReadBenchmarks(files);
+	ImageBenchmarks(rng, scratch);
+	CacheBenchmarks(rng, scratch, shaders);
+	SourceKeyBenchmarks(rng, shaders);
+
+	if (!json_path.empty()) {
+		WriteJson(json_path);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,1768 @@
+// Tests for the parts of get-image-hlsl that don't need D3D.
+//
+// Like tools/microbench.cpp it only uses the portable headers, so it builds
+// anywhere. On Linux, from the root of the repository:
+//
+//   g++ -O1 -g -std=c++14 -Wall -Wextra -fsanitize=address,undefined -Iget-image-hlsl tools/tests.cpp -o tests
+//   ./tests [--filter SUBSTRING]
+//
+// Each test prints its name and every failed check, and the exit status is
+// non-zero if any check failed.
+
+#define JSON_NOEXCEPTION
+#include "json.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "AdapterInfo.h"
+#include "Arena.h"
+#include "BytecodeCache.h"
+#include "DebugMessages.h"
+#include "DeltaDebug.h"
+#include "Differential.h"
+#include "FileUtil.h"
+#include "FileView.h"
+#include "Image.h"
+#include "ImageCompare.h"
+#include "ImageHash.h"
+#include "ImageWriters.h"
+#include "IncludeCache.h"
+#include "Incremental.h"
+#include "JobPipeline.h"
+#include "Journal.h"
+#include "JsonCheck.h"
+#include "LruCache.h"
+#include "NegativeCache.h"
+#include "ReadbackRing.h"
+#include "RenderMemo.h"
+#include "ShaderBundle.h"
+#include "Sharding.h"
+#include "SourceKey.h"
+#include "UniformLoader.h"
+#include "WorkStealing.h"
+
+using json = nlohmann::json;
+
+// Every allocation in the process goes through the replacement operators
+// below, so tests can check that code which shouldn't touch the heap doesn't.
+// As in tools/microbench.cpp, all of the forms are replaced and they go
+// through two functions kept out of line, so that GCC doesn't warn about
+// free() being called on what operator new returned.
+static std::atomic<uint64_t> g_allocations(0);
+
+#if defined(_MSC_VER)
+#define TESTS_NOINLINE __declspec(noinline)
+#else
+#define TESTS_NOINLINE __attribute__((noinline))
+#endif
+
+TESTS_NOINLINE static void *CountedAllocate(size_t size, size_t alignment) noexcept
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	size = size == 0 ? 1 : size;
+	if (alignment <= alignof(std::max_align_t)) {
+		return malloc(size);
+	}
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void *p = nullptr;
+	return posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+#endif
+}
+
+TESTS_NOINLINE static void CountedFree(void *p, size_t alignment) noexcept
+{
+#ifdef _WIN32
+	if (alignment > alignof(std::max_align_t)) {
+		_aligned_free(p);
+		return;
+	}
+#else
+	(void)alignment;
+#endif
+	free(p);
+}
+
+static void *CountedNew(size_t size, size_t alignment)
+{
+	void *p = CountedAllocate(size, alignment);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void *operator new(size_t size)
+{
+	return CountedNew(size, 0);
+}
+
+void *operator new[](size_t size)
+{
+	return CountedNew(size, 0);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, 0);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, 0);
+}
+
+void operator delete(void *p) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete[](void *p) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete(void *p, const std::nothrow_t&) noexcept
+{
+	CountedFree(p, 0);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) noexcept
+{
+	CountedFree(p, 0);
+}
+
+#ifdef __cpp_aligned_new
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	return CountedNew(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+	return CountedNew(size, static_cast<size_t>(alignment));
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p, std::align_val_t alignment) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *p, std::align_val_t alignment) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p, size_t, std::align_val_t alignment) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *p, size_t, std::align_val_t alignment) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	CountedFree(p, static_cast<size_t>(alignment));
+}
+#endif
+
+namespace {
+
+int g_failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+			g_failures++; \
+		} \
+	} while (0)
+
+// A scratch directory for the files the tests write, removed again at the
+// end.
+class ScratchDirectory {
+public:
+	ScratchDirectory() {
+#ifdef _WIN32
+		char temp[MAX_PATH];
+		GetTempPathA(MAX_PATH, temp);
+		path_ = std::string(temp) + "tests" + std::to_string(GetCurrentProcessId());
+		CreateDirectoryA(path_.c_str(), nullptr);
+#else
+		char temp[] = "/tmp/testsXXXXXX";
+		if (mkdtemp(temp)) {
+			path_ = temp;
+		}
+#endif
+		if (path_.empty()) {
+			fprintf(stderr, "Could not create a scratch directory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	~ScratchDirectory() {
+		// Newest first, so directories are empty by the time they go.
+		for (auto it = files_.rbegin(); it != files_.rend(); ++it) {
+			remove(it->c_str());
+		}
+#ifdef _WIN32
+		RemoveDirectoryA(path_.c_str());
+#else
+		rmdir(path_.c_str());
+#endif
+	}
+
+	// A path in the directory, which is deleted with it. It can also be a
+	// directory, as long as everything in it is given to File too.
+	std::wstring File(const std::string &name) {
+		files_.push_back(path_ + "/" + name);
+		return std::wstring(files_.back().begin(), files_.back().end());
+	}
+
+	std::wstring Write(const std::string &name, const std::string &contents) {
+		std::wstring path = File(name);
+		CHECK(WriteFileReplacing(path, contents.data(), contents.size()));
+		return path;
+	}
+
+private:
+	std::string path_;
+	std::vector<std::string> files_;
+};
+
+std::string ReadWholeFile(const std::wstring &path)
+{
+	FileView view;
+	return view.Open(path) ? std::string(view.Data(), view.Size()) : std::string();
+}
+
+uint64_t SizeOf(const std::wstring &path)
+{
+	uint64_t mtime, size = 0;
+	FileStamp(path, &mtime, &size);
+	return size;
+}
+
+Image SolidImage(uint32_t width, uint32_t height, uint8_t value)
+{
+	Image image;
+	image.width = width;
+	image.height = height;
+	image.pixels.assign(static_cast<size_t>(width) * height * 4, value);
+	return image;
+}
+
+// A backend whose copies land after a given number of polls, recording the
+// order everything happened in.
+struct FakeReadbackBackend {
+	size_t depth;
+	size_t polls_until_ready;
+	std::vector<size_t> polls;
+	std::vector<uint8_t> frames;
+	std::vector<std::string> log;
+	uint8_t next_frame = 0;
+
+	FakeReadbackBackend(size_t depth, size_t polls_until_ready)
+		: depth(depth), polls_until_ready(polls_until_ready), polls(depth), frames(depth) {
+	}
+
+	size_t Depth() const {
+		return depth;
+	}
+
+	void IssueCopy(size_t slot) {
+		polls[slot] = 0;
+		frames[slot] = next_frame++;
+		log.push_back("copy" + std::to_string(slot));
+	}
+
+	bool IsReady(size_t slot) {
+		return ++polls[slot] > polls_until_ready;
+	}
+
+	ImageView Map(size_t slot) {
+		log.push_back("map" + std::to_string(slot));
+		return { &frames[slot], 1, 1, 4 };
+	}
+
+	void Unmap(size_t slot) {
+		log.push_back("unmap" + std::to_string(slot));
+	}
+};
+
+void TestReadbackRing()
+{
+	const size_t depths[] = { 1, 3 };
+	const size_t latencies[] = { 0, 5 };
+	for (size_t depth : depths) {
+		for (size_t latency : latencies) {
+			FakeReadbackBackend backend(depth, latency);
+			std::vector<int> tags;
+			std::vector<uint8_t> pixels;
+			size_t max_in_flight = 0;
+			{
+				ReadbackRing<FakeReadbackBackend, int> ring(backend, [&](const int &tag, const ImageView &image) {
+					tags.push_back(tag);
+					pixels.push_back(image.Row(0)[0]);
+				});
+				for (int i = 0; i < 10; i++) {
+					ring.Push(i);
+					max_in_flight = std::max(max_in_flight, ring.InFlight());
+				}
+				ring.Flush();
+				CHECK(ring.InFlight() == 0);
+			}
+			// Every frame comes back once, in order, with its own pixels.
+			CHECK(tags.size() == 10);
+			for (int i = 0; i < static_cast<int>(tags.size()); i++) {
+				CHECK(tags[i] == i);
+				CHECK(pixels[i] == i);
+			}
+			CHECK(max_in_flight <= depth);
+			// Slow copies fill the ring before anything is drained.
+			CHECK(latency == 0 || max_in_flight == depth);
+		}
+	}
+
+	// Frames still in flight are drained when the ring goes away.
+	FakeReadbackBackend backend(4, 100);
+	int consumed = 0;
+	{
+		ReadbackRing<FakeReadbackBackend, int> ring(backend, [&](const int&, const ImageView&) { consumed++; });
+		ring.Push(0);
+		ring.Push(1);
+	}
+	CHECK(consumed == 2);
+	CHECK(backend.log.back() == "unmap1");
+}
+
+void TestImageArrayWriter(ScratchDirectory &scratch)
+{
+	std::wstring path = scratch.File("images.gfia");
+	Image a = SolidImage(3, 2, 0x11);
+	Image b = SolidImage(3, 2, 0x22);
+	uint64_t index = 99;
+	{
+		ImageArrayWriter writer;
+		CHECK(writer.Open(path, 3, 2));
+		CHECK(writer.Append(a.View(), &index) && index == 0);
+		CHECK(writer.Append(b.View(), &index) && index == 1);
+		Image wrong = SolidImage(2, 2, 0);
+		CHECK(!writer.Append(wrong.View(), &index));
+		CHECK(writer.Close());
+	}
+	CHECK(SizeOf(path) == ImageArrayWriter::kHeaderSize + 2 * a.pixels.size());
+
+	// Appending again carries on from the count, growing the mapping.
+	{
+		ImageArrayWriter writer;
+		CHECK(writer.Open(path, 3, 2));
+		CHECK(writer.Count() == 2);
+		for (int i = 0; i < 40; i++) {
+			CHECK(writer.Append(a.View(), &index));
+		}
+		CHECK(index == 41);
+		CHECK(writer.Close());
+	}
+	std::string file = ReadWholeFile(path);
+	uint64_t count = 0;
+	memcpy(&count, &file[16], 8);
+	CHECK(file.compare(0, 4, "GFIA") == 0);
+	CHECK(count == 42);
+	CHECK(file.size() == ImageArrayWriter::kHeaderSize + 42 * a.pixels.size());
+	CHECK(static_cast<uint8_t>(file[ImageArrayWriter::kHeaderSize + a.pixels.size()]) == 0x22);
+
+	// Other dimensions are refused, and anything that isn't an image array,
+	// all without touching the file.
+	{
+		ImageArrayWriter writer;
+		CHECK(!writer.Open(path, 4, 2));
+		CHECK(!writer.Append(a.View(), &index));
+	}
+	CHECK(SizeOf(path) == ImageArrayWriter::kHeaderSize + 42 * a.pixels.size());
+	const std::string foreign[] = { std::string(100 * 1024, 'x'), "GFIA" };
+	for (auto &contents : foreign) {
+		std::wstring other = scratch.Write("other.bin", contents);
+		{
+			ImageArrayWriter writer;
+			CHECK(!writer.Open(other, 3, 2));
+			CHECK(writer.Close());
+		}
+		CHECK(ReadWholeFile(other) == contents);
+	}
+}
+
+void TestRawWriters(ScratchDirectory &scratch)
+{
+	Image image = SolidImage(2, 3, 0x40);
+	image.pixels[3] = 0x7F;
+	std::wstring raw = scratch.File("image.rgba");
+	CHECK(WriteRawRgba(image.View(), raw));
+	std::string file = ReadWholeFile(raw);
+	CHECK(file.size() == kRawRgbaHeaderSize + image.pixels.size());
+	CHECK(file.compare(0, 4, "RGBA") == 0);
+	CHECK(static_cast<uint8_t>(file[kRawRgbaHeaderSize + 3]) == 0x7F);
+
+	std::wstring ppm = scratch.File("image.ppm");
+	CHECK(WritePpm(image.View(), ppm));
+	file = ReadWholeFile(ppm);
+	CHECK(file.compare(0, 11, "P6\n2 3\n255\n") == 0);
+	CHECK(file.size() == 11 + 2 * 3 * 3);
+}
+
+void TestDedupIndex()
+{
+	Image a = SolidImage(4, 4, 1);
+	Image b = SolidImage(4, 4, 2);
+	Image c = SolidImage(4, 4, 1);
+	CHECK(HashImage(a.View()) == HashImage(c.View()));
+	CHECK(HashImage(a.View()) != HashImage(b.View()));
+
+	DedupIndex index;
+	CHECK(index.Add(HashImage(a.View()), "a.png"));
+	CHECK(index.Add(HashImage(b.View()), "b.png"));
+	CHECK(!index.Add(HashImage(c.View()), "c.png"));
+	CHECK(*index.Canonical(HashImage(c.View())) == "a.png");
+	CHECK(index.Size() == 2);
+	CHECK(index.Entries().at(HashImage(a.View())).size() == 2);
+	CHECK(!index.Canonical(12345));
+
+	// Running the batch again lists nothing twice.
+	CHECK(!index.Add(HashImage(a.View()), "a.png"));
+	CHECK(!index.Add(HashImage(c.View()), "c.png"));
+	CHECK(!index.Add(HashImage(b.View()), "b.png"));
+	CHECK(index.Entries().at(HashImage(a.View())).size() == 2);
+	CHECK(index.Entries().at(HashImage(b.View())).size() == 1);
+	CHECK(*index.Canonical(HashImage(a.View())) == "a.png");
+
+	uint64_t hash = 0;
+	CHECK(HexToHash(HashToHex(0x0123456789ABCDEFull), &hash) && hash == 0x0123456789ABCDEFull);
+	CHECK(!HexToHash("0123", &hash));
+}
+
+void TestImageCompare()
+{
+	Image a = SolidImage(3, 1, 100);
+	Image b = a;
+	b.pixels[1] = 103;
+	b.pixels[10] = 90;
+	CompareResult result = CompareImages(a.View(), b.View(), 3, CompareRowScalar);
+	CHECK(result.total_pixels == 3 && result.differing_pixels == 1 && result.max_diff == 10);
+	CHECK(CompareImages(a.View(), b.View(), 0, CompareRowScalar).differing_pixels == 2);
+	CHECK(CompareImages(a.View(), a.View(), 0).differing_pixels == 0);
+
+	// Whatever kernel the CPU gets agrees with the scalar one exactly, on
+	// rows that aren't a whole number of vectors, with padding between them,
+	// and with differences clustered around the tolerance.
+	std::vector<CompareRowFn> kernels = { SelectCompareRow() };
+#ifdef IMAGE_COMPARE_X86
+	if (CpuHasAvx2()) {
+		kernels.push_back(CompareRowAvx2);
+	}
+#endif
+	const uint8_t tolerances[] = { 0, 1, 2, 7, 16, 128, 254, 255 };
+	std::mt19937 rng(29);
+	for (int i = 0; i < 400; i++) {
+		uint32_t width = i < 40 ? i + 1 : 1 + rng() % 70;
+		uint32_t height = 1 + rng() % 4;
+		uint32_t pitch = width * 4 + 4 * (rng() % 3);
+		uint8_t tolerance = tolerances[rng() % sizeof(tolerances)];
+		std::vector<uint8_t> lhs(static_cast<size_t>(pitch) * height);
+		for (auto &byte : lhs) {
+			byte = static_cast<uint8_t>(rng());
+		}
+		std::vector<uint8_t> rhs = lhs;
+		for (auto &byte : rhs) {
+			switch (rng() % 4) {
+			case 0:
+				break;
+			case 1:
+				byte = static_cast<uint8_t>(rng());
+				break;
+			default: {
+				int delta = static_cast<int>(rng() % 7) - 3 + (rng() % 2 ? tolerance : -tolerance);
+				byte = static_cast<uint8_t>(std::min(255, std::max(0, byte + delta)));
+				break;
+			}
+			}
+		}
+		ImageView left = { lhs.data(), width, height, pitch };
+		ImageView right = { rhs.data(), width, height, pitch };
+		CompareResult expected = CompareImages(left, right, tolerance, CompareRowScalar);
+		for (CompareRowFn kernel : kernels) {
+			CompareResult got = CompareImages(left, right, tolerance, kernel);
+			CHECK(got.total_pixels == expected.total_pixels);
+			CHECK(got.differing_pixels == expected.differing_pixels);
+			CHECK(got.max_diff == expected.max_diff);
+		}
+	}
+
+	std::vector<uint8_t> heatmap;
+	DiffHeatmap(a.View(), b.View(), 3, heatmap);
+	CHECK(heatmap.size() == a.pixels.size());
+	CHECK(heatmap[0] == heatmap[1] && heatmap[8] == 128 + 5 && heatmap[9] == 0 && heatmap[11] == 255);
+}
+
+// Counts how many are alive, standing in for a compiled shader.
+struct FakePreparedShader {
+	static std::atomic<int> alive;
+	uint8_t value;
+
+	explicit FakePreparedShader(uint8_t value) : value(value) {
+		alive++;
+	}
+
+	~FakePreparedShader() {
+		alive--;
+	}
+};
+
+std::atomic<int> FakePreparedShader::alive(0);
+
+// A device that draws the shader's value into every channel, or one more than
+// that when it gets a shader it mishandles. Rows are padded, like a mapped
+// staging texture's.
+struct FakeDevice {
+	bool mishandles_odd_shaders;
+	std::chrono::microseconds delay;
+	std::vector<uint8_t> frame;
+
+	ImageView Render(uint8_t value) {
+		std::this_thread::sleep_for(delay);
+		uint8_t drawn = mishandles_odd_shaders && value % 2 ? value + 1 : value;
+		frame.assign(3 * 32, 0);
+		for (uint32_t y = 0; y < 3; y++) {
+			std::fill(frame.begin() + y * 32, frame.begin() + y * 32 + 5 * 4, drawn);
+		}
+		return { frame.data(), 5, 3, 32 };
+	}
+};
+
+void TestDifferential()
+{
+	Image reference = SolidImage(2, 2, 50);
+	Image close = reference;
+	close.pixels[0] = 52;
+	Image off = reference;
+	off.pixels[4] = 200;
+	Image smaller = SolidImage(1, 2, 50);
+	std::vector<ImageView> views = { reference.View(), close.View(), off.View(), reference.View(), smaller.View() };
+	auto groups = GroupMatchingImages(views, 2, 0.0);
+	CHECK(groups.size() == 3);
+	CHECK((groups[0] == std::vector<size_t>{ 0, 1, 3 }));
+	CHECK((groups[1] == std::vector<size_t>{ 2 }));
+	CHECK((groups[2] == std::vector<size_t>{ 4 }));
+	// One pixel in four differing is fine when up to a quarter may.
+	CHECK(GroupMatchingImages(views, 0, 25.0).size() == 2);
+	CHECK(GroupMatchingImages(views, 0, 24.9).size() == 4);
+	CHECK(GroupMatchingImages(std::vector<ImageView>(3, reference.View()), 0, 0.0).size() == 1);
+
+	// One producer and three devices, the last of them slow and wrong about
+	// every odd shader. Each job is compared exactly once, by whichever device
+	// finishes it last, and the producer never gets more than `capacity`
+	// shaders ahead.
+	const size_t jobs = 40, capacity = 3;
+	std::vector<FakeDevice> devices = {
+		{ false, std::chrono::microseconds(0), {} },
+		{ false, std::chrono::microseconds(50), {} },
+		{ true, std::chrono::microseconds(200), {} },
+	};
+	PreparedJobs<std::shared_ptr<FakePreparedShader>> prepared(jobs, devices.size(), capacity);
+	DifferentialCollector collector(jobs, devices.size());
+	std::vector<std::vector<std::vector<size_t>>> results(jobs);
+	std::vector<std::atomic<int>> compared(jobs);
+	std::vector<std::thread> threads;
+	for (size_t d = 0; d < devices.size(); d++) {
+		threads.emplace_back([&, d] {
+			for (size_t i = 0; i < jobs; i++) {
+				uint8_t value = prepared.Wait(i)->value;
+				prepared.Done(i);
+				if (collector.Add(i, d, devices[d].Render(value))) {
+					compared[i]++;
+					results[i] = collector.Compare(i, 0, 0.0);
+					collector.Release(i);
+				}
+			}
+		});
+	}
+	int most_alive = 0;
+	for (size_t i = 0; i < jobs; i++) {
+		prepared.Publish(i, std::make_shared<FakePreparedShader>(static_cast<uint8_t>(i)));
+		most_alive = std::max(most_alive, FakePreparedShader::alive.load());
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	CHECK(most_alive <= static_cast<int>(capacity));
+	CHECK(FakePreparedShader::alive == 0);
+	for (size_t i = 0; i < jobs; i++) {
+		CHECK(compared[i] == 1);
+		if (i % 2) {
+			CHECK((results[i] == std::vector<std::vector<size_t>>{ { 0, 1 }, { 2 } }));
+		}
+		else {
+			CHECK((results[i] == std::vector<std::vector<size_t>>{ { 0, 1, 2 } }));
+		}
+	}
+}
+
+void TestWorkStealing()
+{
+	// Jobs go to the shortest queue, a worker takes its own oldest job first,
+	// then the newest from the longest other queue.
+	{
+		WorkStealingQueues queues(3);
+		for (size_t job = 0; job < 7; job++) {
+			CHECK(queues.Push(job) == job % 3);
+		}
+		queues.Close();
+		size_t job;
+		const size_t taken_by_1[] = { 1, 4, 6, 3 };
+		for (size_t expected : taken_by_1) {
+			CHECK(queues.Pop(1, &job) && job == expected);
+		}
+		const size_t taken_by_2[] = { 2, 5, 0 };
+		for (size_t expected : taken_by_2) {
+			CHECK(queues.Pop(2, &job) && job == expected);
+		}
+		CHECK(!queues.Pop(2, &job) && !queues.Pop(0, &job));
+		CHECK(queues.Taken(1) == 4 && queues.Stolen(1) == 2);
+		CHECK(queues.Taken(2) == 3 && queues.Stolen(2) == 1);
+		CHECK(queues.Taken(0) == 0);
+	}
+
+	// One slow worker and two fast ones, each starting with a third of the
+	// jobs. Every job runs exactly once, the fast workers take over most of
+	// the slow one's share, and each worker's own jobs come in the order they
+	// were pushed.
+	const size_t jobs = 90;
+	const std::chrono::microseconds delays[] = {
+		std::chrono::microseconds(2000), std::chrono::microseconds(0), std::chrono::microseconds(0),
+	};
+	WorkStealingQueues queues(3);
+	for (size_t job = 0; job < jobs; job++) {
+		queues.Push(job);
+	}
+	queues.Close();
+	std::vector<std::atomic<int>> runs(jobs);
+	std::vector<size_t> results(jobs);
+	bool own_in_order[3] = { true, true, true };
+	std::vector<std::thread> threads;
+	for (size_t w = 0; w < 3; w++) {
+		threads.emplace_back([&, w] {
+			size_t job;
+			size_t last_own = 0;
+			bool any_own = false;
+			for (;;) {
+				// Only this worker adds to its own count of stolen jobs.
+				uint64_t stolen = queues.Stolen(w);
+				if (!queues.Pop(w, &job)) {
+					break;
+				}
+				if (queues.Stolen(w) == stolen) {
+					own_in_order[w] = own_in_order[w] && (!any_own || job > last_own);
+					last_own = job;
+					any_own = true;
+				}
+				runs[job]++;
+				std::this_thread::sleep_for(delays[w]);
+				results[job] = job * job;
+			}
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	for (size_t job = 0; job < jobs; job++) {
+		CHECK(runs[job] == 1);
+		CHECK(results[job] == job * job);
+	}
+	CHECK(queues.Taken(0) + queues.Taken(1) + queues.Taken(2) == jobs);
+	CHECK(queues.Taken(0) < jobs / 6);
+	CHECK(queues.Stolen(1) + queues.Stolen(2) >= jobs / 3 - queues.Taken(0));
+	CHECK(own_in_order[0] && own_in_order[1] && own_in_order[2]);
+}
+
+void TestDebugMessages()
+{
+	MessageRing ring(2);
+	CHECK(ring.Empty());
+	const char *texts[] = { "first\n", "second \"quoted\"\n", "third\tline\x01\n" };
+	for (int i = 0; i < 3; i++) {
+		ring.Push(2, 9, 100 + i, texts[i], strlen(texts[i]));
+	}
+	CHECK(ring.Size() == 2 && ring.Dropped() == 1 && ring.At(0).id == 101);
+
+	json j = DebugMessagesJson("bad.hlsl", "", ring);
+	CHECK(j["shader"] == "bad.hlsl" && j.count("device") == 0 && j["dropped"] == 1);
+	CHECK(j["debug_messages"].size() == 2);
+	CHECK(j["debug_messages"][0]["severity"] == "warning" && j["debug_messages"][0]["category"] == "execution");
+	CHECK(j["debug_messages"][0]["text"] == "second \"quoted\"");
+	// Control characters survive a round trip through the text.
+	CHECK(json::parse(j.dump())["debug_messages"][1]["text"] == "third\tline\x01");
+
+	ring.Clear();
+	ring.Push(17, -1, 5, "odd", 3);
+	j = DebugMessagesJson("bad.hlsl", "warp", ring);
+	CHECK(j["device"] == "warp" && j["debug_messages"][0]["severity"] == "unknown");
+	CHECK(j["debug_messages"][0]["category"] == "unknown");
+}
+
+// Adapters made up for AdapterReport, counting how often it asks for
+// feature levels.
+struct FakeAdapterEnumerator {
+	std::vector<AdapterInfo> adapters;
+	int feature_level_queries = 0;
+
+	bool Adapters(std::vector<AdapterInfo> *out) {
+		*out = adapters;
+		return true;
+	}
+
+	std::vector<std::string> FeatureLevels(size_t index) {
+		feature_level_queries++;
+		return index == 0 ? std::vector<std::string> { "11_1", "11_0" } : std::vector<std::string> { "10_0" };
+	}
+};
+
+void TestAdapterReport(ScratchDirectory &scratch)
+{
+	FakeAdapterEnumerator enumerator;
+	enumerator.adapters.resize(2);
+	enumerator.adapters[0].description = "GPU \"one\"\t\x01";
+	enumerator.adapters[0].vendor_id = 0x10DE;
+	enumerator.adapters[0].driver_version = (uint64_t(31) << 48) | (uint64_t(0) << 32) | (15 << 16) | 4601;
+	enumerator.adapters[1].description = "Microsoft Basic Render Driver";
+	enumerator.adapters[1].software = true;
+
+	std::wstring path = scratch.File("adapter-info.json");
+	std::string report;
+	bool cached = true;
+	CHECK(AdapterReport(enumerator, path, &report, &cached) && !cached);
+	CHECK(enumerator.feature_level_queries == 2);
+	json j = json::parse(report);
+	CHECK(j["key"] == HashToHex(AdapterInfoKey(enumerator.adapters)));
+	CHECK(j["adapters"].size() == 2);
+	CHECK(j["adapters"][0]["Description"] == enumerator.adapters[0].description);
+	CHECK(j["adapters"][0]["VendorId"] == 0x10DE);
+	CHECK(j["adapters"][0]["DriverVersion"] == "31.0.15.4601");
+	CHECK(j["adapters"][0]["FeatureLevels"][0] == "11_1");
+	CHECK(j["adapters"][1]["DriverVersion"].is_null() && j["adapters"][1]["Software"] == true);
+
+	// The second time round the report comes from the file.
+	std::string again;
+	CHECK(AdapterReport(enumerator, path, &again, &cached) && cached);
+	CHECK(again == report && enumerator.feature_level_queries == 2);
+
+	// A cut short file, or a new driver, means asking again.
+	std::string stored = ReadWholeFile(path);
+	CHECK(WriteFileReplacing(path, stored.data(), stored.size() - 2));
+	CHECK(AdapterReport(enumerator, path, &again, &cached) && !cached && again == report);
+	enumerator.adapters[0].driver_version++;
+	CHECK(AdapterReport(enumerator, path, &again, &cached) && !cached && again != report);
+	CHECK(AdapterReport(enumerator, std::wstring(), &again, &cached) && !cached);
+}
+
+struct Constants {
+	float injection_switch[2];
+	float resolution[2];
+};
+
+const UniformBinding BINDINGS[] = {
+	{ "injectionSwitch", offsetof(Constants, injection_switch), 2 },
+	{ "resolution", offsetof(Constants, resolution), 2 },
+};
+
+// Parses j in every format, checking they all agree, and returns whether it
+// parsed.
+bool ParseEveryFormat(const json &j, Constants *constants, uint32_t *found)
+{
+	std::string text = j.dump();
+	std::vector<uint8_t> cbor = json::to_cbor(j);
+	std::vector<uint8_t> msgpack = json::to_msgpack(j);
+	const char *begins[] = {
+		text.data(), reinterpret_cast<const char*>(cbor.data()), reinterpret_cast<const char*>(msgpack.data()),
+	};
+	size_t sizes[] = { text.size(), cbor.size(), msgpack.size() };
+	UniformFormat formats[] = { UNIFORM_FORMAT_JSON, UNIFORM_FORMAT_CBOR, UNIFORM_FORMAT_MSGPACK };
+	bool results[3];
+	Constants parsed[3];
+	uint32_t founds[3];
+	for (int f = 0; f < 3; f++) {
+		std::string error;
+		memset(&parsed[f], 0, sizeof(parsed[f]));
+		results[f] = ParseUniforms(formats[f], begins[f], begins[f] + sizes[f], BINDINGS, 2,
+			reinterpret_cast<uint8_t*>(&parsed[f]), &founds[f], &error);
+		CHECK(results[f] || !error.empty());
+		// Anything cut short fails cleanly.
+		for (size_t n = 0; n < sizes[f]; n += 1 + sizes[f] / 64) {
+			Constants scratch;
+			uint32_t scratch_found;
+			std::string scratch_error;
+			ParseUniforms(formats[f], begins[f], begins[f] + n, BINDINGS, 2, reinterpret_cast<uint8_t*>(&scratch),
+				&scratch_found, &scratch_error);
+		}
+	}
+	for (int f = 1; f < 3; f++) {
+		CHECK(results[f] == results[0]);
+		CHECK(!results[0] || founds[f] == founds[0]);
+		CHECK(!results[0] || memcmp(&parsed[f], &parsed[0], sizeof(Constants)) == 0);
+	}
+	*constants = parsed[0];
+	*found = founds[0];
+	return results[0];
+}
+
+void TestUniformParsers()
+{
+	Constants constants;
+	uint32_t found = 0;
+	json j = {
+		{ "other", { { "func", "glUniform1f" }, { "args", { 1.5, { 2, 3 }, nullptr, true, "x" } } } },
+		{ "injectionSwitch", { 0.0, 1.0 } },
+		{ "resolution", { 256, 128.5 } },
+	};
+	CHECK(ParseEveryFormat(j, &constants, &found));
+	CHECK(found == 3);
+	CHECK(constants.injection_switch[0] == 0.0f && constants.injection_switch[1] == 1.0f);
+	CHECK(constants.resolution[0] == 256.0f && constants.resolution[1] == 128.5f);
+
+	// Missing uniforms just aren't found.
+	CHECK(ParseEveryFormat(json { { "resolution", { 1, 2 } } }, &constants, &found));
+	CHECK(found == 2);
+	CHECK(ParseEveryFormat(json::array({ 1, 2 }), &constants, &found));
+	CHECK(found == 0);
+
+	// A known uniform of the wrong shape is an error.
+	CHECK(!ParseEveryFormat(json { { "injectionSwitch", { 1, 2, 3 } } }, &constants, &found));
+	CHECK(!ParseEveryFormat(json { { "injectionSwitch", "on" } }, &constants, &found));
+
+	// Random documents agree between the formats.
+	std::mt19937 rng(1);
+	std::function<json(int)> random_value = [&](int depth) -> json {
+		switch (rng() % (depth > 3 ? 5 : 7)) {
+		case 0:
+			return json(static_cast<int>(rng() % 100000) - 50000);
+		case 1:
+			return json(static_cast<double>(rng() % 1000) / 8.0 - 50.0);
+		case 2:
+			return json(std::string(rng() % 40, 'x'));
+		case 3:
+			return json(rng() % 2 == 0);
+		case 4:
+			return json(nullptr);
+		case 5: {
+			json array = json::array();
+			for (int i = 0, n = static_cast<int>(rng() % 20); i < n; i++) {
+				array.push_back(random_value(depth + 1));
+			}
+			return array;
+		}
+		default: {
+			json object = json::object();
+			for (int i = 0, n = static_cast<int>(rng() % 6); i < n; i++) {
+				object["k" + std::to_string(rng() % 300)] = random_value(depth + 1);
+			}
+			return object;
+		}
+		}
+	};
+	for (int i = 0; i < 500; i++) {
+		json document = random_value(1);
+		if (document.is_object() && rng() % 2) {
+			document["injectionSwitch"] = { random_value(5), random_value(5) };
+		}
+		ParseEveryFormat(document, &constants, &found);
+	}
+
+	// Half floats only come from other CBOR writers.
+	const uint8_t half[] = {
+		0xA1, 0x6F, 'i', 'n', 'j', 'e', 'c', 't', 'i', 'o', 'n', 'S', 'w', 'i', 't', 'c', 'h',
+		0x82, 0xF9, 0x3C, 0x00, 0xF9, 0xC0, 0x00,
+	};
+	std::string error;
+	CHECK(CborUniformParser::Parse(reinterpret_cast<const char*>(half), reinterpret_cast<const char*>(half) +
+		sizeof(half), BINDINGS, 2, reinterpret_cast<uint8_t*>(&constants), &found, &error));
+	CHECK(found == 1 && constants.injection_switch[0] == 1.0f && constants.injection_switch[1] == -2.0f);
+
+	std::string text = "{\"injectionSwitch\": [0, 1]} x";
+	CHECK(!UniformParser::Parse(text.data(), text.data() + text.size(), BINDINGS, 2,
+		reinterpret_cast<uint8_t*>(&constants), &found, &error));
+}
+
+void TestArena(ScratchDirectory &scratch)
+{
+	// The same allocations after a reset land in the same places, in the
+	// chunks already there, however many chunks the first round needed.
+	Arena arena(256);
+	const size_t sizes[] = { 1, 10, 100, 7, 200, 1000, 3, 64 };
+	const size_t alignments[] = { 1, 2, 8, 16, 64 };
+	std::vector<void*> first_round;
+	uint64_t chunks = 0;
+	size_t capacity = 0;
+	for (int round = 0; round < 3; round++) {
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			size_t alignment = alignments[i % (sizeof(alignments) / sizeof(alignments[0]))];
+			void *p = arena.Allocate(sizes[i], alignment);
+			CHECK(reinterpret_cast<uintptr_t>(p) % alignment == 0);
+			memset(p, round, sizes[i]);
+			if (round == 0) {
+				first_round.push_back(p);
+			}
+			else {
+				CHECK(p == first_round[i]);
+			}
+		}
+		if (round == 0) {
+			chunks = arena.HeapAllocations();
+			capacity = arena.Capacity();
+		}
+		arena.Reset();
+	}
+	CHECK(chunks > 2 && arena.HeapAllocations() == chunks && arena.Capacity() == capacity);
+	CHECK(arena.Allocations() == 3 * sizeof(sizes) / sizeof(sizes[0]));
+	const wchar_t *copy = arena.Copy(L"abc", 2);
+	CHECK(copy[0] == L'a' && copy[1] == L'b' && copy[2] == 0);
+
+	// Once the arena has grown to fit, loading a job's uniforms doesn't touch
+	// the heap at all.
+	scratch.Write("uniforms.json", "{\"injectionSwitch\": [0.0, 1.0], \"resolution\": [256.0, 256.0]}");
+	std::wstring shader = scratch.File("uniforms.hlsl");
+	Arena job_arena;
+	std::string error;
+	uint64_t allocations_before = 0;
+	for (int i = 0; i < 100; i++) {
+		if (i == 1) {
+			allocations_before = g_allocations;
+		}
+		Constants constants;
+		const wchar_t *path;
+		UniformFormat format;
+		uint32_t found = 0;
+		{
+			FileView content;
+			CHECK(FindUniformFile(shader.c_str(), job_arena, &path, &format) &&
+				content.Open(path, FileView::kMapThreshold, &job_arena) &&
+				ParseUniforms(format, content.Data(), content.Data() + content.Size(), BINDINGS, 2,
+					reinterpret_cast<uint8_t*>(&constants), &found, &error));
+		}
+		CHECK(found == 3 && constants.injection_switch[1] == 1.0f);
+		job_arena.Reset();
+	}
+	CHECK(g_allocations == allocations_before);
+	CHECK(job_arena.HeapAllocations() == 1);
+}
+
+void TestLruCache()
+{
+	LruCache<int, std::string> cache(10);
+	cache.Insert(1, "one", 4);
+	cache.Insert(2, "two", 4);
+	CHECK(*cache.Find(1) == "one");
+	// 2 is now the least recently used, so it goes first.
+	cache.Insert(3, "three", 4);
+	CHECK(!cache.Find(2));
+	CHECK(cache.Find(1) && cache.Find(3));
+	CHECK(cache.Cost() == 8 && cache.Size() == 2 && cache.Evictions() == 1);
+	// Too big to keep at all.
+	cache.Insert(4, "four", 11);
+	CHECK(!cache.Find(4) && cache.Size() == 2);
+	// Replacing an entry replaces its cost.
+	cache.Insert(1, "uno", 2);
+	CHECK(*cache.Find(1) == "uno" && cache.Cost() == 6);
+	cache.SetCapacity(3);
+	CHECK(cache.Size() == 1 && cache.Find(1) && cache.Cost() == 2);
+	cache.Erase(1);
+	CHECK(cache.Size() == 0 && cache.Cost() == 0);
+}
+
+void TestIncludeCache(ScratchDirectory &scratch)
+{
+	std::wstring path = scratch.Write("prelude.h", "float4 a;");
+	IncludeCache cache;
+	auto first = cache.Get(path);
+	CHECK(first && std::string(first->contents.Data(), first->contents.Size()) == "float4 a;");
+	CHECK(cache.Get(path) == first && cache.Hits() == 1);
+	CHECK(!cache.Get(scratch.File("missing.h")));
+
+	IncludeSet includes = { { first->path, first->hash } };
+	CHECK(cache.UpToDate(includes));
+	// A different size is noticed without waiting for the clock to tick.
+	scratch.Write("prelude.h", "float4 ab;");
+	auto second = cache.Get(path);
+	CHECK(second && second != first && second->hash != first->hash);
+	CHECK(std::string(first->contents.Data(), first->contents.Size()) == "float4 a;");
+	CHECK(!cache.UpToDate(includes));
+}
+
+void TestBytecodeCache(ScratchDirectory &scratch)
+{
+	std::wstring directory = scratch.File("bytecode");
+	std::wstring include = scratch.Write("common.h", "#define X 1");
+	BytecodeCache cache;
+	IncludeCache include_cache;
+	CHECK(!cache.Enabled());
+	CHECK(cache.Open(directory) && cache.Enabled());
+
+	uint64_t key = CompileKey().Add("source").Add("ps_5_0").Add(uint64_t(7)).Digest();
+	CHECK(key != CompileKey().Add("sourceps_5_0").Add(uint64_t(7)).Digest());
+	std::string entry_name = HashToHex(key) + ".dxbc";
+	scratch.File("bytecode/" + entry_name);
+
+	auto common = include_cache.Get(include);
+	IncludeSet includes = { { common->path, common->hash } };
+	const std::string bytecode = "DXBC and then some";
+	CHECK(cache.Store(key, includes, bytecode.data(), bytecode.size()));
+
+	FileView entry;
+	const uint8_t *loaded = nullptr;
+	size_t size = 0;
+	IncludeSet loaded_includes;
+	CHECK(cache.Load(key, include_cache, entry, &loaded, &size, &loaded_includes));
+	CHECK(std::string(reinterpret_cast<const char*>(loaded), size) == bytecode);
+	CHECK(loaded_includes.size() == 1 && loaded_includes[0].path == common->path);
+	CHECK(!cache.Load(key + 1, include_cache, entry, &loaded, &size));
+
+	// A changed include makes the entry stale.
+	scratch.Write("common.h", "#define X 22");
+	CHECK(!cache.Load(key, include_cache, entry, &loaded, &size));
+	scratch.Write("common.h", "#define X 1");
+	CHECK(cache.Load(key, include_cache, entry, &loaded, &size));
+	entry = FileView();
+
+	// So does any damage to the file.
+	std::wstring entry_path = directory + L"/" + std::wstring(entry_name.begin(), entry_name.end());
+	std::string stored = ReadWholeFile(entry_path);
+	stored[stored.size() - 1] ^= 1;
+	CHECK(WriteFileReplacing(entry_path, stored.data(), stored.size()));
+	CHECK(!cache.Load(key, include_cache, entry, &loaded, &size));
+	CHECK(WriteFileReplacing(entry_path, stored.data(), 10));
+	CHECK(!cache.Load(key, include_cache, entry, &loaded, &size));
+	CHECK(cache.Hits() == 2 && cache.Misses() == 4);
+}
+
+void TestShaderBundle(ScratchDirectory &scratch)
+{
+	std::vector<std::pair<std::string, std::string>> shaders = {
+		{ "blur", std::string(37, 'b') },
+		{ "add", "DXBC" },
+		{ "add2", std::string(16, '\0') },
+	};
+	std::wstring path = scratch.File("shaders.gfsb");
+	{
+		ShaderBundleWriter writer;
+		CHECK(writer.Open(path));
+		for (auto &shader : shaders) {
+			CHECK(writer.Add(shader.first, shader.second.data(), shader.second.size()));
+		}
+		CHECK(!writer.Add("add", "x", 1));
+		CHECK(writer.Close());
+	}
+
+	{
+		ShaderBundle bundle;
+		CHECK(bundle.Open(path));
+		CHECK(bundle.Count() == shaders.size());
+		for (auto &shader : shaders) {
+			const ShaderBundleEntry *entry = bundle.Find(shader.first);
+			CHECK(entry && bundle.Name(*entry) == shader.first);
+			if (entry) {
+				CHECK(entry->size == shader.second.size());
+				CHECK(memcmp(bundle.Bytecode(*entry), shader.second.data(), shader.second.size()) == 0);
+				CHECK(reinterpret_cast<uintptr_t>(bundle.Bytecode(*entry)) % ShaderBundleWriter::kAlignment == 0);
+				CHECK(bundle.Verify(*entry));
+			}
+		}
+		CHECK(bundle.Name(bundle.Entry(0)) == "add" && bundle.Name(bundle.Entry(2)) == "blur");
+		CHECK(!bundle.Find("") && !bundle.Find("ad") && !bundle.Find("add3") && !bundle.Find("zzz"));
+	}
+
+	// Cut short anywhere, the index no longer fits and the bundle is refused.
+	std::string file = ReadWholeFile(path);
+	const size_t cuts[] = { 0, 3, 23, 24, file.size() / 2, file.size() - 1 };
+	for (size_t cut : cuts) {
+		ShaderBundle bundle;
+		CHECK(!bundle.Open(scratch.Write("cut" + std::to_string(cut) + ".gfsb", file.substr(0, cut))));
+	}
+
+	// So is one whose header or index has been damaged.
+	uint64_t index_offset;
+	ShaderBundleEntry first;
+	memcpy(&index_offset, file.data() + 16, sizeof(index_offset));
+	memcpy(&first, file.data() + index_offset, sizeof(first));
+	auto damaged = [&](size_t at, uint64_t value, size_t size) {
+		std::string copy = file;
+		memcpy(&copy[at], &value, size);
+		return scratch.Write("damaged" + std::to_string(at) + ".gfsb", copy);
+	};
+	const std::wstring bad[] = {
+		damaged(0, 'X', 1),
+		damaged(4, 2, sizeof(uint32_t)),
+		damaged(8, UINT64_MAX / 2, sizeof(uint64_t)),
+		damaged(16, index_offset + 8, sizeof(uint64_t)),
+		damaged(index_offset + offsetof(ShaderBundleEntry, size), file.size(), sizeof(uint64_t)),
+		damaged(index_offset + offsetof(ShaderBundleEntry, name_offset), file.size() - 1, sizeof(uint64_t)),
+		// "add", first in the index, becomes "zdd" and out of order.
+		damaged(static_cast<size_t>(first.name_offset), 'z', 1),
+	};
+	for (auto &damaged_path : bad) {
+		ShaderBundle bundle;
+		CHECK(!bundle.Open(damaged_path));
+	}
+
+	// Damaged bytecode leaves the index sound, but no longer matches its hash.
+	ShaderBundle bundle;
+	CHECK(bundle.Open(damaged(static_cast<size_t>(first.offset), 'Y', 1)));
+	const ShaderBundleEntry *entry = bundle.Find("add");
+	CHECK(entry && !bundle.Verify(*entry) && bundle.Verify(*bundle.Find("blur")));
+}
+
+void TestSourceKey()
+{
+	auto canonical = [](const std::string &source, SourceKeyMode mode) {
+		std::string out;
+		CanonicalSource(source.data(), source.size(), mode, &out);
+		return out;
+	};
+	auto same = [&](const std::string &a, const std::string &b, SourceKeyMode mode) {
+		return canonical(a, mode) == canonical(b, mode);
+	};
+	CHECK(same("float  x =\r\n 1; // one", "float x=1;", SOURCE_KEY_TOKENS));
+	CHECK(same("a /* c */ b", "a b", SOURCE_KEY_TOKENS));
+	CHECK(!same("a b", "ab", SOURCE_KEY_TOKENS));
+	CHECK(!same("a - -b", "a--b", SOURCE_KEY_TOKENS));
+	CHECK(!same("x = 1e+5;", "x = 1e +5;", SOURCE_KEY_TOKENS));
+	CHECK(!same("#define F(x) x\nF(1)", "#define F (x) x\nF(1)", SOURCE_KEY_TOKENS));
+	CHECK(!same("#define X 1\n+2", "#define X 1 +2", SOURCE_KEY_TOKENS));
+	CHECK(same("#define X 1 \\\n+2\nX", "#define X 1 +2\nX", SOURCE_KEY_TOKENS));
+	CHECK(!same("\"a  b\"", "\"a b\"", SOURCE_KEY_TOKENS));
+	CHECK(!same("a\nb", "a b", SOURCE_KEY_LINES));
+	CHECK(same("a /* one\ntwo */ b", "a\nb", SOURCE_KEY_LINES));
+	CHECK(!same("a b", "a  b", SOURCE_KEY_BYTES));
+
+	// __LINE__ is a different number once the line it is on moves, even in
+	// the default mode, however it gets into the source.
+	CHECK(!same("float x = __LINE__;", "\n\nfloat x = __LINE__;", SOURCE_KEY_TOKENS));
+	CHECK(!same("float x = __LI\\\nNE__;", "\n\nfloat x = __LINE__;", SOURCE_KEY_TOKENS));
+	CHECK(!same("#define L(a, b) a ## b\nfloat x = L(__LI, NE__);",
+		"#define L(a, b) a ## b\n\nfloat x = L(__LI, NE__);", SOURCE_KEY_TOKENS));
+	CHECK(same("float  x = __LINE__;", "float x=__LINE__;", SOURCE_KEY_TOKENS));
+
+	std::string buffer;
+	std::string source = "float4 main() : SV_TARGET { return 1; }";
+	CHECK(SourceKey(source.data(), source.size(), SOURCE_KEY_BYTES, buffer) == Xxh64::Hash(source.data(),
+		source.size()));
+	std::string spaced = "float4  main ( ) : SV_TARGET\n{\n\treturn 1;\n}\n";
+	CHECK(SourceKey(source.data(), source.size(), SOURCE_KEY_TOKENS, buffer) ==
+		SourceKey(spaced.data(), spaced.size(), SOURCE_KEY_TOKENS, buffer));
+}
+
+std::vector<std::string> ReadJournal(const std::wstring &path)
+{
+	std::vector<std::string> records;
+	CHECK(Journal::Read(path, [&](const char *payload, size_t size) { records.emplace_back(payload, size); }));
+	return records;
+}
+
+void TestJournal(ScratchDirectory &scratch)
+{
+	std::wstring path = scratch.File("jobs.gfjl");
+	{
+		Journal journal(4);
+		CHECK(journal.Open(path, [](const char*, size_t) {}));
+		for (int i = 0; i < 10; i++) {
+			CHECK(journal.Append("record " + std::to_string(i)));
+		}
+		CHECK(journal.Syncs() == 2);
+		CHECK(journal.Close());
+	}
+	CHECK(ReadJournal(path).size() == 10);
+
+	// A record cut short is dropped, along with anything after it, and new
+	// records follow on from the good ones.
+	uint64_t size = SizeOf(path);
+	CHECK(TruncateFile(path, size - 3));
+	std::vector<std::string> recovered;
+	{
+		Journal journal;
+		CHECK(journal.Open(path, [&](const char *payload, size_t length) { recovered.emplace_back(payload, length); }));
+		CHECK(recovered.size() == 9 && recovered.back() == "record 8");
+		CHECK(journal.TruncatedBytes() == 8 + 8 - 3);
+		CHECK(journal.Append("record 9 again"));
+	}
+	std::vector<std::string> records = ReadJournal(path);
+	CHECK(records.size() == 10 && records.back() == "record 9 again");
+
+	// So is a record that fails its checksum.
+	std::string file = ReadWholeFile(path);
+	file[file.size() - 2] ^= 0x20;
+	CHECK(WriteFileReplacing(path, file.data(), file.size()));
+	CHECK(ReadJournal(path).size() == 9);
+
+	// Something that isn't a journal is left alone.
+	std::wstring other = scratch.Write("other.txt", "not a journal at all");
+	Journal journal;
+	CHECK(!journal.Open(other, [](const char*, size_t) {}));
+	CHECK(ReadWholeFile(other) == "not a journal at all");
+	CHECK(!journal.Append("x"));
+	CHECK(Crc32("123456789", 9) == 0xCBF43926u);
+}
+
+void TestSharding(ScratchDirectory &scratch)
+{
+	// Shards get about as many keys as each other, and adding one only moves
+	// keys to the new one.
+	const uint32_t kShards = 5;
+	std::vector<uint32_t> counts(kShards + 1);
+	uint32_t moved = 0;
+	const uint32_t kKeys = 20000;
+	for (uint64_t key = 0; key < kKeys; key++) {
+		uint64_t hash = Xxh64::Hash(&key, sizeof(key));
+		uint32_t before = ShardOf(hash, kShards);
+		uint32_t after = ShardOf(hash, kShards + 1);
+		CHECK(before < kShards && before == ShardOf(hash, kShards));
+		CHECK(after == before || after == kShards);
+		counts[before]++;
+		moved += after != before;
+	}
+	for (uint32_t shard = 0; shard < kShards; shard++) {
+		CHECK(counts[shard] > kKeys / kShards * 9 / 10 && counts[shard] < kKeys / kShards * 11 / 10);
+	}
+	CHECK(moved > kKeys / (kShards + 1) * 9 / 10 && moved < kKeys / (kShards + 1) * 11 / 10);
+	CHECK(ShardOf(1234, 1) == 0);
+
+	uint32_t index = 0, count = 0;
+	CHECK(ParseShard(L"2/4", &index, &count) && index == 2 && count == 4);
+	CHECK(!ParseShard(L"4/4", &index, &count));
+	CHECK(!ParseShard(L"1/0", &index, &count));
+	CHECK(!ParseShard(L"1/", &index, &count));
+	CHECK(!ParseShard(L"-1/4", &index, &count));
+
+	std::wstring journals[2] = { scratch.File("shard0.gfjl"), scratch.File("shard1.gfjl") };
+	const char *ids[2][2] = { { "b", "a" }, { "c", "a" } };
+	for (int j = 0; j < 2; j++) {
+		Journal journal;
+		CHECK(journal.Open(journals[j], [](const char*, size_t) {}));
+		for (const char *id : ids[j]) {
+			CHECK(journal.Append(json { { "id", id }, { "shard", j } }.dump()));
+		}
+	}
+	json report;
+	size_t bad = 99;
+	CHECK(MergeJournals({ journals[0], journals[1] }, &report, &bad));
+	CHECK(report["journals"] == 2 && report["jobs"] == 3 && report["duplicates"] == 1);
+	CHECK(report["results"].size() == 3);
+	CHECK(report["results"][0]["id"] == "a" && report["results"][0]["shard"] == 0);
+	CHECK(report["results"][2]["id"] == "c");
+
+	std::wstring missing = scratch.File("missing.gfjl");
+	CHECK(!MergeJournals({ journals[0], missing }, &report, &bad) && bad == 1);
+	Journal journal;
+	CHECK(journal.Open(journals[1], [](const char*, size_t) {}));
+	CHECK(journal.Append("[1, 2]"));
+	CHECK(journal.Close());
+	CHECK(!MergeJournals({ journals[0], journals[1] }, &report, &bad) && bad == 1);
+
+	// Records that aren't JSON at all are refused too, rather than taking the
+	// process down in json::parse.
+	const std::string not_json[] = { "not json", std::string("{\x01\xff\0id", 6), "{\"id\": \"d\"", "" };
+	for (size_t i = 0; i < sizeof(not_json) / sizeof(not_json[0]); i++) {
+		std::wstring path = scratch.File("garbage" + std::to_string(i) + ".gfjl");
+		Journal garbage;
+		CHECK(garbage.Open(path, [](const char*, size_t) {}));
+		CHECK(garbage.Append(json { { "id", "d" } }.dump()));
+		CHECK(garbage.Append(not_json[i]));
+		CHECK(garbage.Close());
+		bad = 99;
+		CHECK(!MergeJournals({ journals[0], path }, &report, &bad) && bad == 1);
+	}
+}
+
+void TestJsonCheck()
+{
+	const char *good[] = {
+		"0", "-0", "-12.5e+3", "1E-2", "1e400", "123456789012345678901234567890", " true ", "\r\n\tnull",
+		"\"\"", "\"a\\\"\\/\\b\\f\\n\\r\\t\\u00e9\"", "\"\\ud83d\\ude00\"", "\"\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\"",
+		"[]", "{}", "[1, [2, {\"a\": [false]}]]", "{\"a\": 1, \"b\": {\"c\": null}}",
+	};
+	for (const char *text : good) {
+		CHECK(IsWellFormedJson(text, text + strlen(text)));
+	}
+	const char *bad[] = {
+		"", " ", "01", "1.", ".5", "+1", "1e", "-", "0x10", "NaN", "tru", "nul", "True", "[1,]", "[1 2]", "{\"a\"}",
+		"{\"a\": 1,}", "{a: 1}", "{1: 1}", "[", "]", "{\"a\": 1}}", "1 2", "\"a", "'a'", "\"a\tb\"", "\"\\x41\"",
+		"\"\\u12\"", "\"\\ud800\"", "\"\\udc00\"", "\"\\ud800\\u0041\"", "\"\xff\"", "\"\xc3\"", "\"\xc0\x80\"",
+		"\"\xed\xa0\x80\"", "\"\xf4\x90\x80\x80\"", "\f1", "[1]\x01",
+	};
+	for (const char *text : bad) {
+		CHECK(!IsWellFormedJson(text, text + strlen(text)));
+	}
+	const char nul[] = "[1]\0";
+	CHECK(!IsWellFormedJson(nul, nul + 4));
+	std::string deep = std::string(256, '[') + std::string(256, ']');
+	CHECK(IsWellFormedJson(deep.data(), deep.data() + deep.size()));
+	deep = "[" + deep + "]";
+	CHECK(!IsWellFormedJson(deep.data(), deep.data() + deep.size()));
+
+	// Whatever json.hpp writes passes, and whatever passes, json.hpp parses:
+	// were it not to, this would exit here. Random documents are written out
+	// and then damaged byte by byte.
+	std::mt19937 rng(45);
+	const char *pieces[] = { "a", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\"", "\\", "\n", "\x01", "\x7f" };
+	std::function<json(int)> random_value = [&](int depth) -> json {
+		switch (rng() % (depth > 4 ? 5 : 7)) {
+		case 0:
+			return json(static_cast<int64_t>(rng()) - INT32_MAX);
+		case 1:
+			return json(static_cast<double>(rng() % 100000) / 64.0 - 700.0);
+		case 2: {
+			std::string str;
+			for (int i = 0, n = static_cast<int>(rng() % 8); i < n; i++) {
+				str += pieces[rng() % (sizeof(pieces) / sizeof(pieces[0]))];
+			}
+			return json(str);
+		}
+		case 3:
+			return json(rng() % 2 == 0);
+		case 4:
+			return json(nullptr);
+		case 5: {
+			json array = json::array();
+			for (int i = 0, n = static_cast<int>(rng() % 5); i < n; i++) {
+				array.push_back(random_value(depth + 1));
+			}
+			return array;
+		}
+		default: {
+			json object = json::object();
+			for (int i = 0, n = static_cast<int>(rng() % 5); i < n; i++) {
+				object[pieces[rng() % 4] + std::to_string(rng() % 100)] = random_value(depth + 1);
+			}
+			return object;
+		}
+		}
+	};
+	const char alphabet[] = "{}[],:\"\\0123456789.eE+-tfnu \x01\x80\xc3\xff";
+	int passed = 0;
+	for (int i = 0; i < 2000; i++) {
+		json document = random_value(1);
+		std::string text = document.dump(rng() % 2 ? 1 : -1);
+		CHECK(IsWellFormedJson(text.data(), text.data() + text.size()));
+		CHECK(json::parse(text) == document);
+		for (int k = 0, n = 1 + static_cast<int>(rng() % 3); k < n; k++) {
+			size_t at = text.empty() ? 0 : rng() % text.size();
+			char c = alphabet[rng() % (sizeof(alphabet) - 1)];
+			switch (rng() % 4) {
+			case 0:
+				text.insert(text.begin() + at, c);
+				break;
+			case 1:
+				text.resize(at);
+				break;
+			default:
+				if (at < text.size()) {
+					text[at] = c;
+				}
+				break;
+			}
+		}
+		if (IsWellFormedJson(text.data(), text.data() + text.size())) {
+			json parsed = json::parse(text.data(), text.data() + text.size());
+			std::string again = parsed.dump();
+			CHECK(IsWellFormedJson(again.data(), again.data() + again.size()));
+			passed++;
+		}
+	}
+	// Damage sometimes leaves valid JSON, so both sides got exercised.
+	CHECK(passed > 100 && passed < 1900);
+}
+
+void TestOutputManifest(ScratchDirectory &scratch)
+{
+	std::wstring path = scratch.File("outputs.gfim");
+	std::wstring output = scratch.Write("out.png", "png");
+	std::wstring include = scratch.Write("inc.h", "one");
+	IncludeCache include_cache;
+	auto file = include_cache.Get(include);
+	{
+		OutputManifest manifest;
+		CHECK(manifest.Load(path) && manifest.Size() == 0);
+		manifest.Record(output, 42, { { file->path, file->hash } });
+		manifest.Record(scratch.File("never.png"), 7, IncludeSet());
+		CHECK(manifest.Save());
+	}
+	OutputManifest manifest;
+	CHECK(manifest.Load(path) && manifest.Size() == 2);
+	CHECK(manifest.UpToDate(output, 42, include_cache));
+	CHECK(!manifest.UpToDate(output, 43, include_cache));
+	// Outputs have to exist to be up to date.
+	CHECK(!manifest.UpToDate(scratch.File("never.png"), 7, include_cache));
+	scratch.Write("inc.h", "two!");
+	CHECK(!manifest.UpToDate(output, 42, include_cache));
+
+	// Damage empties the manifest; something else entirely isn't touched.
+	std::string stored = ReadWholeFile(path);
+	stored[stored.size() - 1] ^= 1;
+	CHECK(WriteFileReplacing(path, stored.data(), stored.size()));
+	CHECK(manifest.Load(path) && manifest.Size() == 0);
+	std::wstring other = scratch.Write("other.bin", "something else");
+	CHECK(!manifest.Load(other));
+}
+
+// A DXBC container holding the given chunks.
+std::string DxbcContainer(const std::vector<std::pair<std::string, std::string>> &chunks)
+{
+	std::string container(32 + 4 * chunks.size(), '\0');
+	for (size_t c = 0; c < chunks.size(); c++) {
+		uint32_t offset = static_cast<uint32_t>(container.size());
+		uint32_t size = static_cast<uint32_t>(chunks[c].second.size());
+		memcpy(&container[32 + 4 * c], &offset, 4);
+		container += chunks[c].first;
+		container.append(reinterpret_cast<const char*>(&size), 4);
+		container += chunks[c].second;
+	}
+	uint32_t total = static_cast<uint32_t>(container.size());
+	uint32_t count = static_cast<uint32_t>(chunks.size());
+	memcpy(&container[0], "DXBC", 4);
+	memset(&container[4], static_cast<int>(total), 16);
+	memcpy(&container[24], &total, 4);
+	memcpy(&container[28], &count, 4);
+	return container;
+}
+
+void TestRenderMemo(ScratchDirectory &scratch)
+{
+	std::string a = DxbcContainer({ { "RDEF", "names" }, { "SHEX", "code" }, { "STAT", "12" } });
+	std::string b = DxbcContainer({ { "RDEF", "other names" }, { "SHEX", "code" }, { "STAT", "345" } });
+	std::string c = DxbcContainer({ { "RDEF", "names" }, { "SHEX", "cod3" }, { "STAT", "12" } });
+	CHECK(CanonicalBytecodeHash(a.data(), a.size()) == CanonicalBytecodeHash(b.data(), b.size()));
+	CHECK(CanonicalBytecodeHash(a.data(), a.size()) != CanonicalBytecodeHash(c.data(), c.size()));
+	// Anything that isn't a well formed container is hashed whole.
+	std::string broken = a;
+	broken[32] = 0x7F;
+	CHECK(CanonicalBytecodeHash(broken.data(), broken.size()) == Xxh64::Hash(broken.data(), broken.size()));
+
+	std::wstring directory = scratch.File("memo");
+	RenderMemo memo;
+	CHECK(!memo.Enabled());
+	CHECK(memo.Open(directory) && memo.Enabled());
+	Image image = SolidImage(5, 3, 0x33);
+	image.pixels[7] = 0x99;
+	std::string entry = HashToHex(77) + ".gfrm";
+	std::wstring entry_path = scratch.File("memo/" + entry);
+	CHECK(memo.Store(77, image.View()));
+	Image loaded;
+	CHECK(memo.Load(77, &loaded));
+	CHECK(loaded.width == 5 && loaded.height == 3 && loaded.pixels == image.pixels);
+	CHECK(!memo.Load(78, &loaded));
+
+	std::string stored = ReadWholeFile(entry_path);
+	stored[40] ^= 1;
+	CHECK(WriteFileReplacing(entry_path, stored.data(), stored.size()));
+	CHECK(!memo.Load(77, &loaded));
+	CHECK(memo.Hits() == 1 && memo.Misses() == 2);
+}
+
+void TestNegativeCache(ScratchDirectory &scratch)
+{
+	BloomFilter filter(10000 * 10);
+	for (uint64_t key = 1; key <= 10000; key++) {
+		filter.Add(Xxh64::Hash(&key, sizeof(key)));
+	}
+	uint32_t false_positives = 0;
+	for (uint64_t key = 1; key <= 20000; key++) {
+		uint64_t hash = Xxh64::Hash(&key, sizeof(key));
+		CHECK(key > 10000 || filter.MayContain(hash));
+		false_positives += key > 10000 && filter.MayContain(hash);
+	}
+	CHECK(false_positives < 300);
+
+	std::wstring path = scratch.File("failures.gfjl");
+	IncludeCache include_cache;
+	{
+		NegativeCache cache;
+		CHECK(cache.Open(path, 1, 2));
+		CHECK(!cache.Find(10, include_cache));
+		for (uint64_t key = 1; key <= 100; key++) {
+			ShaderFailureKind kind = key % 2 ? SHADER_FAILURE_COMPILE : SHADER_FAILURE_CRASH;
+			CHECK(cache.Add(key * 7919, { kind, "error " + std::to_string(key), false }));
+		}
+		CHECK(cache.Find(7919, include_cache) && cache.Find(7919, include_cache)->message == "error 1");
+		CHECK(cache.Close());
+	}
+	{
+		NegativeCache cache;
+		CHECK(cache.Open(path, 1, 2));
+		CHECK(cache.Size() == 100 && cache.Invalidated() == 0);
+		CHECK(cache.Find(2 * 7919, include_cache) && cache.Find(2 * 7919, include_cache)->kind == SHADER_FAILURE_CRASH);
+		CHECK(cache.Close());
+	}
+	// New drivers forget the crashes, and a new compiler the compile
+	// failures, for good.
+	{
+		NegativeCache cache;
+		CHECK(cache.Open(path, 1, 3));
+		CHECK(cache.Size() == 50 && cache.Invalidated() == 50);
+		CHECK(!cache.Find(2 * 7919, include_cache) && cache.Find(7919, include_cache));
+		CHECK(cache.Close());
+		CHECK(cache.Open(path, 1, 3));
+		CHECK(cache.Size() == 50 && cache.Invalidated() == 0);
+		CHECK(cache.Close());
+		CHECK(cache.Open(path, 4, 3));
+		CHECK(cache.Size() == 0 && cache.Invalidated() == 50);
+		// Messages too long for a record are cut down rather than lost.
+		CHECK(cache.Add(1, { SHADER_FAILURE_COMPILE, std::string(Journal::kMaxRecordSize * 2, 'x'), false }));
+		CHECK(cache.Close());
+		CHECK(cache.Open(path, 4, 3) && cache.Size() == 1);
+		const ShaderFailure *cut = cache.Find(1, include_cache);
+		CHECK(cut && cut->message.size() == Journal::kMaxRecordSize / 2);
+		CHECK(cache.Close());
+	}
+
+	// A compile failure no longer counts once a file it included changes,
+	// and counts again if the file goes back, reopened or not.
+	std::wstring header = scratch.Write("failing.h", "#define X 1");
+	auto included = include_cache.Get(header);
+	IncludeSet includes = { { included->path, included->hash } };
+	std::wstring with_includes = scratch.File("includes.gfjl");
+	{
+		NegativeCache cache;
+		CHECK(cache.Open(with_includes, 1, 2));
+		CHECK(cache.Add(5, { SHADER_FAILURE_COMPILE, "error X3000", false }, includes));
+		CHECK(cache.Find(5, include_cache));
+		scratch.Write("failing.h", "#define X 22");
+		CHECK(!cache.Find(5, include_cache));
+		CHECK(cache.Close());
+		CHECK(cache.Open(with_includes, 1, 2) && cache.Size() == 1);
+		CHECK(!cache.Find(5, include_cache));
+		scratch.Write("failing.h", "#define X 1");
+		CHECK(cache.Find(5, include_cache) && cache.Find(5, include_cache)->message == "error X3000");
+		CHECK(cache.Close());
+	}
+
+	// Compile failures recorded before includes were kept can't be checked,
+	// so they go. Crashes never had any.
+	std::wstring old_format = scratch.File("old.gfjl");
+	{
+		Journal journal;
+		CHECK(journal.Open(old_format, [](const char*, size_t) {}));
+		for (uint8_t kind : { SHADER_FAILURE_COMPILE, SHADER_FAILURE_CRASH }) {
+			std::string record(24, '\0');
+			uint64_t key = kind, environment = kind;
+			record[0] = static_cast<char>(kind);
+			memcpy(&record[8], &key, 8);
+			memcpy(&record[16], &environment, 8);
+			CHECK(journal.Append(record + "message"));
+		}
+		CHECK(journal.Close());
+		NegativeCache cache;
+		CHECK(cache.Open(old_format, 1, 2));
+		CHECK(cache.Size() == 1 && cache.Invalidated() == 1);
+		CHECK(!cache.Find(1, include_cache));
+		CHECK(cache.Find(2, include_cache) && cache.Find(2, include_cache)->message == "message");
+		CHECK(cache.Close());
+	}
+
+	std::wstring marker_path = scratch.File("failures.gfjl.0.running");
+	uint64_t key = 0;
+	std::string name;
+	{
+		CrashMarker marker;
+		CHECK(marker.Open(marker_path));
+		CHECK(!CrashMarker::Leftover(marker_path, &key, &name));
+		CHECK(marker.Set(42, "a/much/longer/name.hlsl"));
+		CHECK(marker.Set(43, "b.hlsl"));
+	}
+	CHECK(CrashMarker::Leftover(marker_path, &key, &name) && key == 43 && name == "b.hlsl");
+	CrashMarker marker;
+	CHECK(marker.Open(marker_path));
+	marker.Remove();
+	CHECK(!FileExists(marker_path.c_str()));
+}
+
+// The fake oracle: a shader "crashes" when a call to bad( and the literal
+// 1337 both survive, as long as its braces still balance.
+bool Crashes(const std::string &source)
+{
+	int depth = 0;
+	for (char c : source) {
+		depth += c == '{' ? 1 : c == '}' ? -1 : 0;
+		if (depth < 0) {
+			return false;
+		}
+	}
+	return depth == 0 && source.find("bad(") != std::string::npos && source.find("1337") != std::string::npos;
+}
+
+void TestDeltaDebugger()
+{
+	std::mt19937_64 rng(7);
+	std::string source = "// header\r\nfloat4 main(float4 p : SV_POSITION) : SV_TARGET {\n";
+	for (int i = 0; i < 200; i++) {
+		source += "  float v" + std::to_string(i) + " = sin(" + std::to_string(rng() % 100) + ".0) * 2; /* c */\n";
+		if (i == 100) {
+			source += "  if (v3 > 0) { bad(v3 + 1337); }\n";
+		}
+	}
+	source += "  return float4(1, \"a b\", 0, 1);\n}\n";
+
+	const ReduceGranularity granularities[] = { REDUCE_LINES, REDUCE_TOKENS };
+	for (ReduceGranularity granularity : granularities) {
+		std::string joined;
+		for (auto &unit : SplitUnits(source, granularity)) {
+			joined += unit;
+		}
+		CHECK(joined == source);
+	}
+	CHECK(SplitUnits("", REDUCE_TOKENS).empty());
+	CHECK(SplitUnits("  a", REDUCE_TOKENS).size() == 2);
+	CHECK(SplitUnits("/* x", REDUCE_TOKENS).size() == 1);
+	CHECK(SplitUnits("\"a b\" c", REDUCE_TOKENS).size() == 2);
+
+	// However many candidates the test takes at a time, the result is the
+	// same, and nothing more can be taken out of it.
+	std::string results[2];
+	const size_t widths[] = { 1, 4 };
+	for (int w = 0; w < 2; w++) {
+		uint64_t tested = 0;
+		DeltaDebugger reducer([&](const std::vector<std::string> &candidates) {
+			CHECK(candidates.size() <= widths[w]);
+			tested += candidates.size();
+			for (size_t i = 0; i < candidates.size(); i++) {
+				if (Crashes(candidates[i])) {
+					return i;
+				}
+			}
+			return candidates.size();
+		}, widths[w]);
+		results[w] = reducer.Reduce(source);
+		CHECK(Crashes(results[w]));
+		CHECK(reducer.GetStats().tests == tested);
+		CHECK(reducer.GetStats().passes >= 2);
+	}
+	CHECK(results[0] == results[1]);
+	CHECK(results[0].size() < 40);
+	std::vector<std::string> units = SplitUnits(results[0], REDUCE_TOKENS);
+	for (size_t i = 0; i < units.size(); i++) {
+		std::string without;
+		for (size_t k = 0; k < units.size(); k++) {
+			without += k == i ? std::string() : units[k];
+		}
+		CHECK(!Crashes(without));
+	}
+}
+
+struct TestCase {
+	const char *name;
+	std::function<void(ScratchDirectory&)> run;
+};
+
+}
+
+int main(int argc, char *argv[])
+{
+	std::string filter;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc) {
+			filter = argv[++i];
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--filter SUBSTRING]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	const TestCase tests[] = {
+		{ "readback_ring", [](ScratchDirectory&) { TestReadbackRing(); } },
+		{ "image_array_writer", TestImageArrayWriter },
+		{ "raw_writers", TestRawWriters },
+		{ "dedup_index", [](ScratchDirectory&) { TestDedupIndex(); } },
+		{ "image_compare", [](ScratchDirectory&) { TestImageCompare(); } },
+		{ "differential", [](ScratchDirectory&) { TestDifferential(); } },
+		{ "work_stealing", [](ScratchDirectory&) { TestWorkStealing(); } },
+		{ "debug_messages", [](ScratchDirectory&) { TestDebugMessages(); } },
+		{ "adapter_report", TestAdapterReport },
+		{ "uniform_parsers", [](ScratchDirectory&) { TestUniformParsers(); } },
+		{ "arena", TestArena },
+		{ "lru_cache", [](ScratchDirectory&) { TestLruCache(); } },
+		{ "include_cache", TestIncludeCache },
+		{ "bytecode_cache", TestBytecodeCache },
+		{ "shader_bundle", TestShaderBundle },
+		{ "source_key", [](ScratchDirectory&) { TestSourceKey(); } },
+		{ "journal", TestJournal },
+		{ "json_check", [](ScratchDirectory&) { TestJsonCheck(); } },
+		{ "sharding", TestSharding },
+		{ "output_manifest", TestOutputManifest },
+		{ "render_memo", TestRenderMemo },
+		{ "negative_cache", TestNegativeCache },
+		{ "delta_debugger", [](ScratchDirectory&) { TestDeltaDebugger(); } },
+	};
+	ScratchDirectory scratch;
+	int failed_tests = 0;
+	for (auto &test : tests) {
+		if (std::string(test.name).find(filter) == std::string::npos) {
+			continue;
+		}
+		int failures_before = g_failures;
+		test.run(scratch);
+		bool passed = g_failures == failures_before;
+		failed_tests += !passed;
+		printf("%-24s %s\n", test.name, passed ? "ok" : "FAILED");
+	}
+	if (failed_tests > 0) {
+		printf("%d test(s) failed\n", failed_tests);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}